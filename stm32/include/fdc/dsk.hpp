@@ -4,6 +4,7 @@
 #include "refcounted.hpp"
 #include <stdint.h>
 #include <vector>
+#include <string>
 #include "bits.h"
 #include <sigc++/sigc++.h>
 
@@ -12,6 +13,7 @@
 namespace dsk {
 
 	class DiskSector;
+	class DiskJournal;
 
 	struct DiskFindSectorCommand {
 		unsigned pcn;
@@ -23,9 +25,57 @@ namespace dsk {
 		bool mfm;
 		bool deleted;
 		bool find_any;
+		//match the sector regardless of its data address mark, as
+		//needed by the write commands.
+		bool ignore_deleted;
 		sigc::slot<void (RefPtr<DiskSector> sector)> slot;
 	};
 
+	struct DiskSectorID {
+		uint8_t C;
+		uint8_t H;
+		uint8_t R;
+		uint8_t N;
+	};
+
+	struct DiskFormatTrackCommand {
+		unsigned pcn;
+		unsigned phn;
+		unsigned N;
+		unsigned SPT;
+		unsigned gap3;
+		unsigned filler;
+		DiskSectorID const *ids;
+		sigc::slot<void (int result)> slot;
+	};
+
+	/* sector lookup table of one track, built when the track is first
+	 * searched. sectors with the same id hash are chained in track order.
+	 */
+	struct DiskTrackIndex {
+		bool valid;
+		uint8_t count;
+		uint16_t offset[29];//of the sector data, relative to the track
+		uint16_t size[29];
+		uint8_t next[29];//next sector in the chain, +1
+		uint8_t bucket[32];//first sector per id hash, +1
+	};
+
+	/* image data of one cylinder. sectors keep a reference, so their
+	 * data stays valid while it is being transferred even if the disk
+	 * moves on to another cylinder.
+	 */
+	class DiskCylinder : public Refcounted<DiskCylinder> {
+	public:
+		std::vector<uint8_t> data;
+		DiskTrackIndex index[2];
+		DiskCylinder() {
+			index[0].valid = false;
+			index[1].valid = false;
+		}
+		virtual ~DiskCylinder() {}
+	};
+
 	class DiskSector : public Refcounted<DiskSector> {
 	public:
 		unsigned C;
@@ -38,7 +88,26 @@ namespace dsk {
 		unsigned size;
 		unsigned pcn;
 		unsigned phn;
+		//points to the CHRN entry in the track header, ST1 is at
+		//id[4], ST2 at id[5] for both image formats.
+		uint8_t *id;
+		RefPtr<DiskCylinder> cylinder;
 		virtual ~DiskSector() {}
+		//served from a small pool, there are only a few at a time.
+		static void *operator new(size_t size);
+		static void operator delete(void *p);
+	};
+
+	//bits in ST1 and ST2 as stored in the images
+	enum {
+		ST1_MissingAddressMark = 0x01,
+		ST1_NoData = 0x04,
+		ST1_DataError = 0x20,
+		ST2_MissingAddressMark = 0x01,
+		ST2_BadCylinder = 0x02,
+		ST2_WrongCylinder = 0x10,
+		ST2_DataError = 0x20,
+		ST2_ControlMark = 0x40,
 	};
 
 	class Disk : public Refcounted<Disk> {
@@ -50,23 +119,213 @@ namespace dsk {
 		enum {
 			IDLE,
 			PRELOAD,
-			FIND
+			FIND,
+			FORMAT
 		} state;
 		unsigned preload_cylinderno;
 		unsigned current_cylinderno;
-		std::vector<uint8_t> current_cylinder;
+		RefPtr<DiskCylinder> current_cylinder;
 		DiskFindSectorCommand *current_command;
 		unsigned current_sector;
 		aio::PReadCommand preadcmd;
+
+		/* write back state. current_cylinder->data[dirty_start,dirty_end)
+		 * has been modified and not written to the image yet. a flush
+		 * moves the dirty cylinder to writeback_cylinder, so reading
+		 * the next cylinder does not need to wait for the write.
+		 */
+		unsigned dirty_start;
+		unsigned dirty_end;
+		unsigned writeback_cylinderno;
+		RefPtr<DiskCylinder> writeback_cylinder;
+		bool writeback_busy;
+		//cylinder load waiting for the writeback buffer to be free.
+		bool load_pending;
+		unsigned load_pending_pcn;
+		sigc::slot<void(int, int)> load_pending_slot;
+		aio::PWriteCommand pwritecmd;
+		sigc::connection flush_timer;
+		//changes go to the journal before they go to the image, if
+		//the image has one.
+		DiskJournal *journal;
+		/* changes in the journal that the image does not have yet.
+		 * they get written to it by the idle flush, or before the
+		 * journal needs to be emptied. until then loading their
+		 * cylinder takes it from here.
+		 */
+		struct Merge {
+			unsigned pcn;
+			unsigned start;
+			unsigned end;
+			RefPtr<DiskCylinder> cylinder;
+		};
+		Merge merges[2];
+		unsigned merge_count;
+		unsigned merge_next;
+		aio::PWriteCommand mergecmd;
+		/* cylinder read speculatively after the last sector of a
+		 * track got accessed, kept apart so current_cylinder stays
+		 * usable until the next cylinder is actually needed.
+		 */
+		unsigned readahead_cylinderno;
+		RefPtr<DiskCylinder> readahead_cylinder;
+		bool readahead_busy;
+		//cylinder load waiting for the readahead to complete.
+		bool readahead_waiting;
+		sigc::slot<void(int, int)> readahead_slot;
+		aio::PReadCommand readaheadcmd;
+
+		void initCache();
+		virtual unsigned cylinderSize(unsigned pcn) = 0;
+		/* reads the cylinder from the image. cmd->slot gets called
+		 * with the cylinder size once cylinder->data is filled.
+		 */
+		virtual void readCylinder(unsigned pcn,
+					  RefPtr<DiskCylinder> const &cylinder,
+					  aio::PReadCommand *cmd);
+		void loadCylinder(unsigned pcn, sigc::slot<void(int, int)> const &slot);
+		sigc::slot<void(int, int)> load_slot;
+		void loadComplete(int res, int errno_code, unsigned pcn);
+		void markDirty(void *start, unsigned len);
+		void startWriteback();
+		void createJournal();
+		void createJournalComplete(int res, int errno_code);
+		void journalWriteback();
+		void writebackJournalComplete(int res, int errno_code);
+		void writebackComplete(int res, int errno_code);
+		Merge *findMerge(unsigned pcn);
+		void startMerge();
+		void mergeNext();
+		void mergeComplete(int res, int errno_code);
+		void closeJournal();
+		void flushTimer();
+		void readaheadCylinder(unsigned pcn);
+		void readaheadComplete(int res, int errno_code);
+		static void hashTrackIndex(DiskTrackIndex &idx, uint8_t const *ids);
+		RefPtr<DiskSector> findInTrack(DiskFindSectorCommand *c,
+					       unsigned &sector_index,
+					       unsigned phn, uint8_t *track,
+					       uint8_t *ids,
+					       DiskTrackIndex const &idx);
 	public:
 		bool write_protected;
+		//file the journal gets created as on the first write, set by
+		//openImage if the image has none yet.
+		std::string journal_name;
 		bool two_sided;
 		int side_offset;
-		virtual ~Disk() {}
+		//number of reads issued to the image, for statistics
+		unsigned image_reads;
+		Disk();
+		virtual ~Disk();
 		virtual void close() = 0;
-		virtual void preloadCylinder(unsigned pcn) = 0;
+		//returns false if the disk is busy, the caller may try again
+		virtual bool preloadCylinder(unsigned pcn) = 0;
 		virtual void findSector(DiskFindSectorCommand *command) = 0;
+		/** \brief Looks for a sector without touching the disk state
+		 *
+		 * Only succeeds if the disk is idle and the cylinder is already
+		 * cached, the slot in command is not used.
+		 *
+		 * \return The sector findSector would find next, or NULL
+		 */
+		virtual RefPtr<DiskSector> findCachedSector
+			(DiskFindSectorCommand *command) = 0;
+		/** \brief Replaces the data of a sector found by findSector
+		 *
+		 * The data is only copied into the cached cylinder, writing it
+		 * to the image happens later when the disk is idle, the
+		 * cylinder gets replaced or the image gets closed.
+		 *
+		 * \param sector Sector as returned by findSector
+		 * \param data New sector data, sector->size bytes
+		 * \param deleted Write a deleted data address mark
+		 * \return 0 on success, -1 if the sector is no longer cached
+		 *         or the image is write protected
+		 */
+		int writeSector(RefPtr<DiskSector> sector, void const *data,
+				bool deleted);
+		virtual void formatTrack(DiskFormatTrackCommand *command) = 0;
+		/** \brief Starts using a journal, used by openImage
+		 *
+		 * Changes left in the journal are written to the image first,
+		 * slot gets called once that is done.
+		 *
+		 * \param journalfd Journal file, owned by the disk afterwards
+		 * \param size Size of the journal file, it does not grow
+		 */
+		void openJournal(int journalfd, size_t size,
+				 sigc::slot<void(int, int)> const &slot);
+		/** \brief Writes all outstanding changes to the image
+		 *
+		 * Waits for the writes to complete, must not be used in
+		 * interrupt context.
+		 */
+		void flush();
+	};
+
+	struct DiskCacheInfo {
+		unsigned hits;
+		unsigned misses;
+		uint64_t bytes_read;
+		size_t size;
+		size_t budget;
 	};
 
+	/** \brief Sets the memory the cylinder cache of all disks may use
+	 *
+	 * Cylinders in use by a disk or a transfer stay in memory regardless.
+	 */
+	void setCacheBudget(size_t bytes);
+	DiskCacheInfo cacheInfo();
+
 	RefPtr<Disk> openImage(char const *filename);
+	/** \brief Opens a disk image without waiting for its header
+	 *
+	 * If a file named like the image with ".jnl" appended exists, it is
+	 * used as the journal of the image. Changes not completely written
+	 * to the image before get written again from it. Otherwise it gets
+	 * created on the first write.
+	 *
+	 * \param filename Image to open
+	 * \param slot Called with the disk, or NULL if the file cannot be
+	 *             opened or is no disk image. May be called from
+	 *             interrupt context.
+	 */
+	void openImage(char const *filename,
+		       sigc::slot<void(RefPtr<Disk> disk)> const &slot);
+
+	//formats createImage can write
+	enum BlankFormat {
+		BlankData,
+		BlankSystem,
+		BlankIBM,
+		BlankData80,
+		BlankSystem80,
+		BlankFormatCount
+	};
+
+	char const *blankFormatName(BlankFormat format);
+	/** \brief Writes a new, formatted disk image
+	 *
+	 * The file must not exist yet. Its journal is created along with it.
+	 *
+	 * \param filename Image to create
+	 * \param format Format of the image
+	 * \param progress Called with the number of tracks written so far
+	 *                 and the number of tracks in total
+	 * \param slot Called with 0 once the image is complete, -1 on
+	 *             failure. May be called from interrupt context.
+	 */
+	void createImage(char const *filename, BlankFormat format,
+			 sigc::slot<void(unsigned done, unsigned total)> const &progress,
+			 sigc::slot<void(int result)> const &slot);
+
+	/** \brief Decodes a lz4 block, as the tracks of CDSK images are stored
+	 *
+	 * \return The decoded length, or -1 if the data is corrupt or does
+	 *         not fit into dst
+	 */
+	int lz4Decode(void const *src, unsigned srclen,
+		      void *dst, unsigned dstlen);
 }
@@ -1,12 +1,58 @@
 #pragma once
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define FDC_LATENCY_BUCKETS 16
+#define FDC_TRACE_SIZE 64
+
+/* statistics per command type(the command numbers of the fdc frontend).
+ * times are in microseconds. the cpc waits for the lookup before the
+ * execution phase and for final before the result phase, transfer is the
+ * execution phase itself. stall_histogram[i] counts commands that kept
+ * the cpc waiting for less than 2^i us, the last one everything longer.
+ */
+struct FDCCommandInfo {
+	uint32_t count;
+	uint32_t worst_lookup;
+	uint32_t worst_final;
+	uint64_t total_lookup;
+	uint64_t total_transfer;
+	uint64_t total_final;
+	uint32_t image_reads;
+	uint32_t stall_histogram[FDC_LATENCY_BUCKETS];
+};
+
+struct FDCTraceEntry {
+	uint32_t time;//ms since power on
+	uint8_t drive;
+	uint8_t command;
+	uint8_t pcn;
+	uint8_t C;
+	uint8_t H;
+	uint8_t R;
+	uint8_t N;
+	uint8_t status;//response sent to the frontend
+	uint16_t image_reads;//reads from the image file during the command
+	uint32_t lookup;
+	uint32_t transfer;
+	uint32_t final;
+};
+
 void FDC_Setup();
 void FDC_InsertDisk(int drive, char const *filename);
 void FDC_EjectDisk(int drive);
+struct FDCCommandInfo FDC_CommandInfo(unsigned command);
+//copies the most recent commands, newest first. returns the number copied.
+unsigned FDC_Trace(struct FDCTraceEntry *entries, unsigned max);
+/* writes the trace to filename as text, one command per line, oldest
+ * first. returns 0 on success, -1 on failure. must not be used in
+ * interrupt context.
+ */
+int FDC_SaveTrace(char const *filename);
 
 //functions to be provided externally
 void FDC_MotorOn();
@@ -15,4 +61,14 @@ void FDC_Activity(int drive, int activity);
 
 #ifdef __cplusplus
 }
+
+#include <sigc++/sigc++.h>
+
+/* opens the image in the background. slot gets called from the main loop
+ * with 0 once the drive is ready or -1 if the image cannot be used. an
+ * insert overtaken by another insert or eject of the same drive is dropped
+ * without calling slot.
+ */
+void FDC_InsertDiskAsync(int drive, char const *filename,
+			 sigc::slot<void(int result)> const &slot);
 #endif
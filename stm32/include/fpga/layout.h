@@ -240,6 +240,11 @@ struct FpgaGraphicsSettings {
    0x20080b            : motor on
    0x20080c            : Soft FDD output debug
    0x200810            : Soft FDD input Drive #0 status
+                         bit 0: reserved. a turbo mode (no seek and
+                                rotational delays) would go here, but
+                                the frontend generates those delays and
+                                has no capability register to tell it
+                                supports skipping them
                          bit 4: Two sided indication
 		         bit 5: Fault
 		         bit 6: Write protected
@@ -5,7 +5,18 @@
 extern "C" {
 #endif
 
+struct FATCacheInfo {
+	unsigned hits;
+	unsigned misses;
+	unsigned blocks;//currently allocated, all partitions
+	unsigned dir_lookups;
+	unsigned dir_scans;//lookups that had to read the directory
+};
+
 void FAT_Setup();
+struct FATCacheInfo FAT_CacheInfo();
+//blocks cached per partition
+void FAT_SetCacheBlocks(unsigned blocks);
 
 #ifdef __cplusplus
 }
@@ -91,6 +91,15 @@ namespace vfs {
 		virtual bool readdir(off_t &/*d_off*/, std::string &/*name*/) {
 			return false;
 		}
+		//removes the entry of dent, which has to be a child.
+		virtual int unlink(RefPtr<Dentry> /*dent*/) {
+			errno = ENOTDIR;
+			return -1;
+		}
+		virtual int truncate(off_t /*length*/) {
+			errno = EINVAL;
+			return -1;
+		}
 	};
 
 	struct Dentry : public Refcounted<Dentry>  {
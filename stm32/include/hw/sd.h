@@ -15,6 +15,9 @@
 #define SD_CLK_GPIO GPIOC
 #define SD_PINS1 (GPIO_Pin_8 | GPIO_Pin_9 | GPIO_Pin_10 | GPIO_Pin_11)
 #define SD_GPIO1 GPIOC
+//D0, read back to see if the card is busy programming
+#define SD_D0_PIN GPIO_Pin_8
+#define SD_D0_GPIO GPIOC
 #define SD_PINS2 (GPIO_Pin_2)
 #define SD_GPIO2 GPIOD
 
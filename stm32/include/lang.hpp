@@ -6,6 +6,7 @@
 namespace lang {
 
 std::string Utf16ToUtf8(std::basic_string<uint16_t> const &str);
+std::basic_string<uint16_t> Utf8ToUtf16(std::string const &str);
 
 enum ElideMode {
 	ElideMiddle,
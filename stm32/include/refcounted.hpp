@@ -114,7 +114,6 @@ public:
 			ISR_Guard g;
 			ptr->refcountdec();
 		}
-		return ptr;
 	}
 	bool operator== (R *ptr) {
 		return this->ptr == ptr;
@@ -13,6 +13,8 @@
 #include <block/msd.hpp>
 #include <block/sdio.hpp>
 #include <deque>
+#include <algorithm>
+#include <string.h>
 
 #include "sdcard_std.h"
 #include <hw/sd.h>
@@ -123,6 +125,56 @@ union {
 } card_SCR;
 static uint16_t card_rca;
 static int card_khz;
+static int card_widebus;
+//switch function status of CMD6, sent MSB first
+static uint32_t card_switch_status[16];
+//SCR read again at the final bus settings, to check them
+static uint32_t card_SCR_check[2];
+
+//lowest clock a card gets slowed down to after crc errors
+#define SDCARD_MIN_KHZ 400
+//clock of cards switched to high speed. 48MHz is as close to 50MHz as the
+//SDIO clock gets.
+#define SDCARD_HIGHSPEED_KHZ 50000
+#define SDCARD_DEFAULT_KHZ 25000
+
+/* slows the bus down after crc errors. high speed cards go back to the
+ * default speed first. returns false if the clock is at the minimum.
+ */
+static bool SDcard_downgrade() {
+	if (card_khz <= SDCARD_MIN_KHZ)
+		return false;
+	if (card_khz > SDCARD_DEFAULT_KHZ)
+		card_khz = SDCARD_DEFAULT_KHZ;
+	else
+		card_khz /= 2;
+	if (card_khz < SDCARD_MIN_KHZ)
+		card_khz = SDCARD_MIN_KHZ;
+	SDIO_ConfigureBus(card_widebus, card_khz);
+	return true;
+}
+
+#ifdef SDCARD_BENCHMARK
+/* throughput measurement: after init, the start of the card gets read a
+ * few times before it is registered. the results are for looking at with
+ * the debugger.
+ */
+struct SDBenchmark {
+	int khz;
+	int widebus;
+	uint32_t blocks;
+	uint32_t usec;
+	int result;
+};
+
+#define SD_BENCHMARK_BLOCKS 16
+#define SD_BENCHMARK_ROUNDS 64
+struct SDBenchmark sd_benchmark;
+static uint32_t sd_benchmark_buf[SD_BENCHMARK_BLOCKS * 512 / 4];
+static MSDReadCommand sd_benchmark_cmd;
+static uint64_t sd_benchmark_start;
+static unsigned sd_benchmark_round;
+#endif
 
 void SDcard_Setup() {
 	SDIO_Setup();
@@ -209,7 +261,18 @@ static void SDcard_init_set_blocksize();
 static void SDcard_init_set_blocksize_cmpl(int result);
 static void SDcard_init_set_bus_width();
 static void SDcard_init_set_bus_width_cmpl(int result);
+static void SDcard_init_switch_check();
+static void SDcard_init_switch_check_cmpl(int result);
+static void SDcard_init_switch_set();
+static void SDcard_init_switch_set_cmpl(int result);
+static void SDcard_init_verify_bus();
+static void SDcard_init_verify_bus_cmpl(int result);
 static void SDcard_init_finish();
+static void SDcard_init_register();
+#ifdef SDCARD_BENCHMARK
+static void SDcard_benchmark_read();
+static void SDcard_benchmark_read_cmpl(int result);
+#endif
 
 static void SDcard_init_get_status();
 static void SDcard_init_get_status_cmpl(int result);
@@ -542,7 +605,7 @@ static void SDcard_init_get_SCR_cmpl(int result) {
 	if (result != SDIO_OK)
 		return;
 
-	for(int i = 0; i < 3; i++) {
+	for(int i = 0; i < 4; i++) {
 		uint8_t t = card_SCR.d[i];
 		card_SCR.d[i] = card_SCR.d[7-i];
 		card_SCR.d[7-i] = t;
@@ -574,9 +637,11 @@ static void SDcard_init_set_blocksize_cmpl(int result) {
 static void SDcard_init_set_bus_width() {
 	if(!(card_SCR.v1.sd_bus_widths & 0x4)) {
 		//card does not support wide bus.
+		card_widebus = 0;
 		SDIO_ConfigureBus(0, card_khz);
 
-		SDcard_init_finish();
+		SDcard_init_switch_check();
+		return;
 	}
 
 	command.argument = 0x2; //four bits
@@ -595,8 +660,104 @@ static void SDcard_init_set_bus_width_cmpl(int result) {
 	if (result != SDIO_OK)
 		return;
 
+	card_widebus = 1;
 	SDIO_ConfigureBus(1, card_khz);
 
+	SDcard_init_switch_check();
+}
+
+static void SDcard_init_switch_check() {
+	//CMD6 came with 1.10, and cards have it if they have class 10.
+	if (card_SCR.v1.SD_spec < 1 ||
+	    !(card_CSD.v1.card_command_class & (1 << 10))) {
+		SDcard_init_verify_bus();
+		return;
+	}
+
+	/* Cmd6: SWITCH_FUNC, check if group 1 can do high speed */
+	command.argument = 0x00fffff1;
+	command.command = 6;
+	command.responseType = SDResponseType::Response1;
+	command.dataType = SDDataType::DataToSDIO;
+	command.retryCounter = 2;
+	command.data = card_switch_status;
+	command.datalength = 64;
+	command.datablocksize = SDIO_DataBlockSize_64b;
+	command.slot = sigc::ptr_fun(&SDcard_init_switch_check_cmpl);
+
+	SDIO_Command(&command);
+}
+
+static void SDcard_init_switch_check_cmpl(int result) {
+	uint8_t const *status = (uint8_t const *)card_switch_status;
+	//bit 401: function 1 supported, bits 379:376: function selected
+	if (result != SDIO_OK ||
+	    !(status[13] & 0x02) ||
+	    (status[16] & 0xf) != 1) {
+		//stays at default speed
+		SDcard_init_verify_bus();
+		return;
+	}
+
+	SDcard_init_switch_set();
+}
+
+static void SDcard_init_switch_set() {
+	/* Cmd6: SWITCH_FUNC, switch group 1 to high speed */
+	command.argument = 0x80fffff1;
+	command.command = 6;
+	command.responseType = SDResponseType::Response1;
+	command.dataType = SDDataType::DataToSDIO;
+	command.retryCounter = 2;
+	command.data = card_switch_status;
+	command.datalength = 64;
+	command.datablocksize = SDIO_DataBlockSize_64b;
+	command.slot = sigc::ptr_fun(&SDcard_init_switch_set_cmpl);
+
+	SDIO_Command(&command);
+}
+
+static void SDcard_init_switch_set_cmpl(int result) {
+	uint8_t const *status = (uint8_t const *)card_switch_status;
+	if (result == SDIO_OK && (status[16] & 0xf) == 1) {
+		//the card is switched 8 clocks after the status.
+		card_khz = SDCARD_HIGHSPEED_KHZ;
+		SDIO_ConfigureBus(card_widebus, card_khz);
+	}
+
+	SDcard_init_verify_bus();
+}
+
+static void SDcard_init_verify_bus() {
+	/* ACMD51: Send SCR, again */
+	command.argument = 0;
+	command.command = 51 | SDIO_APPCMD;
+	command.rca = card_rca;
+	command.responseType = SDResponseType::Response1;
+	command.dataType = SDDataType::DataToSDIO;
+	command.retryCounter = 2;
+	command.data = card_SCR_check;
+	command.datalength = 8;
+	command.datablocksize = SDIO_DataBlockSize_8b;
+	command.slot = sigc::ptr_fun(&SDcard_init_verify_bus_cmpl);
+
+	SDIO_Command(&command);
+}
+
+static void SDcard_init_verify_bus_cmpl(int result) {
+	uint8_t const *check = (uint8_t const *)card_SCR_check;
+	bool ok = result == SDIO_OK;
+	for(int i = 0; ok && i < 8; i++) {
+		if (check[i] != card_SCR.d[7-i])
+			ok = false;
+	}
+	//a bus width or clock the board cannot do shows up as crc errors
+	//or garbage. try again slower.
+	if (!ok && SDcard_downgrade()) {
+		SDcard_init_verify_bus();
+		return;
+	}
+
 	SDcard_init_finish();
 }
 
@@ -610,9 +771,50 @@ static void SDcard_init_finish() {
 	} else {
 		return; //hmm. this card appears to be newer than we support.
 	}
+#ifdef SDCARD_BENCHMARK
+	sd_benchmark.khz = card_khz;
+	sd_benchmark.widebus = card_widebus;
+	sd_benchmark.blocks = 0;
+	sd_benchmark.result = 0;
+	sd_benchmark_round = 0;
+	sd_benchmark_start = Timer_timeSincePowerOn();
+	SDcard_benchmark_read();
+#else
+	SDcard_init_register();
+#endif
+}
+
+static void SDcard_init_register() {
 	MSD_Register(&sdcard);
 }
 
+#ifdef SDCARD_BENCHMARK
+static void SDcard_benchmark_read() {
+	sd_benchmark_cmd.start_block = 0;
+	sd_benchmark_cmd.num_blocks = SD_BENCHMARK_BLOCKS;
+	sd_benchmark_cmd.dst = sd_benchmark_buf;
+	sd_benchmark_cmd.slot = sigc::ptr_fun(&SDcard_benchmark_read_cmpl);
+	sdcard.readBlocks(&sd_benchmark_cmd);
+}
+
+static void SDcard_benchmark_read_cmpl(int result) {
+	if (result == 0) {
+		sd_benchmark.blocks += SD_BENCHMARK_BLOCKS;
+		sd_benchmark_round++;
+	}
+	if (result != 0 || sd_benchmark_round >= SD_BENCHMARK_ROUNDS) {
+		sd_benchmark.result = result;
+		sd_benchmark.usec = Timer_timeSincePowerOn() -
+			sd_benchmark_start;
+		//crc errors may have slowed it down
+		sd_benchmark.khz = card_khz;
+		SDcard_init_register();
+		return;
+	}
+	SDcard_benchmark_read();
+}
+#endif
+
 static void SDcard_deinit() {
 	//switch pins back to input only
 	GPIO_SetBits(SD_PWR_GPIO, SD_PWR_PIN);//switch it off.
@@ -661,7 +863,7 @@ void EXTI9_5_IRQHandler() {
 			EXTI_StructInit(&extiinit);
 			extiinit.EXTI_Line = SD_CD_EXTI_Line;
 			extiinit.EXTI_Mode = EXTI_Mode_Interrupt;
-			extiinit.EXTI_Trigger = EXTI_Trigger_Rising;
+			extiinit.EXTI_Trigger = EXTI_Trigger_Falling;
 			extiinit.EXTI_LineCmd = ENABLE;
 			EXTI_Init(&extiinit);
 
@@ -680,15 +882,159 @@ static void SDcard_read_sectors2(struct MSDReadCommand *command);
 static void SDcard_read_sectors2_cmpl(int result, struct MSDReadCommand *command);
 static void SDcard_read_sectors3(struct MSDReadCommand *command);
 static void SDcard_read_sectors3_cmpl(int result, struct MSDReadCommand *command);
+
+//tries for a read failing with a crc error
+#define SDCARD_READ_RETRIES 3
+static unsigned read_tries;
+//the stop in progress is for a retry, not the end of the read
+static bool read_retrying;
 static void SDcard_write_sectors2(struct MSDWriteCommand *command);
+static void SDcard_write_sectors2_cmpl(int result, struct MSDWriteCommand *command);
+static void SDcard_write_sectors3(struct MSDWriteCommand *command);
+static void SDcard_write_sectors3_cmpl(int result, struct MSDWriteCommand *command);
+static void SDcard_write_sectors4(struct MSDWriteCommand *command);
+static void SDcard_write_sectors4_cmpl(int result, struct MSDWriteCommand *command);
+static void SDcard_write_busy(struct MSDWriteCommand *command);
+static void SDcard_write_status(struct MSDWriteCommand *command);
+static void SDcard_write_status_cmpl(int result, struct MSDWriteCommand *command);
 
 struct SDcard_rwCommand{
   MSDReadCommand *readcmd;
   MSDWriteCommand *writecmd;
+  unsigned bypassed;//times a later command went first
+  uint32_t start() const {
+    return readcmd ? readcmd->start_block : writecmd->start_block;
+  }
+  uint32_t end() const {
+    return readcmd ? readcmd->start_block + readcmd->num_blocks :
+      writecmd->start_block + writecmd->num_blocks;
+  }
 };
 
-static SDcard_rwCommand currentCommand = {NULL, NULL};
+/* 1 and 0 give first come, first served: nothing gets merged and nothing
+ * passes an older command.
+ */
+//blocks read with a single command for several merged reads at most
+#ifndef SDCARD_MERGE_MAX
+#define SDCARD_MERGE_MAX 8
+#endif
+//times the oldest command may be passed by the elevator
+#ifndef SDCARD_BYPASS_MAX
+#define SDCARD_BYPASS_MAX 8
+#endif
+
+static SDcard_rwCommand currentCommand = {NULL, NULL, 0};
 static std::deque<SDcard_rwCommand> commandQueue;
+//block after the last one transferred, the elevator moves up from there.
+static uint32_t head_block = 0;
+
+/* reads of neighbouring or overlapping blocks get merged into one read
+ * into merge_buf, which is copied to the callers once it is done.
+ */
+static MSDReadCommand mergeCommand;
+static MSDReadCommand *mergedReads[SDCARD_MERGE_MAX];
+static unsigned mergedCount = 0;
+static uint32_t merge_buf[SDCARD_MERGE_MAX * 512 / 4];
+
+static void SDcard_read_merged_cmpl(int result) {
+	for(unsigned i = 0; i < mergedCount; i++) {
+		MSDReadCommand *c = mergedReads[i];
+		if (result == 0)
+			memcpy(c->dst,
+			       (uint8_t *)merge_buf +
+			       (c->start_block - mergeCommand.start_block) * 512,
+			       c->num_blocks * 512);
+	}
+	unsigned count = mergedCount;
+	mergedCount = 0;
+	for(unsigned i = 0; i < count; i++)
+		mergedReads[i]->slot(result);
+}
+
+/* commands may only pass older ones they do not conflict with: a write
+ * must stay behind anything touching the same blocks, and so must
+ * anything behind a write.
+ * pre-condition: interrupts disabled
+ */
+static bool SDcard_mayGoFirst(size_t idx) {
+	SDcard_rwCommand const &c = commandQueue[idx];
+	for(size_t i = 0; i < idx; i++) {
+		SDcard_rwCommand const &o = commandQueue[i];
+		if ((c.writecmd || o.writecmd) &&
+		    o.start() < c.end() && c.start() < o.end())
+			return false;
+	}
+	return true;
+}
+
+/* circular elevator: the lowest block at or above the head goes first,
+ * wrapping around to the lowest block overall. the oldest command goes
+ * first once it has been passed too often.
+ * pre-condition: interrupts disabled
+ */
+static size_t SDcard_pickNext() {
+	if (commandQueue.front().bypassed >= SDCARD_BYPASS_MAX)
+		return 0;
+	size_t above = commandQueue.size();
+	size_t lowest = 0;
+	for(size_t i = 0; i < commandQueue.size(); i++) {
+		uint32_t s = commandQueue[i].start();
+		if (s >= head_block &&
+		    (above == commandQueue.size() ||
+		     s < commandQueue[above].start()) &&
+		    SDcard_mayGoFirst(i))
+			above = i;
+		if (s < commandQueue[lowest].start() && SDcard_mayGoFirst(i))
+			lowest = i;
+	}
+	size_t pick = above != commandQueue.size() ? above : lowest;
+	for(size_t i = 0; i < pick; i++)
+		commandQueue[i].bypassed++;
+	return pick;
+}
+
+/* moves the queued reads that can be read together with readcmd into
+ * mergedReads. returns false if there are none.
+ * pre-condition: interrupts disabled
+ */
+static bool SDcard_mergeReads(MSDReadCommand *readcmd) {
+	uint32_t start = readcmd->start_block;
+	uint32_t end = start + readcmd->num_blocks;
+	if (end - start >= SDCARD_MERGE_MAX)
+		return false;
+	mergedReads[0] = readcmd;
+	mergedCount = 1;
+	bool found = true;
+	//merging one may bring the next in reach
+	while(found && mergedCount < SDCARD_MERGE_MAX) {
+		found = false;
+		for(size_t i = 0; i < commandQueue.size(); i++) {
+			MSDReadCommand *c = commandQueue[i].readcmd;
+			if (!c || c->start_block > end ||
+			    c->start_block + c->num_blocks < start)
+				continue;
+			uint32_t s = std::min(start, c->start_block);
+			uint32_t e = std::max(end, c->start_block + c->num_blocks);
+			if (e - s > SDCARD_MERGE_MAX || !SDcard_mayGoFirst(i))
+				continue;
+			start = s;
+			end = e;
+			mergedReads[mergedCount++] = c;
+			commandQueue.erase(commandQueue.begin() + i);
+			found = true;
+			break;
+		}
+	}
+	if (mergedCount == 1) {
+		mergedCount = 0;
+		return false;
+	}
+	mergeCommand.start_block = start;
+	mergeCommand.num_blocks = end - start;
+	mergeCommand.dst = merge_buf;
+	mergeCommand.slot = sigc::ptr_fun(&SDcard_read_merged_cmpl);
+	return true;
+}
 
 static void SDcard_dequeueNextCommand() {
 	ISR_Guard g;
@@ -697,12 +1043,18 @@ static void SDcard_dequeueNextCommand() {
 		currentCommand.writecmd = NULL;
 		return;
 	}
-	currentCommand = commandQueue.front();
-	commandQueue.pop_front();
+	size_t pick = SDcard_pickNext();
+	currentCommand = commandQueue[pick];
+	commandQueue.erase(commandQueue.begin() + pick);
 	if (currentCommand.readcmd) {
+		if (SDcard_mergeReads(currentCommand.readcmd))
+			currentCommand.readcmd = &mergeCommand;
+		head_block = currentCommand.end();
+		read_tries = 0;
 		SDcard_read_sectors2(currentCommand.readcmd);
 	}
 	if (currentCommand.writecmd) {
+		head_block = currentCommand.end();
 		SDcard_write_sectors2(currentCommand.writecmd);
 	}
 }
@@ -710,10 +1062,12 @@ static void SDcard_dequeueNextCommand() {
 void SDCard::readBlocks(struct MSDReadCommand *command) {
 	ISR_Guard g;
 	if (currentCommand.readcmd || currentCommand.writecmd) {
-		SDcard_rwCommand c = {command , NULL};
+		SDcard_rwCommand c = {command , NULL, 0};
 		commandQueue.push_back(c);
 	} else {
 		currentCommand.readcmd = command;
+		head_block = command->start_block + command->num_blocks;
+		read_tries = 0;
 		SDcard_read_sectors2(command);
 	}
 }
@@ -744,6 +1098,19 @@ static void SDcard_read_sectors2(struct MSDReadCommand *command) {
 }
 
 static void SDcard_read_sectors2_cmpl(int result, struct MSDReadCommand *command) {
+	if (result == SDIO_DataCRC && read_tries < SDCARD_READ_RETRIES) {
+		//again, slower
+		read_tries++;
+		SDcard_downgrade();
+		if (command->num_blocks > 1) {
+			//the card is still sending
+			read_retrying = true;
+			SDcard_read_sectors3(command);
+		} else {
+			SDcard_read_sectors2(command);
+		}
+		return;
+	}
 	if (result != SDIO_OK) {
 		if (result == SDIO_CommandTimeout)
 			command->slot(ETIMEDOUT);
@@ -784,6 +1151,11 @@ static void SDcard_read_sectors3(struct MSDReadCommand *command) {
 }
 
 static void SDcard_read_sectors3_cmpl(int result, struct MSDReadCommand *command) {
+	if (read_retrying) {
+		read_retrying = false;
+		SDcard_read_sectors2(command);
+		return;
+	}
 	if (result != SDIO_OK) {
 		if (result == SDIO_CommandTimeout)
 			command->slot(ETIMEDOUT);
@@ -800,15 +1172,202 @@ static void SDcard_read_sectors3_cmpl(int result, struct MSDReadCommand *command
 void SDCard::writeBlocks(struct MSDWriteCommand *command) {
 	ISR_Guard g;
 	if (currentCommand.readcmd || currentCommand.writecmd) {
-		SDcard_rwCommand c = { NULL, command };
+		SDcard_rwCommand c = { NULL, command, 0 };
 		commandQueue.push_back(c);
 	} else {
 		currentCommand.writecmd = command;
+		head_block = command->start_block + command->num_blocks;
 		SDcard_write_sectors2(command);
 	}
 }
 
+//tries for a write failing with a crc error
+#define SDCARD_WRITE_RETRIES 3
+//DAT0 polling interval and limit while the card is programming, in us
+#define SDCARD_BUSY_POLL 100
+#define SDCARD_BUSY_TIMEOUT 500000
+
+//state of the write in progress, there is only one at a time.
+static unsigned write_tries;
+static int write_result;//SDIO_* of the data transfer
+static uint32_t write_response;
+static unsigned write_busy_polls;
+
+static int SDcard_write_errno(int result, uint32_t response) {
+	if (result == SDIO_OK)
+		return 0;
+	if (result == SDIO_CommandTimeout || result == SDIO_SystemTimeout ||
+	    result == SDIO_DataTimeout)
+		return ETIMEDOUT;
+	if (result == SDIO_CSError) {
+		if (response & SD_CS_ADDR_OUT_OF_RANGE)
+			return ENOSPC;
+		if (response & SD_CS_WRITE_PROT_VIOLATION)
+			return EROFS;
+	}
+	return EIO;
+}
+
+static bool SDcard_write_retryable(int result, uint32_t response) {
+	return result == SDIO_DataCRC || result == SDIO_CommandCRC ||
+		(result == SDIO_CSError && (response & SD_CS_COM_CRC_FAILED));
+}
+
 static void SDcard_write_sectors2(struct MSDWriteCommand *command) {
-	command->slot(-1);
+	write_tries = 0;
+	write_result = SDIO_OK;
+	if (command->num_blocks > 1) {
+		/* ACMD23: SET_WR_BLK_ERASE_COUNT, lets the card erase
+		 * all of the blocks in one go
+		 */
+		command->sdcard.sdcommand.argument = command->num_blocks;
+		command->sdcard.sdcommand.command = 23 | SDIO_APPCMD;
+		command->sdcard.sdcommand.rca = card_rca;
+		command->sdcard.sdcommand.responseType = SDResponseType::Response1;
+		command->sdcard.sdcommand.dataType = SDDataType::NoData;
+		command->sdcard.sdcommand.retryCounter = 2;
+		command->sdcard.sdcommand.data = NULL;
+		command->sdcard.sdcommand.slot = sigc::bind(sigc::ptr_fun(&SDcard_write_sectors2_cmpl), command);
+
+		SDIO_Command(&command->sdcard.sdcommand);
+	} else {
+		SDcard_write_sectors3(command);
+	}
+}
+
+static void SDcard_write_sectors2_cmpl(int /*result*/, struct MSDWriteCommand *command) {
+	//only a hint, the write works without it.
+	SDcard_write_sectors3(command);
+}
+
+static void SDcard_write_sectors3(struct MSDWriteCommand *command) {
+	if (card_type == CardHC) {
+		command->sdcard.sdcommand.argument = command->start_block;
+	} else {
+		command->sdcard.sdcommand.argument = command->start_block * 512;
+	}
+	if (command->num_blocks > 1) {
+		/* Send CMD25 WRITE_MULT_BLOCK */
+		command->sdcard.sdcommand.command = 25;
+	} else {
+		/* Send CMD24 WRITE_SINGLE_BLOCK */
+		command->sdcard.sdcommand.command = 24;
+	}
+	command->sdcard.sdcommand.rca = card_rca;
+	command->sdcard.sdcommand.responseType = SDResponseType::Response1;
+	command->sdcard.sdcommand.retryCounter = 2;
+	command->sdcard.sdcommand.data = const_cast<void *>(command->src);
+	command->sdcard.sdcommand.datalength = 512*command->num_blocks;
+	command->sdcard.sdcommand.datablocksize = SDIO_DataBlockSize_512b;
+	command->sdcard.sdcommand.dataType = SDDataType::DataToCard;
+	command->sdcard.sdcommand.slot = sigc::bind(sigc::ptr_fun(&SDcard_write_sectors3_cmpl), command);
+
+	write_tries++;
+	SDIO_Command(&command->sdcard.sdcommand);
+}
+
+static void SDcard_write_sectors3_cmpl(int result, struct MSDWriteCommand *command) {
+	write_result = result;
+	write_response = command->sdcard.sdcommand.response[0];
+	//stops sent again count against the busy timeout too
+	write_busy_polls = 0;
+
+	//the card only leaves the receive state of a multi block write
+	//with a stop, even if the data did not get through.
+	if (command->num_blocks > 1 &&
+	    result != SDIO_CommandTimeout && result != SDIO_CSError) {
+		SDcard_write_sectors4(command);
+		return;
+	}
+
+	SDcard_write_busy(command);
+}
+
+static void SDcard_write_sectors4(struct MSDWriteCommand *command) {
+	/* Cmd12: STOP_TRANSMISSION */
+	command->sdcard.sdcommand.argument = 0;
+	command->sdcard.sdcommand.command = 12;
+	command->sdcard.sdcommand.responseType = SDResponseType::Response1;
+	command->sdcard.sdcommand.dataType = SDDataType::NoData;
+	command->sdcard.sdcommand.retryCounter = 2;
+	command->sdcard.sdcommand.data = NULL;
+	command->sdcard.sdcommand.slot = sigc::bind(sigc::ptr_fun(&SDcard_write_sectors4_cmpl), command);
+
+	SDIO_Command(&command->sdcard.sdcommand);
+}
+
+static void SDcard_write_sectors4_cmpl(int result, struct MSDWriteCommand *command) {
+	if (write_result == SDIO_OK && result != SDIO_OK) {
+		write_result = result;
+		write_response = command->sdcard.sdcommand.response[0];
+	}
+
+	SDcard_write_busy(command);
+}
+
+/* the card holds DAT0 low while it programs the data. poll it from the
+ * timer instead of waiting, then check the outcome with CMD13.
+ */
+static void SDcard_write_busy(struct MSDWriteCommand *command) {
+	write_busy_polls++;
+	if (write_busy_polls * SDCARD_BUSY_POLL > SDCARD_BUSY_TIMEOUT) {
+		command->slot(ETIMEDOUT);
+		SDcard_dequeueNextCommand();
+		return;
+	}
+	if (GPIO_ReadInputDataBit(SD_D0_GPIO, SD_D0_PIN) == Bit_RESET) {
+		sdcard_timer_connection = Timer_Oneshot
+		(SDCARD_BUSY_POLL, sigc::bind(sigc::ptr_fun(&SDcard_write_busy), command));
+		return;
+	}
+
+	SDcard_write_status(command);
+}
+
+static void SDcard_write_status(struct MSDWriteCommand *command) {
+	/* Cmd13: SEND_STATUS */
+	command->sdcard.sdcommand.argument = card_rca << 16;
+	command->sdcard.sdcommand.command = 13;
+	command->sdcard.sdcommand.responseType = SDResponseType::Response1;
+	command->sdcard.sdcommand.dataType = SDDataType::NoData;
+	command->sdcard.sdcommand.retryCounter = 2;
+	command->sdcard.sdcommand.data = NULL;
+	command->sdcard.sdcommand.slot = sigc::bind(sigc::ptr_fun(&SDcard_write_status_cmpl), command);
+
+	SDIO_Command(&command->sdcard.sdcommand);
+}
+
+static void SDcard_write_status_cmpl(int result, struct MSDWriteCommand *command) {
+	uint32_t response = command->sdcard.sdcommand.response[0];
+	uint32_t state = (response >> 9) & 0xf;
+	if (result == SDIO_OK && (state == 5 || state == 6)) {
+		//the stop did not get through, the card still waits for
+		//data. it does not take anything else before it has one.
+		SDcard_write_sectors4(command);
+		return;
+	}
+	if (result == SDIO_OK && state != 4) {
+		//not back in TRAN yet, still programming.
+		sdcard_timer_connection = Timer_Oneshot
+		(SDCARD_BUSY_POLL, sigc::bind(sigc::ptr_fun(&SDcard_write_busy), command));
+		return;
+	}
+	//errors of the programming show up here
+	if (write_result == SDIO_OK && result != SDIO_OK) {
+		write_result = result;
+		write_response = response;
+	}
+
+	if (write_result != SDIO_OK &&
+	    SDcard_write_retryable(write_result, write_response) &&
+	    write_tries < SDCARD_WRITE_RETRIES) {
+		if (write_result == SDIO_DataCRC)
+			SDcard_downgrade();
+		write_result = SDIO_OK;
+		SDcard_write_sectors3(command);
+		return;
+	}
+
+	command->slot(SDcard_write_errno(write_result, write_response));
 	SDcard_dequeueNextCommand();
 }
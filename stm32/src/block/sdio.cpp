@@ -131,9 +131,18 @@ void SDIO_ConfigureBus(int widebus, int maxkhz) {
 	sdioinit.SDIO_ClockPowerSave = SDIO_ClockPowerSave_Disable;// not during setup, maybe later.
 	sdioinit.SDIO_BusWide = widebus?SDIO_BusWide_4b:SDIO_BusWide_1b;
 	sdioinit.SDIO_HardwareFlowControl = SDIO_HardwareFlowControl_Enable;
+	if (maxkhz >= 48000) {
+		//high speed: the divider cannot go below 2, bypass it to
+		//get the full 48MHz.
+		sdioinit.SDIO_ClockBypass = SDIO_ClockBypass_Enable;
+		sdioinit.SDIO_ClockDiv = 0;
+		SDIO_Init(&sdioinit);
+		return;
+	}
 	int div = (48000+maxkhz-1)/maxkhz;//round up
-	if (div > 253)
-		div = 253;
+	//the divider field is 8 bits: 48/(255+2) is still above 0.18
+	if (div > 257)
+		div = 257;
 	if (div < 2)
 		div = 2;
 	sdioinit.SDIO_ClockDiv = div-2; //48/(0+2) = 24. 48/(118+2) = 0.4.
@@ -316,12 +325,17 @@ void SDIO_IRQHandler(void) {
 		case DataToCard:
 			SD_DEBUG_SAMPLE(result, c);
 			c->state = 3;
-			//enable irqs for data transfer
+			//enable irqs for data transfer. the dma is done
+			//before the card has got the data, so writes
+			//complete on DATAEND instead.
 			SDIO_ITConfig(SDIO_IT_TXUNDERR, ENABLE);
 			SDIO_ITConfig(SDIO_IT_DCRCFAIL, ENABLE);
 			SDIO_ITConfig(SDIO_IT_DTIMEOUT, ENABLE);
 			SDIO_ITConfig(SDIO_IT_STBITERR, ENABLE);
-			sdio_timer_connection = Timer_Oneshot(1000, sigc::ptr_fun(&SDIO_timeout));
+			SDIO_ITConfig(SDIO_IT_DATAEND, ENABLE);
+			//the card may take up to 250ms per block to
+			//accept it
+			sdio_timer_connection = Timer_Oneshot(250000, sigc::ptr_fun(&SDIO_timeout));
 			break;
 		}
 	} else if (c->state == 2 || c->state == 3) {
@@ -337,9 +351,19 @@ void SDIO_IRQHandler(void) {
 			result = SDIO_DataTimeout;
 		if (SDIO_GetFlagStatus(SDIO_FLAG_STBITERR))
 			result = SDIO_DataStartBitError;
+		if (SDIO_GetFlagStatus(SDIO_FLAG_TXUNDERR))
+			result = SDIO_UnknownError;
+		else if (c->state == 3 && result == SDIO_UnknownError &&
+			 SDIO_GetFlagStatus(SDIO_FLAG_DATAEND))
+			result = SDIO_OK;
+
+		//the dma may not have been told yet
+		if (c->state == 3)
+			DMA_ITConfig(DMA2_Stream3, DMA_IT_TE | DMA_IT_TC, DISABLE);
 
 		SDIO_ITConfig(SDIO_IT_RXOVERR, DISABLE);
 		SDIO_ITConfig(SDIO_IT_TXUNDERR, DISABLE);
+		SDIO_ITConfig(SDIO_IT_DATAEND, DISABLE);
 		SDIO_ITConfig(SDIO_IT_DCRCFAIL, DISABLE);
 		SDIO_ITConfig(SDIO_IT_DTIMEOUT, DISABLE);
 		SDIO_ITConfig(SDIO_IT_STBITERR, DISABLE);
@@ -353,6 +377,13 @@ void SDIO_IRQHandler(void) {
 
 void DMA2_Stream3_IRQHandler() {
 	struct SDCommand *c = sdio_current_command;
+	if (c && c->state == 3 &&
+	    !DMA_GetFlagStatus(DMA2_Stream3, DMA_FLAG_TEIF3)) {
+		//write: the SDIO irq completes the command on DATAEND
+		DMA_ClearITPendingBit(DMA2_Stream3, DMA_IT_TCIF3);
+		DMA_ITConfig(DMA2_Stream3, DMA_IT_TE | DMA_IT_TC, DISABLE);
+		return;
+	}
 	sdio_current_command = NULL;
 	sdio_timer_connection.disconnect();
 	SDIO_ITConfig(SDIO_IT_RXOVERR, DISABLE);
@@ -418,6 +449,8 @@ static void SDIO_timeout() {
 	SDIO_ITConfig(SDIO_IT_DCRCFAIL, DISABLE);
 	SDIO_ITConfig(SDIO_IT_DTIMEOUT, DISABLE);
 	SDIO_ITConfig(SDIO_IT_STBITERR, DISABLE);
+	SDIO_ITConfig(SDIO_IT_TXUNDERR, DISABLE);
+	SDIO_ITConfig(SDIO_IT_DATAEND, DISABLE);
 	DMA_ITConfig(DMA2_Stream3, DMA_IT_TE | DMA_IT_TC, DISABLE);
 	//SDIO_ClearFlag(0x00c007ff);
 	SD_DEBUG_SAMPLE(SDIO_SystemTimeout, c);
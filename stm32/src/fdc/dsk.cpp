@@ -1,10 +1,16 @@
 
 #include <fdc/dsk.hpp>
 
+#include <timer.hpp>
+#include <deferredwork.hpp>
 #include <fcntl.h>
 #include <vector>
+#include <list>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <string>
 
 namespace dsk {
 	typedef struct
@@ -47,14 +53,24 @@ namespace dsk {
 	class DSK : public Disk {
 	private:
 		unsigned short TrackSize;
+		DiskFormatTrackCommand *current_format_command;
 		void preloadReadComplete(int res, int errno_code);
+		RefPtr<DiskSector> searchSector(DiskFindSectorCommand *c,
+						unsigned &sector_index);
 		void fillSectorInfoAndComplete();
 		void findSectorReadComplete(int res, int /*errno_code*/);
+		void formatTrackAndComplete();
+		void formatReadComplete(int res, int /*errno_code*/);
+	protected:
+		virtual unsigned cylinderSize(unsigned pcn);
 	public:
-		bool probe(int fd);
+		bool probe(int fd, void const *header);
 		virtual void close();
-		virtual void preloadCylinder(unsigned pcn);
+		virtual bool preloadCylinder(unsigned pcn);
 		virtual void findSector(DiskFindSectorCommand *command);
+		virtual RefPtr<DiskSector> findCachedSector
+			(DiskFindSectorCommand *command);
+		virtual void formatTrack(DiskFormatTrackCommand *command);
 	};
 
 	typedef struct
@@ -95,23 +111,1122 @@ namespace dsk {
 	} EXTDSKHEADER;
 
 	class ExtDSK : public Disk {
-	private:
+	protected:
 		unsigned short TrackSize;
 		std::vector<unsigned char> TrackSizeTable;
+		unsigned trackOffset(unsigned pcn, unsigned phn);
+		DiskFormatTrackCommand *current_format_command;
+	private:
 		void preloadReadComplete(int res, int errno_code);
+		RefPtr<DiskSector> searchSector(DiskFindSectorCommand *c,
+						unsigned &sector_index);
 		void fillSectorInfoAndComplete();
 		void findSectorReadComplete(int res, int /*errno_code*/);
+		void formatTrackAndComplete();
+		void formatReadComplete(int res, int /*errno_code*/);
+	protected:
+		virtual unsigned cylinderSize(unsigned pcn);
 	public:
-		bool probe(int fd);
+		bool probe(int fd, void const *header);
 		virtual void close();
-		virtual void preloadCylinder(unsigned pcn);
+		virtual bool preloadCylinder(unsigned pcn);
 		virtual void findSector(DiskFindSectorCommand *command);
+		virtual RefPtr<DiskSector> findCachedSector
+			(DiskFindSectorCommand *command);
+		virtual void formatTrack(DiskFormatTrackCommand *command);
+	};
+
+	/* compressed image: header, track table, track data. every track
+	 * decompresses(lz4 block format) to the track as stored in an
+	 * extended image, Track-Info block included. tracks with identical
+	 * contents may share their data. a PackedSize of 0 marks an
+	 * unformatted track, a PackedSize equal to TrackSize a track stored
+	 * uncompressed. all values little endian. tools/cdskconv converts
+	 * images into this format.
+	 *
+	 * the track table is the index: a cylinder is always loaded whole,
+	 * and the sector ids come with it. filler sectors are not shared
+	 * on their own, lz4 packs a sector of one byte into a few bytes.
+	 */
+	typedef struct
+	{
+		char		DskHeader[34];//"CPC CDSK", zero padded
+		char		DskCreator[14];
+		unsigned char	NumTracks;
+		unsigned char	NumSides;
+		unsigned char	Version;//1
+		char		pad0[255-3-14-33];
+	} CDSKHEADER;
+
+	typedef struct
+	{
+		uint32_t	Offset;
+		uint16_t	PackedSize;
+		uint16_t	TrackSize;//multiple of 256
+	} __attribute__((packed)) CDSKTRACK;
+
+	struct CDSKRead {
+		RefPtr<DiskCylinder> cylinder;
+		aio::PReadCommand *cmd;
+		unsigned pcn;
+		unsigned phn;//track of the cylinder currently read
+		std::vector<uint8_t> packed;
+		aio::PReadCommand preadcmd;
+	};
+
+	/* read only, the data layout is the one of ExtDSK once decompressed.
+	 */
+	class CDSK : public ExtDSK {
+	private:
+		std::vector<CDSKTRACK> Tracks;
+		void readTrack(CDSKRead *r);
+		void readTrackComplete(int res, int errno_code, CDSKRead *r);
+		void decodeTrack(CDSKRead *r);
+	protected:
+		virtual void readCylinder(unsigned pcn,
+					  RefPtr<DiskCylinder> const &cylinder,
+					  aio::PReadCommand *cmd);
+	public:
+		bool probe(int fd, void const *header, void const *tracks);
 	};
 }
 
 using namespace dsk;
 
-RefPtr<Disk> dsk::openImage(char const *filename) {
+//time without writes before changed cylinders get written to the image
+#define DSK_FLUSH_DELAY_US 500000
+/* default memory budget of the cylinder cache, two cylinders of a
+ * double sided disk with 9 sectors per track. the heap shares the 120k ram
+ * with the fat block cache, directory indexes and the vfs page pool, and
+ * a failing allocation stops the box.
+ */
+#define DSK_CACHE_BUDGET 20480
+/* size journals get created with. a record holds the changes to one
+ * cylinder, this is room for three of a double sided disk with 9 sectors
+ * per track before the journal has to be emptied.
+ */
+#define DSK_JOURNAL_SIZE 32768
+
+namespace dsk {
+	struct CachedCylinder {
+		Disk const *disk;
+		unsigned pcn;
+		RefPtr<DiskCylinder> cylinder;
+	};
+}
+
+/* cylinders of all disks, most recently used first.
+ */
+static std::list<CachedCylinder> cylindercache;
+static size_t cylindercache_budget = DSK_CACHE_BUDGET;
+static DiskCacheInfo cylindercache_info;
+
+/* pre-condition: interrupts disabled
+ */
+static void cacheEvict() {
+	//the newest entry stays, even if it is too large on its own
+	while (cylindercache_info.size > cylindercache_budget &&
+	       cylindercache.size() > 1) {
+		cylindercache_info.size -=
+			cylindercache.back().cylinder->data.size();
+		cylindercache.pop_back();
+	}
+}
+
+/* pre-condition: interrupts disabled
+ */
+static RefPtr<DiskCylinder> cacheLookup(Disk const *disk, unsigned pcn) {
+	for(auto it = cylindercache.begin(); it != cylindercache.end(); it++) {
+		if (it->disk == disk && it->pcn == pcn) {
+			cylindercache.splice(cylindercache.begin(),
+					     cylindercache, it);
+			return cylindercache.front().cylinder;
+		}
+	}
+	return RefPtr<DiskCylinder>();
+}
+
+/* pre-condition: interrupts disabled
+ */
+static void cacheInsert(Disk const *disk, unsigned pcn,
+			RefPtr<DiskCylinder> const &cylinder) {
+	for(auto it = cylindercache.begin(); it != cylindercache.end(); it++) {
+		if (it->disk == disk && it->pcn == pcn) {
+			cylindercache_info.size -= it->cylinder->data.size();
+			cylindercache.erase(it);
+			break;
+		}
+	}
+	CachedCylinder c;
+	c.disk = disk;
+	c.pcn = pcn;
+	c.cylinder = cylinder;
+	cylindercache.push_front(c);
+	cylindercache_info.size += cylinder->data.size();
+	cacheEvict();
+}
+
+static void cacheDrop(Disk const *disk) {
+	ISR_Guard g;
+	for(auto it = cylindercache.begin(); it != cylindercache.end(); ) {
+		if (it->disk == disk) {
+			cylindercache_info.size -= it->cylinder->data.size();
+			it = cylindercache.erase(it);
+		} else
+			it++;
+	}
+}
+
+void dsk::setCacheBudget(size_t bytes) {
+	ISR_Guard g;
+	cylindercache_budget = bytes;
+	cacheEvict();
+}
+
+DiskCacheInfo dsk::cacheInfo() {
+	ISR_Guard g;
+	DiskCacheInfo info = cylindercache_info;
+	info.budget = cylindercache_budget;
+	return info;
+}
+
+/* journal file: JOURNALHEADER, followed by records of a JOURNALRECORD
+ * and Length bytes of data to be written to the image at Offset. a
+ * record is only valid if it has the Generation of the header, so
+ * incrementing that empties the journal. the data of a record is
+ * written before its JOURNALRECORD, a valid record is complete.
+ */
+namespace dsk {
+	typedef struct
+	{
+		char		Magic[8];//"CPC DSKJ"
+		uint32_t	Generation;
+		uint32_t	pad0;
+	} JOURNALHEADER;
+
+	typedef struct
+	{
+		uint32_t	Generation;
+		uint32_t	Offset;
+		uint32_t	Length;
+		uint32_t	Checksum;//adler32 of Offset, Length and data
+	} JOURNALRECORD;
+
+	/* the disk writes everything in the journal to the image before
+	 * it appends a record that does not fit, so the journal only gets
+	 * emptied once the image has all of it.
+	 */
+	class DiskJournal {
+	private:
+		int fd;
+		int imagefd;
+		uint32_t size;
+		uint32_t end;//where the next record goes
+		JOURNALHEADER header;
+		JOURNALRECORD record;
+		void const *data;
+		std::vector<uint8_t> replaydata;
+		aio::PReadCommand preadcmd;
+		aio::PWriteCommand pwritecmd;
+		sigc::slot<void(int, int)> slot;
+		sigc::slot<void(int, int)> reset_slot;
+		void reset(sigc::slot<void(int, int)> const &slot);
+		void resetComplete(int res, int errno_code);
+		void appendData(int res, int errno_code);
+		void appendDataComplete(int res, int errno_code);
+		void appendRecordComplete(int res, int errno_code);
+		void replayHeaderComplete(int res, int errno_code);
+		void replayRecord();
+		void replayRecordComplete(int res, int errno_code);
+		void replayDataComplete(int res, int errno_code);
+		void replayWriteComplete(int res, int errno_code);
+	public:
+		DiskJournal(int fd, int imagefd, uint32_t size);
+		~DiskJournal();
+		//whether a record of len bytes fits without emptying first
+		bool fits(unsigned len) const;
+		void append(uint32_t offset, void const *data, unsigned len,
+			    sigc::slot<void(int, int)> const &slot);
+		void replay(sigc::slot<void(int, int)> const &slot);
+		void close();
+	};
+}
+
+static uint32_t journalChecksum(uint32_t sum, void const *data,
+				unsigned len) {
+	uint8_t const *p = reinterpret_cast<uint8_t const *>(data);
+	uint32_t a = sum & 0xffff;
+	uint32_t b = sum >> 16;
+	while(len > 0) {
+		//small enough for b not to overflow before the modulo
+		unsigned n = len > 2048 ? 2048 : len;
+		len -= n;
+		while(n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+DiskJournal::DiskJournal(int fd, int imagefd, uint32_t size)
+: fd(fd)
+, imagefd(imagefd)
+, size(size)
+, end(sizeof(JOURNALHEADER))
+{
+	memset(&header, 0, sizeof(header));
+}
+
+DiskJournal::~DiskJournal() {
+	if (fd != -1)
+		::close(fd);
+}
+
+void DiskJournal::reset(sigc::slot<void(int, int)> const &slot) {
+	reset_slot = slot;
+	memcpy(header.Magic, "CPC DSKJ", 8);
+	header.Generation++;
+	end = sizeof(JOURNALHEADER);
+	pwritecmd.ptr = &header;
+	pwritecmd.len = sizeof(header);
+	pwritecmd.offset = 0;
+	pwritecmd.slot = sigc::mem_fun(this, &DiskJournal::resetComplete);
+	if (aio::pwrite(fd, &pwritecmd) != 0)
+		resetComplete(-1, errno);
+}
+
+void DiskJournal::resetComplete(int res, int errno_code) {
+	if (res != (int)sizeof(header)) {
+		reset_slot(-1, res < 0 ? errno_code : EIO);
+		return;
+	}
+	reset_slot(0, 0);
+}
+
+bool DiskJournal::fits(unsigned len) const {
+	return end + sizeof(JOURNALRECORD) + len <= size;
+}
+
+/* post-condition: slot gets called once the record is in the journal,
+                   with -1 if it is not.
+ */
+void DiskJournal::append(uint32_t offset, void const *data, unsigned len,
+			 sigc::slot<void(int, int)> const &slot) {
+	unsigned need = sizeof(JOURNALRECORD) + len;
+	if (sizeof(JOURNALHEADER) + need > size) {
+		slot(-1, ENOSPC);
+		return;
+	}
+	this->slot = slot;
+	this->data = data;
+	record.Offset = offset;
+	record.Length = len;
+	record.Checksum = journalChecksum(1, &record.Offset, 8);
+	record.Checksum = journalChecksum(record.Checksum, data, len);
+	if (end + need > size)
+		reset(sigc::mem_fun(this, &DiskJournal::appendData));
+	else
+		appendData(0, 0);
+}
+
+void DiskJournal::appendData(int res, int errno_code) {
+	if (res < 0) {
+		slot(res, errno_code);
+		return;
+	}
+	record.Generation = header.Generation;
+	pwritecmd.ptr = data;
+	pwritecmd.len = record.Length;
+	pwritecmd.offset = end + sizeof(JOURNALRECORD);
+	pwritecmd.slot = sigc::mem_fun(this, &DiskJournal::appendDataComplete);
+	if (aio::pwrite(fd, &pwritecmd) != 0)
+		appendDataComplete(-1, errno);
+}
+
+void DiskJournal::appendDataComplete(int res, int errno_code) {
+	if (res != (int)record.Length) {
+		slot(-1, res < 0 ? errno_code : EIO);
+		return;
+	}
+	pwritecmd.ptr = &record;
+	pwritecmd.len = sizeof(record);
+	pwritecmd.offset = end;
+	pwritecmd.slot = sigc::mem_fun(this,
+				       &DiskJournal::appendRecordComplete);
+	if (aio::pwrite(fd, &pwritecmd) != 0)
+		appendRecordComplete(-1, errno);
+}
+
+void DiskJournal::appendRecordComplete(int res, int errno_code) {
+	if (res != (int)sizeof(record)) {
+		slot(-1, res < 0 ? errno_code : EIO);
+		return;
+	}
+	end += sizeof(JOURNALRECORD) + record.Length;
+	slot(0, 0);
+}
+
+/* writes all valid records to the image, then empties the journal.
+ */
+void DiskJournal::replay(sigc::slot<void(int, int)> const &slot) {
+	this->slot = slot;
+	preadcmd.ptr = &header;
+	preadcmd.len = sizeof(header);
+	preadcmd.offset = 0;
+	preadcmd.slot = sigc::mem_fun(this, &DiskJournal::replayHeaderComplete);
+	if (aio::pread(fd, &preadcmd) != 0)
+		replayHeaderComplete(-1, errno);
+}
+
+void DiskJournal::replayHeaderComplete(int res, int /*errno_code*/) {
+	if (res != (int)sizeof(header) ||
+	    memcmp(header.Magic, "CPC DSKJ", 8) != 0) {
+		//not used yet
+		memset(&header, 0, sizeof(header));
+		reset(slot);
+		return;
+	}
+	end = sizeof(JOURNALHEADER);
+	replayRecord();
+}
+
+void DiskJournal::replayRecord() {
+	if (end + sizeof(JOURNALRECORD) > size) {
+		reset(slot);
+		return;
+	}
+	preadcmd.ptr = &record;
+	preadcmd.len = sizeof(record);
+	preadcmd.offset = end;
+	preadcmd.slot = sigc::mem_fun(this, &DiskJournal::replayRecordComplete);
+	if (aio::pread(fd, &preadcmd) != 0)
+		replayRecordComplete(-1, errno);
+}
+
+void DiskJournal::replayRecordComplete(int res, int /*errno_code*/) {
+	if (res != (int)sizeof(record) ||
+	    record.Generation != header.Generation ||
+	    record.Length > size - end - sizeof(JOURNALRECORD)) {
+		//end of the journal
+		replaydata.clear();
+		reset(slot);
+		return;
+	}
+	replaydata.resize(record.Length);
+	preadcmd.ptr = replaydata.data();
+	preadcmd.len = record.Length;
+	preadcmd.offset = end + sizeof(JOURNALRECORD);
+	preadcmd.slot = sigc::mem_fun(this, &DiskJournal::replayDataComplete);
+	if (aio::pread(fd, &preadcmd) != 0)
+		replayDataComplete(-1, errno);
+}
+
+void DiskJournal::replayDataComplete(int res, int /*errno_code*/) {
+	uint32_t sum = journalChecksum(1, &record.Offset, 8);
+	if (res != (int)record.Length ||
+	    journalChecksum(sum, replaydata.data(), record.Length) !=
+	    record.Checksum) {
+		//torn record, it never made it to the image either.
+		replaydata.clear();
+		reset(slot);
+		return;
+	}
+	pwritecmd.ptr = replaydata.data();
+	pwritecmd.len = record.Length;
+	pwritecmd.offset = record.Offset;
+	pwritecmd.slot = sigc::mem_fun(this, &DiskJournal::replayWriteComplete);
+	if (aio::pwrite(imagefd, &pwritecmd) != 0)
+		replayWriteComplete(-1, errno);
+}
+
+void DiskJournal::replayWriteComplete(int res, int errno_code) {
+	if (res != (int)record.Length) {
+		//keep the journal, the next attempt may be more lucky.
+		replaydata.clear();
+		slot(-1, res < 0 ? errno_code : EIO);
+		return;
+	}
+	end += sizeof(JOURNALRECORD) + record.Length;
+	replayRecord();
+}
+
+static void journalSyncComplete(int /*res*/, int /*errno_code*/,
+				volatile bool *done) {
+	*done = true;
+}
+
+/* empties the journal and closes it. must not be used in interrupt
+   context.
+ */
+void DiskJournal::close() {
+	volatile bool done = false;
+	reset(sigc::bind(sigc::ptr_fun(&journalSyncComplete), &done));
+	while(!done)
+		sched_yield();
+	::close(fd);
+	fd = -1;
+}
+
+Disk::Disk()
+: fd(-1)
+, dirty_start(0)
+, dirty_end(0)
+, writeback_cylinderno(~0U)
+, writeback_busy(false)
+, load_pending(false)
+, journal(NULL)
+, merge_count(0)
+, merge_next(0)
+, readahead_cylinderno(~0U)
+, readahead_busy(false)
+, readahead_waiting(false)
+, write_protected(false)
+, image_reads(0)
+{}
+
+Disk::~Disk() {
+	flush_timer.disconnect();
+	delete journal;
+	cacheDrop(this);
+}
+
+void Disk::initCache() {
+	preload_cylinderno = ~0U;
+	current_cylinderno = ~0U;
+	current_sector = 0;
+	state = IDLE;
+}
+
+/* pre-condition: interrupts disabled or in completion context
+   post-condition: slot gets called once the cylinder is in current_cylinder
+ */
+void Disk::loadCylinder(unsigned pcn,
+			sigc::slot<void(int, int)> const &slot) {
+	if (dirty_end > dirty_start) {
+		if (writeback_busy) {
+			//picked up once the writeback is done
+			load_pending = true;
+			load_pending_pcn = pcn;
+			load_pending_slot = slot;
+			return;
+		}
+		startWriteback();
+	}
+	if (pcn == writeback_cylinderno) {
+		//the image does not have the data yet, but we do.
+		current_cylinder = writeback_cylinder;
+		slot(current_cylinder->data.size(), 0);
+		return;
+	}
+	if (Merge *m = findMerge(pcn)) {
+		current_cylinder = m->cylinder;
+		slot(current_cylinder->data.size(), 0);
+		return;
+	}
+	if (pcn == readahead_cylinderno && readahead_busy) {
+		readahead_waiting = true;
+		readahead_slot = slot;
+		return;
+	}
+	RefPtr<DiskCylinder> cached = cacheLookup(this, pcn);
+	if (cached) {
+		cylindercache_info.hits++;
+		current_cylinder = cached;
+		slot(current_cylinder->data.size(), 0);
+		return;
+	}
+	cylindercache_info.misses++;
+	unsigned CylinderSize = cylinderSize(pcn);
+	//never reuse the buffer, sectors may still refer to it.
+	current_cylinder = new DiskCylinder();
+	current_cylinder->data.resize(CylinderSize);
+	load_slot = slot;
+	preadcmd.slot = sigc::bind(sigc::mem_fun(this, &Disk::loadComplete),
+				   pcn);
+	image_reads++;
+	readCylinder(pcn, current_cylinder, &preadcmd);
+}
+
+void Disk::readCylinder(unsigned pcn, RefPtr<DiskCylinder> const &cylinder,
+			aio::PReadCommand *cmd) {
+	cmd->ptr = cylinder->data.data();
+	cmd->len = cylinder->data.size();
+	cmd->offset = TrackOffsetTable[pcn * NumSides];
+	if (aio::pread(fd, cmd) != 0)
+		cmd->slot(-1, errno);
+}
+
+void Disk::loadComplete(int res, int errno_code, unsigned pcn) {
+	{
+		ISR_Guard g;
+		if (res > 0)
+			cylindercache_info.bytes_read += res;
+		if (res == (int)current_cylinder->data.size())
+			cacheInsert(this, pcn, current_cylinder);
+	}
+	load_slot(res, errno_code);
+}
+
+/* pre-condition: interrupts disabled or in completion context
+ */
+void Disk::readaheadCylinder(unsigned pcn) {
+	if (pcn >= NumTracks || readahead_busy ||
+	    pcn == current_cylinderno ||
+	    pcn == writeback_cylinderno || findMerge(pcn))
+		return;
+	for(auto &c : cylindercache) {
+		if (c.disk == this && c.pcn == pcn)
+			return;
+	}
+	unsigned CylinderSize = cylinderSize(pcn);
+	if (CylinderSize == 0)
+		return;
+	readahead_cylinderno = pcn;
+	readahead_busy = true;
+	readahead_cylinder = new DiskCylinder();
+	readahead_cylinder->data.resize(CylinderSize);
+	readaheadcmd.slot = sigc::mem_fun(this, &Disk::readaheadComplete);
+	image_reads++;
+	readCylinder(pcn, readahead_cylinder, &readaheadcmd);
+}
+
+void Disk::readaheadComplete(int res, int /*errno_code*/) {
+	ISR_Guard g;
+	unsigned pcn = readahead_cylinderno;
+	readahead_busy = false;
+	if (res > 0)
+		cylindercache_info.bytes_read += res;
+	if (res == (int)readahead_cylinder->data.size())
+		cacheInsert(this, pcn, readahead_cylinder);
+	readahead_cylinderno = ~0U;
+	readahead_cylinder = NULL;
+	if (readahead_waiting) {
+		readahead_waiting = false;
+		//loadCylinder either finds it in the cache or reads it again.
+		loadCylinder(pcn, readahead_slot);
+	}
+}
+
+void Disk::markDirty(void *start, unsigned len) {
+	unsigned s = reinterpret_cast<uint8_t *>(start) -
+		current_cylinder->data.data();
+	if (dirty_end <= dirty_start) {
+		dirty_start = s;
+		dirty_end = s + len;
+	} else {
+		if (s < dirty_start)
+			dirty_start = s;
+		if (s + len > dirty_end)
+			dirty_end = s + len;
+	}
+	flush_timer.disconnect();
+	flush_timer = Timer_Oneshot(DSK_FLUSH_DELAY_US,
+				    sigc::mem_fun(this, &Disk::flushTimer));
+}
+
+/* pre-condition: interrupts disabled, !writeback_busy, current cylinder dirty
+   post-condition: the dirty cylinder has moved to writeback_cylinder and is
+                   being written, current_cylinder is invalid.
+ */
+void Disk::startWriteback() {
+	flush_timer.disconnect();
+	writeback_cylinder = current_cylinder;
+	current_cylinder = NULL;
+	writeback_cylinderno = current_cylinderno;
+	current_cylinderno = ~0U;
+	pwritecmd.ptr = writeback_cylinder->data.data() + dirty_start;
+	pwritecmd.len = dirty_end - dirty_start;
+	pwritecmd.offset = TrackOffsetTable[writeback_cylinderno * NumSides] +
+		dirty_start;
+	pwritecmd.slot = sigc::mem_fun(this, &Disk::writebackComplete);
+	dirty_start = 0;
+	dirty_end = 0;
+	writeback_busy = true;
+	if (!journal && !journal_name.empty()) {
+		//files cannot be created in interrupt context
+		addDeferredWork(sigc::mem_fun(this, &Disk::createJournal));
+		return;
+	}
+	if (journal) {
+		journalWriteback();
+		return;
+	}
+	if (aio::pwrite(fd, &pwritecmd) != 0)
+		writebackComplete(-1, errno);
+}
+
+/* creates the journal of an image, zero filled so appending records never
+ * has to grow the file. returns the file, -1 on failure.
+ */
+static int createJournalFile(std::string const &name) {
+	int fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return -1;
+	if (ftruncate(fd, DSK_JOURNAL_SIZE) != 0) {
+		int e = errno;
+		::close(fd);
+		errno = e;
+		return -1;
+	}
+	return fd;
+}
+
+/* pre-condition: a writeback is waiting for the journal
+ */
+void Disk::createJournal() {
+	int journalfd = createJournalFile(journal_name);
+	if (journalfd == -1 && errno == EBUSY) {
+		//the filesystem is in the middle of another change, try again
+		//once that is done.
+		addDeferredWork(sigc::mem_fun(this, &Disk::createJournal));
+		return;
+	}
+	ISR_Guard g;
+	journal_name.clear();
+	if (journalfd == -1) {
+		//the image still gets the data, just without the protection.
+		if (aio::pwrite(fd, &pwritecmd) != 0)
+			writebackComplete(-1, errno);
+		return;
+	}
+	journal = new DiskJournal(journalfd, fd, DSK_JOURNAL_SIZE);
+	//finds nothing to replay and writes the header
+	journal->replay(sigc::mem_fun(this, &Disk::createJournalComplete));
+}
+
+void Disk::createJournalComplete(int /*res*/, int /*errno_code*/) {
+	ISR_Guard g;
+	journalWriteback();
+}
+
+/* pre-condition: interrupts disabled, writeback_busy, the writeback is in
+                  pwritecmd
+ */
+void Disk::journalWriteback() {
+	//emptying the journal would lose what the image does not have yet
+	if (merge_count == sizeof(merges) / sizeof(merges[0]) ||
+	    (merge_count && !journal->fits(pwritecmd.len))) {
+		startMerge();
+		return;
+	}
+	journal->append(pwritecmd.offset, pwritecmd.ptr, pwritecmd.len,
+			sigc::mem_fun(this, &Disk::writebackJournalComplete));
+}
+
+void Disk::writebackJournalComplete(int res, int /*errno_code*/) {
+	if (res < 0) {
+		//even if the journal failed to take the data, the image still
+		//gets it, just without the protection.
+		if (aio::pwrite(fd, &pwritecmd) != 0)
+			writebackComplete(-1, errno);
+		return;
+	}
+	ISR_Guard g;
+	//safe in the journal, the image gets it when the disk is idle.
+	unsigned start = pwritecmd.offset -
+		TrackOffsetTable[writeback_cylinderno * NumSides];
+	unsigned end = start + pwritecmd.len;
+	Merge *m = findMerge(writeback_cylinderno);
+	if (m && m->cylinder.operator->() == writeback_cylinder.operator->()) {
+		if (start < m->start)
+			m->start = start;
+		if (end > m->end)
+			m->end = end;
+	} else {
+		m = &merges[merge_count++];
+		m->pcn = writeback_cylinderno;
+		m->start = start;
+		m->end = end;
+		m->cylinder = writeback_cylinder;
+	}
+	writebackComplete(0, 0);
+}
+
+void Disk::writebackComplete(int /*res*/, int /*errno_code*/) {
+	ISR_Guard g;
+	//if the write failed, there is nothing sensible left to do with
+	//the data, the image is not writable after all.
+	writeback_busy = false;
+	writeback_cylinderno = ~0U;
+	writeback_cylinder = NULL;
+	if (merge_count && !flush_timer.connected())
+		flush_timer = Timer_Oneshot(DSK_FLUSH_DELAY_US,
+					    sigc::mem_fun(this, &Disk::flushTimer));
+	if (load_pending) {
+		load_pending = false;
+		loadCylinder(load_pending_pcn, load_pending_slot);
+	}
+}
+
+//the latest changes to pcn in the journal, if the image lacks them
+Disk::Merge *Disk::findMerge(unsigned pcn) {
+	for(unsigned i = merge_count; i > 0; i--) {
+		if (merges[i - 1].pcn == pcn)
+			return &merges[i - 1];
+	}
+	return NULL;
+}
+
+/* pre-condition: interrupts disabled, merge_count > 0, no writeback busy
+                  or one waiting for the journal to have room
+   post-condition: the changes in the journal are being written to the
+                   image.
+ */
+void Disk::startMerge() {
+	writeback_busy = true;
+	merge_next = 0;
+	mergeNext();
+}
+
+void Disk::mergeNext() {
+	Merge const &m = merges[merge_next];
+	//the cylinder may have changed since, the journal gets that later
+	//and a replay puts this range back to what it has.
+	mergecmd.ptr = m.cylinder->data.data() + m.start;
+	mergecmd.len = m.end - m.start;
+	mergecmd.offset = TrackOffsetTable[m.pcn * NumSides] + m.start;
+	mergecmd.slot = sigc::mem_fun(this, &Disk::mergeComplete);
+	if (aio::pwrite(fd, &mergecmd) != 0)
+		mergeComplete(-1, errno);
+}
+
+void Disk::mergeComplete(int /*res*/, int /*errno_code*/) {
+	ISR_Guard g;
+	//as with the writeback, a failed write leaves nothing to do
+	merges[merge_next].cylinder = NULL;
+	if (++merge_next < merge_count) {
+		mergeNext();
+		return;
+	}
+	merge_count = 0;
+	if (writeback_cylinder) {
+		//a writeback waited for the journal to have room
+		journalWriteback();
+		return;
+	}
+	writebackComplete(0, 0);
+}
+
+void Disk::flushTimer() {
+	ISR_Guard g;
+	if (dirty_end <= dirty_start && !merge_count)
+		return;
+	if (writeback_busy || state != IDLE) {
+		flush_timer = Timer_Oneshot(DSK_FLUSH_DELAY_US,
+					    sigc::mem_fun(this, &Disk::flushTimer));
+		return;
+	}
+	if (dirty_end <= dirty_start) {
+		startMerge();
+		return;
+	}
+	unsigned pcn = current_cylinderno;
+	startWriteback();
+	//keep the cylinder cached, it is likely to be used again.
+	current_cylinder = writeback_cylinder;
+	current_cylinderno = pcn;
+}
+
+void Disk::openJournal(int journalfd, size_t size,
+		       sigc::slot<void(int, int)> const &slot) {
+	journal = new DiskJournal(journalfd, fd, size);
+	journal->replay(slot);
+}
+
+/* pre-condition: all changes have been flushed
+ */
+void Disk::closeJournal() {
+	if (!journal)
+		return;
+	journal->close();
+	delete journal;
+	journal = NULL;
+}
+
+void Disk::flush() {
+	while(1) {
+		{
+			ISR_Guard g;
+			//the readahead completion refers to us, too.
+			if (!writeback_busy && !readahead_busy) {
+				if (dirty_end <= dirty_start) {
+					if (!merge_count)
+						break;
+					startMerge();
+				} else if (state == IDLE) {
+					unsigned pcn = current_cylinderno;
+					startWriteback();
+					current_cylinder = writeback_cylinder;
+					current_cylinderno = pcn;
+				}
+			}
+		}
+		sched_yield();
+	}
+}
+
+int Disk::writeSector(RefPtr<DiskSector> sector, void const *data,
+		      bool deleted) {
+	ISR_Guard g;
+	if (write_protected || state != IDLE ||
+	    sector->pcn != current_cylinderno)
+		return -1;
+	uint8_t *d = reinterpret_cast<uint8_t *>(sector->data);
+	if (!current_cylinder || !sector->cylinder ||
+	    sector->cylinder->data.data() != current_cylinder->data.data())
+		return -1;
+	memcpy(d, data, sector->size);
+	sector->id[4] &= ~ST1_DataError;
+	sector->id[5] &= ~(ST2_DataError | ST2_ControlMark);
+	if (deleted)
+		sector->id[5] |= ST2_ControlMark;
+	sector->ST1 = sector->id[4];
+	sector->ST2 = sector->id[5];
+	markDirty(sector->id, 8);
+	markDirty(d, sector->size);
+	return 0;
+}
+
+//sectors are short lived and only a few exist at a time, so they do not
+//need to go through the heap.
+#define DSK_SECTOR_POOL_SIZE 8
+
+static union DiskSectorPoolEntry {
+	DiskSectorPoolEntry *next;
+	char storage[sizeof(DiskSector)];
+} __attribute__((aligned(8))) sectorpool[DSK_SECTOR_POOL_SIZE];
+static DiskSectorPoolEntry *sectorpool_free = NULL;
+static bool sectorpool_initialized = false;
+
+void *DiskSector::operator new(size_t size) {
+	{
+		ISR_Guard g;
+		if (!sectorpool_initialized) {
+			for(unsigned i = 0; i < DSK_SECTOR_POOL_SIZE; i++) {
+				sectorpool[i].next = sectorpool_free;
+				sectorpool_free = &sectorpool[i];
+			}
+			sectorpool_initialized = true;
+		}
+		if (sectorpool_free && size <= sizeof(DiskSectorPoolEntry)) {
+			DiskSectorPoolEntry *e = sectorpool_free;
+			sectorpool_free = e->next;
+			return e;
+		}
+	}
+	return ::operator new(size);
+}
+
+void DiskSector::operator delete(void *p) {
+	DiskSectorPoolEntry *e = reinterpret_cast<DiskSectorPoolEntry *>(p);
+	if (e >= sectorpool && e < sectorpool + DSK_SECTOR_POOL_SIZE) {
+		ISR_Guard g;
+		e->next = sectorpool_free;
+		sectorpool_free = e;
+		return;
+	}
+	::operator delete(p);
+}
+
+static inline unsigned sectorIdHash(unsigned C, unsigned H, unsigned R,
+				    unsigned N) {
+	return (R ^ (C << 2) ^ (H << 4) ^ (N << 1)) & 31;
+}
+
+/* ids points to the sector ids in the track header, 8 bytes each with
+ * C,H,R,N,ST1,ST2 at the start for both image formats. idx.count, offset and
+ * size need to be filled already.
+ */
+void Disk::hashTrackIndex(DiskTrackIndex &idx, uint8_t const *ids) {
+	memset(idx.bucket, 0, sizeof(idx.bucket));
+	//going backwards leaves the chains in track order
+	for(unsigned i = idx.count; i > 0; i--) {
+		uint8_t const *id = ids + (i-1) * 8;
+		unsigned hash = sectorIdHash(id[0], id[1], id[2], id[3]);
+		idx.next[i-1] = idx.bucket[hash];
+		idx.bucket[hash] = i;
+	}
+	idx.valid = true;
+}
+
+/* looks for the sector starting at sector_index, which is left after the
+   sector found, or at the index after two unsuccessful revolutions.
+ */
+RefPtr<DiskSector> Disk::findInTrack(DiskFindSectorCommand *c,
+				     unsigned &sector_index,
+				     unsigned phn, uint8_t *track,
+				     uint8_t *ids,
+				     DiskTrackIndex const &idx) {
+	unsigned count = idx.count;
+	if (sector_index >= count)
+		sector_index = 0;
+	int found = -1;
+	if (c->find_any) {
+		for(unsigned n = 0; n < count; n++) {
+			unsigned i = (sector_index + n) % count;
+			if ((ids[i*8+4] & 0x05) == 0) {
+				found = i;
+				break;
+			}
+		}
+	} else {
+		int first = -1;
+		unsigned hash = sectorIdHash(c->C, c->H, c->R, c->N);
+		for(unsigned i = idx.bucket[hash]; i; i = idx.next[i-1]) {
+			uint8_t const *id = ids + (i-1) * 8;
+			if (id[0] != c->C || id[1] != c->H ||
+			    id[2] != c->R || id[3] != c->N)
+				continue;
+			if ((id[4] & 0x05) != 0)
+				continue;
+			if (!c->ignore_deleted &&
+			    ((id[5] & ST2_ControlMark) != 0) != c->deleted)
+				continue;
+			//the first one coming under the head wins
+			if (i-1 >= sector_index) {
+				found = i-1;
+				break;
+			}
+			if (first == -1)
+				first = i-1;
+		}
+		if (found == -1)
+			found = first;
+	}
+	if (found == -1) {
+		sector_index = 0;
+		return RefPtr<DiskSector>();
+	}
+	sector_index = found + 1;
+	if (sector_index >= count)
+		sector_index = 0;
+	uint8_t *id = ids + found * 8;
+	RefPtr<DiskSector> d = new DiskSector();
+	d->C = id[0];
+	d->H = id[1];
+	d->R = id[2];
+	d->N = id[3];
+	d->ST1 = id[4];
+	d->ST2 = id[5];
+	d->pcn = c->pcn;
+	d->phn = phn;
+	d->data = track + idx.offset[found];
+	d->size = idx.size[found];
+	d->id = id;
+	d->cylinder = current_cylinder;
+	return d;
+}
+
+/* opening takes the one read of the header, plus the track table for
+ * CDSK, and the journal is opened. that is the same for 40 and 80 tracks,
+ * an index cached next to the image would need a read of its own and
+ * could not save any.
+ */
+namespace dsk {
+	struct ImageOpen {
+		int fd;
+		bool write_protected;
+		int journalfd;
+		size_t journalsize;
+		std::string journal_name;
+		//all image formats have a header of the same size
+		char header[sizeof(DSKHEADER)];
+		//track table of compressed images
+		std::vector<CDSKTRACK> tracks;
+		aio::PReadCommand preadcmd;
+		sigc::slot<void(RefPtr<Disk>)> slot;
+	};
+}
+
+/* pre-condition: o is allocated using new.
+   post-condition: o is deallocated, o->slot has been called.
+ */
+static void openImageJournalComplete(int /*res*/, int /*errno_code*/,
+				     RefPtr<Disk> disk,
+				     sigc::slot<void(RefPtr<Disk>)> slot) {
+	slot(disk);
+}
+
+static void openImageComplete(RefPtr<Disk> disk, ImageOpen *o) {
+	if (disk) {
+		//compressed images are always write protected
+		if (o->write_protected)
+			disk->write_protected = true;
+	} else {
+		::close(o->fd);
+	}
+	sigc::slot<void(RefPtr<Disk>)> slot = o->slot;
+	int journalfd = o->journalfd;
+	size_t journalsize = o->journalsize;
+	if (journalfd == -1 && disk && !disk->write_protected)
+		disk->journal_name = o->journal_name;
+	delete o;
+	if (journalfd != -1) {
+		if (disk && !disk->write_protected) {
+			disk->openJournal(journalfd, journalsize,
+					  sigc::bind(sigc::ptr_fun
+						     (&openImageJournalComplete),
+						     disk, slot));
+			return;
+		}
+		::close(journalfd);
+	}
+	slot(disk);
+}
+
+static void openImageTableComplete(int res, int /*errno_code*/,
+				   ImageOpen *o) {
+	RefPtr<Disk> disk;
+	if (res == (int)o->preadcmd.len) {
+		CDSK *cdsk = new CDSK();
+		if (cdsk->probe(o->fd, o->header, o->tracks.data()))
+			disk = cdsk;
+		else
+			delete cdsk;
+	}
+	openImageComplete(disk, o);
+}
+
+static void openImageHeaderComplete(int res, int /*errno_code*/,
+				    ImageOpen *o) {
+	RefPtr<Disk> disk;
+	if (res != (int)sizeof(o->header)) {
+		openImageComplete(disk, o);
+		return;
+	}
+	CDSKHEADER const *ch = reinterpret_cast<CDSKHEADER const *>(o->header);
+	if (memcmp(ch->DskHeader, "CPC CDSK", 8) == 0) {
+		//the track table follows the header
+		o->tracks.resize(ch->NumTracks * ch->NumSides);
+		o->preadcmd.ptr = o->tracks.data();
+		o->preadcmd.len = o->tracks.size() * sizeof(CDSKTRACK);
+		o->preadcmd.offset = sizeof(CDSKHEADER);
+		o->preadcmd.slot = sigc::bind
+			(sigc::ptr_fun(&openImageTableComplete), o);
+		if (aio::pread(o->fd, &o->preadcmd) != 0)
+			openImageTableComplete(-1, errno, o);
+		return;
+	}
+	DSK *dsk = new DSK();
+	if (dsk->probe(o->fd, o->header))
+		disk = dsk;
+	else
+		delete dsk;
+	if (!disk) {
+		ExtDSK *extdsk = new ExtDSK();
+		if (extdsk->probe(o->fd, o->header))
+			disk = extdsk;
+		else
+			delete extdsk;
+	}
+	openImageComplete(disk, o);
+}
+
+void dsk::openImage(char const *filename,
+		    sigc::slot<void(RefPtr<Disk> disk)> const &slot) {
 	bool write_protected = false;
 	int fd = open(filename, O_RDWR);
 	if (fd == -1) {
@@ -119,28 +1234,223 @@ RefPtr<Disk> dsk::openImage(char const *filename) {
 		fd = open(filename, O_RDONLY);
 	}
 	if (fd == -1) {
-		return RefPtr<Disk>(NULL);
+		slot(RefPtr<Disk>(NULL));
+		return;
 	}
-	DSK *dsk = new DSK();
-	if (dsk->probe(fd)) {
-		dsk->write_protected = write_protected;
-		return dsk;
+	ImageOpen *o = new ImageOpen();
+	o->fd = fd;
+	o->write_protected = write_protected;
+	o->journalfd = -1;
+	o->journalsize = 0;
+	if (!write_protected) {
+		o->journal_name = std::string(filename) + ".jnl";
+		o->journalfd = open(o->journal_name.c_str(), O_RDWR);
+		struct stat st;
+		if (o->journalfd != -1 && fstat(o->journalfd, &st) == 0)
+			o->journalsize = st.st_size;
+	}
+	o->slot = slot;
+	o->preadcmd.ptr = o->header;
+	o->preadcmd.len = sizeof(o->header);
+	o->preadcmd.offset = 0;
+	o->preadcmd.slot = sigc::bind(sigc::ptr_fun(&openImageHeaderComplete),
+				      o);
+	if (aio::pread(fd, &o->preadcmd) != 0)
+		openImageHeaderComplete(-1, errno, o);
+}
+
+static void openImageSyncComplete(RefPtr<Disk> disk, RefPtr<Disk> *result,
+				  volatile bool *done) {
+	*result = disk;
+	swbarrier();
+	*done = true;
+}
+
+RefPtr<Disk> dsk::openImage(char const *filename) {
+	RefPtr<Disk> disk;
+	volatile bool done = false;
+	openImage(filename,
+		  sigc::bind(sigc::ptr_fun(&openImageSyncComplete),
+			     &disk, &done));
+	while(!done)
+		sched_yield();
+	return disk;
+}
+
+namespace dsk {
+	struct BlankFormatInfo {
+		char const *name;
+		unsigned char NumTracks;
+		unsigned char FirstSector;
+		unsigned char SPT;
+		unsigned char Gap3;
+		//sectors in the order 1,6,2,7,... as the CPC formats them
+		bool interleaved;
+	};
+
+	struct ImageCreate {
+		int fd;
+		BlankFormatInfo const *format;
+		unsigned track;//next track to write
+		unsigned TrackSize;
+		DSKHEADER header;
+		std::vector<uint8_t> buffer;
+		aio::PWriteCommand pwritecmd;
+		sigc::slot<void(unsigned, unsigned)> progress;
+		sigc::slot<void(int)> slot;
+	};
+}
+
+static BlankFormatInfo const blank_formats[BlankFormatCount] = {
+	{ "Data", 40, 0xc1, 9, 0x52, true },
+	{ "System", 40, 0x41, 9, 0x52, true },
+	{ "IBM", 40, 0x01, 8, 0x50, false },
+	{ "Data, 80 Tracks", 80, 0xc1, 9, 0x52, true },
+	{ "System, 80 Tracks", 80, 0x41, 9, 0x52, true },
+};
+
+char const *dsk::blankFormatName(BlankFormat format) {
+	if (format >= BlankFormatCount)
+		return "";
+	return blank_formats[format].name;
+}
+
+/* the tracks only differ in their number, so the one buffer gets filled
+ * once and renumbered for each track.
+ */
+static void createImageFillTrack(ImageCreate *c) {
+	BlankFormatInfo const *f = c->format;
+	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>
+		(c->buffer.data());
+	memset(h, 0, sizeof(*h));
+	memcpy(h->TrackHeader, "Track-Info\r\n", 12);
+	h->side = 0;
+	h->BPS = 2;
+	h->SPT = f->SPT;
+	h->Gap3 = f->Gap3;
+	h->FillerByte = 0xe5;
+	for(unsigned i = 0; i < f->SPT; i++) {
+		unsigned r = i;
+		if (f->interleaved)
+			r = (i & 1) ? (i + f->SPT) / 2 : i / 2;
+		h->SectorIDs[i].H = 0;
+		h->SectorIDs[i].R = f->FirstSector + r;
+		h->SectorIDs[i].N = 2;
+	}
+	memset(h+1, 0xe5, c->TrackSize - sizeof(*h));
+}
+
+static void createImageNumberTrack(ImageCreate *c, unsigned track) {
+	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>
+		(c->buffer.data());
+	h->track = track;
+	for(unsigned i = 0; i < c->format->SPT; i++)
+		h->SectorIDs[i].C = track;
+}
+
+/* pre-condition: c is allocated using new.
+   post-condition: c is deallocated, c->slot has been called.
+ */
+static void createImageComplete(int res, ImageCreate *c) {
+	::close(c->fd);
+	sigc::slot<void(int)> slot = c->slot;
+	delete c;
+	slot(res);
+}
+
+static void createImageWriteComplete(int res, int errno_code,
+				     ImageCreate *c);
+
+static void createImageWrite(ImageCreate *c) {
+	createImageNumberTrack(c, c->track);
+	c->pwritecmd.ptr = c->buffer.data();
+	c->pwritecmd.len = c->TrackSize;
+	c->pwritecmd.offset = sizeof(DSKHEADER) + c->track * c->TrackSize;
+	c->pwritecmd.slot = sigc::bind
+		(sigc::ptr_fun(&createImageWriteComplete), c);
+	c->track++;
+	if (aio::pwrite(c->fd, &c->pwritecmd) != 0)
+		createImageWriteComplete(-1, errno, c);
+}
+
+static void createImageWriteComplete(int res, int /*errno_code*/,
+				     ImageCreate *c) {
+	if (res != (int)c->pwritecmd.len) {
+		createImageComplete(-1, c);
+		return;
+	}
+	if (c->pwritecmd.offset != 0)
+		c->progress(c->track, c->format->NumTracks);
+	if (c->track >= c->format->NumTracks) {
+		createImageComplete(0, c);
+		return;
+	}
+	createImageWrite(c);
+}
+
+static void createImageRetry(std::string filename, BlankFormat format,
+			     sigc::slot<void(unsigned, unsigned)> progress,
+			     sigc::slot<void(int)> slot) {
+	dsk::createImage(filename.c_str(), format, progress, slot);
+}
+
+void dsk::createImage(char const *filename, BlankFormat format,
+		      sigc::slot<void(unsigned, unsigned)> const &progress,
+		      sigc::slot<void(int)> const &slot) {
+	if (format >= BlankFormatCount) {
+		slot(-1);
+		return;
+	}
+	int fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd == -1 && errno == EBUSY) {
+		//the filesystem is in the middle of another change further
+		//up the stack, try again once that is done.
+		addDeferredWork(sigc::bind(sigc::ptr_fun(&createImageRetry),
+					   std::string(filename), format,
+					   progress, slot));
+		return;
 	}
-	delete dsk;
-	ExtDSK *extdsk = new ExtDSK();
-	if (extdsk->probe(fd)) {
-		extdsk->write_protected = write_protected;
-		return extdsk;
+	if (fd == -1) {
+		slot(-1);
+		return;
 	}
-	delete extdsk;
-	return RefPtr<Disk>(NULL);
+	//room for the changes before the first write needs it
+	int journalfd = createJournalFile(std::string(filename) + ".jnl");
+	if (journalfd != -1)
+		::close(journalfd);
+	ImageCreate *c = new ImageCreate();
+	c->fd = fd;
+	c->format = &blank_formats[format];
+	c->track = 0;
+	c->TrackSize = sizeof(DSKTRACKHEADER) + c->format->SPT * 512;
+	//DSK needs track sizes in multiples of 256
+	c->TrackSize = (c->TrackSize + 255) & ~255;
+	c->progress = progress;
+	c->slot = slot;
+	c->buffer.resize(c->TrackSize);
+	createImageFillTrack(c);
+	memset(&c->header, 0, sizeof(c->header));
+	memcpy(c->header.DskHeader, "MV - CPCEMU Disk-File\r\nDisk-Info\r\n",
+	       34);
+	memcpy(c->header.DskCreator, "CPC464 Addon ", 13);
+	c->header.NumTracks = c->format->NumTracks;
+	c->header.NumSides = 1;
+	c->header.TrackSizeLow = c->TrackSize & 0xff;
+	c->header.TrackSizeHigh = c->TrackSize >> 8;
+	//the header first, then one write per track.
+	c->pwritecmd.ptr = &c->header;
+	c->pwritecmd.len = sizeof(c->header);
+	c->pwritecmd.offset = 0;
+	c->pwritecmd.slot = sigc::bind
+		(sigc::ptr_fun(&createImageWriteComplete), c);
+	if (aio::pwrite(fd, &c->pwritecmd) != 0)
+		createImageWriteComplete(-1, errno, c);
 }
 
-bool DSK::probe(int fd) {
+bool DSK::probe(int fd, void const *header) {
 	this->fd = fd;
 	DSKHEADER h;
-	lseek(fd, 0, SEEK_SET);
-	read(fd, &h, sizeof(h));
+	memcpy(&h, header, sizeof(h));
 	if (memcmp(h.DskHeader,"MV - CPC",8)!=0)
 		return false;
 	/* has main header */
@@ -158,9 +1468,8 @@ bool DSK::probe(int fd) {
 	TrackSize = h.TrackSizeLow | (h.TrackSizeHigh << 8);
 	two_sided = h.NumSides == 2;
 	side_offset = 0;
-	preload_cylinderno = ~0U;
-	current_cylinderno = ~0U;
-	state = IDLE;
+	current_format_command = NULL;
+	initCache();
 	TrackOffsetTable.resize(NumSides * NumTracks);
 	uint32_t offset = sizeof(DSKHEADER);
 	for(unsigned int i = 0; i < NumSides*NumTracks; i++) {
@@ -171,11 +1480,18 @@ bool DSK::probe(int fd) {
 }
 
 void DSK::close() {
+	flush();
+	closeJournal();
+	cacheDrop(this);
 	int f = fd;
 	fd = -1;
 	::close(f);
 }
 
+unsigned DSK::cylinderSize(unsigned /*pcn*/) {
+	return TrackSize * NumSides;
+}
+
 void DSK::preloadReadComplete(int res, int errno_code) {
 	current_cylinderno = preload_cylinderno;
 	if (res == -1)
@@ -184,93 +1500,82 @@ void DSK::preloadReadComplete(int res, int errno_code) {
 		if (current_cylinderno == current_command->pcn) {
 			findSectorReadComplete(res, errno_code);
 		} else {
-			unsigned TrackIndex = current_command->pcn * NumSides;
-			unsigned CylinderSize = TrackSize * NumSides;
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &DSK::findSectorReadComplete);
-			aio::pread(fd, &preadcmd);
+			loadCylinder(current_command->pcn,
+				     sigc::mem_fun(this, &DSK::findSectorReadComplete));
+		}
+	} else if (state == FORMAT) {
+		if (current_cylinderno == current_format_command->pcn) {
+			formatReadComplete(res, errno_code);
+		} else {
+			loadCylinder(current_format_command->pcn,
+				     sigc::mem_fun(this, &DSK::formatReadComplete));
 		}
 	} else {
 		state = IDLE;
 	}
 }
 
-void DSK::preloadCylinder(unsigned pcn) {
-	if (pcn != current_cylinderno) {
-		ISR_Guard g;
-		preload_cylinderno = pcn;
-		if (state == IDLE) {
-			state = PRELOAD;
-			unsigned TrackIndex = pcn * NumSides;
-			unsigned CylinderSize = TrackSize * NumSides;
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &DSK::preloadReadComplete);
-			aio::pread(fd, &preadcmd);
-		}
-	}
+bool DSK::preloadCylinder(unsigned pcn) {
+	ISR_Guard g;
+	if (pcn >= NumTracks || pcn == current_cylinderno)
+		return true;
+	if (state != IDLE)
+		return false;
+	preload_cylinderno = pcn;
+	state = PRELOAD;
+	loadCylinder(pcn,
+		     sigc::mem_fun(this, &DSK::preloadReadComplete));
+	return true;
 }
 
-void DSK::fillSectorInfoAndComplete() {
-	DiskFindSectorCommand *c = current_command;
-	//init the sector info. pointer to read data can be provided already.
-	//also check if the track header(s) is correct.
+/* the cylinder must be in current_cylinder.
+ */
+RefPtr<DiskSector> DSK::searchSector(DiskFindSectorCommand *c,
+				     unsigned &sector_index) {
 	unsigned phn = (c->phn + side_offset) % NumSides;
-	unsigned offset = TrackSize * phn;
-	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>
-		(current_cylinder.data() + offset);
-
-	RefPtr<DiskSector> d;
-	unsigned indexctr = 0;
-	char * sectorData = reinterpret_cast<char*>(h+1);
-	for(unsigned i = 0; i < current_sector; i++) {
-		sectorData += 128<<(h->SectorIDs[i].N&0x07);
-	}
-	while(indexctr < 2) {
-		unsigned int i = current_sector;
-		void *data = sectorData;
-		sectorData += 128<<(h->SectorIDs[i].N&0x07);
-		current_sector++;
-		if (current_sector >= h->SPT) {
-			indexctr++;
-			current_sector = 0;
-			sectorData = reinterpret_cast<char*>(h+1);
-		}
-		if ((h->SectorIDs[i].ST1 & 0x05) == 0) {
-			if (c->find_any ||
-			    (((c->deleted && (h->SectorIDs[i].ST2 &
-					    0x80) != 0) ||
-			      (!c->deleted && (h->SectorIDs[i].ST2 &
-					       0x80) == 0)) &&
-			     h->SectorIDs[i].C == c->C &&
-			     h->SectorIDs[i].H == c->H &&
-			     h->SectorIDs[i].R == c->R &&
-			     h->SectorIDs[i].N == c->N)) {
-				d = new DiskSector();
-				d->C = h->SectorIDs[i].C;
-				d->H = h->SectorIDs[i].H;
-				d->R = h->SectorIDs[i].R;
-				d->N = h->SectorIDs[i].N;
-				d->ST1 = h->SectorIDs[i].ST1;
-				d->ST2 = h->SectorIDs[i].ST2;
-				d->pcn = c->pcn;
-				d->phn = phn;
-				d->data = data;
-				d->size = 128<<(h->SectorIDs[i].N&0x07);
+	uint8_t *track = current_cylinder->data.data() + TrackSize * phn;
+	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>(track);
+	DiskTrackIndex &idx = current_cylinder->index[phn];
+	if (!idx.valid) {
+		//sector sizes follow from N, stop at the end of the track.
+		unsigned offset = sizeof(DSKTRACKHEADER);
+		idx.count = 0;
+		for(unsigned i = 0; i < h->SPT && i < 29; i++) {
+			unsigned size = 128<<(h->SectorIDs[i].N&0x07);
+			if (offset + size > TrackSize)
 				break;
-			}
+			idx.offset[i] = offset;
+			idx.size[i] = size;
+			idx.count++;
+			offset += size;
 		}
+		hashTrackIndex(idx, &h->SectorIDs[0].C);
 	}
+	return findInTrack(c, sector_index, phn, track,
+			   &h->SectorIDs[0].C, idx);
+}
+
+void DSK::fillSectorInfoAndComplete() {
+	DiskFindSectorCommand *c = current_command;
+	RefPtr<DiskSector> d = searchSector(c, current_sector);
+	//sequential reads continue on the next cylinder.
+	if (d && current_sector == 0)
+		readaheadCylinder(c->pcn + 1);
 	state = IDLE;
 	current_command = NULL;
 	c->slot(d);
 }
 
+RefPtr<DiskSector> DSK::findCachedSector(DiskFindSectorCommand *command) {
+	ISR_Guard g;
+	if (state != IDLE || command->pcn != current_cylinderno ||
+	    command->phn > NumSides)
+		return RefPtr<DiskSector>();
+	//only looking, the rotational position stays where it is.
+	unsigned sector_index = current_sector;
+	return searchSector(command, sector_index);
+}
+
 void DSK::findSectorReadComplete(int res, int /*errno*/) {
 	DiskFindSectorCommand *c = current_command;
 	if (res == -1) {
@@ -286,7 +1591,7 @@ void DSK::findSectorReadComplete(int res, int /*errno*/) {
 	unsigned phn = (c->phn + side_offset) % NumSides;
 	unsigned offset = TrackSize * phn;
 	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>
-		(current_cylinder.data() + offset);
+		(current_cylinder->data.data() + offset);
 	if (memcmp(h->TrackHeader,"Track-Info",10) != 0) {
 		state = IDLE;
 		current_cylinderno = ~0U;
@@ -299,7 +1604,7 @@ void DSK::findSectorReadComplete(int res, int /*errno*/) {
 
 
 void DSK::findSector(DiskFindSectorCommand *command) {
-	if (command->pcn > NumTracks || command->phn > NumSides) {
+	if (command->pcn >= NumTracks || command->phn > NumSides) {
 		command->slot(RefPtr<DiskSector>());
 		return;
 	}
@@ -311,14 +1616,8 @@ void DSK::findSector(DiskFindSectorCommand *command) {
 		ISR_Guard g;
 		if (state == IDLE) {
 			state = FIND;
-			unsigned TrackIndex = command->pcn * NumSides;
-			unsigned CylinderSize = TrackSize * NumSides;
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &DSK::findSectorReadComplete);
-			aio::pread(fd, &preadcmd);
+			loadCylinder(command->pcn,
+				     sigc::mem_fun(this, &DSK::findSectorReadComplete));
 			return;
 		} else {
 			state = FIND;
@@ -329,11 +1628,86 @@ void DSK::findSector(DiskFindSectorCommand *command) {
 	fillSectorInfoAndComplete();
 }
 
-bool ExtDSK::probe(int fd) {
+void DSK::formatTrackAndComplete() {
+	DiskFormatTrackCommand *c = current_format_command;
+	unsigned phn = (c->phn + side_offset) % NumSides;
+	unsigned offset = TrackSize * phn;
+	DSKTRACKHEADER *h = reinterpret_cast<DSKTRACKHEADER *>
+		(current_cylinder->data.data() + offset);
+	//the data layout is defined by the N of the sector ids, so that
+	//is what needs to fit into the track.
+	unsigned datasize = 0;
+	for(unsigned i = 0; i < c->SPT && i < 29; i++)
+		datasize += 128<<(c->ids[i].N&0x07);
+	int res = -1;
+	if (c->SPT <= 29 && sizeof(DSKTRACKHEADER) + datasize <= TrackSize) {
+		memset(h, 0, sizeof(*h));
+		memcpy(h->TrackHeader, "Track-Info\r\n", 12);
+		h->track = c->pcn;
+		h->side = phn;
+		current_cylinder->index[phn].valid = false;
+		h->BPS = c->N;
+		h->SPT = c->SPT;
+		h->Gap3 = c->gap3;
+		h->FillerByte = c->filler;
+		for(unsigned i = 0; i < c->SPT; i++) {
+			h->SectorIDs[i].C = c->ids[i].C;
+			h->SectorIDs[i].H = c->ids[i].H;
+			h->SectorIDs[i].R = c->ids[i].R;
+			h->SectorIDs[i].N = c->ids[i].N;
+		}
+		memset(h+1, c->filler, TrackSize - sizeof(*h));
+		markDirty(h, TrackSize);
+		res = 0;
+	}
+	state = IDLE;
+	current_format_command = NULL;
+	c->slot(res);
+}
+
+void DSK::formatReadComplete(int res, int /*errno*/) {
+	DiskFormatTrackCommand *c = current_format_command;
+	if (res == -1) {
+		current_cylinderno = ~0U;
+		state = IDLE;
+		current_format_command = NULL;
+		c->slot(-1);
+		return;
+	}
+	current_cylinderno = c->pcn;
+	formatTrackAndComplete();
+}
+
+void DSK::formatTrack(DiskFormatTrackCommand *command) {
+	if (write_protected ||
+	    command->pcn >= NumTracks || command->phn > NumSides) {
+		command->slot(-1);
+		return;
+	}
+	{
+		ISR_Guard g;
+		current_format_command = command;
+	}
+	if (command->pcn != current_cylinderno) {
+		ISR_Guard g;
+		if (state == IDLE) {
+			state = FORMAT;
+			loadCylinder(command->pcn,
+				     sigc::mem_fun(this, &DSK::formatReadComplete));
+			return;
+		} else {
+			state = FORMAT;
+			//will be picked up once the current PRELOAD is done
+			return;
+		}
+	}
+	formatTrackAndComplete();
+}
+
+bool ExtDSK::probe(int fd, void const *header) {
 	this->fd = fd;
 	EXTDSKHEADER h;
-	lseek(fd, 0, SEEK_SET);
-	read(fd, &h, sizeof(h));
+	memcpy(&h, header, sizeof(h));
 	if (memcmp(h.DskHeader,"EXTENDED",8)!=0)
 		return false;
 	/* has main header */
@@ -355,9 +1729,8 @@ bool ExtDSK::probe(int fd) {
 	       h.NumSides*h.NumTracks);
 	two_sided = h.NumSides == 2;
 	side_offset = 0;
-	preload_cylinderno = ~0U;
-	current_cylinderno = ~0U;
-	state = IDLE;
+	current_format_command = NULL;
+	initCache();
 	TrackOffsetTable.resize(NumSides * NumTracks);
 	uint32_t offset = sizeof(DSKHEADER);
 	for(unsigned int i = 0; i < NumSides*NumTracks; i++) {
@@ -368,11 +1741,34 @@ bool ExtDSK::probe(int fd) {
 }
 
 void ExtDSK::close() {
+	flush();
+	closeJournal();
+	cacheDrop(this);
 	int f = fd;
 	fd = -1;
 	::close(f);
 }
 
+unsigned ExtDSK::cylinderSize(unsigned pcn) {
+	unsigned TrackIndex = pcn * NumSides;
+	unsigned CylinderSize = 0;
+	for(unsigned i = TrackIndex; i < TrackIndex + NumSides; i++) {
+		if (i >= TrackSizeTable.size())
+			break;
+		CylinderSize += TrackSizeTable[i] << 8;
+	}
+	return CylinderSize;
+}
+
+//offset of the track inside its cylinder
+unsigned ExtDSK::trackOffset(unsigned pcn, unsigned phn) {
+	unsigned TrackIndex = pcn * NumSides;
+	unsigned offset = 0;
+	for(unsigned i = 0; i < phn; i++)
+		offset += TrackSizeTable[TrackIndex + i] << 8;
+	return offset;
+}
+
 void ExtDSK::preloadReadComplete(int res, int errno_code) {
 	current_cylinderno = preload_cylinderno;
 	if (res == -1)
@@ -381,117 +1777,90 @@ void ExtDSK::preloadReadComplete(int res, int errno_code) {
 		if (current_cylinderno == current_command->pcn) {
 			findSectorReadComplete(res, errno_code);
 		} else {
-			unsigned TrackIndex = current_command->pcn * NumSides;
-			unsigned CylinderSize = 0;
-			for(unsigned i = TrackIndex; i < TrackIndex + NumSides; i++) {
-				if (i >= TrackSizeTable.size())
-					break;
-				CylinderSize += TrackSizeTable[i] << 8;
-			}
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &ExtDSK::findSectorReadComplete);
-			aio::pread(fd, &preadcmd);
+			loadCylinder(current_command->pcn,
+				     sigc::mem_fun(this, &ExtDSK::findSectorReadComplete));
+		}
+	} else if (state == FORMAT) {
+		if (current_cylinderno == current_format_command->pcn) {
+			formatReadComplete(res, errno_code);
+		} else {
+			loadCylinder(current_format_command->pcn,
+				     sigc::mem_fun(this, &ExtDSK::formatReadComplete));
 		}
 	} else {
 		state = IDLE;
 	}
 }
 
-void ExtDSK::preloadCylinder(unsigned pcn) {
-	if (pcn != current_cylinderno) {
-		ISR_Guard g;
-		preload_cylinderno = pcn;
-		if (state == IDLE) {
-			state = PRELOAD;
-			unsigned TrackIndex = pcn * NumSides;
-			unsigned CylinderSize = 0;
-			for(unsigned i = TrackIndex; i < TrackIndex + NumSides; i++) {
-				if (i >= TrackSizeTable.size())
-					break;
-				CylinderSize += TrackSizeTable[i] << 8;
-			}
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &ExtDSK::preloadReadComplete);
-			aio::pread(fd, &preadcmd);
-		}
-	}
+bool ExtDSK::preloadCylinder(unsigned pcn) {
+	ISR_Guard g;
+	if (pcn >= NumTracks || pcn == current_cylinderno)
+		return true;
+	if (state != IDLE)
+		return false;
+	preload_cylinderno = pcn;
+	state = PRELOAD;
+	loadCylinder(pcn,
+		     sigc::mem_fun(this, &ExtDSK::preloadReadComplete));
+	return true;
 }
 
-void ExtDSK::fillSectorInfoAndComplete() {
-	DiskFindSectorCommand *c = current_command;
-	//init the sector info. pointer to read data can be provided already.
-	//also check if the track header(s) is correct.
+/* the cylinder must be in current_cylinder.
+ */
+RefPtr<DiskSector> ExtDSK::searchSector(DiskFindSectorCommand *c,
+					unsigned &sector_index) {
 	unsigned TrackIndex = c->pcn * NumSides;
 	unsigned phn = (c->phn + side_offset) % NumSides;
 	//does the track exist?
-	if (TrackSizeTable[TrackIndex + phn] == 0) {
-		state = IDLE;
-		current_command = NULL;
-		c->slot(RefPtr<DiskSector>());
-		return;
-	}
-	unsigned offset = 0;
-	for(unsigned i = 0; i < phn; i++)
-		offset += TrackSizeTable[i] << 8;
-	EXTDSKTRACKHEADER *h = reinterpret_cast<EXTDSKTRACKHEADER *>
-		(current_cylinder.data() + offset);
-	RefPtr<DiskSector> d;
-	unsigned indexctr = 0;
-	char * sectorData = reinterpret_cast<char*>(h+1);
-	for(unsigned i = 0; i < current_sector; i++) {
-		sectorData += (h->SectorIDs[i].SectorSizeHigh << 8) |
-			h->SectorIDs[i].SectorSizeLow;
-	}
-	while(indexctr < 2) {
-		unsigned int i = current_sector;
-		void *data = sectorData;
-		sectorData +=
-			(h->SectorIDs[i].SectorSizeHigh << 8) |
-			h->SectorIDs[i].SectorSizeLow;
-		current_sector++;
-		if (current_sector >= h->SPT) {
-			indexctr++;
-			current_sector = 0;
-			sectorData = reinterpret_cast<char*>(h+1);
-		}
-		if ((h->SectorIDs[i].ST1 & 0x05) == 0) {
-			if (c->find_any ||
-			    (((c->deleted && (h->SectorIDs[i].ST2 &
-					    0x80) != 0) ||
-			      (!c->deleted && (h->SectorIDs[i].ST2 &
-					       0x80) == 0)) &&
-			     h->SectorIDs[i].C == c->C &&
-			     h->SectorIDs[i].H == c->H &&
-			     h->SectorIDs[i].R == c->R &&
-			     h->SectorIDs[i].N == c->N)) {
-				d = new DiskSector();
-				d->C = h->SectorIDs[i].C;
-				d->H = h->SectorIDs[i].H;
-				d->R = h->SectorIDs[i].R;
-				d->N = h->SectorIDs[i].N;
-				d->ST1 = h->SectorIDs[i].ST1;
-				d->ST2 = h->SectorIDs[i].ST2;
-				d->pcn = c->pcn;
-				d->phn = phn;
-				d->data = data;
-				d->size =
-					(h->SectorIDs[i].SectorSizeHigh << 8) |
-					h->SectorIDs[i].SectorSizeLow;
+	unsigned tracksize = TrackSizeTable[TrackIndex + phn] << 8;
+	if (tracksize == 0)
+		return RefPtr<DiskSector>();
+	uint8_t *track = current_cylinder->data.data() +
+		trackOffset(c->pcn, phn);
+	EXTDSKTRACKHEADER *h = reinterpret_cast<EXTDSKTRACKHEADER *>(track);
+	DiskTrackIndex &idx = current_cylinder->index[phn];
+	if (!idx.valid) {
+		//sector sizes are stored per sector, stop at the end of the
+		//track.
+		unsigned offset = sizeof(EXTDSKTRACKHEADER);
+		idx.count = 0;
+		for(unsigned i = 0; i < h->SPT && i < 29; i++) {
+			unsigned size = (h->SectorIDs[i].SectorSizeHigh << 8) |
+				h->SectorIDs[i].SectorSizeLow;
+			if (offset + size > tracksize)
 				break;
-			}
+			idx.offset[i] = offset;
+			idx.size[i] = size;
+			idx.count++;
+			offset += size;
 		}
+		hashTrackIndex(idx, &h->SectorIDs[0].C);
 	}
+	return findInTrack(c, sector_index, phn, track,
+			   &h->SectorIDs[0].C, idx);
+}
+
+void ExtDSK::fillSectorInfoAndComplete() {
+	DiskFindSectorCommand *c = current_command;
+	RefPtr<DiskSector> d = searchSector(c, current_sector);
+	//sequential reads continue on the next cylinder.
+	if (d && current_sector == 0)
+		readaheadCylinder(c->pcn + 1);
 	state = IDLE;
 	current_command = NULL;
 	c->slot(d);
 }
 
+RefPtr<DiskSector> ExtDSK::findCachedSector(DiskFindSectorCommand *command) {
+	ISR_Guard g;
+	if (state != IDLE || command->pcn != current_cylinderno ||
+	    command->phn > NumSides)
+		return RefPtr<DiskSector>();
+	//only looking, the rotational position stays where it is.
+	unsigned sector_index = current_sector;
+	return searchSector(command, sector_index);
+}
+
 void ExtDSK::findSectorReadComplete(int res, int /*errno*/) {
 	DiskFindSectorCommand *c = current_command;
 	if (res == -1) {
@@ -513,11 +1882,9 @@ void ExtDSK::findSectorReadComplete(int res, int /*errno*/) {
 		c->slot(RefPtr<DiskSector>());
 		return;
 	}
-	unsigned offset = 0;
-	for(unsigned i = 0; i < phn; i++)
-		offset += TrackSizeTable[i] << 8;
+	unsigned offset = trackOffset(c->pcn, phn);
 	EXTDSKTRACKHEADER *h = reinterpret_cast<EXTDSKTRACKHEADER *>
-		(current_cylinder.data() + offset);
+		(current_cylinder->data.data() + offset);
 	if (memcmp(h->TrackHeader,"Track-Info",10) != 0) {
 		state = IDLE;
 		current_cylinderno = ~0U;
@@ -529,7 +1896,7 @@ void ExtDSK::findSectorReadComplete(int res, int /*errno*/) {
 }
 
 void ExtDSK::findSector(DiskFindSectorCommand *command) {
-	if (command->pcn > NumTracks || command->phn > NumSides) {
+	if (command->pcn >= NumTracks || command->phn > NumSides) {
 		command->slot(RefPtr<DiskSector>());
 		return;
 	}
@@ -541,19 +1908,8 @@ void ExtDSK::findSector(DiskFindSectorCommand *command) {
 		ISR_Guard g;
 		if (state == IDLE) {
 			state = FIND;
-			unsigned TrackIndex = command->pcn * NumSides;
-			unsigned CylinderSize = 0;
-			for(unsigned i = TrackIndex; i < TrackIndex + NumSides; i++) {
-				if (i >= TrackSizeTable.size())
-					break;
-				CylinderSize += TrackSizeTable[i] << 8;
-			}
-			current_cylinder.resize(CylinderSize);
-			preadcmd.ptr = current_cylinder.data();
-			preadcmd.len = CylinderSize;
-			preadcmd.offset = TrackOffsetTable[TrackIndex];
-			preadcmd.slot = sigc::mem_fun(this, &ExtDSK::findSectorReadComplete);
-			aio::pread(fd, &preadcmd);
+			loadCylinder(command->pcn,
+				     sigc::mem_fun(this, &ExtDSK::findSectorReadComplete));
 			return;
 		} else {
 			state = FIND;
@@ -564,3 +1920,259 @@ void ExtDSK::findSector(DiskFindSectorCommand *command) {
 	fillSectorInfoAndComplete();
 }
 
+void ExtDSK::formatTrackAndComplete() {
+	DiskFormatTrackCommand *c = current_format_command;
+	unsigned TrackIndex = c->pcn * NumSides;
+	unsigned phn = (c->phn + side_offset) % NumSides;
+	//the track cannot grow, the rest of the image would have to move.
+	unsigned tracksize = TrackSizeTable[TrackIndex + phn] << 8;
+	unsigned sectorsize = 128<<(c->N&0x07);
+	int res = -1;
+	if (c->SPT <= 29 &&
+	    sizeof(EXTDSKTRACKHEADER) + c->SPT * sectorsize <= tracksize) {
+		EXTDSKTRACKHEADER *h = reinterpret_cast<EXTDSKTRACKHEADER *>
+			(current_cylinder->data.data() + trackOffset(c->pcn, phn));
+		memset(h, 0, sizeof(*h));
+		memcpy(h->TrackHeader, "Track-Info\r\n", 12);
+		h->track = c->pcn;
+		h->side = phn;
+		current_cylinder->index[phn].valid = false;
+		h->BPS = c->N;
+		h->SPT = c->SPT;
+		h->Gap3 = c->gap3;
+		h->FillerByte = c->filler;
+		for(unsigned i = 0; i < c->SPT; i++) {
+			h->SectorIDs[i].C = c->ids[i].C;
+			h->SectorIDs[i].H = c->ids[i].H;
+			h->SectorIDs[i].R = c->ids[i].R;
+			h->SectorIDs[i].N = c->ids[i].N;
+			h->SectorIDs[i].SectorSizeLow = sectorsize & 0xff;
+			h->SectorIDs[i].SectorSizeHigh = sectorsize >> 8;
+		}
+		memset(h+1, c->filler, tracksize - sizeof(*h));
+		markDirty(h, tracksize);
+		res = 0;
+	}
+	state = IDLE;
+	current_format_command = NULL;
+	c->slot(res);
+}
+
+void ExtDSK::formatReadComplete(int res, int /*errno*/) {
+	DiskFormatTrackCommand *c = current_format_command;
+	if (res == -1) {
+		current_cylinderno = ~0U;
+		state = IDLE;
+		current_format_command = NULL;
+		c->slot(-1);
+		return;
+	}
+	current_cylinderno = c->pcn;
+	formatTrackAndComplete();
+}
+
+void ExtDSK::formatTrack(DiskFormatTrackCommand *command) {
+	if (write_protected ||
+	    command->pcn >= NumTracks || command->phn > NumSides) {
+		command->slot(-1);
+		return;
+	}
+	{
+		ISR_Guard g;
+		current_format_command = command;
+	}
+	if (command->pcn != current_cylinderno) {
+		ISR_Guard g;
+		if (state == IDLE) {
+			state = FORMAT;
+			loadCylinder(command->pcn,
+				     sigc::mem_fun(this, &ExtDSK::formatReadComplete));
+			return;
+		} else {
+			state = FORMAT;
+			//will be picked up once the current PRELOAD is done
+			return;
+		}
+	}
+	formatTrackAndComplete();
+}
+
+int dsk::lz4Decode(void const *srcp, unsigned srclen,
+		   void *dstp, unsigned dstlen) {
+	uint8_t const *src = static_cast<uint8_t const *>(srcp);
+	uint8_t *dst = static_cast<uint8_t *>(dstp);
+	uint8_t const *ip = src;
+	uint8_t const *iend = src + srclen;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dstlen;
+	while(ip < iend) {
+		unsigned token = *ip++;
+		unsigned len = token >> 4;
+		if (len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while(b == 255);
+		}
+		if (len > (unsigned)(iend - ip) || len > (unsigned)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+		//the last sequence only has literals
+		if (ip == iend)
+			break;
+		if (iend - ip < 2)
+			return -1;
+		unsigned offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (unsigned)(op - dst))
+			return -1;
+		len = token & 0x0f;
+		if (len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				len += b;
+			} while(b == 255);
+		}
+		len += 4;
+		if (len > (unsigned)(oend - op))
+			return -1;
+		//the match may overlap the output, copy bytewise
+		uint8_t const *m = op - offset;
+		while(len--)
+			*op++ = *m++;
+	}
+	return op - dst;
+}
+
+bool CDSK::probe(int fd, void const *header, void const *tracks) {
+	this->fd = fd;
+	CDSKHEADER h;
+	memcpy(&h, header, sizeof(h));
+	if (memcmp(h.DskHeader,"CPC CDSK",8)!=0 || h.Version != 1)
+		return false;
+
+	if (h.NumSides!=1 && h.NumSides!=2)
+		return false;
+
+	if (h.NumTracks<=0 || h.NumTracks>=85)
+		return false;
+
+	NumSides = h.NumSides;
+	NumTracks = h.NumTracks;
+	Tracks.resize(NumSides * NumTracks);
+	memcpy(Tracks.data(), tracks, Tracks.size() * sizeof(CDSKTRACK));
+	TrackSize = 0;
+	TrackSizeTable.resize(NumSides * NumTracks);
+	//the offsets of the packed data, nothing gets written back.
+	TrackOffsetTable.resize(NumSides * NumTracks);
+	for(unsigned int i = 0; i < NumSides*NumTracks; i++) {
+		CDSKTRACK const &t = Tracks[i];
+		if ((t.TrackSize & 0xff) != 0 || t.TrackSize > 0xff00 ||
+		    t.PackedSize > t.TrackSize ||
+		    (t.TrackSize != 0 && t.TrackSize < sizeof(EXTDSKTRACKHEADER)))
+			return false;
+		TrackSizeTable[i] = t.TrackSize >> 8;
+		TrackOffsetTable[i] = t.Offset;
+	}
+	two_sided = h.NumSides == 2;
+	side_offset = 0;
+	current_format_command = NULL;
+	initCache();
+	write_protected = true;
+	return true;
+}
+
+void CDSK::readCylinder(unsigned pcn, RefPtr<DiskCylinder> const &cylinder,
+			aio::PReadCommand *cmd) {
+	CDSKRead *r = new CDSKRead();
+	r->cylinder = cylinder;
+	r->cmd = cmd;
+	r->pcn = pcn;
+	r->phn = 0;
+	//one buffer large enough for all packed tracks of the cylinder
+	unsigned packed = 0;
+	for(unsigned i = 0; i < NumSides; i++) {
+		CDSKTRACK const &t = Tracks[pcn * NumSides + i];
+		if (t.PackedSize != t.TrackSize && t.PackedSize > packed)
+			packed = t.PackedSize;
+	}
+	r->packed.resize(packed);
+	readTrack(r);
+}
+
+/* post-condition: a read of track r->phn is in flight, or r is
+   deallocated and r->cmd->slot has been called.
+ */
+void CDSK::readTrack(CDSKRead *r) {
+	for(; r->phn < NumSides; r->phn++) {
+		CDSKTRACK const &t = Tracks[r->pcn * NumSides + r->phn];
+		uint8_t *track = r->cylinder->data.data() +
+			trackOffset(r->pcn, r->phn);
+		if (t.PackedSize == 0) {
+			//unformatted
+			memset(track, 0, t.TrackSize);
+			continue;
+		}
+		r->preadcmd.offset = t.Offset;
+		if (t.PackedSize == t.TrackSize) {
+			r->preadcmd.ptr = track;
+			r->preadcmd.len = t.TrackSize;
+		} else {
+			r->preadcmd.ptr = r->packed.data();
+			r->preadcmd.len = t.PackedSize;
+		}
+		r->preadcmd.slot = sigc::bind
+			(sigc::mem_fun(this, &CDSK::readTrackComplete), r);
+		if (aio::pread(fd, &r->preadcmd) != 0)
+			readTrackComplete(-1, errno, r);
+		return;
+	}
+	aio::PReadCommand *cmd = r->cmd;
+	int size = r->cylinder->data.size();
+	delete r;
+	cmd->slot(size, 0);
+}
+
+void CDSK::readTrackComplete(int res, int errno_code, CDSKRead *r) {
+	CDSKTRACK const &t = Tracks[r->pcn * NumSides + r->phn];
+	if (res != (int)r->preadcmd.len) {
+		if (res >= 0)
+			errno_code = EIO;
+		aio::PReadCommand *cmd = r->cmd;
+		delete r;
+		cmd->slot(-1, errno_code);
+		return;
+	}
+	//decoding takes a while, not in interrupt context
+	if (t.PackedSize != t.TrackSize) {
+		addDeferredWork(sigc::bind(sigc::mem_fun(this,
+							 &CDSK::decodeTrack),
+					   r));
+		return;
+	}
+	r->phn++;
+	readTrack(r);
+}
+
+void CDSK::decodeTrack(CDSKRead *r) {
+	CDSKTRACK const &t = Tracks[r->pcn * NumSides + r->phn];
+	uint8_t *track = r->cylinder->data.data() +
+		trackOffset(r->pcn, r->phn);
+	if (lz4Decode(r->packed.data(), t.PackedSize,
+		      track, t.TrackSize) != t.TrackSize) {
+		aio::PReadCommand *cmd = r->cmd;
+		delete r;
+		cmd->slot(-1, EIO);
+		return;
+	}
+	r->phn++;
+	readTrack(r);
+}
@@ -5,10 +5,15 @@
 #include <fpga/layout.h>
 #include <timer.hpp>
 #include <fdc/dsk.hpp>
+#include <deferredwork.hpp>
 
 #include <string.h>
 #include <stdint.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
 
 struct FDDCommand {
 	uint8_t driveUnit:2;
@@ -26,6 +31,11 @@ struct FDDCommand {
 	uint8_t gapLength;
 	uint8_t fillerByte;
 };
+/* the frontend turns these into the status registers of the result phase.
+ * bit 0 is not read. not writable comes from the write protected bit of
+ * the drive status instead, writes that fail on the box anyway end with a
+ * data error.
+ */
 struct FDDResponse {
 	uint8_t reserved:1;
 	uint8_t controlMark:1;
@@ -55,9 +65,32 @@ static FPGAComm_Command driveStatusFPGACommand;
 static int driveStatusState = 0;
 static uint8_t driveLastMotorState = 0;
 static uint8_t driveLastAccessState = 0;
-static uint8_t driveAccessCount[4] = {0,0,0,0};
 
-static RefPtr<dsk::Disk> images[4];
+/* state kept per drive. data commands are serialised through the fdcirq
+ * state machine, everything else is handled for each drive on its own.
+ */
+static struct FDCDrive {
+	RefPtr<dsk::Disk> image;
+	uint8_t accessCount;
+	//cylinder the drive has last been seen seeking to
+	uint8_t ncn;
+	//the image has not started loading ncn yet
+	bool ncnPending;
+	//bumped by every insert and eject, older inserts get dropped
+	uint32_t insertSeq;
+} drives[4];
+
+//bit 0 stays reserved until the frontend reports it can skip delays
+static void driveUpdateStatus(int drive) {
+	uint8_t b = 0x00;
+	RefPtr<dsk::Disk> image = drives[drive].image;
+	if (image) {
+		b |= 0x80;
+		if (image->write_protected)
+			b |= 0x40;
+	}
+	FPGAComm_CopyToFPGA(FPGA_CPC_FDC_FDD_STS(drive), (void*)&b, 1);
+}
 
 static void driveStatusCompletion(int result) {
 	driveStatusState = 0;
@@ -72,12 +105,24 @@ static void driveStatusCompletion(int result) {
 		driveLastMotorState = 0;
 		FDC_MotorOff();
 	}
+	//the head is moving, get the cylinder ready before the cpc asks
+	//for the first sector.
+	//a drive busy with a command gets another try on the next poll.
+	for(unsigned i = 0; i < 4; i++) {
+		FDCDrive &d = drives[i];
+		if (fddInfoBlock.driveNCN[i] != d.ncn) {
+			d.ncn = fddInfoBlock.driveNCN[i];
+			d.ncnPending = true;
+		}
+		if (d.ncnPending && d.image)
+			d.ncnPending = !d.image->preloadCylinder(d.ncn);
+	}
 }
 
 static void driveStatusTimer() {
 	for(unsigned i = 0; i < 4; i++) {
-		if (driveAccessCount[i] > 0) {
-			driveAccessCount[i]--;
+		if (drives[i].accessCount > 0) {
+			drives[i].accessCount--;
 			if (!(driveLastAccessState & (1 << i))) {
 				driveLastAccessState |= 1 << i;
 				FDC_Activity(i, 1);
@@ -108,17 +153,33 @@ static FPGAComm_Command fdcirq_FPGACommand;
 static FPGAComm_Command fdcirq_FPGACommand2;
 static FPGAComm_Command fdcirq_endisable_FPGACommand;
 static dsk::DiskFindSectorCommand fdcirq_findsectorcommand;
+static dsk::DiskFormatTrackCommand fdcirq_formattrackcommand;
 static enum {
 	IDLE,
 	COMMAND_FETCH,
 	SECTOR_FETCH,
 	WAIT_TRANSFERDONE,
 	COMMAND_FINAL_FETCH,
+	DATA_FETCH,
 } fdcirq_state = IDLE;
 static RefPtr<dsk::Disk> fdcirq_dskimage;
+//sector of the current read or write command
+static RefPtr<dsk::DiskSector> fdcirq_sector;
+//sector already sitting in the data ram, uploaded ahead of its read command
+static RefPtr<dsk::DiskSector> fdcirq_uploaded;
+static dsk::DiskFindSectorCommand fdcirq_nextsectorcommand;
 
+//data collected by the frontend for write and format, read id result
 static uint8_t sectorbuf[2048];
 
+static struct FDCCommandInfo fdc_commandinfo[8];
+static struct FDCTraceEntry fdc_trace[FDC_TRACE_SIZE];
+static unsigned fdc_tracepos = 0;
+static struct FDCTraceEntry fdcirq_trace;
+static uint64_t fdcirq_ready_time;
+static unsigned fdcirq_image_reads;
+static uint64_t fdcirq_irq_time;
+
 static void fdcirq_FPGACommCompletion(int result);
 /*
   communication protocol between stm32 and fdc frontend:
@@ -133,10 +194,104 @@ static void fdcirq_FPGACommCompletion(int result);
   * the frontend pauses in execution state waiting for response.valid
     to go low.
   * stm32 reads memory and pulls response.valid low when it is done, which
-    clears irq.
+    clears irq. if writing the data to the image failed, the status bits
+    sent along with it have the data error set.
 */
+
+/* records the times of the command phases. the first response ends the
+ * lookup, the second one completes the command.
+ */
+static void fdcirq_traceResponse() {
+	uint64_t now = Timer_timeSincePowerOn();
+	FDCTraceEntry &t = fdcirq_trace;
+	if (fdcirq_response.valid) {
+		t.time = fdcirq_irq_time / 1000;
+		t.drive = fdcirq_command.driveUnit;
+		t.command = fdcirq_command.command;
+		t.pcn = fdcirq_command.PCN;
+		t.C = fdcirq_command.C;
+		t.H = fdcirq_command.H;
+		t.R = fdcirq_command.R;
+		t.N = fdcirq_command.N;
+		memcpy(&t.status, &fdcirq_response, 1);
+		t.lookup = now - fdcirq_irq_time;
+		fdcirq_ready_time = now;
+		return;
+	}
+	t.transfer = fdcirq_irq_time - fdcirq_ready_time;
+	t.final = now - fdcirq_irq_time;
+	t.image_reads = 0;
+	if (fdcirq_dskimage) {
+		t.image_reads = fdcirq_dskimage->image_reads -
+			fdcirq_image_reads;
+	}
+
+	FDCCommandInfo &ci = fdc_commandinfo[t.command];
+	uint32_t stall = t.lookup + t.final;
+	unsigned bucket = stall?32 - __builtin_clz(stall):0;
+	if (bucket >= FDC_LATENCY_BUCKETS)
+		bucket = FDC_LATENCY_BUCKETS-1;
+	ci.count++;
+	ci.stall_histogram[bucket]++;
+	ci.total_lookup += t.lookup;
+	ci.total_transfer += t.transfer;
+	ci.total_final += t.final;
+	ci.image_reads += t.image_reads;
+	if (t.lookup > ci.worst_lookup)
+		ci.worst_lookup = t.lookup;
+	if (t.final > ci.worst_final)
+		ci.worst_final = t.final;
+
+	fdc_trace[fdc_tracepos] = t;
+	fdc_tracepos++;
+	if (fdc_tracepos >= FDC_TRACE_SIZE)
+		fdc_tracepos = 0;
+}
+
+/* sends fdcirq_response to the frontend and reenables the irq.
+ */
+static void fdcirq_sendResponse() {
+	fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
+	fdcirq_FPGACommand.length = 1;
+	fdcirq_FPGACommand.read_data = NULL;
+	fdcirq_FPGACommand.write_data = &fdcirq_response;
+	fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
+	FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
+
+	fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
+	FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
+
+	fdcirq_traceResponse();
+}
+
+static void fdcirq_setSectorResponse(RefPtr<dsk::DiskSector> const &sector) {
+	if (!sector) {
+		fdcirq_response.reserved = 0;
+		fdcirq_response.controlMark = 0;
+		fdcirq_response.badCylinder = 0;
+		fdcirq_response.wrongCylinder = 0;
+		fdcirq_response.missingAddressMark = 1;
+		fdcirq_response.noData = 1;
+		fdcirq_response.dataError = 0;
+		fdcirq_response.valid = 1;
+		return;
+	}
+	fdcirq_response.reserved = 0;
+	fdcirq_response.controlMark =
+		(sector->ST2 & dsk::ST2_ControlMark)?1:0;
+	fdcirq_response.badCylinder =
+		(sector->ST2 & dsk::ST2_BadCylinder)?1:0;
+	fdcirq_response.wrongCylinder =
+		(sector->ST2 & dsk::ST2_WrongCylinder)?1:0;
+	fdcirq_response.missingAddressMark =
+		(sector->ST2 & dsk::ST2_MissingAddressMark)?1:0;
+	fdcirq_response.noData = (sector->ST1 & dsk::ST1_NoData)?1:0;
+	fdcirq_response.dataError = (sector->ST1 & dsk::ST1_DataError)?1:0;
+	fdcirq_response.valid = 1;
+}
+
 static void fdcirq_DiskFindSectorCompletion(RefPtr<dsk::DiskSector> sector) {
-	driveAccessCount[fdcirq_command.driveUnit] = 10;
+	drives[fdcirq_command.driveUnit].accessCount = 10;
 	switch (fdcirq_state) {
 	case SECTOR_FETCH:
 		switch (fdcirq_command.command) {
@@ -144,17 +299,7 @@ static void fdcirq_DiskFindSectorCompletion(RefPtr<dsk::DiskSector> sector) {
 			assert(0);
 			break;
 		case 1: //read id
-			if (!sector) {
-				//setup response
-				fdcirq_response.reserved = 0;
-				fdcirq_response.controlMark = 0;
-				fdcirq_response.badCylinder = 0;
-				fdcirq_response.wrongCylinder = 0;
-				fdcirq_response.missingAddressMark = 1;
-				fdcirq_response.noData = 1;
-				fdcirq_response.dataError = 0;
-				fdcirq_response.valid = 1;
-			} else {
+			if (sector) {
 				sectorbuf[0] = sector->C;
 				sectorbuf[1] = sector->H;
 				sectorbuf[2] = sector->R;
@@ -166,68 +311,51 @@ static void fdcirq_DiskFindSectorCompletion(RefPtr<dsk::DiskSector> sector) {
 				//no slot needed
 				fdcirq_FPGACommand2.slot = sigc::slot<void(int)>();
 				FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand2);
-
-				fdcirq_response.reserved = 0;
-				fdcirq_response.controlMark = (sector->ST2 & 0x80)?1:0;
-				fdcirq_response.badCylinder = (sector->ST2 & 0x02)?1:0;
-				fdcirq_response.wrongCylinder = (sector->ST2 & 0x10)?1:0;
-				fdcirq_response.missingAddressMark = (sector->ST2 & 0x01)?1:0;
-				fdcirq_response.noData = (sector->ST1 & 0x04)?1:0;
-				fdcirq_response.dataError = (sector->ST1 & 0x20)?1:0;
-				fdcirq_response.valid = 1;
 			}
-			fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
-			fdcirq_FPGACommand.length = 1;
-			fdcirq_FPGACommand.read_data = NULL;
-			fdcirq_FPGACommand.write_data = &fdcirq_response;
-			fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
-
-			fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
+			fdcirq_setSectorResponse(sector);
+			fdcirq_sendResponse();
 			fdcirq_state = WAIT_TRANSFERDONE;
 			break;
 		case 3: //read data
-			if (!sector) {
-				//setup response
-				fdcirq_response.reserved = 0;
-				fdcirq_response.controlMark = 0;
-				fdcirq_response.badCylinder = 0;
-				fdcirq_response.wrongCylinder = 0;
-				fdcirq_response.missingAddressMark = 1;
-				fdcirq_response.noData = 1;
-				fdcirq_response.dataError = 0;
-				fdcirq_response.valid = 1;
-			} else {
-				//copy data to sectorbuf
-				memcpy(sectorbuf, sector->data, sector->size);
-
+			if (sector && fdcirq_uploaded &&
+			    sector->data == fdcirq_uploaded->data &&
+			    sector->size == fdcirq_uploaded->size) {
+				//data is already there.
+				fdcirq_sector = sector;
+			} else if (sector) {
+				//straight from the cached cylinder, the sector
+				//keeps it alive until the command is done.
+				fdcirq_sector = sector;
 				fdcirq_FPGACommand2.address = FPGA_CPC_FDC_DATA;
-				fdcirq_FPGACommand2.length = sector->size;
+				//the data ram has the same size as sectorbuf
+				fdcirq_FPGACommand2.length =
+					sector->size < sizeof(sectorbuf)?
+					sector->size:sizeof(sectorbuf);
 				fdcirq_FPGACommand2.read_data = NULL;
-				fdcirq_FPGACommand2.write_data = &sectorbuf;
+				fdcirq_FPGACommand2.write_data = sector->data;
 				//no slot needed
 				fdcirq_FPGACommand2.slot = sigc::slot<void(int)>();
 				FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand2);
-
-				fdcirq_response.reserved = 0;
-				fdcirq_response.controlMark = (sector->ST2 & 0x80)?1:0;
-				fdcirq_response.badCylinder = (sector->ST2 & 0x02)?1:0;
-				fdcirq_response.wrongCylinder = (sector->ST2 & 0x10)?1:0;
-				fdcirq_response.missingAddressMark = (sector->ST2 & 0x01)?1:0;
-				fdcirq_response.noData = (sector->ST1 & 0x04)?1:0;
-				fdcirq_response.dataError = (sector->ST1 & 0x20)?1:0;
-				fdcirq_response.valid = 1;
 			}
-			fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
-			fdcirq_FPGACommand.length = 1;
-			fdcirq_FPGACommand.read_data = NULL;
-			fdcirq_FPGACommand.write_data = &fdcirq_response;
-			fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
-
-			fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
+			fdcirq_setSectorResponse(sector);
+			fdcirq_sendResponse();
+			fdcirq_state = WAIT_TRANSFERDONE;
+			break;
+		case 5: //write data
+		case 6: //write deleted data
+			//the data arrives during execution, we pick it up
+			//once the frontend is done.
+			fdcirq_sector = sector;
+			fdcirq_setSectorResponse(sector);
+			//the write replaces a bad crc
+			fdcirq_response.dataError = 0;
+			//sectors larger than the data ram cannot be written
+			if (sector && (fdcirq_dskimage->write_protected ||
+				       sector->size > sizeof(sectorbuf))) {
+				fdcirq_sector = NULL;
+				fdcirq_response.dataError = 1;
+			}
+			fdcirq_sendResponse();
 			fdcirq_state = WAIT_TRANSFERDONE;
 			break;
 		default:
@@ -241,13 +369,117 @@ static void fdcirq_DiskFindSectorCompletion(RefPtr<dsk::DiskSector> sector) {
 	}
 }
 
+static void fdcirq_finishCommand() {
+	//the data ram has been used by this command.
+	fdcirq_uploaded = NULL;
+	fdcirq_sector = NULL;
+	fdcirq_response.valid = 0;
+	fdcirq_sendResponse();
+	fdcirq_state = IDLE;
+}
+
+/* ends a write or format whose data could not go to the image.
+ */
+static void fdcirq_failCommand() {
+	fdcirq_response.dataError = 1;
+	fdcirq_finishCommand();
+}
+
+/* multi sector reads continue with the next R. if that sector is cached,
+ * its data gets into the data ram while the cpc is still busy with the
+ * result phase of the current one.
+ */
+static void fdcirq_uploadNextSector() {
+	fdcirq_nextsectorcommand = fdcirq_findsectorcommand;
+	fdcirq_nextsectorcommand.R++;
+	fdcirq_nextsectorcommand.slot =
+		sigc::slot<void(RefPtr<dsk::DiskSector>)>();
+	RefPtr<dsk::DiskSector> sector =
+		fdcirq_dskimage->findCachedSector(&fdcirq_nextsectorcommand);
+	if (!sector)
+		return;
+	//only queued behind the response, the frontend is done with the
+	//data ram at this point.
+	fdcirq_FPGACommand2.address = FPGA_CPC_FDC_DATA;
+	fdcirq_FPGACommand2.length =
+		sector->size < sizeof(sectorbuf)?
+		sector->size:sizeof(sectorbuf);
+	fdcirq_FPGACommand2.read_data = NULL;
+	fdcirq_FPGACommand2.write_data = sector->data;
+	fdcirq_FPGACommand2.slot = sigc::slot<void(int)>();
+	FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand2);
+	//also keeps the data alive until the upload is done
+	fdcirq_uploaded = sector;
+}
+
+static void fdcirq_FormatTrackCompletion(int result) {
+	if (result != 0)
+		fdcirq_failCommand();
+	else
+		fdcirq_finishCommand();
+}
+
+static void fdcirq_DataFetchCompletion(int result) {
+	if (result != 0) {
+		//this is bad. retry.
+		FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand2);
+		return;
+	}
+	drives[fdcirq_command.driveUnit].accessCount = 10;
+	switch (fdcirq_command.command) {
+	case 2: //format track
+		fdcirq_formattrackcommand.pcn = fdcirq_command.PCN;
+		fdcirq_formattrackcommand.phn = fdcirq_command.PHN;
+		fdcirq_formattrackcommand.N =
+			fdcirq_command.configuredSectorSize;
+		fdcirq_formattrackcommand.SPT =
+			fdcirq_command.sectorsPerTrack;
+		fdcirq_formattrackcommand.gap3 = fdcirq_command.gapLength;
+		fdcirq_formattrackcommand.filler = fdcirq_command.fillerByte;
+		fdcirq_formattrackcommand.ids =
+			reinterpret_cast<dsk::DiskSectorID *>(sectorbuf);
+		fdcirq_formattrackcommand.slot =
+			sigc::ptr_fun(&fdcirq_FormatTrackCompletion);
+		fdcirq_dskimage->formatTrack(&fdcirq_formattrackcommand);
+		break;
+	case 5: //write data
+	case 6: //write deleted data
+		//only goes to the cached cylinder, no need to wait for
+		//the sd card. fails if the disk moved on to another
+		//cylinder meanwhile.
+		if (fdcirq_dskimage->writeSector(fdcirq_sector, sectorbuf,
+						 fdcirq_command.command == 6) != 0)
+			fdcirq_failCommand();
+		else
+			fdcirq_finishCommand();
+		break;
+	default:
+		assert(0);
+		break;
+	}
+}
+
+/* reads the data the frontend collected during execution
+ */
+static void fdcirq_fetchData(unsigned length) {
+	if (length > sizeof(sectorbuf))
+		length = sizeof(sectorbuf);
+	fdcirq_FPGACommand2.address = FPGA_CPC_FDC_DATA;
+	fdcirq_FPGACommand2.length = length;
+	fdcirq_FPGACommand2.read_data = &sectorbuf;
+	fdcirq_FPGACommand2.write_data = NULL;
+	fdcirq_FPGACommand2.slot = sigc::ptr_fun(&fdcirq_DataFetchCompletion);
+	fdcirq_state = DATA_FETCH;
+	FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand2);
+}
+
 static void fdcirq_FPGACommCompletion(int result) {
 	if (result != 0) {
 		//this is bad. retry.
 		FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
 		return;
 	}
-	driveAccessCount[fdcirq_command.driveUnit] = 10;
+	drives[fdcirq_command.driveUnit].accessCount = 10;
 	switch (fdcirq_state) {
 	case COMMAND_FETCH: //we just fetched our fdcirq_command.
 		if(!fdcirq_command.valid) {
@@ -256,7 +488,9 @@ static void fdcirq_FPGACommCompletion(int result) {
 			fdcirq_state = IDLE;
 			return;
 		}
-		fdcirq_dskimage = images[fdcirq_command.driveUnit];
+		fdcirq_dskimage = drives[fdcirq_command.driveUnit].image;
+		if (fdcirq_dskimage)
+			fdcirq_image_reads = fdcirq_dskimage->image_reads;
 		//formattrack does not need a disk to work.
 		//it should not happen while ready is low(should be handled by
 		//fpga without intervention), but the implementation is simple
@@ -272,15 +506,7 @@ static void fdcirq_FPGACommCompletion(int result) {
 			fdcirq_response.noData = 0;
 			fdcirq_response.dataError = 0;
 			fdcirq_response.valid = 1;
-			fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
-			fdcirq_FPGACommand.length = 1;
-			fdcirq_FPGACommand.read_data = NULL;
-			fdcirq_FPGACommand.write_data = &fdcirq_response;
-			fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
-
-			fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
+			fdcirq_sendResponse();
 			fdcirq_state = WAIT_TRANSFERDONE;
 		} else {
 			switch (fdcirq_command.command) {
@@ -304,13 +530,36 @@ static void fdcirq_FPGACommCompletion(int result) {
 					fdcirq_command.N;
 				fdcirq_findsectorcommand.deleted = false;
 				fdcirq_findsectorcommand.find_any = true;
+				fdcirq_findsectorcommand.ignore_deleted = false;
 				fdcirq_findsectorcommand.slot =
 					sigc::ptr_fun(&fdcirq_DiskFindSectorCompletion);
 				fdcirq_state = SECTOR_FETCH;
 				fdcirq_dskimage->findSector
 					(&fdcirq_findsectorcommand);
 				break;
+			case 2: //format track
+				//the sector ids arrive during execution. get
+				//the cylinder ready in the meantime.
+				if (fdcirq_dskimage)
+					fdcirq_dskimage->preloadCylinder
+						(fdcirq_command.PCN);
+				fdcirq_response.reserved = 0;
+				fdcirq_response.controlMark = 0;
+				fdcirq_response.badCylinder = 0;
+				fdcirq_response.wrongCylinder = 0;
+				fdcirq_response.missingAddressMark = 0;
+				fdcirq_response.noData = 0;
+				fdcirq_response.dataError = 0;
+				fdcirq_response.valid = 1;
+				if (fdcirq_dskimage &&
+				    fdcirq_dskimage->write_protected)
+					fdcirq_response.dataError = 1;
+				fdcirq_sendResponse();
+				fdcirq_state = WAIT_TRANSFERDONE;
+				break;
 			case 3: //READDATA
+			case 5: //WRITEDATA
+			case 6: //WRITEDELETEDDATA
 				fdcirq_findsectorcommand.pcn =
 					fdcirq_command.PCN;
 				fdcirq_findsectorcommand.phn =
@@ -327,6 +576,8 @@ static void fdcirq_FPGACommCompletion(int result) {
 					fdcirq_command.N;
 				fdcirq_findsectorcommand.deleted = false;
 				fdcirq_findsectorcommand.find_any = false;
+				fdcirq_findsectorcommand.ignore_deleted =
+					fdcirq_command.command != 3;
 				fdcirq_findsectorcommand.slot =
 					sigc::ptr_fun(&fdcirq_DiskFindSectorCompletion);
 				fdcirq_state = SECTOR_FETCH;
@@ -342,33 +593,38 @@ static void fdcirq_FPGACommCompletion(int result) {
 	case COMMAND_FINAL_FETCH:
 		assert(!fdcirq_command_final.valid);
 		if (!fdcirq_dskimage && fdcirq_command.command != 2) {
-			fdcirq_response.valid = 0;
-			fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
-			fdcirq_FPGACommand.length = 1;
-			fdcirq_FPGACommand.read_data = NULL;
-			fdcirq_FPGACommand.write_data = &fdcirq_response;
-			fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
-			fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
-			FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
-			fdcirq_state = IDLE;
+			fdcirq_finishCommand();
 		} else {
 			switch (fdcirq_command.command) {
 			case 0: //no command, cannot happen.
 				assert(0);
 				break;
 			case 1: //read id
+				fdcirq_finishCommand();
+				break;
 			case 3: //read data
-				fdcirq_response.valid = 0;
-				fdcirq_FPGACommand.address = FPGA_CPC_FDC_INSTS;
-				fdcirq_FPGACommand.length = 1;
-				fdcirq_FPGACommand.read_data = NULL;
-				fdcirq_FPGACommand.write_data = &fdcirq_response;
-				fdcirq_FPGACommand.slot = sigc::slot<void(int)>();
-				FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
-				fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
-				FPGAComm_EnableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
-				fdcirq_state = IDLE;
+				if (fdcirq_sector) {
+					fdcirq_finishCommand();
+					fdcirq_uploadNextSector();
+				} else
+					fdcirq_finishCommand();
+				break;
+			case 2: //format track
+				if (!fdcirq_dskimage ||
+				    fdcirq_response.dataError ||
+				    fdcirq_command.sectorsPerTrack == 0)
+					fdcirq_finishCommand();
+				else
+					fdcirq_fetchData
+						(fdcirq_command.sectorsPerTrack *
+						 sizeof(dsk::DiskSectorID));
+				break;
+			case 5: //write data
+			case 6: //write deleted data
+				if (!fdcirq_sector)
+					fdcirq_finishCommand();
+				else
+					fdcirq_fetchData(fdcirq_sector->size);
 				break;
 			default:
 				assert(0);
@@ -385,6 +641,7 @@ static void fdcirq_FPGACommCompletion(int result) {
 static void FDC_IRQHandler() {
 	switch(fdcirq_state) {
 	case IDLE:
+		fdcirq_irq_time = Timer_timeSincePowerOn();
 		//first, queue the disable command so we can retrigger the irq when we reenable and it is asserted again already.
 		fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
 		FPGAComm_DisableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
@@ -398,6 +655,7 @@ static void FDC_IRQHandler() {
 		FPGAComm_ReadWriteCommand(&fdcirq_FPGACommand);
 		break;
 	case WAIT_TRANSFERDONE:
+		fdcirq_irq_time = Timer_timeSincePowerOn();
 		//first, queue the disable command so we can retrigger the irq when we reenable and it is asserted again already.
 		fdcirq_endisable_FPGACommand.slot = sigc::slot<void(int)>();
 		FPGAComm_DisableIRQs_nb(0x01, &fdcirq_endisable_FPGACommand);
@@ -422,25 +680,145 @@ void FDC_Setup() {
 	FPGAComm_EnableIRQs(0x01);
 }
 
+static void FDC_InsertDiskComplete(RefPtr<dsk::Disk> image, int drive,
+				   uint32_t seq,
+				   sigc::slot<void(int)> slot) {
+	RefPtr<dsk::Disk> old;
+	bool stale;
+	{
+		ISR_Guard g;
+		//another insert or an eject came in while opening
+		stale = seq != drives[drive].insertSeq;
+		if (stale) {
+			old = image;
+		} else {
+			old = drives[drive].image;
+			drives[drive].image = image;
+			drives[drive].ncnPending = true;
+		}
+	}
+	if (old)
+		old->close();
+	if (stale)
+		return;
+	driveUpdateStatus(drive);
+	slot(image?0:-1);
+}
+
 void FDC_InsertDisk(int drive, char const *filename) {
 	assert(drive >= 0 && drive < 4);
-	images[drive] = dsk::openImage(filename);
-	if (!images[drive])
-		return;
-	uint8_t b;
-	if (images[drive]->write_protected)
-		b = 0xc0;
-	else
-		b = 0x80;
-	FPGAComm_CopyToFPGA(FPGA_CPC_FDC_FDD_STS(drive), (void*)&b, 1);
+	uint32_t seq;
+	{
+		ISR_Guard g;
+		seq = ++drives[drive].insertSeq;
+	}
+	//opening takes a while, the other drives keep going meanwhile.
+	RefPtr<dsk::Disk> image = dsk::openImage(filename);
+	FDC_InsertDiskComplete(image, drive, seq, sigc::slot<void(int)>());
+}
+
+static void FDC_InsertDiskOpened(RefPtr<dsk::Disk> image, int drive,
+				 uint32_t seq,
+				 sigc::slot<void(int)> slot) {
+	//updating the drive status needs to wait for the fpga, not
+	//possible in interrupt context.
+	addDeferredWork(sigc::bind(sigc::ptr_fun(&FDC_InsertDiskComplete),
+				   image, drive, seq, slot));
+}
+
+void FDC_InsertDiskAsync(int drive, char const *filename,
+			 sigc::slot<void(int result)> const &slot) {
+	assert(drive >= 0 && drive < 4);
+	uint32_t seq;
+	{
+		ISR_Guard g;
+		seq = ++drives[drive].insertSeq;
+	}
+	dsk::openImage(filename,
+		       sigc::bind(sigc::ptr_fun(&FDC_InsertDiskOpened),
+				  drive, seq, slot));
 }
 
 void FDC_EjectDisk(int drive) {
 	assert(drive >= 0 && drive < 4);
-	uint8_t b;
-	b = 0x00;
-	FPGAComm_CopyToFPGA(FPGA_CPC_FDC_FDD_STS(drive), (void*)&b, 1);
-	if (images[drive])
-		images[drive]->close();
-	images[drive] = NULL;
+	RefPtr<dsk::Disk> image;
+	{
+		ISR_Guard g;
+		image = drives[drive].image;
+		drives[drive].image = NULL;
+		drives[drive].insertSeq++;
+	}
+	driveUpdateStatus(drive);
+	//a command still running on it keeps its own reference.
+	if (image)
+		image->close();
+}
+
+struct FDCCommandInfo FDC_CommandInfo(unsigned command) {
+	assert(command < 8);
+	ISR_Guard g;
+	return fdc_commandinfo[command];
+}
+
+unsigned FDC_Trace(struct FDCTraceEntry *entries, unsigned max) {
+	ISR_Guard g;
+	unsigned n = 0;
+	unsigned pos = fdc_tracepos;
+	while (n < max && n < FDC_TRACE_SIZE) {
+		pos = pos == 0?FDC_TRACE_SIZE-1:pos-1;
+		if (fdc_trace[pos].command == 0)
+			break;
+		entries[n++] = fdc_trace[pos];
+	}
+	return n;
+}
+
+static void traceAppend(std::string &text, uint32_t v, bool hex) {
+	char buf[12];
+	char *p = buf + sizeof(buf);
+	do {
+		*--p = "0123456789abcdef"[v % (hex ? 16 : 10)];
+		v /= hex ? 16 : 10;
+	} while(v);
+	if (hex) {
+		*--p = 'x';
+		*--p = '0';
+	}
+	if (text[text.size() - 1] != '\n')
+		text += ' ';
+	text.append(p, buf + sizeof(buf) - p);
+}
+
+int FDC_SaveTrace(char const *filename) {
+	std::vector<FDCTraceEntry> entries(FDC_TRACE_SIZE);
+	unsigned n = FDC_Trace(entries.data(), entries.size());
+	std::string text = "# ms drive command pcn C H R N status reads"
+		" lookup_us transfer_us final_us\n";
+	//oldest first, the ids and the status in hex
+	while(n > 0) {
+		FDCTraceEntry const &t = entries[--n];
+		traceAppend(text, t.time, false);
+		traceAppend(text, t.drive, false);
+		traceAppend(text, t.command, false);
+		traceAppend(text, t.pcn, false);
+		traceAppend(text, t.C, true);
+		traceAppend(text, t.H, true);
+		traceAppend(text, t.R, true);
+		traceAppend(text, t.N, true);
+		traceAppend(text, t.status, true);
+		traceAppend(text, t.image_reads, false);
+		traceAppend(text, t.lookup, false);
+		traceAppend(text, t.transfer, false);
+		traceAppend(text, t.final, false);
+		text += '\n';
+	}
+	int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return -1;
+	int res = 0;
+	if (write(fd, text.data(), text.size()) != (ssize_t)text.size())
+		res = -1;
+	if (close(fd) != 0)
+		res = -1;
+	return res;
 }
@@ -3,10 +3,12 @@
 
 #include <deque>
 #include <vector>
+#include <algorithm>
 #include <string.h>
 #include <block/msd.hpp>
 #include <fs/vfs.hpp>
 #include <lang.hpp>
+#include <deferredwork.hpp>
 
 /** \brief Private structures for parsing and manipulating FAT file systems
  */
@@ -14,13 +16,36 @@ namespace fat_priv {
 
 	struct DirInode;
 
+	/* one block of the partition, shared by everyone reading it. the
+	 * data is valid once the fill is done, until the last reference
+	 * is given back.
+	 */
+	struct CachedBlock {
+		uint32_t blockno;//relative to first_block, ~0U if unused
+		unsigned refcount;
+		bool valid;
+		bool filling;
+		//written while being filled, the data read is outdated.
+		bool stale;
+		//modified, not written to the partition yet. kept in the
+		//cache until blockFlush wrote it.
+		bool dirty;
+		uint32_t last_use;
+		std::deque<sigc::slot<void(CachedBlock *)> > waiters;
+		MSDReadCommand read_command;
+		uint8_t data[512];
+	};
+
 	struct Partition {
 		uint32_t first_block;
 		uint32_t num_blocks;
 		MSD *msd;
-		uint32_t blockno;
-		std::vector<uint8_t> block;
-		MSDReadCommand read_command;
+		std::vector<CachedBlock *> cache;
+		uint32_t cache_clock;
+		~Partition() {
+			for(auto b : cache)
+				delete b;
+		}
 
 		uint32_t fat_start_block;//relative to first_block
 		uint32_t fat_block_count;
@@ -30,10 +55,28 @@ namespace fat_priv {
 		uint32_t blocks_per_cluster;
 		uint32_t cluster_0_block;//relative to first_block, also does not
 		//actually pointer to a valid cluster.
+		uint32_t root_dir_block;//relative to first_block, fat12/16 only
+		uint32_t root_dir_blocks;
+		uint32_t cluster_count;//highest valid cluster number + 1
+		uint32_t fsinfo_block;//relative to first_block, 0 if there is none
+		//free cluster count and where to start looking for one, read
+		//from the fsinfo block on the first allocation.
+		bool fsinfo_loaded;
+		bool fsinfo_dirty;
+		uint32_t free_count;//~0U if unknown
+		uint32_t next_free;
+		//the fat is being changed, the changes wait for each other.
+		bool meta_busy;
 		RefPtr<vfs::Inode> rootInode;
 		//need to store where the fat and its copies are kept
 		//need to store where any other global info is kept
-		enum { Fat12, Fat16, Fat32 } fattype;
+		enum { Fat12, Fat16, Fat32, ExFat } fattype;
+		//exfat only, the root directory is needed for finding the
+		//up-case table. upcase holds the characters that do not map
+		//to themselves, sorted.
+		uint32_t root_cluster;
+		bool upcase_loaded;
+		std::vector<std::pair<uint16_t, uint16_t> > upcase;
 	};
 
 	static std::deque<Partition*> partitions;
@@ -138,45 +181,406 @@ namespace fat_priv {
 			uint16_t name3[2];
 		} __attribute__((packed)) longfilename;
 	} __attribute__((packed));
+
+	struct ExFAT_BootSector {
+		uint8_t code1[3];
+		char name[8];//"EXFAT   "
+		uint8_t zero[53];
+		uint64_t partition_offset;
+		uint64_t volume_length;
+		uint32_t fat_offset;//in sectors, like all offsets here
+		uint32_t fat_length;
+		uint32_t cluster_heap_offset;
+		uint32_t cluster_count;
+		uint32_t root_dir_cluster;
+		uint32_t serial;
+		uint16_t revision;
+		uint16_t flags;//bit 0: second fat is the active one
+		uint8_t bytes_per_sector_shift;
+		uint8_t sectors_per_cluster_shift;
+		uint8_t fat_copies;
+		uint8_t drive_select;
+		uint8_t percent_in_use;
+		uint8_t reserved[7];
+		char code2[390];
+		uint16_t signature;
+	} __attribute__((packed));
+
+	union ExFatDirEntry {
+		//bit 0x80 is set for entries in use, 0 ends the directory.
+		uint8_t type;
+		struct {
+			uint8_t type;//0x85
+			uint8_t secondary_count;
+			uint16_t checksum;
+			uint16_t attributes;//same bits as for fat
+			uint8_t reserved[26];
+		} __attribute__((packed)) file;
+		struct {
+			uint8_t type;//0xc0, follows the file entry
+			uint8_t flags;//bit 1: no fat chain, clusters are consecutive
+			uint8_t reserved1;
+			uint8_t name_length;
+			uint16_t name_hash;
+			uint16_t reserved2;
+			uint64_t valid_data_length;
+			uint32_t reserved3;
+			uint32_t first_cluster;
+			uint64_t data_length;
+		} __attribute__((packed)) stream;
+		struct {
+			uint8_t type;//0xc1, 15 characters each
+			uint8_t flags;
+			uint16_t name[15];
+		} __attribute__((packed)) name;
+		struct {
+			uint8_t type;//0x82, in the root directory
+			uint8_t reserved1[3];
+			uint32_t checksum;
+			uint8_t reserved2[12];
+			uint32_t first_cluster;
+			uint64_t data_length;
+		} __attribute__((packed)) upcase;
+	} __attribute__((packed));
 }
 
-static void fetchBlock_cmpl(int res, fat_priv::Partition *p) {
-	if (res != 0) {
-		p->blockno = ~0U;
-		return; //hmm. okay, well.
+//blocks kept per partition, more are used while all are referenced
+#define FAT_CACHE_BLOCKS 8
+
+static unsigned fat_cache_blocks = FAT_CACHE_BLOCKS;
+static struct FATCacheInfo fat_cache_info;
+
+/* pre-condition: interrupts disabled
+ */
+static fat_priv::CachedBlock *cacheFind(fat_priv::Partition *priv,
+					uint32_t block) {
+	for(auto b : priv->cache) {
+		if (b->blockno == block && !b->stale)
+			return b;
+	}
+	return NULL;
+}
+
+/* pre-condition: interrupts disabled
+   post-condition: the returned block is unused and unreferenced
+ */
+static fat_priv::CachedBlock *cacheAlloc(fat_priv::Partition *priv) {
+	fat_priv::CachedBlock *victim = NULL;
+	for(auto b : priv->cache) {
+		if (b->refcount == 0 && b->blockno == ~0U)
+			return b;
+	}
+	if (priv->cache.size() >= fat_cache_blocks) {
+		for(auto b : priv->cache) {
+			if (b->refcount != 0 || b->dirty)
+				continue;
+			if (!victim || b->last_use < victim->last_use)
+				victim = b;
+		}
 	}
-	p->blockno = p->read_command.start_block - p->first_block;
+	if (!victim) {
+		victim = new fat_priv::CachedBlock();
+		victim->refcount = 0;
+		victim->dirty = false;
+		priv->cache.push_back(victim);
+	}
+	victim->blockno = ~0U;
+	victim->valid = false;
+	victim->stale = false;
+	return victim;
 }
 
-static void fetchBlock( fat_priv::Partition *priv, uint32_t block) {
-	volatile uint32_t* blocknop = &priv->blockno;
-	if (priv->blockno == block)
+/* gives back a reference from blockGet.
+ */
+static void blockPut(fat_priv::Partition *priv, fat_priv::CachedBlock *b) {
+	ISR_Guard g;
+	b->refcount--;
+	if (b->refcount != 0)
 		return;
-	priv->blockno = ~0U;
+	if (!b->valid || b->stale) {
+		b->blockno = ~0U;
+		b->valid = false;
+		b->stale = false;
+	}
+	if (priv->cache.size() > fat_cache_blocks && !b->dirty) {
+		for(auto it = priv->cache.begin(); it != priv->cache.end(); it++) {
+			if (*it == b) {
+				priv->cache.erase(it);
+				break;
+			}
+		}
+		delete b;
+	}
+}
 
-	priv->read_command.start_block = priv->first_block + block;
-	priv->read_command.num_blocks = 1;
-	priv->read_command.dst = priv->block.data();
-	priv->read_command.slot = sigc::bind(sigc::ptr_fun(&fetchBlock_cmpl),priv);
-	priv->msd->readBlocks(&priv->read_command);
-	while(*blocknop == ~0U)
-		sched_yield();
+static void blockFill_cmpl(int res, fat_priv::CachedBlock *b,
+			   fat_priv::Partition *priv) {
+	std::deque<sigc::slot<void(fat_priv::CachedBlock *)> > waiters;
+	{
+		ISR_Guard g;
+		b->filling = false;
+		b->valid = res == 0;
+		waiters.swap(b->waiters);
+	}
+	for(auto &w : waiters) {
+		if (res == 0) {
+			w(b);
+		} else {
+			blockPut(priv, b);
+			w(NULL);
+		}
+	}
 }
 
-/* caller fills: read_command->num_blocks, dst, slot.
-*/
 /* pre-condition: none
-   post-condition: read_command->slot gets called once and only once
+   post-condition: slot gets called once and only once, with a referenced
+                   block or NULL if it could not be read. the reference
+                   must be given back using blockPut.
+ */
+static void blockGet(fat_priv::Partition *priv, uint32_t block,
+		     sigc::slot<void(fat_priv::CachedBlock *)> const &slot) {
+	fat_priv::CachedBlock *b;
+	{
+		ISR_Guard g;
+		b = cacheFind(priv, block);
+		if (b) {
+			fat_cache_info.hits++;
+			b->refcount++;
+			b->last_use = ++priv->cache_clock;
+			if (b->filling) {
+				b->waiters.push_back(slot);
+				return;
+			}
+		} else {
+			fat_cache_info.misses++;
+			b = cacheAlloc(priv);
+			b->blockno = block;
+			b->refcount = 1;
+			b->last_use = ++priv->cache_clock;
+			b->filling = true;
+			b->waiters.push_back(slot);
+			b->read_command.start_block = priv->first_block + block;
+			b->read_command.num_blocks = 1;
+			b->read_command.dst = b->data;
+			b->read_command.slot = sigc::bind
+				(sigc::ptr_fun(&blockFill_cmpl), b, priv);
+		}
+	}
+	if (b->filling)
+		priv->msd->readBlocks(&b->read_command);
+	else
+		slot(b);
+}
+
+/* returns a referenced block if it is cached already, NULL otherwise.
+   completions walking many blocks use this to avoid deep recursion.
+ */
+static fat_priv::CachedBlock *blockTryGet(fat_priv::Partition *priv,
+					  uint32_t block) {
+	ISR_Guard g;
+	fat_priv::CachedBlock *b = cacheFind(priv, block);
+	if (!b || !b->valid || b->filling)
+		return NULL;
+	fat_cache_info.hits++;
+	b->refcount++;
+	b->last_use = ++priv->cache_clock;
+	return b;
+}
+
+static void blockGetSync_cmpl(fat_priv::CachedBlock *b,
+			      fat_priv::CachedBlock **result,
+			      volatile bool *done) {
+	*result = b;
+	swbarrier();
+	*done = true;
+}
+
+/* must not be used in interrupt context.
+ */
+static fat_priv::CachedBlock *blockGetSync(fat_priv::Partition *priv,
+					   uint32_t block) {
+	fat_priv::CachedBlock *b = NULL;
+	volatile bool done = false;
+	blockGet(priv, block, sigc::bind(sigc::ptr_fun(&blockGetSync_cmpl),
+					 &b, &done));
+	while(!done)
+		sched_yield();
+	return b;
+}
+
+/* keeps the cache coherent with a block that has been written.
+ */
+static void blockUpdate(fat_priv::Partition *priv, uint32_t block,
+			void const *data) {
+	ISR_Guard g;
+	fat_priv::CachedBlock *b = cacheFind(priv, block);
+	if (!b)
+		return;
+	if (b->filling)
+		b->stale = true;
+	else if (b->valid)
+		memcpy(b->data, data, 512);
+}
+
+static void blockWriteSync_cmpl(int res, volatile int *cmdres) {
+	*cmdres = res != 0 ? -1 : 0;
+}
+
+/* writes the block straight to the partition, the cache is not touched.
+   must not be used in interrupt context.
+ */
+static int blockWriteSync(fat_priv::Partition *priv, uint32_t block,
+			  void const *data) {
+	MSDWriteCommand cmd;
+	volatile int cmdres = 1;
+	cmd.start_block = priv->first_block + block;
+	cmd.num_blocks = 1;
+	cmd.src = data;
+	cmd.slot = sigc::bind(sigc::ptr_fun(&blockWriteSync_cmpl), &cmdres);
+	priv->msd->writeBlocks(&cmd);
+	while(cmdres == 1)
+		sched_yield();
+	return cmdres;
+}
+
+/* writes all modified blocks, and the fsinfo block if the free cluster
+   information changed. fat blocks go to every copy of the fat.
+   must not be used in interrupt context.
+ */
+static int blockFlush(fat_priv::Partition *priv) {
+	if (priv->fsinfo_dirty && priv->fsinfo_block != 0) {
+		fat_priv::CachedBlock *b = blockGetSync(priv, priv->fsinfo_block);
+		if (b) {
+			{
+				ISR_Guard g;
+				uint32_t *words = (uint32_t *)b->data;
+				words[488/4] = priv->free_count;
+				words[492/4] = priv->next_free;
+				b->dirty = true;
+			}
+			blockPut(priv, b);
+		}
+		priv->fsinfo_dirty = false;
+	}
+	int res = 0;
+	while(1) {
+		fat_priv::CachedBlock *b = NULL;
+		{
+			ISR_Guard g;
+			for(auto c : priv->cache) {
+				if (c->dirty) {
+					b = c;
+					break;
+				}
+			}
+			if (!b)
+				break;
+			//modifications from here on set it again
+			b->dirty = false;
+			b->refcount++;
+		}
+		unsigned copies = 1;
+		if (b->blockno >= priv->fat_start_block &&
+		    b->blockno < priv->fat_start_block + priv->fat_block_count)
+			copies = priv->fat_count;
+		for(unsigned i = 0; i < copies; i++) {
+			if (blockWriteSync(priv, b->blockno +
+					   i * priv->fat_block_count,
+					   b->data) != 0)
+				res = -1;
+		}
+		blockPut(priv, b);
+	}
+	if (res != 0)
+		errno = EIO;
+	return res;
+}
+
+/* byte offset of the fat entry of cluster, relative to the fat.
+ */
+static uint32_t fatEntryOffset(fat_priv::Partition *priv, uint32_t cluster) {
+	switch(priv->fattype) {
+	case fat_priv::Partition::Fat12:
+		return cluster + cluster / 2;
+	case fat_priv::Partition::Fat16:
+		return cluster * 2;
+	default:
+		return cluster * 4;
+	}
+}
+
+static uint32_t fatEntryBlock(fat_priv::Partition *priv, uint32_t cluster) {
+	return fatEntryOffset(priv, cluster) / 512 + priv->fat_start_block;
+}
+
+/* fat12 entries at the end of a block continue in the next one.
+ */
+static bool fatEntrySplit(fat_priv::Partition *priv, uint32_t cluster) {
+	return priv->fattype == fat_priv::Partition::Fat12 &&
+		fatEntryOffset(priv, cluster) % 512 == 511;
+}
+
+/* turns the raw entry into the fat32 value range, end of chain and bad
+   cluster markers compare the same for all variants that way.
+ */
+static uint32_t fatEntryValue(fat_priv::Partition *priv, uint32_t cluster,
+			      uint32_t raw) {
+	switch(priv->fattype) {
+	case fat_priv::Partition::Fat12:
+		raw = (cluster & 1) ? (raw >> 4) & 0xfff : raw & 0xfff;
+		if (raw >= 0xff7)
+			raw |= 0x0ffff000;
+		return raw;
+	case fat_priv::Partition::Fat16:
+		raw &= 0xffff;
+		if (raw >= 0xfff7)
+			raw |= 0x0fff0000;
+		return raw;
+	case fat_priv::Partition::ExFat:
+		//all 32 bits are used, clusters above 0x0ffffff6 are
+		//not supported.
+		if (raw >= 0x0ffffff7)
+			return 0x0fffffff;
+		return raw;
+	default:
+		return raw & 0x0fffffff;
+	}
+}
+
+/* entry of cluster in the fat block data, which must not be split.
  */
-static void fetchBlock_nb( fat_priv::Partition *priv, uint32_t block,
-			  MSDReadCommand *read_command) {
-	read_command->start_block = priv->first_block + block;
-	priv->msd->readBlocks(read_command);
+static uint32_t fatEntryGet(fat_priv::Partition *priv, uint32_t cluster,
+			    uint8_t const *data) {
+	uint32_t off = fatEntryOffset(priv, cluster) % 512;
+	uint32_t raw;
+	if (priv->fattype == fat_priv::Partition::Fat32 ||
+	    priv->fattype == fat_priv::Partition::ExFat)
+		raw = *(uint32_t const *)(data + off);
+	else
+		raw = data[off] | (data[off+1] << 8);
+	return fatEntryValue(priv, cluster, raw);
 }
 
 static uint32_t findNextCluster( fat_priv::Partition *priv, uint32_t cluster) {
-	fetchBlock(priv, cluster*4/512 + priv->fat_start_block);
-	return ((uint32_t*)priv->block.data())[cluster%(512/4)];
+	uint32_t block = fatEntryBlock(priv, cluster);
+	fat_priv::CachedBlock *b = blockGetSync(priv, block);
+	if (!b)
+		return ~0U;
+	uint32_t next;
+	if (fatEntrySplit(priv, cluster)) {
+		fat_priv::CachedBlock *b2 = blockGetSync(priv, block + 1);
+		if (!b2) {
+			blockPut(priv, b);
+			return ~0U;
+		}
+		next = fatEntryValue(priv, cluster,
+				     b->data[511] | (b2->data[0] << 8));
+		blockPut(priv, b2);
+	} else {
+		next = fatEntryGet(priv, cluster, b->data);
+	}
+	blockPut(priv, b);
+	return next;
 }
 
 struct Fat_FindNextCluster_Command {
@@ -184,45 +588,314 @@ struct Fat_FindNextCluster_Command {
 	uint32_t cluster;
 	sigc::slot<void(uint32_t cluster,
 			   Fat_FindNextCluster_Command *command)> slot;
-	uint32_t blockno;//init with ~0U
-	MSDReadCommand read_command;
-	char buf[512];
+	//first byte of a split fat12 entry, ~0U until it has been read
+	uint32_t low;
 };
 
+/* returns false if the fat block is not cached.
+ */
+static bool findNextCluster_cached(fat_priv::Partition *priv,
+				   uint32_t cluster, uint32_t &next) {
+	uint32_t block = fatEntryBlock(priv, cluster);
+	fat_priv::CachedBlock *b = blockTryGet(priv, block);
+	if (!b)
+		return false;
+	if (fatEntrySplit(priv, cluster)) {
+		fat_priv::CachedBlock *b2 = blockTryGet(priv, block + 1);
+		if (!b2) {
+			blockPut(priv, b);
+			return false;
+		}
+		next = fatEntryValue(priv, cluster,
+				     b->data[511] | (b2->data[0] << 8));
+		blockPut(priv, b2);
+	} else {
+		next = fatEntryGet(priv, cluster, b->data);
+	}
+	blockPut(priv, b);
+	return true;
+}
+
 /* pre-condition: none
    post-condition: command->slot gets called once and only once
  */
-static void findNextCluster_nb_cmpl(int res, Fat_FindNextCluster_Command *p) {
-	if (res != 0) {
-		p->blockno = ~0U;
-		p->slot(~0U, p);
+static void findNextCluster_nb_cmpl(fat_priv::CachedBlock *b,
+				    Fat_FindNextCluster_Command *command) {
+	if (!b) {
+		command->slot(~0U, command);
+		return;
+	}
+	uint32_t next;
+	if (fatEntrySplit(command->priv, command->cluster)) {
+		if (command->low == ~0U) {
+			//got the first half, the rest is in the next block
+			command->low = b->data[511];
+			uint32_t blockno = b->blockno + 1;
+			blockPut(command->priv, b);
+			blockGet(command->priv, blockno,
+				 sigc::bind(sigc::ptr_fun(&findNextCluster_nb_cmpl), command));
+			return;
+		}
+		next = fatEntryValue(command->priv, command->cluster,
+				     command->low | (b->data[0] << 8));
+	} else {
+		next = fatEntryGet(command->priv, command->cluster, b->data);
 	}
-	p->blockno = p->read_command.start_block - p->priv->first_block;
-	p->slot(
-		((uint32_t*)p->buf)[p->cluster%(512/4)],
-		p);
+	blockPut(command->priv, b);
+	command->slot(next, command);
 }
 
-/* caller fills command->priv, cluster, slot. everything else gets used.
+/* caller fills command->priv, cluster, slot.
  */
 /* pre-condition: none
    post-condition: command->slot gets called once and only once
  */
 static void findNextCluster_nb(Fat_FindNextCluster_Command *command) {
-	uint32_t blockno = command->cluster*4/512 +
-		command->priv->fat_start_block;
-	if (command->blockno == blockno) {
-		command->slot(
-			((uint32_t*)command->buf)[command->cluster%(512/4)],
-			command);
+	command->low = ~0U;
+	blockGet(command->priv, fatEntryBlock(command->priv, command->cluster),
+		 sigc::bind(sigc::ptr_fun(&findNextCluster_nb_cmpl), command));
+}
+
+/* changes the fat entry of cluster in the cache, blockFlush writes it.
+   must not be used in interrupt context.
+ */
+static int fatSet(fat_priv::Partition *priv, uint32_t cluster,
+		  uint32_t value) {
+	uint32_t block = fatEntryBlock(priv, cluster);
+	fat_priv::CachedBlock *b = blockGetSync(priv, block);
+	fat_priv::CachedBlock *b2 = NULL;
+	if (b && fatEntrySplit(priv, cluster)) {
+		b2 = blockGetSync(priv, block + 1);
+		if (!b2) {
+			blockPut(priv, b);
+			b = NULL;
+		}
+	}
+	if (!b) {
+		errno = EIO;
+		return -1;
+	}
+	{
+		ISR_Guard g;
+		uint32_t off = fatEntryOffset(priv, cluster) % 512;
+		switch(priv->fattype) {
+		case fat_priv::Partition::Fat12: {
+			//two entries share the middle byte
+			uint8_t *lo = &b->data[off];
+			uint8_t *hi = b2 ? &b2->data[0] : &b->data[off+1];
+			value &= 0xfff;
+			if (cluster & 1) {
+				*lo = (*lo & 0x0f) | ((value << 4) & 0xf0);
+				*hi = value >> 4;
+			} else {
+				*lo = value & 0xff;
+				*hi = (*hi & 0xf0) | (value >> 8);
+			}
+			break;
+		}
+		case fat_priv::Partition::Fat16:
+			*(uint16_t *)(b->data + off) = value;
+			break;
+		default: {
+			//the upper 4 bits are reserved and must be kept
+			uint32_t *e = (uint32_t *)(b->data + off);
+			*e = (*e & 0xf0000000) | (value & 0x0fffffff);
+			break;
+		}
+		}
+		b->dirty = true;
+		if (b2)
+			b2->dirty = true;
+	}
+	if (b2)
+		blockPut(priv, b2);
+	blockPut(priv, b);
+	return 0;
+}
+
+static void loadFSInfo(fat_priv::Partition *priv) {
+	if (priv->fsinfo_loaded)
+		return;
+	priv->fsinfo_loaded = true;
+	priv->free_count = ~0U;
+	priv->next_free = 2;
+	if (priv->fsinfo_block == 0)
 		return;
+	fat_priv::CachedBlock *b = blockGetSync(priv, priv->fsinfo_block);
+	if (!b) {
+		priv->fsinfo_block = 0;
+		return;
+	}
+	uint32_t *words = (uint32_t *)b->data;
+	if (words[0] == 0x41615252 && words[484/4] == 0x61417272) {
+		//both are hints, ~0U means unknown
+		if (words[488/4] < priv->cluster_count)
+			priv->free_count = words[488/4];
+		if (words[492/4] >= 2 && words[492/4] < priv->cluster_count)
+			priv->next_free = words[492/4];
+	} else {
+		priv->fsinfo_block = 0;
+	}
+	blockPut(priv, b);
+}
+
+/* allocates a free cluster and links it behind prev, unless prev is 0.
+   the search starts right behind prev to keep files contiguous, at the
+   fsinfo next free hint otherwise. returns 0 and sets errno on failure.
+   must not be used in interrupt context.
+ */
+static uint32_t allocCluster(fat_priv::Partition *priv, uint32_t prev) {
+	loadFSInfo(priv);
+	if (priv->free_count == 0) {
+		errno = ENOSPC;
+		return 0;
 	}
-	command->read_command.num_blocks = 1;
-	command->read_command.dst = command->buf;
-	command->read_command.slot = sigc::bind(sigc::ptr_fun(&findNextCluster_nb_cmpl),command);
-	fetchBlock_nb(command->priv, blockno, &command->read_command);
+	uint32_t cluster = priv->next_free;
+	if (prev >= 2 && prev + 1 < priv->cluster_count)
+		cluster = prev + 1;
+	if (cluster < 2 || cluster >= priv->cluster_count)
+		cluster = 2;
+	uint32_t searched = 0;
+	uint32_t total = priv->cluster_count - 2;
+	//the fat block currently looked at
+	fat_priv::CachedBlock *b = NULL;
+	bool found = false;
+	while(searched < total) {
+		uint32_t value;
+		if (fatEntrySplit(priv, cluster)) {
+			value = findNextCluster(priv, cluster);
+		} else {
+			uint32_t block = fatEntryBlock(priv, cluster);
+			if (!b || b->blockno != block) {
+				if (b)
+					blockPut(priv, b);
+				b = blockGetSync(priv, block);
+			}
+			value = b ? fatEntryGet(priv, cluster, b->data) : ~0U;
+		}
+		if (value == ~0U) {
+			if (b)
+				blockPut(priv, b);
+			errno = EIO;
+			return 0;
+		}
+		if (value == 0) {
+			found = true;
+			break;
+		}
+		searched++;
+		cluster++;
+		if (cluster >= priv->cluster_count)
+			cluster = 2;
+	}
+	if (b)
+		blockPut(priv, b);
+	if (found) {
+		if (fatSet(priv, cluster, 0x0fffffff) != 0)
+			return 0;
+		if (prev >= 2 && fatSet(priv, prev, cluster) != 0) {
+			fatSet(priv, cluster, 0);
+			return 0;
+		}
+		if (priv->free_count != ~0U)
+			priv->free_count--;
+		priv->next_free = cluster + 1;
+		priv->fsinfo_dirty = true;
+		return cluster;
+	}
+	priv->free_count = 0;
+	priv->fsinfo_dirty = true;
+	errno = ENOSPC;
+	return 0;
+}
+
+/* gives the chain starting at cluster back to the free clusters.
+   must not be used in interrupt context.
+ */
+static int freeChain(fat_priv::Partition *priv, uint32_t cluster) {
+	loadFSInfo(priv);
+	while(cluster >= 2 && cluster < priv->cluster_count) {
+		uint32_t next = findNextCluster(priv, cluster);
+		if (next == ~0U || fatSet(priv, cluster, 0) != 0) {
+			errno = EIO;
+			return -1;
+		}
+		if (priv->free_count != ~0U)
+			priv->free_count++;
+		if (cluster < priv->next_free)
+			priv->next_free = cluster;
+		priv->fsinfo_dirty = true;
+		cluster = next;
+	}
+	return 0;
+}
+
+struct FATCacheInfo FAT_CacheInfo() {
+	ISR_Guard g;
+	struct FATCacheInfo info = fat_cache_info;
+	info.blocks = 0;
+	for(auto p : fat_priv::partitions)
+		info.blocks += p->cache.size();
+	return info;
+}
+
+void FAT_SetCacheBlocks(unsigned blocks) {
+	ISR_Guard g;
+	fat_cache_blocks = blocks;
 }
 
+/* free list of request objects, they are needed for every access and
+ * only a few exist at a time.
+ */
+template<typename T, unsigned N>
+struct RequestPool {
+	union Entry {
+		Entry *next;
+		char storage[sizeof(T)];
+	} __attribute__((aligned(8)));
+	static Entry entries[N];
+	static Entry *free_list;
+	static bool initialized;
+	static void *alloc(size_t size) {
+		{
+			ISR_Guard g;
+			if (!initialized) {
+				for(unsigned i = 0; i < N; i++) {
+					entries[i].next = free_list;
+					free_list = &entries[i];
+				}
+				initialized = true;
+			}
+			if (free_list && size <= sizeof(Entry)) {
+				Entry *e = free_list;
+				free_list = e->next;
+				return e;
+			}
+		}
+		return ::operator new(size);
+	}
+	static void release(void *p) {
+		Entry *e = reinterpret_cast<Entry *>(p);
+		if (e >= entries && e < entries + N) {
+			ISR_Guard g;
+			e->next = free_list;
+			free_list = e;
+			return;
+		}
+		::operator delete(p);
+	}
+};
+
+template<typename T, unsigned N>
+typename RequestPool<T, N>::Entry RequestPool<T, N>::entries[N];
+template<typename T, unsigned N>
+typename RequestPool<T, N>::Entry *RequestPool<T, N>::free_list = NULL;
+template<typename T, unsigned N>
+bool RequestPool<T, N>::initialized = false;
+
+#define FAT_READ_POOL_SIZE 4
+#define FAT_WRITE_POOL_SIZE 2
+
 struct FatInode;
 
 struct AioFatInodeRead {
@@ -231,18 +904,61 @@ struct AioFatInodeRead {
 	size_t len;
 	off_t offset;
 	int res;
-	uint32_t current_cluster;
-	uint32_t current_offset;
 	RefPtr<FatInode> inode;//for keeping the reference alive for as long as the read takes
 	Fat_FindNextCluster_Command findnextcluster_command;
+	//blocks read straight into ptr
+	MSDReadCommand read_command;
+	static void *operator new(size_t size) {
+		return RequestPool<AioFatInodeRead, FAT_READ_POOL_SIZE>::alloc(size);
+	}
+	static void operator delete(void *p) {
+		RequestPool<AioFatInodeRead, FAT_READ_POOL_SIZE>::release(p);
+	}
+};
+
+struct AioFatInodeWrite {
+	aio::PWriteCommand *command;
+	char const *ptr;
+	size_t len;
+	off_t offset;
+	int res;
+	RefPtr<FatInode> inode;//for keeping the reference alive for as long as the write takes
+	Fat_FindNextCluster_Command findnextcluster_command;
+	//buf, or blocks written straight from ptr
+	MSDWriteCommand write_command;
+	uint32_t blockno;//block in buf, ~0U if none
+	char buf[512];//partial blocks only
+	static void *operator new(size_t size) {
+		return RequestPool<AioFatInodeWrite, FAT_WRITE_POOL_SIZE>::alloc(size);
+	}
+	static void operator delete(void *p) {
+		RequestPool<AioFatInodeWrite, FAT_WRITE_POOL_SIZE>::release(p);
+	}
+};
+
+/* run of consecutive clusters in a file
+ */
+struct FatExtent {
+	uint32_t index;//of the first cluster, counted from the file start
+	uint32_t cluster;
+	uint32_t count;
 };
 
 struct FatInode : public vfs::Inode {
 	fat_priv::Partition *priv;
 	uint32_t first_cluster;
 	uint32_t size;
-	uint32_t current_cluster;
-	uint32_t current_offset;
+	/* the part of the cluster chain walked so far, grown on demand.
+	 * complete once the end of the chain has been seen.
+	 */
+	std::vector<FatExtent> extents;
+	bool extents_complete;
+	//directory holding the entry of this inode, NULL for the root
+	RefPtr<FatInode> parent;
+	uint32_t dirent;//index of the entry in parent
+	uint32_t dirent_first;//first long name entry belonging to it
+	//the entry is gone, it must not be written anymore.
+	bool unlinked;
 	FatInode( fat_priv::Partition *priv,
 		 uint32_t first_cluster,
 		 uint32_t size,
@@ -250,39 +966,254 @@ struct FatInode : public vfs::Inode {
 		: priv(priv)
 		, first_cluster(first_cluster)
 		, size(size)
-		, current_cluster(first_cluster)
-		, current_offset(0)
+		, extents_complete(false)
+		, dirent(0)
+		, dirent_first(0)
+		, unlinked(false)
 		{
 			this->mode = mode;
+			vfs::Inode::size = size;
+			if (first_cluster >= 2 && first_cluster < 0xffffff7) {
+				FatExtent e = { 0, first_cluster, 1 };
+				extents.push_back(e);
+			} else {
+				extents_complete = true;
+			}
 		}
+	uint32_t mapCluster(uint32_t index, uint32_t &last, uint32_t &run);
+	void appendCluster(uint32_t last, uint32_t cluster);
+	uint32_t clusterAt(uint32_t index, uint32_t &run);
+	uint32_t growRun(uint32_t index, uint32_t run, uint32_t want);
+	void addCluster(uint32_t cluster);
+	void setContiguous(uint32_t count);
+	void trimExtents(uint32_t count);
+	uint32_t clusterCount();
+	int allocClusters(uint32_t count);
+	int freeClusters(uint32_t keep);
+	void setSize(uint32_t newsize);
+	int extend(uint32_t newsize);
+	int zeroRange(uint32_t from, uint32_t to);
+	virtual int direntIO(uint32_t index, fat_priv::DirEntry *ent,
+			     bool write);
+	int updateDirent();
+	virtual int truncate(off_t length);
+	uint32_t directBlocks(void const *ptr, size_t len, uint32_t coff,
+			      uint32_t run);
 	virtual _ssize_t pread(void *ptr, size_t len, off_t offset);
-	virtual _ssize_t pwrite(const void */*ptr*/, size_t /*len*/, off_t /*offset*/);
+	virtual _ssize_t pwrite(const void *ptr, size_t len, off_t offset);
 
 	void aio_pread_helper(AioFatInodeRead *p);
-	void aio_pread_cmpl1(uint32_t cluster, AioFatInodeRead *p);
-	void aio_pread_cmpl2(int res, AioFatInodeRead *p);
+	void aio_pread_cmpl1(uint32_t cluster, uint32_t last,
+			     AioFatInodeRead *p);
+	void aio_pread_cmpl2(fat_priv::CachedBlock *b, AioFatInodeRead *p);
+	void aio_pread_copy(fat_priv::CachedBlock *b, AioFatInodeRead *p);
+	void aio_pread_cmpl3(int res, AioFatInodeRead *p);
+	void aio_pread_finish(int res, int errno_code, AioFatInodeRead *p);
 	virtual _ssize_t pread(aio::PReadCommand * command);
+	void aio_pwrite_helper(AioFatInodeWrite *p);
+	void aio_pwrite_cmpl1(uint32_t cluster, uint32_t last,
+			      AioFatInodeWrite *p);
+	void aio_pwrite_cmpl2(fat_priv::CachedBlock *b, AioFatInodeWrite *p);
+	void aio_pwrite_cmpl3(int res, AioFatInodeWrite *p);
+	void aio_pwrite_cmpl4(int res, AioFatInodeWrite *p);
+	void aio_pwrite_finish(int res, int errno_code, AioFatInodeWrite *p);
+	void aio_pwrite_start(aio::PWriteCommand * command);
+	void aio_pwrite_extend(RefPtr<FatInode> self,
+			       aio::PWriteCommand * command);
 	virtual _ssize_t pwrite(aio::PWriteCommand * command);
 };
 
-struct Fat16RootDirInode : public vfs::Inode {
-	fat_priv::Partition *priv;
-	uint32_t root_dir_start_block;//relative to first_block
-	uint32_t root_dir_entry_count;
-	Fat16RootDirInode( fat_priv::Partition *priv) : priv(priv) {}
+//limit set by the fat specification
+#define FAT_DIR_ENTRIES_MAX 65536
+
+//source for zeroing new directory clusters and file areas
+static uint32_t zero_block[512/4];
+
+/* memory all directory indexes together may use. directories too large
+ * for it are searched without an index.
+ */
+#define FAT_DIR_INDEX_BUDGET 8192
+
+struct FatDirIndexSlot {
+	uint16_t hash;
+	uint16_t first;//entry the name starts at
+	bool operator<(FatDirIndexSlot const &o) const {
+		return hash < o.hash;
+	}
+};
+
+/* name lookup index of a directory: the hash of each name and the entry
+ * it starts at, sorted by hash. candidates are read back from the
+ * directory and compared, so collisions only cost time. the least
+ * recently used indexes are dropped to keep within FAT_DIR_INDEX_BUDGET.
+ */
+class FatDirIndex {
+public:
+	typedef std::vector<FatDirIndexSlot>::const_iterator iterator;
+	bool valid;
+	bool too_large;
+	FatDirIndex() : valid(false), too_large(false), last_use(0) {}
+	~FatDirIndex() { clear(); }
+	//drops the index, it gets built again on the next lookup.
+	void clear();
+	void begin();
+	//returns false if there is no room, the index is dropped then.
+	bool add(uint16_t hash, uint32_t first);
+	void end();
+	//adds to a valid index, keeping it sorted
+	void insert(uint16_t hash, uint32_t first);
+	void remove(uint32_t first);
+	std::pair<iterator, iterator> find(uint16_t hash);
+private:
+	std::vector<FatDirIndexSlot> slots;
+	uint32_t last_use;
+	static std::vector<FatDirIndex *> all;
+	static size_t used;
+	static uint32_t clock;
+	static bool dropOldest(FatDirIndex *except);
+};
+
+std::vector<FatDirIndex *> FatDirIndex::all;
+size_t FatDirIndex::used = 0;
+uint32_t FatDirIndex::clock = 0;
+
+void FatDirIndex::clear() {
+	used -= slots.size() * sizeof(FatDirIndexSlot);
+	auto it = std::find(all.begin(), all.end(), this);
+	if (it != all.end())
+		all.erase(it);
+	std::vector<FatDirIndexSlot>().swap(slots);
+	valid = false;
+	too_large = false;
+}
+
+bool FatDirIndex::dropOldest(FatDirIndex *except) {
+	FatDirIndex *oldest = NULL;
+	for(auto i : all) {
+		if (i != except && (!oldest || i->last_use < oldest->last_use))
+			oldest = i;
+	}
+	if (!oldest)
+		return false;
+	oldest->clear();
+	return true;
+}
+
+void FatDirIndex::begin() {
+	clear();
+	all.push_back(this);
+	last_use = ++clock;
+}
+
+bool FatDirIndex::add(uint16_t hash, uint32_t first) {
+	while(used + sizeof(FatDirIndexSlot) > FAT_DIR_INDEX_BUDGET) {
+		if (!dropOldest(this)) {
+			clear();
+			too_large = true;
+			return false;
+		}
+	}
+	if (first > 0xffff) {
+		clear();
+		too_large = true;
+		return false;
+	}
+	//small steps, the budget counts what is used
+	if (slots.size() == slots.capacity())
+		slots.reserve(slots.size() + 64);
+	FatDirIndexSlot sl = { hash, (uint16_t)first };
+	slots.push_back(sl);
+	used += sizeof(FatDirIndexSlot);
+	return true;
+}
+
+void FatDirIndex::end() {
+	std::sort(slots.begin(), slots.end());
+	slots.shrink_to_fit();
+	valid = true;
+}
+
+void FatDirIndex::insert(uint16_t hash, uint32_t first) {
+	if (!valid)
+		return;
+	if (!add(hash, first))
+		return;
+	std::sort(slots.begin(), slots.end());
+}
+
+void FatDirIndex::remove(uint32_t first) {
+	for(auto it = slots.begin(); it != slots.end();) {
+		if (it->first == first) {
+			it = slots.erase(it);
+			used -= sizeof(FatDirIndexSlot);
+		} else {
+			it++;
+		}
+	}
+}
+
+std::pair<FatDirIndex::iterator, FatDirIndex::iterator>
+FatDirIndex::find(uint16_t hash) {
+	last_use = ++clock;
+	FatDirIndexSlot key = { hash, 0 };
+	return std::equal_range(slots.cbegin(), slots.cend(), key);
+}
+
+/* what lookup needs to know about a directory entry
+ */
+struct FatDirIndexEntry {
+	uint32_t cluster;
+	uint32_t size;
+	uint8_t attributes;
+	uint32_t dirent;
+	uint32_t dirent_first;
 };
 
 struct FatDirInode : public FatInode {
+	/* all names in the directory, long and short ones, built on the
+	 * first lookup. names not in it do not exist.
+	 */
+	FatDirIndex index;
 	FatDirInode( fat_priv::Partition *priv,
 		    uint32_t first_cluster,
 		    uint32_t size,
 		    mode_t mode)
 		: FatInode(priv, first_cluster, size, mode)
 		{}
+	/* case does not matter for the hash. fnv-1a folded to 16 bits,
+	 * names differing in a digit or two, like numbered disk images,
+	 * have to end up apart.
+	 */
+	static uint16_t nameHash(std::string const &name) {
+		uint32_t hash = 2166136261U;
+		for(unsigned char c : name) {
+			if (c >= 'a' && c <= 'z')
+				c = c - 'a' + 'A';
+			hash = (hash ^ c) * 16777619U;
+		}
+		return hash ^ (hash >> 16);
+	}
+	static std::string shortName(fat_priv::DirEntry const &ent) {
+		std::string name;
+		for(unsigned i = 0; i < 8; i++) {
+			if (ent.regular.filename[i] == ' ')
+				break;
+			name += ent.regular.filename[i];
+		}
+		name += ".";
+		for(unsigned i = 0; i < 3; i++) {
+			if (ent.regular.extension[i] == ' ')
+				break;
+			name += ent.regular.extension[i];
+		}
+		return name;
+	}
 	//first d_off is -1, -2 and -3 are reserved, rest is free for use.
+	//first is set to the first entry belonging to the name.
 	bool _readdir(off_t &d_off, std::string &name,
-		      fat_priv::DirEntry &ent) {
+		      fat_priv::DirEntry &ent, off_t &first) {
 		std::basic_string<uint16_t> long_name;
+		off_t long_first = 0;
 		while(1) {
 			d_off++;
 			int res = pread(&ent, sizeof(ent), d_off * sizeof(ent));
@@ -297,8 +1228,10 @@ struct FatDirInode : public FatInode {
 				//the long file name entries are stored in
 				//reverse order, i.E. the last one is first.
 				//last entry marker
-				if (ent.longfilename.order & 0x40)
+				if (ent.longfilename.order & 0x40) {
 					long_name.clear();
+					long_first = d_off;
+				}
 				uint16_t nm[13];
 				unsigned i = 0;
 				for(i = 0; i < 5; i++) {
@@ -336,76 +1269,731 @@ struct FatDirInode : public FatInode {
 			//do we have a long name?
 			if (!long_name.empty()) {
 				name = lang::Utf16ToUtf8(long_name);
+				first = long_first;
 			} else {
-				name = "";
-				for(unsigned i = 0; i < 8; i++) {
-					if (ent.regular.filename[i] == ' ')
-						break;
-					name += ent.regular.filename[i];
-				}
-				name += ".";
-				for(unsigned i = 0; i < 3; i++) {
-					if (ent.regular.extension[i] == ' ')
-						break;
-					name += ent.regular.extension[i];
-				}
+				name = shortName(ent);
+				first = d_off;
 			}
 			return true;
 		}
 
 		return false;
 	}
-	virtual int lookup(RefPtr<vfs::Dentry> dent) {
+	/* must be called whenever the directory gets modified.
+	 */
+	void invalidateIndex() {
+		index.clear();
+	}
+	static void indexEntry(FatDirIndexEntry &e, fat_priv::DirEntry const &ent,
+			       off_t d_off, off_t first) {
+		e.cluster = ent.regular.low_cluster |
+			(ent.regular.high_cluster << 16);
+		e.size = ent.regular.size;
+		e.attributes = ent.regular.attributes;
+		e.dirent = d_off;
+		e.dirent_first = first;
+	}
+	void buildIndex() {
 		off_t d_off = -1;
+		off_t first;
 		std::string name;
 		fat_priv::DirEntry ent;
-		while(_readdir(d_off, name, ent)) {
-			if (name == dent->name) {
-				mode = S_IRUSR | S_IRGRP | S_IROTH |
-					S_IWUSR | S_IWGRP | S_IWOTH;
-				if (ent.regular.attributes & 0x01)
-					//readonly
-					mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
-				if (ent.regular.attributes & 0x02) {
-					//hidden
-					mode &= ~(S_IRWXO);
-				}
-				if (ent.regular.attributes & 0x04) {
-					//system
-					mode &= ~(S_IRWXG | S_IRWXO);
-				}
-				if (ent.regular.attributes & 0x20) {
-					//archive
-					mode &= ~S_IWOTH;
-				}
-				if (ent.regular.attributes & 0x10) {
-					//that's a directory
-					dent->inode = new FatDirInode(
-						priv, ent.regular.low_cluster |
-						(ent.regular.high_cluster << 16),
-						ent.regular.size,
-						mode | S_IFDIR |
-						S_IXUSR | S_IXGRP | S_IXOTH);
-				} else {
-					//plain inode
-					dent->inode = new FatInode(
-						priv, ent.regular.low_cluster |
-						(ent.regular.high_cluster << 16),
-						ent.regular.size,
-						mode | S_IFREG);
+		index.begin();
+		fat_cache_info.dir_scans++;
+		while(_readdir(d_off, name, ent, first)) {
+			uint16_t hash = nameHash(name);
+			if (!index.add(hash, first))
+				return;
+			//the short name of long named files works as well
+			uint16_t shash = nameHash(shortName(ent));
+			if (shash != hash && !index.add(shash, first))
+				return;
+		}
+		index.end();
+	}
+	void createInode(RefPtr<vfs::Dentry> const &dent,
+			 FatDirIndexEntry const &e) {
+		mode_t m = S_IRUSR | S_IRGRP | S_IROTH |
+			S_IWUSR | S_IWGRP | S_IWOTH;
+		if (e.attributes & 0x01)
+			//readonly
+			m &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+		if (e.attributes & 0x02) {
+			//hidden
+			m &= ~(S_IRWXO);
+		}
+		if (e.attributes & 0x04) {
+			//system
+			m &= ~(S_IRWXG | S_IRWXO);
+		}
+		if (e.attributes & 0x20) {
+			//archive
+			m &= ~S_IWOTH;
+		}
+		FatInode *ino;
+		if (e.attributes & 0x10) {
+			//that's a directory. the size in the entry is 0,
+			//it ends with its cluster chain.
+			ino = new FatDirInode(
+				priv, e.cluster, ~0U,
+				m | S_IFDIR |
+				S_IXUSR | S_IXGRP | S_IXOTH);
+		} else {
+			//plain inode
+			ino = new FatInode(
+				priv, e.cluster, e.size,
+				m | S_IFREG);
+		}
+		ino->parent = this;
+		ino->dirent = e.dirent;
+		ino->dirent_first = e.dirent_first;
+		dent->inode = ino;
+	}
+	static bool nameEqual(std::string const &a, std::string const &b,
+			      bool nocase) {
+		if (!nocase)
+			return a == b;
+		if (a.size() != b.size())
+			return false;
+		for(size_t i = 0; i < a.size(); i++) {
+			unsigned char ca = a[i];
+			unsigned char cb = b[i];
+			if (ca >= 'a' && ca <= 'z')
+				ca = ca - 'a' + 'A';
+			if (cb >= 'a' && cb <= 'z')
+				cb = cb - 'a' + 'A';
+			if (ca != cb)
+				return false;
+		}
+		return true;
+	}
+	/* lookups match the name exactly, so there is only one dentry for
+	 * each entry. nocase is for checking whether a name is taken, as
+	 * fat does not tell names apart by case.
+	 */
+	bool findEntry(std::string const &name, FatDirIndexEntry &e,
+		       bool nocase = false) {
+		if (!index.valid && !index.too_large)
+			buildIndex();
+		off_t first;
+		std::string n;
+		fat_priv::DirEntry ent;
+		if (index.valid) {
+			auto r = index.find(nameHash(name));
+			for(auto it = r.first; it != r.second; it++) {
+				off_t d_off = it->first - 1;
+				if (_readdir(d_off, n, ent, first) &&
+				    (nameEqual(n, name, nocase) ||
+				     nameEqual(shortName(ent), name, nocase))) {
+					indexEntry(e, ent, d_off, first);
+					return true;
 				}
-				return 0;
 			}
+			return false;
 		}
+		//too large for the index, search it.
+		off_t d_off = -1;
+		fat_cache_info.dir_scans++;
+		while(_readdir(d_off, n, ent, first)) {
+			if (nameEqual(n, name, nocase) ||
+			    nameEqual(shortName(ent), name, nocase)) {
+				indexEntry(e, ent, d_off, first);
+				return true;
+			}
+		}
+		return false;
+	}
+	virtual int lookup(RefPtr<vfs::Dentry> dent) {
+		fat_cache_info.dir_lookups++;
+		FatDirIndexEntry e;
+		if (findEntry(dent->name, e))
+			createInode(dent, e);
 		return 0;
 	}
 	//first d_off is -1, -2 and -3 are reserved, rest is free for use.
 	virtual bool readdir(off_t &d_off, std::string &name) {
 		fat_priv::DirEntry ent;
-		return _readdir(d_off, name, ent);
+		off_t first;
+		return _readdir(d_off, name, ent, first);
+	}
+	bool shortNameUsed(std::string const &name) {
+		FatDirIndexEntry e;
+		return findEntry(name, e, true);
+	}
+	/* fills in the 8.3 name for name, with a numeric tail if the name
+	   does not fit. returns false for names that cannot be used.
+	 */
+	bool makeShortName(std::string const &name, fat_priv::DirEntry &ent) {
+		if (name.empty() || name == "." || name == ".." ||
+		    name.find_first_of("/\\:*?\"<>|") != std::string::npos)
+			return false;
+		size_t dot = name.rfind('.');
+		if (dot == 0)
+			dot = std::string::npos;
+		std::string base;
+		std::string ext;
+		bool lossy = false;
+		for(size_t i = 0; i < name.size(); i++) {
+			unsigned char c = name[i];
+			if (i == dot)
+				continue;
+			if (c == ' ' || c == '.') {
+				lossy = true;
+				continue;
+			}
+			if (c >= 'a' && c <= 'z')
+				c = c - 'a' + 'A';
+			else if (c >= 0x80 || strchr("+,;=[]", c)) {
+				c = '_';
+				lossy = true;
+			}
+			std::string &part = (dot != std::string::npos && i > dot) ?
+				ext : base;
+			part += c;
+		}
+		if (base.empty())
+			base = "_";
+		if (base.size() > 8 || ext.size() > 3)
+			lossy = true;
+		if (ext.size() > 3)
+			ext.resize(3);
+		std::string candidate = base.substr(0, 8);
+		if (lossy || shortNameUsed(candidate + "." + ext)) {
+			unsigned n;
+			for(n = 1; n < 1000000; n++) {
+				std::string tail = "~";
+				for(unsigned v = n; v > 0; v /= 10)
+					tail.insert(1, 1, '0' + v % 10);
+				candidate = base.substr(0, 8 - tail.size()) + tail;
+				if (!shortNameUsed(candidate + "." + ext))
+					break;
+			}
+			if (n == 1000000)
+				return false;
+		}
+		memset(ent.regular.filename, ' ', 8);
+		memset(ent.regular.extension, ' ', 3);
+		memcpy(ent.regular.filename, candidate.data(), candidate.size());
+		memcpy(ent.regular.extension, ext.data(), ext.size());
+		//a deleted entry starts with 0xe5, 0x05 stands for it
+		if (ent.detect.state == 0xe5)
+			ent.detect.state = 0x05;
+		return true;
+	}
+	/* adds a zeroed cluster to the directory.
+	 */
+	virtual int addDirCluster() {
+		uint32_t count = clusterCount();
+		if (count == ~0U || allocClusters(count + 1) != 0)
+			return -1;
+		uint32_t run;
+		uint32_t cluster = clusterAt(count, run);
+		for(unsigned i = 0; i < priv->blocks_per_cluster; i++) {
+			uint32_t block = priv->cluster_0_block +
+				cluster * priv->blocks_per_cluster + i;
+			if (blockWriteSync(priv, block, zero_block) != 0) {
+				errno = EIO;
+				return -1;
+			}
+			blockUpdate(priv, block, zero_block);
+		}
+		return 0;
+	}
+	/* finds count consecutive unused entries, the directory grows if
+	   there are not enough.
+	 */
+	int findFreeEntries(unsigned count, uint32_t &slot) {
+		fat_priv::DirEntry ent;
+		unsigned found = 0;
+		for(uint32_t i = 0; i < FAT_DIR_ENTRIES_MAX;) {
+			_ssize_t res = pread(&ent, sizeof(ent), i * sizeof(ent));
+			if (res == -1)
+				return -1;
+			if (res != sizeof(ent)) {
+				//end of the cluster chain
+				if (addDirCluster() != 0)
+					return -1;
+				continue;
+			}
+			if (ent.detect.state == 0 || ent.detect.state == 0xe5) {
+				if (found == 0)
+					slot = i;
+				found++;
+				if (found == count)
+					return 0;
+			} else {
+				found = 0;
+			}
+			i++;
+		}
+		errno = ENOSPC;
+		return -1;
+	}
+	static uint8_t shortNameChecksum(fat_priv::DirEntry const &ent) {
+		uint8_t const *n = (uint8_t const *)ent.regular.filename;
+		uint8_t sum = 0;
+		for(unsigned i = 0; i < 11; i++)
+			sum = ((sum & 1) << 7) + (sum >> 1) + n[i];
+		return sum;
+	}
+	int _create(RefPtr<vfs::Dentry> dent, mode_t mode) {
+		FatDirIndexEntry e;
+		if (findEntry(dent->name, e, true)) {
+			errno = EEXIST;
+			return -1;
+		}
+		fat_priv::DirEntry ent;
+		memset(&ent, 0, sizeof(ent));
+		if (!makeShortName(dent->name, ent)) {
+			errno = EINVAL;
+			return -1;
+		}
+		std::basic_string<uint16_t> long_name;
+		unsigned count = 1;
+		if (shortName(ent) != dent->name) {
+			long_name = lang::Utf8ToUtf16(dent->name);
+			if (long_name.size() > 255) {
+				errno = ENAMETOOLONG;
+				return -1;
+			}
+			count += (long_name.size() + 12) / 13;
+		}
+		ent.regular.attributes = 0x20;//archive
+		if (!(mode & (S_IWUSR | S_IWGRP | S_IWOTH)))
+			ent.regular.attributes |= 0x01;//readonly
+		uint32_t slot;
+		if (findFreeEntries(count, slot) != 0)
+			return -1;
+		//the long name parts come first, last part first.
+		uint8_t checksum = shortNameChecksum(ent);
+		for(unsigned i = 0; i + 1 < count; i++) {
+			unsigned part = count - 1 - i;
+			fat_priv::DirEntry lent;
+			memset(&lent, 0xff, sizeof(lent));
+			lent.longfilename.order = part | (i == 0 ? 0x40 : 0);
+			lent.longfilename.attributes = 0x0f;
+			lent.longfilename.type = 0;
+			lent.longfilename.checksum = checksum;
+			lent.longfilename.cluster = 0;
+			uint16_t nm[13];
+			for(unsigned j = 0; j < 13; j++) {
+				size_t pos = (part - 1) * 13 + j;
+				if (pos < long_name.size())
+					nm[j] = long_name[pos];
+				else if (pos == long_name.size())
+					nm[j] = 0;
+				else
+					nm[j] = 0xffff;
+			}
+			memcpy(lent.longfilename.name1, nm + 0, 5 * 2);
+			memcpy(lent.longfilename.name2, nm + 5, 6 * 2);
+			memcpy(lent.longfilename.name3, nm + 11, 2 * 2);
+			if (direntIO(slot + i, &lent, true) != 0)
+				return -1;
+		}
+		if (direntIO(slot + count - 1, &ent, true) != 0)
+			return -1;
+		if (blockFlush(priv) != 0)
+			return -1;
+		indexEntry(e, ent, slot + count - 1, slot);
+		uint16_t hash = nameHash(dent->name);
+		index.insert(hash, slot);
+		if (nameHash(shortName(ent)) != hash)
+			index.insert(nameHash(shortName(ent)), slot);
+		createInode(dent, e);
+		return 0;
+	}
+	virtual int create(RefPtr<vfs::Dentry> dent, mode_t mode) {
+		//whoever changes the fat is further up the stack, waiting
+		//for them would never end.
+		if (priv->meta_busy) {
+			errno = EBUSY;
+			return -1;
+		}
+		priv->meta_busy = true;
+		int res = _create(dent, mode);
+		priv->meta_busy = false;
+		return res;
+	}
+	virtual int unlink(RefPtr<vfs::Dentry> dent) {
+		FatDirIndexEntry e;
+		if (priv->meta_busy) {
+			errno = EBUSY;
+			return -1;
+		}
+		if (!dent->inode || !findEntry(dent->name, e)) {
+			errno = ENOENT;
+			return -1;
+		}
+		if (e.attributes & 0x10) {
+			errno = EISDIR;
+			return -1;
+		}
+		//gives back the clusters, the inode stays usable for
+		//whoever has it open, with a size of 0.
+		if (dent->inode->truncate(0) != 0)
+			return -1;
+		priv->meta_busy = true;
+		//all inodes in here are FatInodes, see createInode
+		FatInode *ino = static_cast<FatInode *>(dent->inode.operator->());
+		ino->unlinked = true;
+		int res = 0;
+		for(uint32_t i = e.dirent_first; i <= e.dirent && res == 0; i++) {
+			fat_priv::DirEntry ent;
+			res = direntIO(i, &ent, false);
+			if (res == 0) {
+				ent.detect.state = 0xe5;
+				res = direntIO(i, &ent, true);
+			}
+		}
+		if (blockFlush(priv) != 0)
+			res = -1;
+		index.remove(e.dirent_first);
+		priv->meta_busy = false;
+		return res;
+	}
+};
+
+/* the fat12/16 root directory, a fixed number of entries in front of the
+ * clusters.
+ */
+struct Fat16RootDirInode : public FatDirInode {
+	Fat16RootDirInode(fat_priv::Partition *priv, uint32_t entry_count)
+		: FatDirInode(priv, 0, entry_count * sizeof(fat_priv::DirEntry),
+			      S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO)
+		{}
+	using FatDirInode::pread;
+	virtual _ssize_t pread(void *ptr, size_t len, off_t offset) {
+		if ((unsigned)offset >= size)
+			return 0;
+		if (len + offset > size)
+			len = size - offset;
+		_ssize_t res = 0;
+		char *cptr = (char*)ptr;
+		while(len > 0) {
+			fat_priv::CachedBlock *b = blockGetSync
+				(priv, priv->root_dir_block + offset/512);
+			if (!b)
+				break;
+			size_t l2 = 512 - offset % 512;
+			if(l2 > len)
+				l2 = len;
+			memcpy(cptr, b->data + offset % 512, l2);
+			blockPut(priv, b);
+			len -= l2;
+			offset += l2;
+			res += l2;
+			cptr += l2;
+		}
+		return res;
+	}
+	virtual int direntIO(uint32_t index, fat_priv::DirEntry *ent,
+			     bool write) {
+		uint32_t off = index * sizeof(*ent);
+		if (off >= size) {
+			errno = EIO;
+			return -1;
+		}
+		fat_priv::CachedBlock *b = blockGetSync
+			(priv, priv->root_dir_block + off/512);
+		if (!b) {
+			errno = EIO;
+			return -1;
+		}
+		if (write) {
+			ISR_Guard g;
+			memcpy(b->data + off % 512, ent, sizeof(*ent));
+			b->dirty = true;
+		} else {
+			memcpy(ent, b->data + off % 512, sizeof(*ent));
+		}
+		blockPut(priv, b);
+		return 0;
+	}
+	virtual int addDirCluster() {
+		//cannot grow
+		errno = ENOSPC;
+		return -1;
+	}
+};
+
+//characters of the up-case table not mapping to themselves kept at most
+#define EXFAT_UPCASE_MAX 2048
+
+/* looks up c in the exfat up-case table, plain ascii rules are used until
+ * the table has been loaded.
+ */
+static uint16_t exfatUpcase(fat_priv::Partition *priv, uint16_t c) {
+	if (priv->upcase.empty()) {
+		if (c >= 'a' && c <= 'z')
+			return c - 'a' + 'A';
+		return c;
+	}
+	auto it = std::lower_bound(priv->upcase.begin(), priv->upcase.end(),
+				   std::make_pair(c, (uint16_t)0));
+	if (it != priv->upcase.end() && it->first == c)
+		return it->second;
+	return c;
+}
+
+/* what the entry set of a file tells about it
+ */
+struct ExFatEntryInfo {
+	uint32_t cluster;
+	uint32_t size;
+	uint16_t attributes;
+	bool contiguous;
+};
+
+struct ExFatDirInode : public FatInode {
+	/* the name hashes of the directory, built on the first lookup.
+	 * names not in it do not exist.
+	 */
+	FatDirIndex index;
+	ExFatDirInode( fat_priv::Partition *priv,
+		      uint32_t first_cluster,
+		      uint32_t size,
+		      mode_t mode)
+		: FatInode(priv, first_cluster, size, mode)
+		{}
+	static void loadUpcase(fat_priv::Partition *priv);
+	std::basic_string<uint16_t> upcaseName
+	(std::basic_string<uint16_t> const &name) {
+		std::basic_string<uint16_t> res(name);
+		for(auto &c : res)
+			c = exfatUpcase(priv, c);
+		return res;
+	}
+	static uint16_t nameHash(std::basic_string<uint16_t> const &upcased) {
+		uint16_t hash = 0;
+		for(auto c : upcased) {
+			hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xff);
+			hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+		}
+		return hash;
+	}
+	/* reads the next entry set describing a file. the name hash is
+	   returned for quick comparisons, first is set to the file entry
+	   of the set.
+	 */
+	//first d_off is -1, -2 and -3 are reserved, rest is free for use.
+	bool _readdir(off_t &d_off, std::basic_string<uint16_t> &name,
+		      ExFatEntryInfo &info, uint16_t &hash, off_t &first) {
+		fat_priv::ExFatDirEntry ent;
+		while(1) {
+			d_off++;
+			if (pread(&ent, sizeof(ent), d_off * sizeof(ent)) !=
+			    sizeof(ent))
+				return false;
+			if (ent.type == 0x00)
+				return false;
+			if (ent.type != 0x85 || ent.file.secondary_count < 2)
+				continue;
+			first = d_off;
+			unsigned count = ent.file.secondary_count;
+			info.attributes = ent.file.attributes;
+			//the stream extension follows right away
+			if (pread(&ent, sizeof(ent), (d_off + 1) * sizeof(ent)) !=
+			    sizeof(ent))
+				return false;
+			if (ent.type != 0xc0)
+				continue;
+			d_off++;
+			unsigned name_length = ent.stream.name_length;
+			hash = ent.stream.name_hash;
+			info.cluster = ent.stream.first_cluster;
+			info.contiguous = (ent.stream.flags & 0x02) != 0;
+			//data past the valid length reads as zeros, it is
+			//left out. sizes above 4GB are cut.
+			uint64_t len = (info.attributes & 0x10) ?
+				ent.stream.data_length :
+				ent.stream.valid_data_length;
+			info.size = len > 0xffffffffULL ? 0xffffffff : len;
+			name.clear();
+			for(unsigned i = 1; i < count; i++) {
+				if (pread(&ent, sizeof(ent),
+					  (d_off + 1) * sizeof(ent)) !=
+				    sizeof(ent))
+					return false;
+				if (ent.type != 0xc1)
+					break;
+				d_off++;
+				for(unsigned j = 0; j < 15 &&
+					    name.size() < name_length; j++)
+					name += ent.name.name[j];
+			}
+			if (name.empty() || name.size() != name_length)
+				continue;
+			return true;
+		}
+	}
+	void buildIndex() {
+		off_t d_off = -1;
+		std::basic_string<uint16_t> name;
+		ExFatEntryInfo info;
+		uint16_t hash;
+		index.begin();
+		fat_cache_info.dir_scans++;
+		off_t first;
+		while(_readdir(d_off, name, info, hash, first)) {
+			if (!index.add(hash, first))
+				return;
+		}
+		index.end();
+	}
+	bool findEntry(std::string const &name, ExFatEntryInfo &info) {
+		loadUpcase(priv);
+		std::basic_string<uint16_t> key =
+			upcaseName(lang::Utf8ToUtf16(name));
+		/* the hashes were made with the up-case table. without it,
+		 * only names of ascii characters hash the same here, the
+		 * others have to be compared one by one.
+		 */
+		bool hashed = true;
+		if (priv->upcase.empty()) {
+			for(auto c : key) {
+				if (c >= 0x80)
+					hashed = false;
+			}
+		}
+		if (hashed && !index.valid && !index.too_large)
+			buildIndex();
+		//the hash rules out most names without comparing them.
+		uint16_t key_hash = nameHash(key);
+		std::basic_string<uint16_t> n;
+		uint16_t hash;
+		off_t first;
+		if (hashed && index.valid) {
+			auto r = index.find(key_hash);
+			for(auto it = r.first; it != r.second; it++) {
+				off_t d_off = it->first - 1;
+				if (_readdir(d_off, n, info, hash, first) &&
+				    upcaseName(n) == key)
+					return true;
+			}
+			return false;
+		}
+		//too large for the index or not hashed, search it.
+		off_t d_off = -1;
+		fat_cache_info.dir_scans++;
+		while(_readdir(d_off, n, info, hash, first)) {
+			if ((!hashed || hash == key_hash) &&
+			    upcaseName(n) == key)
+				return true;
+		}
+		return false;
+	}
+	virtual int lookup(RefPtr<vfs::Dentry> dent) {
+		fat_cache_info.dir_lookups++;
+		ExFatEntryInfo info;
+		if (!findEntry(dent->name, info))
+			return 0;
+		mode_t m = S_IRUSR | S_IRGRP | S_IROTH;
+		if (info.attributes & 0x02)
+			//hidden
+			m &= ~(S_IRWXO);
+		if (info.attributes & 0x04)
+			//system
+			m &= ~(S_IRWXG | S_IRWXO);
+		FatInode *ino;
+		if (info.attributes & 0x10)
+			ino = new ExFatDirInode(priv, info.cluster, info.size,
+						m | S_IFDIR |
+						S_IXUSR | S_IXGRP | S_IXOTH);
+		else
+			ino = new FatInode(priv, info.cluster, info.size,
+					   m | S_IFREG);
+		if (info.contiguous)
+			ino->setContiguous(((uint64_t)info.size +
+					    priv->bytes_per_cluster - 1) /
+					   priv->bytes_per_cluster);
+		dent->inode = ino;
+		return 0;
+	}
+	//first d_off is -1, -2 and -3 are reserved, rest is free for use.
+	virtual bool readdir(off_t &d_off, std::string &name) {
+		std::basic_string<uint16_t> n;
+		ExFatEntryInfo info;
+		uint16_t hash;
+		off_t first;
+		if (!_readdir(d_off, n, info, hash, first))
+			return false;
+		name = lang::Utf16ToUtf8(n);
+		return true;
+	}
+	virtual int create(RefPtr<vfs::Dentry> /*dent*/, mode_t /*mode*/) {
+		errno = EROFS;
+		return -1;
+	}
+	virtual int unlink(RefPtr<vfs::Dentry> /*dent*/) {
+		errno = EROFS;
+		return -1;
 	}
 };
 
+/* the table is stored compressed, a 0xffff is followed by the number of
+ * characters mapping to themselves. only the others are kept, tables with
+ * more than EXFAT_UPCASE_MAX of them are not used. must not be used in
+ * interrupt context.
+ */
+void ExFatDirInode::loadUpcase(fat_priv::Partition *priv) {
+	if (priv->upcase_loaded)
+		return;
+	priv->upcase_loaded = true;
+	RefPtr<FatInode> root = new FatInode(priv, priv->root_cluster, ~0U,
+					     S_IFDIR);
+	fat_priv::ExFatDirEntry ent;
+	for(uint32_t i = 0; ; i++) {
+		if (root->pread(&ent, sizeof(ent), i * sizeof(ent)) !=
+		    sizeof(ent) || ent.type == 0x00)
+			return;
+		if (ent.type == 0x82)
+			break;
+	}
+	if (ent.upcase.data_length > 0x20000)
+		return;
+	uint32_t length = ent.upcase.data_length & ~1U;
+	RefPtr<FatInode> file = new FatInode(priv, ent.upcase.first_cluster,
+					     length, S_IFREG);
+	//a block at a time, an uncompressed table alone is 128k.
+	uint16_t table[256];
+	std::vector<std::pair<uint16_t, uint16_t> > upcase;
+	uint32_t c = 0;
+	bool skip = false;
+	for(uint32_t off = 0; off < length && c < 0x10000;
+	    off += sizeof(table)) {
+		uint32_t l = length - off;
+		if (l > sizeof(table))
+			l = sizeof(table);
+		if (file->pread(table, l, off) != (_ssize_t)l)
+			return;
+		for(size_t i = 0; i < l / 2 && c < 0x10000; i++) {
+			if (skip) {
+				//count of characters mapping to themselves
+				skip = false;
+				c += table[i];
+				continue;
+			}
+			if (table[i] == 0xffff) {
+				skip = true;
+				continue;
+			}
+			if (table[i] != c) {
+				if (upcase.size() >= EXFAT_UPCASE_MAX)
+					//plain ascii rules then
+					return;
+				if (upcase.size() == upcase.capacity())
+					upcase.reserve(upcase.size() + 128);
+				upcase.push_back(std::make_pair((uint16_t)c,
+								table[i]));
+			}
+			c++;
+		}
+	}
+	upcase.shrink_to_fit();
+	priv->upcase.swap(upcase);
+}
+
 class FatDriver : public FilesystemDriver {
 public:
   virtual void probe_partition(uint32_t type, uint32_t first_block,
@@ -413,12 +2001,12 @@ public:
   virtual void remove_msd(MSD *msd);
 };
 
-static void FAT_probe_cmpl(int res, fat_priv::Partition *p);
+static void FAT_probe_cmpl(fat_priv::CachedBlock *b, fat_priv::Partition *p);
 
 void FatDriver::probe_partition(uint32_t type, uint32_t first_block,
 				uint32_t num_blocks, MSD *msd) {
-	if (type != 0x01 && type != 0x03 && type != 0x06 && type != 0x0b &&
-	    type != 0x0c && type != 0x0e)
+	if (type != 0x01 && type != 0x03 && type != 0x04 && type != 0x06 &&
+	    type != 0x0b && type != 0x0c && type != 0x0e)
 		return;
 	//otherwise, create and register the filesystem support structure
 	//and read the first sector of the partition
@@ -427,17 +2015,13 @@ void FatDriver::probe_partition(uint32_t type, uint32_t first_block,
 	p->first_block = first_block;
 	p->num_blocks = num_blocks;
 	p->msd = msd;
-	p->block.resize(512);
+	p->cache_clock = 0;
 	fat_priv::partitions.push_back(p);
-	p->read_command.start_block = first_block;
-	p->read_command.num_blocks = 1;
-	p->read_command.dst = p->block.data();
-	p->read_command.slot = sigc::bind(sigc::ptr_fun(&FAT_probe_cmpl),p);
-	p->msd->readBlocks(&p->read_command);
+	blockGet(p, 0, sigc::bind(sigc::ptr_fun(&FAT_probe_cmpl),p));
 }
 
-static void FAT_probe_cmpl(int res, fat_priv::Partition *p) {
-	if (res != 0) {
+static void FAT_probe_cmpl(fat_priv::CachedBlock *b, fat_priv::Partition *p) {
+	if (!b) {
 		for(auto it = fat_priv::partitions.begin();
 		    it != fat_priv::partitions.end();it++) {
 			if (*it == p) {
@@ -449,35 +2033,22 @@ static void FAT_probe_cmpl(int res, fat_priv::Partition *p) {
 		return;
 	}
 
-	p->blockno = 0;
-	fat_priv::FAT16_BootSector *fat16bs = (fat_priv::FAT16_BootSector*)p->block.data();
-	fat_priv::FAT32_BootSector *fat32bs = (fat_priv::FAT32_BootSector*)p->block.data();
-	if (memcmp(fat16bs->fatvariant,"FAT16",5) == 0 && 0) {
-		p->fattype = fat_priv::Partition::Fat12;
-	} else if (memcmp(fat16bs->fatvariant,"FAT16",5) == 0 && 0) {
-		p->fattype = fat_priv::Partition::Fat16;
-	} else if (memcmp(fat32bs->fatvariant,"FAT32",5) == 0) {
-		p->fattype = fat_priv::Partition::Fat32;
-		p->fat_start_block = fat32bs->reserved_sectors*
-			fat32bs->byte_per_sector/512;
-		p->fat_block_count = fat32bs->sectors_per_fat*
-			fat32bs->byte_per_sector/512;
-		p->blocks_per_cluster = fat32bs->sectors_per_cluster*
-			fat32bs->byte_per_sector/512;
-		p->fat_count = fat32bs->fat_copies;
-		p->fs_num_blocks = (uint64_t)fat32bs->num_sectors*
-			fat32bs->byte_per_sector/512;
-		p->cluster_0_block = p->fat_start_block +
-			p->fat_block_count * p->fat_count -
-			2 * p->blocks_per_cluster;
-		p->bytes_per_cluster = p->blocks_per_cluster*512;
-
-		p->rootInode = new FatDirInode(p, fat32bs->root_dir_cluster,
-					       ~0U,
-					       S_IFDIR |
-					       S_IRWXU | S_IRWXG | S_IRWXO);
-		vfs::RegisterFilesystem("fat",p->rootInode);
-	} else {
+	fat_priv::FAT16_BootSector *fat16bs = (fat_priv::FAT16_BootSector*)b->data;
+	fat_priv::FAT32_BootSector *fat32bs = (fat_priv::FAT32_BootSector*)b->data;
+	uint32_t bps = fat16bs->byte_per_sector;
+	uint32_t spc = fat16bs->sectors_per_cluster;
+	uint32_t sectors_per_fat = fat16bs->sectors_per_fat ?
+		fat16bs->sectors_per_fat : fat32bs->sectors_per_fat;
+	uint32_t num_sectors = fat16bs->num_sectors_short ?
+		fat16bs->num_sectors_short : fat16bs->num_sectors;
+	uint32_t root_sectors = (fat16bs->root_dir_entry_count * 32 + bps - 1) /
+		bps;
+	uint32_t meta_sectors = fat16bs->reserved_sectors +
+		fat16bs->fat_copies * sectors_per_fat + root_sectors;
+	if (fat16bs->signature != 0xaa55 || bps < 512 || (bps % 512) != 0 ||
+	    spc == 0 || (spc & (spc - 1)) != 0 || fat16bs->fat_copies == 0 ||
+	    sectors_per_fat == 0 || num_sectors <= meta_sectors) {
+		blockPut(p, b);
 		for(auto it = fat_priv::partitions.begin();
 		    it != fat_priv::partitions.end();it++) {
 			if (*it == p) {
@@ -488,6 +2059,53 @@ static void FAT_probe_cmpl(int res, fat_priv::Partition *p) {
 		}
 		return;
 	}
+	//the variant follows from the number of clusters, the name in the
+	//boot sector does not matter.
+	uint32_t clusters = (num_sectors - meta_sectors) / spc;
+	uint32_t entry_bits;
+	if (clusters < 4085) {
+		p->fattype = fat_priv::Partition::Fat12;
+		entry_bits = 12;
+	} else if (clusters < 65525) {
+		p->fattype = fat_priv::Partition::Fat16;
+		entry_bits = 16;
+	} else {
+		p->fattype = fat_priv::Partition::Fat32;
+		entry_bits = 32;
+	}
+	p->fat_start_block = fat16bs->reserved_sectors*bps/512;
+	p->fat_block_count = sectors_per_fat*bps/512;
+	p->blocks_per_cluster = spc*bps/512;
+	p->fat_count = fat16bs->fat_copies;
+	p->fs_num_blocks = (uint64_t)num_sectors*bps/512;
+	//fat12/16 keep the root directory between the fats and the clusters
+	p->root_dir_block = p->fat_start_block +
+		p->fat_block_count * p->fat_count;
+	p->root_dir_blocks = root_sectors*bps/512;
+	p->cluster_0_block = p->root_dir_block + p->root_dir_blocks -
+		2 * p->blocks_per_cluster;
+	p->bytes_per_cluster = p->blocks_per_cluster*512;
+	p->cluster_count = clusters + 2;
+	if (p->cluster_count > (uint64_t)p->fat_block_count * 512 * 8 / entry_bits)
+		p->cluster_count = (uint64_t)p->fat_block_count * 512 * 8 / entry_bits;
+	p->fsinfo_block = 0;
+	if (p->fattype == fat_priv::Partition::Fat32 &&
+	    fat32bs->fs_information_sector != 0xffff)
+		p->fsinfo_block = fat32bs->fs_information_sector*bps/512;
+	p->fsinfo_loaded = false;
+	p->fsinfo_dirty = false;
+	p->meta_busy = false;
+
+	if (p->fattype == fat_priv::Partition::Fat32)
+		p->rootInode = new FatDirInode(p, fat32bs->root_dir_cluster,
+					       ~0U,
+					       S_IFDIR |
+					       S_IRWXU | S_IRWXG | S_IRWXO);
+	else
+		p->rootInode = new Fat16RootDirInode
+			(p, fat16bs->root_dir_entry_count);
+	blockPut(p, b);
+	vfs::RegisterFilesystem("fat",p->rootInode);
 }
 
 void FatDriver::remove_msd(MSD *msd) {
@@ -505,8 +2123,459 @@ void FatDriver::remove_msd(MSD *msd) {
 
 static FatDriver fatdriver;
 
+class ExFatDriver : public FilesystemDriver {
+public:
+  virtual void probe_partition(uint32_t type, uint32_t first_block,
+			  uint32_t num_blocks, MSD *msd);
+  virtual void remove_msd(MSD *msd);
+};
+
+static void EXFAT_probe_cmpl(fat_priv::CachedBlock *b, fat_priv::Partition *p);
+
+void ExFatDriver::probe_partition(uint32_t type, uint32_t first_block,
+				  uint32_t num_blocks, MSD *msd) {
+	//shared with ntfs, the boot sector tells them apart
+	if (type != 0x07)
+		return;
+	fat_priv::Partition *p = new fat_priv::Partition();
+
+	p->first_block = first_block;
+	p->num_blocks = num_blocks;
+	p->msd = msd;
+	p->cache_clock = 0;
+	fat_priv::partitions.push_back(p);
+	blockGet(p, 0, sigc::bind(sigc::ptr_fun(&EXFAT_probe_cmpl),p));
+}
+
+static void EXFAT_probe_cmpl(fat_priv::CachedBlock *b, fat_priv::Partition *p) {
+	fat_priv::ExFAT_BootSector *bs = NULL;
+	if (b)
+		bs = (fat_priv::ExFAT_BootSector*)b->data;
+	if (!b || memcmp(bs->name, "EXFAT   ", 8) != 0 ||
+	    bs->signature != 0xaa55 ||
+	    bs->bytes_per_sector_shift < 9 || bs->bytes_per_sector_shift > 12 ||
+	    bs->bytes_per_sector_shift + bs->sectors_per_cluster_shift > 25 ||
+	    bs->fat_copies == 0 || bs->cluster_count == 0) {
+		if (b)
+			blockPut(p, b);
+		for(auto it = fat_priv::partitions.begin();
+		    it != fat_priv::partitions.end();it++) {
+			if (*it == p) {
+				fat_priv::partitions.erase(it);
+				delete p;
+				break;
+			}
+		}
+		return;
+	}
+	//sectors are 512 to 4096 bytes
+	uint32_t spb = 1 << (bs->bytes_per_sector_shift - 9);
+	p->fattype = fat_priv::Partition::ExFat;
+	p->fat_start_block = bs->fat_offset * spb;
+	p->fat_block_count = bs->fat_length * spb;
+	p->fat_count = bs->fat_copies;
+	if ((bs->flags & 1) && bs->fat_copies > 1)
+		p->fat_start_block += p->fat_block_count;
+	p->blocks_per_cluster = spb << bs->sectors_per_cluster_shift;
+	p->bytes_per_cluster = p->blocks_per_cluster*512;
+	p->fs_num_blocks = bs->volume_length * spb;
+	p->root_dir_block = 0;
+	p->root_dir_blocks = 0;
+	p->cluster_0_block = bs->cluster_heap_offset * spb -
+		2 * p->blocks_per_cluster;
+	p->cluster_count = bs->cluster_count + 2;
+	p->fsinfo_block = 0;
+	p->fsinfo_loaded = false;
+	p->fsinfo_dirty = false;
+	p->meta_busy = false;
+	p->root_cluster = bs->root_dir_cluster;
+	p->upcase_loaded = false;
+
+	p->rootInode = new ExFatDirInode(p, bs->root_dir_cluster, ~0U,
+					 S_IFDIR |
+					 S_IRUSR | S_IRGRP | S_IROTH |
+					 S_IXUSR | S_IXGRP | S_IXOTH);
+	blockPut(p, b);
+	vfs::RegisterFilesystem("exfat",p->rootInode);
+}
+
+void ExFatDriver::remove_msd(MSD */*msd*/) {
+	//the partitions are shared with the fat driver, it removes them.
+}
+
+static ExFatDriver exfatdriver;
+
 void FAT_Setup() {
   FSDriver_Register(&fatdriver);
+  FSDriver_Register(&exfatdriver);
+}
+
+/* returns the cluster holding cluster index of the file, ~0U past the
+   end of the chain and 0 if the chain has not been walked that far yet.
+   last is set to the last cluster walked so far, run to the number of
+   consecutive clusters known to start at the returned one.
+ */
+uint32_t FatInode::mapCluster(uint32_t index, uint32_t &last,
+			      uint32_t &run) {
+	ISR_Guard g;
+	last = 0;
+	run = 0;
+	if (extents.empty())
+		return ~0U;
+	FatExtent const &back = extents.back();
+	last = back.cluster + back.count - 1;
+	if (index >= back.index + back.count)
+		return extents_complete ? ~0U : 0;
+	//last extent with e.index <= index
+	unsigned lo = 0;
+	unsigned hi = extents.size();
+	while(hi - lo > 1) {
+		unsigned mid = (lo + hi) / 2;
+		if (extents[mid].index <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	run = extents[lo].count - (index - extents[lo].index);
+	return extents[lo].cluster + index - extents[lo].index;
+}
+
+/* adds the cluster following last, unless someone else did already.
+ */
+void FatInode::appendCluster(uint32_t last, uint32_t cluster) {
+	ISR_Guard g;
+	if (extents_complete || extents.empty())
+		return;
+	FatExtent &back = extents.back();
+	if (back.cluster + back.count - 1 != last)
+		return;
+	if (cluster < 2 || cluster >= 0xffffff7) {
+		extents_complete = true;
+		return;
+	}
+	if (cluster == back.cluster + back.count) {
+		back.count++;
+		return;
+	}
+	FatExtent e = { back.index + back.count, cluster, 1 };
+	extents.push_back(e);
+}
+
+/* walks the chain as far as needed. must not be used in interrupt
+   context.
+ */
+uint32_t FatInode::clusterAt(uint32_t index, uint32_t &run) {
+	while(1) {
+		uint32_t last;
+		uint32_t cluster = mapCluster(index, last, run);
+		if (cluster != 0)
+			return cluster;
+		uint32_t next = findNextCluster(priv, last);
+		if (next == ~0U)
+			return ~0U;
+		appendCluster(last, next);
+	}
+}
+
+/* the run starting at cluster index of the file, grown by walking the
+   chain on as long as the next clusters follow each other and their fat
+   blocks are cached, until it covers want clusters. the fat block of the
+   last step usually has the following entries as well, so reads and
+   writes of consecutive clusters do not stop at each one.
+ */
+uint32_t FatInode::growRun(uint32_t index, uint32_t run, uint32_t want) {
+	while(run < want) {
+		uint32_t last;
+		uint32_t cluster = mapCluster(index, last, run);
+		uint32_t next;
+		if (extents_complete || cluster == 0 || cluster >= 0xffffff7 ||
+		    cluster + run - 1 != last ||
+		    !findNextCluster_cached(priv, last, next))
+			break;
+		appendCluster(last, next);
+		if (next != last + 1)
+			break;
+	}
+	return run;
+}
+
+/* clusters touched by len bytes at offset coff of a cluster
+ */
+static uint32_t clusterSpan(fat_priv::Partition *priv, uint32_t coff,
+			    size_t len) {
+	uint64_t span = ((uint64_t)coff + len + priv->bytes_per_cluster - 1) /
+		priv->bytes_per_cluster;
+	return span > 0xffffffffULL ? 0xffffffffU : span;
+}
+
+/* adds a newly allocated cluster to the end of the chain, which must
+   have been walked completely.
+ */
+void FatInode::addCluster(uint32_t cluster) {
+	ISR_Guard g;
+	extents_complete = true;
+	if (extents.empty()) {
+		FatExtent e = { 0, cluster, 1 };
+		extents.push_back(e);
+		return;
+	}
+	FatExtent &back = extents.back();
+	if (cluster == back.cluster + back.count) {
+		back.count++;
+		return;
+	}
+	FatExtent e = { back.index + back.count, cluster, 1 };
+	extents.push_back(e);
+}
+
+/* the file occupies count consecutive clusters, the fat is not used.
+ */
+void FatInode::setContiguous(uint32_t count) {
+	ISR_Guard g;
+	extents.clear();
+	if (count > 0 && first_cluster >= 2) {
+		FatExtent e = { 0, first_cluster, count };
+		extents.push_back(e);
+	}
+	extents_complete = true;
+}
+
+/* forgets about all but the first count clusters, the chain ends there.
+ */
+void FatInode::trimExtents(uint32_t count) {
+	ISR_Guard g;
+	while(!extents.empty() && extents.back().index >= count)
+		extents.pop_back();
+	if (!extents.empty() &&
+	    extents.back().index + extents.back().count > count)
+		extents.back().count = count - extents.back().index;
+	extents_complete = true;
+}
+
+/* walks the whole chain, returns ~0U on read errors. must not be used
+   in interrupt context.
+ */
+uint32_t FatInode::clusterCount() {
+	uint32_t run;
+	clusterAt(0xfffffff, run);
+	ISR_Guard g;
+	if (!extents_complete)
+		return ~0U;
+	if (extents.empty())
+		return 0;
+	return extents.back().index + extents.back().count;
+}
+
+/* makes the chain at least count clusters long. must not be used in
+   interrupt context.
+ */
+int FatInode::allocClusters(uint32_t count) {
+	uint32_t have = clusterCount();
+	if (have == ~0U) {
+		errno = EIO;
+		return -1;
+	}
+	uint32_t last = 0;
+	if (have > 0) {
+		ISR_Guard g;
+		last = extents.back().cluster + extents.back().count - 1;
+	}
+	for(; have < count; have++) {
+		uint32_t cluster = allocCluster(priv, last);
+		if (!cluster)
+			return -1;
+		if (!last)
+			first_cluster = cluster;
+		addCluster(cluster);
+		last = cluster;
+	}
+	return 0;
+}
+
+/* shortens the chain to keep clusters. must not be used in interrupt
+   context.
+ */
+int FatInode::freeClusters(uint32_t keep) {
+	uint32_t next;
+	if (keep == 0) {
+		next = first_cluster;
+		first_cluster = 0;
+	} else {
+		uint32_t run;
+		uint32_t cluster = clusterAt(keep - 1, run);
+		if (cluster >= 0xffffff7)
+			//shorter already
+			return extents_complete ? 0 : -1;
+		next = findNextCluster(priv, cluster);
+		if (next == ~0U)
+			return -1;
+		if (next < 2 || next >= 0xffffff7)
+			return 0;
+		if (fatSet(priv, cluster, 0x0fffffff) != 0)
+			return -1;
+	}
+	trimExtents(keep);
+	return freeChain(priv, next);
+}
+
+void FatInode::setSize(uint32_t newsize) {
+	ISR_Guard g;
+	size = newsize;
+	vfs::Inode::size = newsize;
+}
+
+/* grows the file to newsize bytes, the new part is not initialized.
+   must not be used in interrupt context.
+ */
+int FatInode::extend(uint32_t newsize) {
+	if (unlinked) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (newsize <= size)
+		return 0;
+	uint32_t old_count = ((uint64_t)size + priv->bytes_per_cluster - 1) /
+		priv->bytes_per_cluster;
+	uint32_t count = ((uint64_t)newsize + priv->bytes_per_cluster - 1) /
+		priv->bytes_per_cluster;
+	if (allocClusters(count) != 0) {
+		//give back what could be allocated
+		int errno_code = errno;
+		freeClusters(old_count);
+		updateDirent();
+		blockFlush(priv);
+		errno = errno_code;
+		return -1;
+	}
+	setSize(newsize);
+	int res = updateDirent();
+	if (blockFlush(priv) != 0)
+		res = -1;
+	return res;
+}
+
+/* writes zeros to [from, to), through the normal write path.
+ */
+int FatInode::zeroRange(uint32_t from, uint32_t to) {
+	while(from < to) {
+		size_t l = to - from;
+		if (l > sizeof(zero_block))
+			l = sizeof(zero_block);
+		if (pwrite(zero_block, l, from) != (_ssize_t)l)
+			return -1;
+		from += l;
+	}
+	return 0;
+}
+
+/* reads or writes entry index of this directory, writes go to the block
+   cache only. must not be used in interrupt context.
+ */
+int FatInode::direntIO(uint32_t index, fat_priv::DirEntry *ent,
+		       bool write) {
+	uint32_t off = index * sizeof(*ent);
+	uint32_t run;
+	uint32_t cluster = clusterAt(off / priv->bytes_per_cluster, run);
+	if (cluster >= 0xffffff7) {
+		errno = EIO;
+		return -1;
+	}
+	uint32_t coff = off % priv->bytes_per_cluster;
+	fat_priv::CachedBlock *b = blockGetSync
+		(priv, priv->cluster_0_block +
+		 cluster * priv->blocks_per_cluster + coff/512);
+	if (!b) {
+		errno = EIO;
+		return -1;
+	}
+	if (write) {
+		ISR_Guard g;
+		memcpy(b->data + coff % 512, ent, sizeof(*ent));
+		b->dirty = true;
+	} else {
+		memcpy(ent, b->data + coff % 512, sizeof(*ent));
+	}
+	blockPut(priv, b);
+	return 0;
+}
+
+/* puts the first cluster and size into the directory entry.
+ */
+int FatInode::updateDirent() {
+	if (!parent || unlinked)
+		return 0;
+	fat_priv::DirEntry ent;
+	if (parent->direntIO(dirent, &ent, false) != 0)
+		return -1;
+	ent.regular.low_cluster = first_cluster & 0xffff;
+	ent.regular.high_cluster = first_cluster >> 16;
+	if (!S_ISDIR(mode)) {
+		ent.regular.size = size;
+		ent.regular.attributes |= 0x20;//archive
+	}
+	if (parent->direntIO(dirent, &ent, true) != 0)
+		return -1;
+	return 0;
+}
+
+int FatInode::truncate(off_t length) {
+	if (priv->fattype == fat_priv::Partition::ExFat) {
+		errno = EROFS;
+		return -1;
+	}
+	if (S_ISDIR(mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (length < 0 || (uint64_t)length > 0xffffffffULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	//see FatDirInode::create
+	if (priv->meta_busy) {
+		errno = EBUSY;
+		return -1;
+	}
+	priv->meta_busy = true;
+	uint32_t old_size = size;
+	int res;
+	if ((uint32_t)length < size) {
+		//readers must not see the clusters once they are free
+		setSize(length);
+		res = freeClusters(((uint64_t)length +
+				    priv->bytes_per_cluster - 1) /
+				   priv->bytes_per_cluster);
+		if (updateDirent() != 0)
+			res = -1;
+		if (blockFlush(priv) != 0)
+			res = -1;
+	} else {
+		res = extend(length);
+	}
+	priv->meta_busy = false;
+	if (res == 0 && (uint32_t)length > old_size)
+		res = zeroRange(old_size, length);
+	return res;
+}
+
+/* number of whole blocks that can be read straight into ptr or written
+   straight from it, 0 if a single block has to be buffered. coff is the offset in the cluster, run the
+   number of consecutive clusters starting with the current one.
+ */
+uint32_t FatInode::directBlocks(void const *ptr, size_t len, uint32_t coff,
+				uint32_t run) {
+	//the sdio dma transfers words
+	if ((coff % 512) != 0 || len < 512 ||
+	    (reinterpret_cast<uintptr_t>(ptr) & 3) != 0)
+		return 0;
+	uint32_t blocks = run * priv->blocks_per_cluster - coff / 512;
+	if (blocks > len / 512)
+		blocks = len / 512;
+	return blocks;
+}
+
+static void readBlocksSync_cmpl(int res, volatile int *cmdres) {
+	*cmdres = res != 0 ? -1 : 0;
 }
 
 _ssize_t FatInode::pread(void *ptr, size_t len, off_t offset) {
@@ -516,30 +2585,46 @@ _ssize_t FatInode::pread(void *ptr, size_t len, off_t offset) {
 		len = size - offset;
 	_ssize_t res = 0;
 	char *cptr = (char*)ptr;
-	if ((unsigned)offset < current_offset) {
-		//need to restart from 0.
-		current_offset = 0;
-		current_cluster = first_cluster;
-	}
 	while(len > 0) {
-		//scan fat to find the given cluster
-		while ((unsigned)offset >= current_offset +
-		       priv->bytes_per_cluster &&
-		       current_cluster < 0xffffff7) {
-			current_offset += priv->bytes_per_cluster;
-			current_cluster = findNextCluster(priv, current_cluster);
-		}
-		if (current_cluster >= 0xffffff7)
+		uint32_t run;
+		uint32_t cluster = clusterAt(offset / priv->bytes_per_cluster,
+					     run);
+		if (cluster >= 0xffffff7)
+			break;
+		uint32_t coff = offset % priv->bytes_per_cluster;
+		run = growRun(offset / priv->bytes_per_cluster, run,
+			      clusterSpan(priv, coff, len));
+		uint32_t blocks = directBlocks(cptr, len, coff, run);
+		if (blocks > 0) {
+			MSDReadCommand cmd;
+			volatile int cmdres = 1;
+			cmd.start_block = priv->first_block + priv->cluster_0_block +
+				cluster * priv->blocks_per_cluster + coff/512;
+			cmd.num_blocks = blocks;
+			cmd.dst = cptr;
+			cmd.slot = sigc::bind(sigc::ptr_fun(&readBlocksSync_cmpl),
+					      &cmdres);
+			priv->msd->readBlocks(&cmd);
+			while(cmdres == 1)
+				sched_yield();
+			if (cmdres != 0)
+				break;
+			len -= blocks * 512;
+			offset += blocks * 512;
+			res += blocks * 512;
+			cptr += blocks * 512;
+			continue;
+		}
+		fat_priv::CachedBlock *b = blockGetSync
+			(priv,priv->cluster_0_block +
+			 cluster * priv->blocks_per_cluster + coff/512);
+		if (!b)
 			break;
-		fetchBlock(priv,priv->cluster_0_block +
-			   current_cluster * priv->blocks_per_cluster +
-			   (offset - current_offset)/512);
-		size_t l2 = 512 - (offset - current_offset) % 512;
+		size_t l2 = 512 - coff % 512;
 		if(l2 > len)
 			l2 = len;
-		memcpy(cptr, priv->block.data() +
-		       (offset - current_offset) % 512,
-		       l2);
+		memcpy(cptr, b->data + coff % 512, l2);
+		blockPut(priv, b);
 		len -= l2;
 		offset += l2;
 		res += l2;
@@ -548,112 +2633,119 @@ _ssize_t FatInode::pread(void *ptr, size_t len, off_t offset) {
 
 	return res;
 }
-_ssize_t FatInode::pwrite(const void */*ptr*/, size_t /*len*/, off_t /*offset*/) {
-	errno = EINVAL;
-	return -1;
+_ssize_t FatInode::pwrite(const void *ptr, size_t len, off_t offset) {
+	//no synchronous path for writing, just wait for the aio one.
+	return vfs::Inode::pwrite(ptr, len, offset);
 }
 
 /* pre-condition: p is allocated using new.
    post-condition: p is deallocated, command->slot has been called.
 */
-void FatInode::aio_pread_cmpl2(int res, AioFatInodeRead *p) {
+void FatInode::aio_pread_finish(int res, int errno_code,
+				AioFatInodeRead *p) {
 	aio::PReadCommand * command = p->command;
+	delete p;
+	command->slot(res, errno_code);
+}
+
+void FatInode::aio_pread_cmpl2(fat_priv::CachedBlock *b,
+			       AioFatInodeRead *p) {
+	if (!b) {
+		aio_pread_finish(-1, EIO, p);
+		return;
+	}
+	aio_pread_copy(b, p);
+	aio_pread_helper(p);
+}
+
+/* blocks have been read straight into the caller's buffer.
+ */
+void FatInode::aio_pread_cmpl3(int res, AioFatInodeRead *p) {
 	if (res != 0) {
-		{
-			ISR_Guard g;
-			current_cluster = p->current_cluster;
-			current_offset = p->current_offset;
-		}
-		delete p;
-		command->slot(-1,EIO);
+		aio_pread_finish(-1, EIO, p);
 		return;
 	}
-	p->findnextcluster_command.blockno =
-		p->findnextcluster_command.read_command.start_block -
-		priv->first_block;
-	size_t l2 = 512 - (p->offset - p->current_offset) % 512;
+	size_t l = p->read_command.num_blocks * 512;
+	p->len -= l;
+	p->offset += l;
+	p->res += l;
+	p->ptr += l;
+	aio_pread_helper(p);
+}
+
+void FatInode::aio_pread_copy(fat_priv::CachedBlock *b, AioFatInodeRead *p) {
+	size_t boff = (p->offset % priv->bytes_per_cluster) % 512;
+	size_t l2 = 512 - boff;
 	if(l2 > p->len)
 		l2 = p->len;
-	memcpy(p->ptr, p->findnextcluster_command.buf +
-	       (p->offset - p->current_offset) % 512,
-	       l2);
+	memcpy(p->ptr, b->data + boff, l2);
+	blockPut(priv, b);
 	p->len -= l2;
 	p->offset += l2;
 	p->res += l2;
 	p->ptr += l2;
-	aio_pread_helper(p);
 }
 
 /* pre-condition: p is allocated using new.
    post-condition: p is deallocated, command->slot has been called.
 */
 void FatInode::aio_pread_helper(AioFatInodeRead *p) {
-	aio::PReadCommand * command = p->command;
-	if (p->current_cluster == ~0U) {
-		p->current_offset = 0;
-		p->current_cluster = first_cluster;
-		{
-			ISR_Guard g;
-			current_cluster = p->current_cluster;
-			current_offset = p->current_offset;
-		}
-		delete p;
-		command->slot(-1,EIO);
-		return;
-	}
-
 	while(p->len > 0) {
-		//scan fat to find the given cluster
-		if ((unsigned)p->offset >= p->current_offset +
-		    priv->bytes_per_cluster &&
-		    p->current_cluster < 0xffffff7) {
-			p->current_offset += priv->bytes_per_cluster;
+		//find the cluster, walking the chain if needed
+		uint32_t last;
+		uint32_t run;
+		uint32_t cluster = mapCluster(p->offset / priv->bytes_per_cluster,
+					      last, run);
+		if (cluster == 0) {
+			uint32_t next;
+			if (findNextCluster_cached(priv, last, next)) {
+				appendCluster(last, next);
+				continue;
+			}
 			p->findnextcluster_command.priv = priv;
-			p->findnextcluster_command.cluster = p->current_cluster;
-			p->findnextcluster_command.slot = sigc::hide(sigc::bind(sigc::mem_fun(this, &FatInode::aio_pread_cmpl1), p));
+			p->findnextcluster_command.cluster = last;
+			p->findnextcluster_command.slot = sigc::hide(sigc::bind(sigc::mem_fun(this, &FatInode::aio_pread_cmpl1), last, p));
 			findNextCluster_nb(&p->findnextcluster_command);
 			return;
 		}
-		if (p->current_cluster >= 0xffffff7)
+		if (cluster >= 0xffffff7)
 			break;
 
-		//found the cluster, now lets read it.
+		//found the cluster, now lets read it. whole blocks go
+		//straight to the caller, as many consecutive ones as known.
+		uint32_t coff = p->offset % priv->bytes_per_cluster;
 		uint32_t blockno = priv->cluster_0_block +
-			p->current_cluster * priv->blocks_per_cluster +
-			(p->offset - p->current_offset)/512;
-		if (blockno != p->findnextcluster_command.blockno) {
-			p->findnextcluster_command.read_command.num_blocks = 1;
-			p->findnextcluster_command.read_command.dst =
-				p->findnextcluster_command.buf;
-			p->findnextcluster_command.read_command.slot = sigc::bind(sigc::mem_fun(this, &FatInode::aio_pread_cmpl2), p);
-			fetchBlock_nb(priv, blockno, &p->findnextcluster_command.read_command);
+			cluster * priv->blocks_per_cluster + coff/512;
+		run = growRun(p->offset / priv->bytes_per_cluster, run,
+			      clusterSpan(priv, coff, p->len));
+		uint32_t blocks = directBlocks(p->ptr, p->len, coff, run);
+		if (blocks > 0) {
+			p->read_command.start_block = priv->first_block + blockno;
+			p->read_command.num_blocks = blocks;
+			p->read_command.dst = p->ptr;
+			p->read_command.slot = sigc::bind(sigc::mem_fun(this, &FatInode::aio_pread_cmpl3), p);
+			priv->msd->readBlocks(&p->read_command);
 			return;
 		}
-		size_t l2 = 512 - (p->offset - p->current_offset) % 512;
-		if(l2 > p->len)
-			l2 = p->len;
-		memcpy(p->ptr, p->findnextcluster_command.buf +
-		       (p->offset - p->current_offset) % 512,
-		       l2);
-		p->len -= l2;
-		p->offset += l2;
-		p->res += l2;
-		p->ptr += l2;
+		fat_priv::CachedBlock *b = blockTryGet(priv, blockno);
+		if (!b) {
+			blockGet(priv, blockno,
+				 sigc::bind(sigc::mem_fun(this, &FatInode::aio_pread_cmpl2), p));
+			return;
+		}
+		aio_pread_copy(b, p);
 	}
 	//done.
-	int res = p->res;
-	{
-		ISR_Guard g;
-		current_cluster = p->current_cluster;
-		current_offset = p->current_offset;
-	}
-	delete p;
-	command->slot(res,0);
-	return;
+	aio_pread_finish(p->res, 0, p);
 }
 
-void FatInode::aio_pread_cmpl1(uint32_t cluster,AioFatInodeRead *p) {
-	p->current_cluster = cluster;
+void FatInode::aio_pread_cmpl1(uint32_t cluster, uint32_t last,
+			       AioFatInodeRead *p) {
+	if (cluster == ~0U) {
+		aio_pread_finish(-1, EIO, p);
+		return;
+	}
+	appendCluster(last, cluster);
 	aio_pread_helper(p);
 }
 
@@ -679,23 +2771,220 @@ _ssize_t FatInode::pread(aio::PReadCommand * command) {
 	p->res = 0;
 	p->inode = this;
 	p->command = command;
-	{
-		ISR_Guard g;
-		p->current_cluster = current_cluster;
-		p->current_offset = current_offset;
+	aio_pread_helper(p);
+	return 0;
+}
+
+/* pre-condition: p is allocated using new.
+   post-condition: p is deallocated, command->slot has been called.
+*/
+void FatInode::aio_pwrite_finish(int res, int errno_code,
+				 AioFatInodeWrite *p) {
+	aio::PWriteCommand * command = p->command;
+	delete p;
+	command->slot(res, errno_code);
+}
+
+/* block has been written.
+ */
+void FatInode::aio_pwrite_cmpl3(int res, AioFatInodeWrite *p) {
+	if (res != 0) {
+		aio_pwrite_finish(-1, EIO, p);
+		return;
+	}
+	//keep the block cache coherent
+	blockUpdate(priv, p->blockno, p->buf);
+	size_t l2 = 512 - (p->offset % priv->bytes_per_cluster) % 512;
+	if(l2 > p->len)
+		l2 = p->len;
+	p->len -= l2;
+	p->offset += l2;
+	p->res += l2;
+	p->ptr += l2;
+	aio_pwrite_helper(p);
+}
+
+/* blocks have been written straight from the caller's buffer.
+ */
+void FatInode::aio_pwrite_cmpl4(int res, AioFatInodeWrite *p) {
+	if (res != 0) {
+		aio_pwrite_finish(-1, EIO, p);
+		return;
 	}
-	//now, prepare to find the cluster. we cannot use the usual
-	//infrastructure for that, it is not safe to use in interrupt.
-	if ((unsigned)p->offset < p->current_offset) {
-		//need to restart from 0.
-		p->current_offset = 0;
-		p->current_cluster = first_cluster;
+	uint32_t blockno = p->write_command.start_block - priv->first_block;
+	for(uint32_t i = 0; i < p->write_command.num_blocks; i++)
+		blockUpdate(priv, blockno + i, p->ptr + i * 512);
+	size_t l = p->write_command.num_blocks * 512;
+	p->len -= l;
+	p->offset += l;
+	p->res += l;
+	p->ptr += l;
+	aio_pwrite_helper(p);
+}
+
+/* block to be partially overwritten has been read.
+ */
+void FatInode::aio_pwrite_cmpl2(fat_priv::CachedBlock *b,
+				AioFatInodeWrite *p) {
+	if (!b) {
+		aio_pwrite_finish(-1, EIO, p);
+		return;
 	}
-	aio_pread_helper(p);
+	memcpy(p->buf, b->data, 512);
+	p->blockno = b->blockno;
+	blockPut(priv, b);
+	aio_pwrite_helper(p);
+}
+
+void FatInode::aio_pwrite_cmpl1(uint32_t cluster, uint32_t last,
+				AioFatInodeWrite *p) {
+	if (cluster == ~0U) {
+		aio_pwrite_finish(-1, EIO, p);
+		return;
+	}
+	appendCluster(last, cluster);
+	aio_pwrite_helper(p);
+}
+
+/* pre-condition: p is allocated using new.
+   post-condition: p is deallocated, command->slot has been called.
+*/
+void FatInode::aio_pwrite_helper(AioFatInodeWrite *p) {
+	while (p->len > 0) {
+		//find the cluster, walking the chain if needed
+		uint32_t last;
+		uint32_t run;
+		uint32_t cluster = mapCluster(p->offset / priv->bytes_per_cluster,
+					      last, run);
+		if (cluster == 0) {
+			uint32_t next;
+			if (findNextCluster_cached(priv, last, next)) {
+				appendCluster(last, next);
+				continue;
+			}
+			p->findnextcluster_command.priv = priv;
+			p->findnextcluster_command.cluster = last;
+			p->findnextcluster_command.slot = sigc::hide(sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_cmpl1), last, p));
+			findNextCluster_nb(&p->findnextcluster_command);
+			return;
+		}
+		if (cluster >= 0xffffff7)
+			break;
+
+		//found the cluster. whole blocks go straight from the
+		//caller, as many consecutive ones as known. partial blocks
+		//need the old contents first.
+		uint32_t coff = p->offset % priv->bytes_per_cluster;
+		uint32_t blockno = priv->cluster_0_block +
+			cluster * priv->blocks_per_cluster + coff/512;
+		run = growRun(p->offset / priv->bytes_per_cluster, run,
+			      clusterSpan(priv, coff, p->len));
+		uint32_t blocks = directBlocks(p->ptr, p->len, coff, run);
+		if (blocks > 0) {
+			p->write_command.start_block = priv->first_block + blockno;
+			p->write_command.num_blocks = blocks;
+			p->write_command.src = p->ptr;
+			p->write_command.slot = sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_cmpl4), p);
+			priv->msd->writeBlocks(&p->write_command);
+			return;
+		}
+		size_t boff = coff % 512;
+		size_t l2 = 512 - boff;
+		if(l2 > p->len)
+			l2 = p->len;
+		if (l2 != 512 && blockno != p->blockno) {
+			blockGet(priv, blockno,
+				 sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_cmpl2), p));
+			return;
+		}
+		memcpy(p->buf + boff, p->ptr, l2);
+		p->blockno = blockno;
+		p->write_command.start_block = priv->first_block + blockno;
+		p->write_command.num_blocks = 1;
+		p->write_command.src = p->buf;
+		p->write_command.slot = sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_cmpl3), p);
+		priv->msd->writeBlocks(&p->write_command);
+		return;
+	}
+	//done.
+	aio_pwrite_finish(p->res, 0, p);
+}
+
+/* grows the file first, that needs synchronous accesses to the fat, so
+   this runs as deferred work.
+ */
+void FatInode::aio_pwrite_extend(RefPtr<FatInode> self,
+				 aio::PWriteCommand * command) {
+	if (priv->meta_busy) {
+		//someone further up the stack changes the fat, try again
+		//once they are done.
+		addDeferredWork(sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_extend), self, command));
+		return;
+	}
+	uint64_t end = (uint64_t)command->offset + command->len;
+	if (end > 0xffffffffULL) {
+		command->slot(-1, EFBIG);
+		return;
+	}
+	uint32_t old_size = size;
+	if (end > size) {
+		priv->meta_busy = true;
+		int res = extend(end);
+		priv->meta_busy = false;
+		if (res != 0) {
+			command->slot(-1, errno);
+			return;
+		}
+		//the gap up to the write reads as zeros
+		if ((uint32_t)command->offset > old_size &&
+		    zeroRange(old_size, command->offset) != 0) {
+			command->slot(-1, errno);
+			return;
+		}
+	}
+	aio_pwrite_start(command);
+}
+
+/* pre-condition: none.
+   post-condition: command->slot has been called, or will be.
+*/
+_ssize_t FatInode::pwrite(aio::PWriteCommand * command) {
+	if (priv->fattype == fat_priv::Partition::ExFat) {
+		errno = EROFS;
+		return -1;
+	}
+	if (command->len == 0) {
+		command->slot(0,0);
+		return 0;
+	}
+	if ((uint64_t)command->offset + command->len > size) {
+		addDeferredWork(sigc::bind(sigc::mem_fun(this, &FatInode::aio_pwrite_extend), RefPtr<FatInode>(this), command));
+		return 0;
+	}
+	aio_pwrite_start(command);
 	return 0;
 }
 
-_ssize_t FatInode::pwrite(aio::PWriteCommand * /*command*/) {
-	errno = EINVAL;
-	return -1;
+/* writes into the existing clusters of the file.
+ */
+/* pre-condition: none.
+   post-condition: command->slot has been called.
+*/
+void FatInode::aio_pwrite_start(aio::PWriteCommand * command) {
+	if ((unsigned)command->offset >= size) {
+		command->slot(0,0);
+		return;
+	}
+	size_t len = command->len;
+	if (len + command->offset > size)
+		len = size - command->offset;
+	AioFatInodeWrite *p = new AioFatInodeWrite();
+	p->ptr = (char const *)command->ptr;
+	p->len = len;
+	p->offset = command->offset;
+	p->res = 0;
+	p->inode = this;
+	p->command = command;
+	p->blockno = ~0U;
+	aio_pwrite_helper(p);
 }
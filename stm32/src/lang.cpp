@@ -32,6 +32,36 @@ std::string lang::Utf16ToUtf8(std::basic_string<uint16_t> const &str) {
 	return out;
 }
 
+std::basic_string<uint16_t> lang::Utf8ToUtf16(std::string const &str) {
+	std::basic_string<uint16_t> out;
+	for(auto it = str.begin(); it != str.end(); it++) {
+		uint32_t codepoint = (uint8_t)*it;
+		unsigned follow = 0;
+		if (codepoint >= 0xf0) {
+			codepoint &= 0x07;
+			follow = 3;
+		} else if (codepoint >= 0xe0) {
+			codepoint &= 0x0f;
+			follow = 2;
+		} else if (codepoint >= 0xc0) {
+			codepoint &= 0x1f;
+			follow = 1;
+		}
+		for(; follow > 0 && it+1 != str.end(); follow--) {
+			it++;
+			codepoint = (codepoint << 6) | (*it & 0x3f);
+		}
+		if (codepoint >= 0x10000) {
+			codepoint -= 0x10000;
+			out += (uint16_t)(0xd800 | ((codepoint >> 10) & 0x3ff));
+			out += (uint16_t)(0xdc00 | (codepoint & 0x3ff));
+		} else {
+			out += (uint16_t)codepoint;
+		}
+	}
+	return out;
+}
+
 std::string lang::elide(std::string const &str, size_t len, enum ElideMode mode) {
 	if(str.size() < len)
 		return str;
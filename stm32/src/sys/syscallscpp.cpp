@@ -16,17 +16,57 @@
 #include <bits.h>
 #include <deferredwork.hpp>
 
+//size of the pages used for reading ahead
+#define VFS_PAGE_SIZE 2048
+//pages shared by all open files, allocated while files that have been
+//read sequentially are open
+#define VFS_CACHE_PAGES 8
+//pages read ahead of a file at most. larger reads are left alone, they
+//are efficient already.
+#define VFS_READAHEAD_MAX 4
+
 namespace vfs {
 	struct File : public Refcounted<File>  {
 		RefPtr<Dentry> dentry;
 		int openflags;
 		size_t offset;
+		/* sequential read detection. a read starting where the last
+		 * one ended doubles the readahead window, any other read
+		 * turns it off.
+		 */
+		size_t ra_next;
+		unsigned ra_window;//in pages
+		//reference on the pages, taken on the first sequential read
+		enum { PagesNone, PagesPending, PagesHeld, PagesClosed } ra_pages;
 		File(RefPtr<Dentry> dentry, int openflags)
 		: dentry(dentry)
 		, openflags(openflags)
 		, offset(0)
+		, ra_next(0)
+		, ra_window(0)
+		, ra_pages(PagesNone)
 		{}
 	};
+
+	/* file data read ahead of sequential readers
+	 */
+	struct Page {
+		RefPtr<Inode> inode;//NULL if unused
+		off_t offset;
+		size_t len;//less than VFS_PAGE_SIZE at the end of the file
+		bool busy;//being read
+		bool valid;
+		//written to while being read, dropped once the read is done
+		bool stale;
+		uint32_t last_use;
+		aio::PReadCommand cmd;
+		uint32_t data[VFS_PAGE_SIZE/4];//words for the dma
+	};
+
+	static std::vector<Page *> pages;
+	static uint32_t page_clock;
+	//files holding a reference on the pages, they exist while nonzero
+	static unsigned page_users;
 	/* logical structuring of file access primitives:
 	 *  FileDescriptors can point to the same data, but don't have to
 	 *  FileDescriptors can share offsets, but don't have to
@@ -160,6 +200,264 @@ namespace vfs {
 
 using namespace vfs;
 
+/* pre-condition: interrupts disabled
+ */
+static Page *pageFind(Inode *ino, off_t offset) {
+	for(auto p : pages) {
+		if (p->inode == ino && p->offset == offset && !p->stale)
+			return p;
+	}
+	return NULL;
+}
+
+/* allocates the pages, done once a file gets read sequentially so
+ * readahead never needs to allocate memory. must not be used in
+ * interrupt context.
+ */
+static void pagesReserve() {
+	{
+		ISR_Guard g;
+		page_users++;
+		if (pages.size() >= VFS_CACHE_PAGES)
+			return;
+	}
+	std::vector<Page *> n;
+	while(n.size() + pages.size() < VFS_CACHE_PAGES) {
+		Page *p = new Page();
+		p->busy = false;
+		p->valid = false;
+		p->stale = false;
+		p->last_use = 0;
+		n.push_back(p);
+	}
+	ISR_Guard g;
+	pages.insert(pages.end(), n.begin(), n.end());
+}
+
+/* frees the pages once the last file holding them is closed, waiting for
+ * reads still in flight. must not be used in interrupt context.
+ */
+static void pagesRelease() {
+	std::vector<Page *> n;
+	while(1) {
+		{
+			ISR_Guard g;
+			if (page_users == 0 || --page_users != 0)
+				return;
+			bool busy = false;
+			for(auto p : pages)
+				busy = busy || p->busy;
+			if (!busy) {
+				n.swap(pages);
+				break;
+			}
+			//check again after the reads are done
+			page_users++;
+		}
+		sched_yield();
+	}
+	for(auto p : n)
+		delete p;
+}
+
+static void pageRead_cmpl(int res, int /*errno_code*/, Page *p) {
+	ISR_Guard g;
+	p->busy = false;
+	p->valid = res > 0 && !p->stale;
+	p->len = res > 0 ? res : 0;
+	p->stale = false;
+	if (!p->valid)
+		p->inode = NULL;
+}
+
+/* starts reading the page at offset, unless it is cached already.
+ * returns false if there is no idle page left.
+ */
+static bool pageReadahead(RefPtr<Inode> const &inode, Inode *ino,
+			  off_t offset) {
+	Page *p = NULL;
+	{
+		ISR_Guard g;
+		if (pageFind(ino, offset))
+			return true;
+		//least recently used idle page
+		for(auto c : pages) {
+			if (c->busy)
+				continue;
+			if (!c->inode) {
+				p = c;
+				break;
+			}
+			if (!p || c->last_use < p->last_use)
+				p = c;
+		}
+		if (!p)
+			return false;
+		p->inode = inode;
+		p->offset = offset;
+		p->busy = true;
+		p->valid = false;
+		p->stale = false;
+		p->last_use = ++page_clock;
+	}
+	p->cmd.ptr = p->data;
+	p->cmd.len = VFS_PAGE_SIZE;
+	p->cmd.offset = offset;
+	p->cmd.slot = sigc::bind(sigc::ptr_fun(&pageRead_cmpl), p);
+	if (inode->pread(&p->cmd) != 0) {
+		ISR_Guard g;
+		p->busy = false;
+		p->inode = NULL;
+	}
+	return true;
+}
+
+/* copies what the pages hold of [offset, offset+len). pages still being
+ * read are waited for if wait is set, which must not be done in
+ * interrupt context. eof is set if the end of the file has been reached.
+ */
+static size_t pageCopy(Inode *ino, char *ptr, size_t len, off_t offset,
+		       bool wait, bool &eof) {
+	size_t done = 0;
+	eof = false;
+	while(done < len) {
+		off_t poff = (offset + done) / VFS_PAGE_SIZE * VFS_PAGE_SIZE;
+		while(1) {
+			{
+				ISR_Guard g;
+				Page *p = pageFind(ino, poff);
+				if (!p)
+					return done;
+				if (!p->busy) {
+					if (!p->valid)
+						return done;
+					size_t boff = offset + done - poff;
+					if (boff >= p->len) {
+						eof = p->len < VFS_PAGE_SIZE;
+						return done;
+					}
+					size_t l = p->len - boff;
+					if (l > len - done)
+						l = len - done;
+					memcpy(ptr + done, (char *)p->data + boff, l);
+					p->last_use = ++page_clock;
+					done += l;
+					if (p->len < VFS_PAGE_SIZE) {
+						eof = done < len;
+						return done;
+					}
+					break;
+				}
+			}
+			if (!wait)
+				return done;
+			sched_yield();
+		}
+	}
+	return done;
+}
+
+/* drops the pages of ino overlapping [offset, offset+len).
+ */
+static void pageInvalidate(Inode *ino, off_t offset, size_t len) {
+	ISR_Guard g;
+	for(auto p : pages) {
+		if (!(p->inode == ino) ||
+		    p->offset + VFS_PAGE_SIZE <= offset ||
+		    (p->offset > offset &&
+		     (size_t)(p->offset - offset) >= len))
+			continue;
+		if (p->busy) {
+			p->stale = true;
+		} else {
+			p->valid = false;
+			p->inode = NULL;
+		}
+	}
+}
+
+/* updates the sequential read detection of fp after a read of
+ * [offset, offset+len). returns the pages to read ahead of it.
+ * pre-condition: interrupts disabled
+ */
+static unsigned fileSequential(RefPtr<File> const &fp, off_t offset,
+			       size_t len) {
+	if (!S_ISREG(fp->dentry->inode->mode))
+		return 0;
+	if ((size_t)offset == fp->ra_next &&
+	    len < VFS_READAHEAD_MAX * VFS_PAGE_SIZE) {
+		unsigned need = (len + VFS_PAGE_SIZE - 1) / VFS_PAGE_SIZE;
+		fp->ra_window = fp->ra_window ? fp->ra_window * 2 : 1;
+		if (fp->ra_window < need)
+			fp->ra_window = need;
+		if (fp->ra_window > VFS_READAHEAD_MAX)
+			fp->ra_window = VFS_READAHEAD_MAX;
+	} else {
+		fp->ra_window = 0;
+	}
+	fp->ra_next = offset + len;
+	return fp->ra_window;
+}
+
+/* takes the reference of fp on the pages, allocating them if needed.
+ * must not be used in interrupt context.
+ */
+static void fileReservePages(RefPtr<File> fp) {
+	{
+		ISR_Guard g;
+		if (fp->ra_pages != File::PagesPending)
+			return;
+	}
+	pagesReserve();
+	bool closed;
+	{
+		ISR_Guard g;
+		closed = fp->ra_pages != File::PagesPending;
+		if (!closed)
+			fp->ra_pages = File::PagesHeld;
+	}
+	if (closed)
+		pagesRelease();
+}
+
+/* reads count pages ahead of where the last read of fp ended. the first
+ * time, the pages are allocated first: right away if alloc is set,
+ * which must not be done in interrupt context, otherwise in deferred
+ * work, and the next sequential read starts reading ahead.
+ */
+static void fileReadahead(RefPtr<File> const &fp, unsigned count,
+			  bool alloc) {
+	if (!count)
+		return;
+	bool reserve = false;
+	off_t start;
+	{
+		ISR_Guard g;
+		if (fp->ra_pages == File::PagesNone) {
+			fp->ra_pages = File::PagesPending;
+			reserve = true;
+		}
+		start = fp->ra_next / VFS_PAGE_SIZE * VFS_PAGE_SIZE;
+	}
+	if (reserve) {
+		if (!alloc) {
+			addDeferredWork(sigc::bind(
+				sigc::ptr_fun(&fileReservePages), fp));
+			return;
+		}
+		fileReservePages(fp);
+	}
+	if (fp->ra_pages != File::PagesHeld)
+		return;
+	RefPtr<Inode> inode = fp->dentry->inode;
+	Inode *ino = inode.operator->();
+	for(unsigned i = 0; i < count; i++) {
+		off_t o = start + i * VFS_PAGE_SIZE;
+		if (o >= ino->size || !pageReadahead(inode, ino, o))
+			break;
+	}
+}
+
 extern "C" {
 	_ssize_t _read_r(struct _reent *r, int file, void *ptr, size_t len);
 	_ssize_t _write_r (struct _reent *r, int file, const void *ptr, size_t len);
@@ -167,6 +465,8 @@ extern "C" {
 	int _close_r(struct _reent *r, int file);
 	_off_t _lseek_r(struct _reent *r, int file, _off_t ptr, int dir);
 	int _fstat_r(struct _reent *r, int file, struct stat *st);
+	int _unlink_r(struct _reent *r, const char *file);
+	int ftruncate(int file, off_t length);
 	int mkdir(const char *path, mode_t mode);
 	int access(const char *path, int mode);
 }
@@ -215,9 +515,31 @@ _ssize_t _read_r(struct _reent */*r*/, int file, void *ptr, size_t len) {
 		}
 		fp = fds[file];
 	}
-	_ssize_t res = fp->dentry->inode->pread(ptr, len, fp->offset);
-	if (res != -1)
-		fp->offset += (unsigned)res;
+	//whatever has been read ahead first, then the rest directly.
+	Inode *ino = fp->dentry->inode.operator->();
+	size_t cached = 0;
+	bool eof = false;
+	if (S_ISREG(ino->mode))
+		cached = pageCopy(ino, (char *)ptr, len, fp->offset, true, eof);
+	_ssize_t res = cached;
+	if (cached < len && !eof) {
+		_ssize_t r = fp->dentry->inode->pread((char *)ptr + cached,
+						     len - cached,
+						     fp->offset + cached);
+		if (r != -1)
+			res += r;
+		else if (cached == 0)
+			res = -1;
+	}
+	if (res != -1) {
+		unsigned ra;
+		{
+			ISR_Guard isrguard;
+			ra = fileSequential(fp, fp->offset, res);
+			fp->offset += (unsigned)res;
+		}
+		fileReadahead(fp, ra, true);
+	}
 	return res;
 }
 
@@ -238,6 +560,7 @@ _ssize_t _write_r (struct _reent */*r*/, int file, const void *ptr, size_t len)
 		}
 		fp = fds[file];
 	}
+	pageInvalidate(fp->dentry->inode.operator->(), fp->offset, len);
 	_ssize_t res = fp->dentry->inode->pwrite(ptr, len, fp->offset);
 	if (res != -1)
 		fp->offset += (unsigned)res;
@@ -318,26 +641,15 @@ int _open_r(struct _reent */*r*/, const char *file, int flags, int mode ) {
 			errno = ENOENT;
 			return -1;
 		}
-		{
-			ISR_Guard g;
-			dc = dp->lookup(basename);
-			if (!dc) {
-				//no entry in DentryCache? means this name has
-				//never been encountered before. create a new
-				//one. it may be discarded if there already
-				//exists a file of that name, or the fs code
-				//could populate the dentry cache using the
-				//parent pointer.
-				dc = new Dentry(basename, dp);
-				dp->insertChild(dc);
-			} else {
-				if (dc->inode) {
-					errno = EEXIST;
-					return -1;
-				}
+		//the lookup tells whether the file exists already, the
+		//result stays in the dentry cache either way.
+		dc = findDentry(file);
+		if (dc->inode) {
+			if (flags & O_EXCL) {
+				errno = EEXIST;
+				return -1;
 			}
-		}
-		if (dp->inode->create(dc, mode) != 0)
+		} else if (dp->inode->create(dc, mode) != 0)
 			return -1;
 	} else {
 		dc = findDentry(file);
@@ -346,6 +658,12 @@ int _open_r(struct _reent */*r*/, const char *file, int flags, int mode ) {
 			return -1;
 		}
 	}
+	if ((flags & O_TRUNC) && S_ISREG(dc->inode->mode) &&
+	    (flags & O_ACCMODE) != O_RDONLY) {
+		pageInvalidate(dc->inode.operator->(), 0, ~(size_t)0);
+		if (dc->inode->truncate(0) != 0)
+			return -1;
+	}
 
 	unsigned fd = -1;
 	{
@@ -362,18 +680,25 @@ int _open_r(struct _reent */*r*/, const char *file, int flags, int mode ) {
 }
 
 int _close_r(struct _reent */*r*/, int file) {
-	ISR_Guard isrguard;
-	if (file == -1 || (unsigned)file >= fds.size()) {
-		errno = EBADF;
-		return -1;
-	}
-	if (!fds[file] ||
-	    ((fds[file]->openflags & O_ACCMODE) != O_WRONLY &&
-	     (fds[file]->openflags & O_ACCMODE) != O_RDWR)) {
-		errno = EBADF;
-		return -1;
+	RefPtr<File> fp;
+	bool held;
+	{
+		ISR_Guard isrguard;
+		if (file == -1 || (unsigned)file >= fds.size()) {
+			errno = EBADF;
+			return -1;
+		}
+		if (!fds[file]) {
+			errno = EBADF;
+			return -1;
+		}
+		fp = fds[file];
+		fds[file] = NULL;
+		held = fp->ra_pages == File::PagesHeld;
+		fp->ra_pages = File::PagesClosed;
 	}
-	fds[file] = NULL;
+	if (held)
+		pagesRelease();
         return 0;
 }
 
@@ -428,20 +753,101 @@ int _fstat_r(struct _reent */*r*/, int file, struct stat *st) {
 	return fds[file]->dentry->inode->fstat(st);
 }
 
-int aio::pread(int file, struct aio::PReadCommand *command) {
-	ISR_Guard isrguard;
-	if (file == -1 || (unsigned)file >= fds.size()) {
-		errno = EBADF;
+int _unlink_r(struct _reent */*r*/, const char *file) {
+	const char *basename;
+	RefPtr<Dentry> dp = findParentDentry(file, basename);
+	if (!dp->inode) {
+		errno = ENOENT;
 		return -1;
 	}
-	if (!fds[file] ||
-	    ((fds[file]->openflags & O_ACCMODE) != O_RDONLY &&
-	     (fds[file]->openflags & O_ACCMODE) != O_RDWR)) {
-		errno = EBADF;
+	RefPtr<Dentry> dc = findDentry(file);
+	if (!dc->inode) {
+		errno = ENOENT;
+		return -1;
+	}
+	if (S_ISDIR(dc->inode->mode)) {
+		errno = EISDIR;
+		return -1;
+	}
+	pageInvalidate(dc->inode.operator->(), 0, ~(size_t)0);
+	if (dp->inode->unlink(dc) != 0)
 		return -1;
+	//open files keep the old dentry and its inode, new lookups find
+	//a negative entry.
+	{
+		ISR_Guard isrguard;
+		dp->children.erase(dc->name);
+		dp->insertChild(new Dentry(dc->name, dp));
 	}
+	return 0;
+}
 
-	return fds[file]->dentry->inode->pread(command);
+int ftruncate(int file, off_t length) {
+	RefPtr<File> fp;
+	{
+		ISR_Guard isrguard;
+
+		if (file == -1 || (unsigned)file >= fds.size()) {
+			errno = EBADF;
+			return -1;
+		}
+		if (!fds[file] ||
+		    ((fds[file]->openflags & O_ACCMODE) != O_WRONLY &&
+		     (fds[file]->openflags & O_ACCMODE) != O_RDWR)) {
+			errno = EBADF;
+			return -1;
+		}
+		fp = fds[file];
+	}
+	pageInvalidate(fp->dentry->inode.operator->(), 0, ~(size_t)0);
+	return fp->dentry->inode->truncate(length);
+}
+
+int aio::pread(int file, struct aio::PReadCommand *command) {
+	RefPtr<File> fp;
+	unsigned ra = 0;
+	size_t cached = 0;
+	bool served = false;
+	int res = 0;
+	{
+		ISR_Guard isrguard;
+		if (file == -1 || (unsigned)file >= fds.size()) {
+			errno = EBADF;
+			return -1;
+		}
+		if (!fds[file] ||
+		    ((fds[file]->openflags & O_ACCMODE) != O_RDONLY &&
+		     (fds[file]->openflags & O_ACCMODE) != O_RDWR)) {
+			errno = EBADF;
+			return -1;
+		}
+
+		//served from the pages if they have all of it
+		fp = fds[file];
+		Inode *ino = fp->dentry->inode.operator->();
+		if (S_ISREG(ino->mode)) {
+			bool eof;
+			cached = pageCopy(ino, (char *)command->ptr,
+					  command->len, command->offset,
+					  false, eof);
+			served = cached == command->len || eof;
+		}
+		if (served) {
+			ra = fileSequential(fp, command->offset, cached);
+		} else {
+			res = ino->pread(command);
+			if (res == 0)
+				ra = fileSequential(fp, command->offset,
+						    command->len);
+		}
+	}
+	//may be in interrupt context, the pages get allocated later
+	fileReadahead(fp, ra, false);
+	if (served) {
+		ISR_Guard isrguard;
+		command->slot(cached, 0);
+	}
+	return res;
 }
 
 int aio::pwrite(int file, struct aio::PWriteCommand *command) {
@@ -457,6 +863,8 @@ int aio::pwrite(int file, struct aio::PWriteCommand *command) {
 		return -1;
 	}
 
+	pageInvalidate(fds[file]->dentry->inode.operator->(), command->offset,
+		       command->len);
 	return fds[file]->dentry->inode->pwrite(command);
 }
 
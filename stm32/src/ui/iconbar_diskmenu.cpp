@@ -2,9 +2,12 @@
 #include "iconbar_diskmenu.hpp"
 
 #include <fdc/fdc.h>
+#include <fdc/dsk.hpp>
 #include <ui/iconbar.h>
+#include <ui/notify.hpp>
 #include <deferredwork.hpp>
 #include "fileselect.hpp"
+#include <sstream>
 
 static std::string iconbar_recent_disks[4];
 static std::string iconbar_current_disks[4];
@@ -26,31 +29,72 @@ static void IconBar_DeferredEjectDisk(unsigned drive) {
   IconBar_addRecent(iconbar_current_disks[drive]);
 }
 
-static void IconBar_DeferredOpenDisk(unsigned drive, std::string file) {
-  FDC_EjectDisk(drive);
-  FDC_InsertDisk(drive,file.c_str());
+//next to the image, the one place known to be on a card.
+static void IconBar_DeferredSaveTrace(unsigned drive) {
+  std::string file = iconbar_current_disks[drive] + ".trace";
+  if (FDC_SaveTrace(file.c_str()) != 0)
+    ui::Notification_Add("Saving FDC Trace failed");
+  else
+    ui::Notification_Add("FDC Trace saved");
+}
+
+static void IconBar_DiskInserted(int result, unsigned drive, std::string file) {
+  if (result != 0) {
+    ui::Notification_Add("Inserting Disk failed");
+    IconBar_disk_unassigned(drive);
+    return;
+  }
   IconBar_disk_assigned(drive, file.c_str());
   iconbar_current_disks[drive] = file;
 }
 
-static void IconBar_DeferredCreateDisk(unsigned drive, std::string file) {
+static void IconBar_DeferredOpenDisk(unsigned drive, std::string file) {
   FDC_EjectDisk(drive);
-  //todo
-  //FDC_InsertDisk(drive,file.c_str());
-  IconBar_disk_assigned(drive, file.c_str());
-  iconbar_current_disks[drive] = file;
+  FDC_InsertDiskAsync(drive,file.c_str(),
+                      sigc::bind(sigc::ptr_fun(IconBar_DiskInserted),drive,file));
+}
+
+static void IconBar_DiskCreateProgress(unsigned done, unsigned total) {
+  //one notification per quarter is plenty.
+  if (done * 4 / total != (done - 1) * 4 / total && done != total) {
+    std::stringstream ss;
+    ss << "Creating Disk " << done * 100 / total << "%";
+    ui::Notification_Add(ss.str());
+  }
+}
+
+static void IconBar_DiskCreated(int result, unsigned drive, std::string file) {
+  if (result != 0) {
+    ui::Notification_Add("Creating Disk failed");
+    IconBar_disk_unassigned(drive);
+    return;
+  }
+  FDC_InsertDiskAsync(drive,file.c_str(),
+                      sigc::bind(sigc::ptr_fun(IconBar_DiskInserted),drive,file));
+}
+
+static void IconBar_DeferredCreateDisk(unsigned drive, std::string file,
+                                       dsk::BlankFormat format) {
+  FDC_EjectDisk(drive);
+  dsk::createImage(file.c_str(), format,
+                   sigc::ptr_fun(IconBar_DiskCreateProgress),
+                   sigc::bind(sigc::ptr_fun(IconBar_DiskCreated),drive,file));
 }
 
 IconBar_DiskMenu::IconBar_DiskMenu(ui::Control *iconbar_control,
 	  ui::FileSelect *iconbar_fileselect)
   : iconbar_control(iconbar_control)
   , iconbar_fileselect(iconbar_fileselect)
+  , choosing_format(false)
+  , create_format(dsk::BlankData)
 {
 }
 
 unsigned int IconBar_DiskMenu::getItemCount() {
+  if(choosing_format)
+    return dsk::BlankFormatCount;
   if(disk_assigned)
-    return 1;
+    return 2;
   unsigned int num = 0;
   for(unsigned int i = 0; i < 4; i++) {
     if(!iconbar_recent_disks[i].empty())
@@ -60,8 +104,10 @@ unsigned int IconBar_DiskMenu::getItemCount() {
 }
 
 std::string IconBar_DiskMenu::getItemText(unsigned int index) {
+  if(choosing_format)
+    return dsk::blankFormatName((dsk::BlankFormat)index);
   if(disk_assigned)
-    return "Eject Disk";
+    return index == 0 ? "Eject Disk" : "Save FDC Trace";
   else
     switch(index) {
     case 0: return "Insert Disk...";
@@ -79,9 +125,26 @@ void IconBar_DiskMenu::selectItem(int index) {
     setVisible(false);
     UI_setTopLevelControl(iconbar_control);
   }
+  if (choosing_format) {
+    setVisible(false);
+    choosing_format = false;
+    if (index < 0 || index >= dsk::BlankFormatCount) {
+      UI_setTopLevelControl(iconbar_control);
+      return;
+    }
+    create_format = (dsk::BlankFormat)index;
+    iconbar_fileselect->setVisible(true);
+    iconbar_fileselect->setActionText("Create");
+    fileSelectedCon = iconbar_fileselect->onFileSelected().connect(sigc::mem_fun(this, &IconBar_DiskMenu::fileSelectedCreate));
+    fileSelectCanceledCon = iconbar_fileselect->onCancel().connect(sigc::mem_fun(this, &IconBar_DiskMenu::fileSelectCanceled));
+    UI_setTopLevelControl(iconbar_fileselect);
+    return;
+  }
   if (disk_assigned) {
     if (index == 0) {
       addDeferredWork(sigc::bind(sigc::ptr_fun(IconBar_DeferredEjectDisk),diskno));
+    } else if (index == 1) {
+      addDeferredWork(sigc::bind(sigc::ptr_fun(IconBar_DeferredSaveTrace),diskno));
     }
     UI_setTopLevelControl(iconbar_control);
     setVisible(false);
@@ -94,12 +157,10 @@ void IconBar_DiskMenu::selectItem(int index) {
       fileSelectCanceledCon = iconbar_fileselect->onCancel().connect(sigc::mem_fun(this, &IconBar_DiskMenu::fileSelectCanceled));
       UI_setTopLevelControl(iconbar_fileselect);
     } else if (index == 1) { // new disk. todo: need to add restrictions to file chooser: accept directories(using action), accept existing files, accept only existing files, accept only non-existing files
+      // choose the format first, the menu shows the formats now.
       setVisible(false);
-      iconbar_fileselect->setVisible(true);
-      iconbar_fileselect->setActionText("Create");
-      fileSelectedCon = iconbar_fileselect->onFileSelected().connect(sigc::mem_fun(this, &IconBar_DiskMenu::fileSelectedCreate));
-      fileSelectCanceledCon = iconbar_fileselect->onCancel().connect(sigc::mem_fun(this, &IconBar_DiskMenu::fileSelectCanceled));
-      UI_setTopLevelControl(iconbar_fileselect);
+      choosing_format = true;
+      setVisible(true);
     } else if (index > 2+4) {
       setVisible(false);
       UI_setTopLevelControl(iconbar_control);
@@ -125,7 +186,7 @@ void IconBar_DiskMenu::fileSelectedOpen(std::string file) {
 void IconBar_DiskMenu::fileSelectedCreate(std::string file) {
   iconbar_fileselect->setVisible(false);
   UI_setTopLevelControl(iconbar_control);
-  addDeferredWork(sigc::bind(sigc::bind(sigc::ptr_fun(IconBar_DeferredCreateDisk),file),diskno));
+  addDeferredWork(sigc::bind(sigc::ptr_fun(IconBar_DeferredCreateDisk),diskno,file,create_format));
   fileSelectedCon.disconnect();
   fileSelectCanceledCon.disconnect();
 }
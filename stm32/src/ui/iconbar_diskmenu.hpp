@@ -2,6 +2,7 @@
 #pragma once
 
 #include "menu.hpp"
+#include <fdc/dsk.hpp>
 
 namespace ui {
 class FileSelect;
@@ -13,10 +14,13 @@ public:
   ui::FileSelect *iconbar_fileselect;
   unsigned diskno;
   bool disk_assigned;
+  bool choosing_format;
+  dsk::BlankFormat create_format;
   /*
         > insert disk (if none inserted)
-        > new disk (if none inserted)
+        > new disk (if none inserted), then the format to use
         > eject disk (if inserted)
+        > save the fdc trace next to the image (if inserted)
 	> ----
         > last 4 inserted disks  (if none inserted)
    */
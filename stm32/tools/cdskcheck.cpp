@@ -0,0 +1,242 @@
+
+/* opens a disk image and its CDSK conversion with the firmware image code
+ * and checks that every track reads back the same, sector ids, status
+ * bytes and data included. also reports how much each image had to read,
+ * and the cpu time the decoder of the firmware takes per packed track on
+ * the host.
+ *
+ * usage: cdskcheck image.dsk image.cdsk
+ */
+
+#include "host/host.hpp"
+
+#include <fdc/dsk.hpp>
+#include <timer.hpp>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+//more than the 29 sectors a track can hold, so the search wraps around
+#define CHECK_FINDS_PER_TRACK 32
+//decodes per track, for a time above the clock resolution
+#define CHECK_DECODE_ROUNDS 100
+
+struct Found {
+	bool done;
+	RefPtr<dsk::DiskSector> sector;
+};
+
+static void findComplete(RefPtr<dsk::DiskSector> sector, Found *f) {
+	f->sector = sector;
+	f->done = true;
+}
+
+static RefPtr<dsk::DiskSector> findAny(RefPtr<dsk::Disk> disk,
+				       unsigned pcn, unsigned phn) {
+	Found f;
+	f.done = false;
+	dsk::DiskFindSectorCommand c;
+	c.pcn = pcn;
+	c.phn = phn;
+	c.C = c.H = c.R = c.N = 0;
+	c.mfm = true;
+	c.deleted = false;
+	c.find_any = true;
+	c.ignore_deleted = false;
+	c.slot = sigc::bind(sigc::ptr_fun(&findComplete), &f);
+	disk->findSector(&c);
+	while(!f.done)
+		Host_Step();
+	return f.sector;
+}
+
+//copy of a sector, so the cylinders do not stay referenced
+struct SectorCopy {
+	bool found;
+	unsigned C, H, R, N, ST1, ST2;
+	std::vector<uint8_t> data;
+	SectorCopy(RefPtr<dsk::DiskSector> const &s)
+		: found(s), C(0), H(0), R(0), N(0), ST1(0), ST2(0) {
+		if (!s)
+			return;
+		C = s->C;
+		H = s->H;
+		R = s->R;
+		N = s->N;
+		ST1 = s->ST1;
+		ST2 = s->ST2;
+		uint8_t const *d = static_cast<uint8_t const *>(s->data);
+		data.assign(d, d + s->size);
+	}
+	bool operator==(SectorCopy const &o) const {
+		return found == o.found && C == o.C && H == o.H &&
+			R == o.R && N == o.N && ST1 == o.ST1 &&
+			ST2 == o.ST2 && data == o.data;
+	}
+};
+
+struct Trace {
+	unsigned sectors;
+	uint64_t bytes_read;
+	unsigned image_reads;
+	uint64_t usec;
+};
+
+/* reads all tracks of disk. sectors of the reference image are kept in
+ * ref, the ones of the converted image get compared against it.
+ */
+static bool readAll(RefPtr<dsk::Disk> disk,
+		    std::vector<SectorCopy> &ref, bool compare,
+		    Trace &trace) {
+	uint64_t bytes_read = host_io_stats.read_bytes;
+	uint64_t start = Timer_timeSincePowerOn();
+	unsigned n = 0;
+	trace.sectors = 0;
+	for(unsigned pcn = 0; pcn < 85; pcn++) {
+		for(unsigned phn = 0; phn < 2; phn++) {
+			for(unsigned i = 0; i < CHECK_FINDS_PER_TRACK; i++) {
+				SectorCopy s(findAny(disk, pcn, phn));
+				if (s.found)
+					trace.sectors++;
+				if (!compare) {
+					ref.push_back(s);
+					continue;
+				}
+				SectorCopy const &r = ref[n++];
+				if (!(s == r)) {
+					fprintf(stderr, "track %u/%u: sector "
+						"%02x %02x %02x %02x differs\n",
+						pcn, phn, r.C, r.H, r.R, r.N);
+					return false;
+				}
+			}
+		}
+	}
+	Host_RunIdle();
+	trace.bytes_read = host_io_stats.read_bytes - bytes_read;
+	trace.image_reads = disk->image_reads;
+	trace.usec = Timer_timeSincePowerOn() - start;
+	return true;
+}
+
+struct DecodeCost {
+	unsigned tracks;
+	uint64_t packed;
+	uint64_t unpacked;
+	uint64_t total_ns;
+	uint64_t worst_ns;
+};
+
+static uint64_t cpuNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* times dsk::lz4Decode on every packed track of the CDSK image in data.
+ * returns false if one does not decode.
+ */
+static bool decodeCost(std::vector<uint8_t> const &data, DecodeCost &cost) {
+	memset(&cost, 0, sizeof(cost));
+	if (data.size() < 256)
+		return false;
+	unsigned count = data[0x30] * data[0x31];
+	if (data.size() < 256 + count * 8)
+		return false;
+	std::vector<uint8_t> track;
+	for(unsigned i = 0; i < count; i++) {
+		uint8_t const *e = data.data() + 256 + i * 8;
+		uint32_t offset = e[0] | (e[1] << 8) | (e[2] << 16) |
+			((uint32_t)e[3] << 24);
+		unsigned packed = e[4] | (e[5] << 8);
+		unsigned size = e[6] | (e[7] << 8);
+		if (packed == 0 || packed == size)
+			continue;
+		if (offset + packed > data.size())
+			return false;
+		track.resize(size);
+		uint64_t start = cpuNs();
+		for(unsigned r = 0; r < CHECK_DECODE_ROUNDS; r++) {
+			if (dsk::lz4Decode(data.data() + offset, packed,
+					   track.data(), size) != (int)size)
+				return false;
+		}
+		uint64_t ns = (cpuNs() - start) / CHECK_DECODE_ROUNDS;
+		cost.tracks++;
+		cost.packed += packed;
+		cost.unpacked += size;
+		cost.total_ns += ns;
+		if (ns > cost.worst_ns)
+			cost.worst_ns = ns;
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s image.dsk image.cdsk\n", argv[0]);
+		return 2;
+	}
+	RefPtr<dsk::Disk> disk = dsk::openImage(argv[1]);
+	if (!disk) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	RefPtr<dsk::Disk> cdsk = dsk::openImage(argv[2]);
+	if (!cdsk) {
+		fprintf(stderr, "%s: cannot open\n", argv[2]);
+		return 1;
+	}
+	std::vector<uint8_t> cdata;
+	FILE *f = fopen(argv[2], "rb");
+	if (f) {
+		uint8_t buf[4096];
+		size_t n;
+		while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			cdata.insert(cdata.end(), buf, buf + n);
+		fclose(f);
+	}
+	if (cdata.size() < 8 || memcmp(cdata.data(), "CPC CDSK", 8) != 0) {
+		fprintf(stderr, "%s: not a CDSK image\n", argv[2]);
+		return 1;
+	}
+	DecodeCost cost;
+	if (!decodeCost(cdata, cost)) {
+		fprintf(stderr, "%s: a track does not decode\n", argv[2]);
+		return 1;
+	}
+
+	std::vector<SectorCopy> ref;
+	Trace t1, t2;
+	readAll(disk, ref, false, t1);
+	if (!readAll(cdsk, ref, true, t2))
+		return 1;
+	ref.clear();
+	disk->close();
+	cdsk->close();
+	if (t1.sectors == 0) {
+		fprintf(stderr, "%s: no sectors found\n", argv[1]);
+		return 1;
+	}
+
+	printf("%u sectors match\n", t1.sectors);
+	printf("%-6s %10s %6s %10s\n", "", "bytes read", "reads", "time us");
+	printf("%-6s %10llu %6u %10llu\n", "image",
+	       (unsigned long long)t1.bytes_read, t1.image_reads,
+	       (unsigned long long)t1.usec);
+	printf("%-6s %10llu %6u %10llu\n", "cdsk",
+	       (unsigned long long)t2.bytes_read, t2.image_reads,
+	       (unsigned long long)t2.usec);
+	if (cost.tracks) {
+		printf("decode: %u packed tracks, %llu bytes to %llu, "
+		       "%llu ns per track, worst %llu ns (host cpu)\n",
+		       cost.tracks,
+		       (unsigned long long)(cost.packed / cost.tracks),
+		       (unsigned long long)(cost.unpacked / cost.tracks),
+		       (unsigned long long)(cost.total_ns / cost.tracks),
+		       (unsigned long long)cost.worst_ns);
+	}
+	return 0;
+}
@@ -0,0 +1,244 @@
+
+/* converts .dsk and extended .dsk images into compressed CDSK images as
+ * read by dsk::CDSK. the layout is described next to CDSKHEADER in
+ * src/fdc/dsk.cpp: header, track table, lz4 compressed tracks in the
+ * extended image layout. identical tracks share their data.
+ *
+ * usage: cdskconv input.dsk output.cdsk
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#define DSK_HEADER_SIZE 256
+#define DSK_TRACKHEADER_SIZE 256
+//largest track size the track table can describe
+#define CDSK_TRACKSIZE_MAX 0xff00
+
+struct Track {
+	std::vector<uint8_t> data;//extended image layout, empty if unformatted
+	uint32_t offset;
+	uint16_t packed;
+};
+
+static void putLength(std::vector<uint8_t> &out, unsigned len) {
+	while(len >= 255) {
+		out.push_back(255);
+		len -= 255;
+	}
+	out.push_back(len);
+}
+
+/* encodes src as a single lz4 block. greedy, with the end of block rules
+ * of the lz4 format: the last five bytes are literals and no match starts
+ * in the last twelve bytes.
+ */
+static std::vector<uint8_t> lz4Encode(uint8_t const *src, unsigned len) {
+	std::vector<uint8_t> out;
+	std::vector<int> table(4096, -1);
+	unsigned anchor = 0;
+	unsigned ip = 0;
+	if (len >= 13) {
+		unsigned mflimit = len - 12;
+		unsigned matchlimit = len - 5;
+		while(ip < mflimit) {
+			uint32_t seq;
+			memcpy(&seq, src + ip, 4);
+			unsigned h = (seq * 2654435761U) >> 20;
+			int ref = table[h];
+			table[h] = ip;
+			if (ref < 0 || ip - ref > 0xffff ||
+			    memcmp(src + ref, src + ip, 4) != 0) {
+				ip++;
+				continue;
+			}
+			unsigned mlen = 4;
+			while(ip + mlen < matchlimit &&
+			      src[ref + mlen] == src[ip + mlen])
+				mlen++;
+			unsigned lit = ip - anchor;
+			unsigned ml = mlen - 4;
+			out.push_back((std::min(lit, 15U) << 4) |
+				      std::min(ml, 15U));
+			if (lit >= 15)
+				putLength(out, lit - 15);
+			out.insert(out.end(), src + anchor, src + ip);
+			unsigned offset = ip - ref;
+			out.push_back(offset & 0xff);
+			out.push_back(offset >> 8);
+			if (ml >= 15)
+				putLength(out, ml - 15);
+			ip += mlen;
+			anchor = ip;
+		}
+	}
+	unsigned lit = len - anchor;
+	out.push_back(std::min(lit, 15U) << 4);
+	if (lit >= 15)
+		putLength(out, lit - 15);
+	out.insert(out.end(), src + anchor, src + len);
+	return out;
+}
+
+static bool readFile(char const *filename, std::vector<uint8_t> &data) {
+	FILE *f = fopen(filename, "rb");
+	if (!f)
+		return false;
+	uint8_t buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	bool ok = !ferror(f);
+	fclose(f);
+	return ok;
+}
+
+/* splits the image into its tracks. tracks of standard images get the
+ * sector sizes filled in, which the extended layout stores per sector.
+ */
+static bool readTracks(std::vector<uint8_t> const &image,
+		       unsigned &NumTracks, unsigned &NumSides,
+		       std::vector<Track> &tracks) {
+	if (image.size() < DSK_HEADER_SIZE)
+		return false;
+	uint8_t const *h = image.data();
+	bool extended;
+	if (memcmp(h, "EXTENDED", 8) == 0)
+		extended = true;
+	else if (memcmp(h, "MV - CPC", 8) == 0)
+		extended = false;
+	else
+		return false;
+	NumTracks = h[0x30];
+	NumSides = h[0x31];
+	if (NumSides != 1 && NumSides != 2)
+		return false;
+	if (NumTracks <= 0 || NumTracks >= 85)
+		return false;
+	unsigned TrackSize = h[0x32] | (h[0x33] << 8);
+	size_t offset = DSK_HEADER_SIZE;
+	tracks.resize(NumTracks * NumSides);
+	for(unsigned i = 0; i < NumTracks * NumSides; i++) {
+		unsigned size = extended ? h[0x34 + i] << 8 : TrackSize;
+		if (offset + size > image.size()) {
+			fprintf(stderr, "image ends in track %u\n", i);
+			return false;
+		}
+		std::vector<uint8_t> &t = tracks[i].data;
+		t.assign(image.begin() + offset, image.begin() + offset + size);
+		offset += size;
+		if (size < DSK_TRACKHEADER_SIZE ||
+		    memcmp(t.data(), "Track-Info", 10) != 0) {
+			//no usable track, same as unformatted
+			t.clear();
+			continue;
+		}
+		//the track table has a resolution of 256 bytes
+		t.resize((t.size() + 255) & ~255);
+		if (t.size() > CDSK_TRACKSIZE_MAX) {
+			fprintf(stderr, "track %u too large\n", i);
+			return false;
+		}
+		if (!extended) {
+			unsigned SPT = t[0x15];
+			for(unsigned s = 0; s < SPT && s < 29; s++) {
+				uint8_t *id = t.data() + 0x18 + s * 8;
+				unsigned sectorsize = 128 << (id[3] & 0x07);
+				id[6] = sectorsize & 0xff;
+				id[7] = sectorsize >> 8;
+			}
+		}
+	}
+	return true;
+}
+
+static void put16(uint8_t *p, unsigned v) {
+	p[0] = v & 0xff;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s input.dsk output.cdsk\n", argv[0]);
+		return 2;
+	}
+	std::vector<uint8_t> image;
+	if (!readFile(argv[1], image)) {
+		perror(argv[1]);
+		return 1;
+	}
+	unsigned NumTracks, NumSides;
+	std::vector<Track> tracks;
+	if (!readTracks(image, NumTracks, NumSides, tracks)) {
+		fprintf(stderr, "%s: not a usable disk image\n", argv[1]);
+		return 1;
+	}
+
+	std::vector<uint8_t> out(DSK_HEADER_SIZE + tracks.size() * 8);
+	memcpy(out.data(), "CPC CDSK", 8);
+	memcpy(out.data() + 34, "cdskconv", 8);
+	out[0x30] = NumTracks;
+	out[0x31] = NumSides;
+	out[0x32] = 1;//version
+
+	std::map<std::vector<uint8_t>, Track const *> stored;
+	unsigned shared = 0;
+	size_t unpacked = 0;
+	for(auto &t : tracks) {
+		t.offset = 0;
+		t.packed = 0;
+		if (t.data.empty())
+			continue;
+		unpacked += t.data.size();
+		auto it = stored.find(t.data);
+		if (it != stored.end()) {
+			t.offset = it->second->offset;
+			t.packed = it->second->packed;
+			shared++;
+			continue;
+		}
+		std::vector<uint8_t> packed =
+			lz4Encode(t.data.data(), t.data.size());
+		t.offset = out.size();
+		if (packed.size() < t.data.size()) {
+			t.packed = packed.size();
+			out.insert(out.end(), packed.begin(), packed.end());
+		} else {
+			//stored as is
+			t.packed = t.data.size();
+			out.insert(out.end(), t.data.begin(), t.data.end());
+		}
+		stored[t.data] = &t;
+	}
+	for(unsigned i = 0; i < tracks.size(); i++) {
+		uint8_t *e = out.data() + DSK_HEADER_SIZE + i * 8;
+		put32(e, tracks[i].offset);
+		put16(e + 4, tracks[i].packed);
+		put16(e + 6, tracks[i].data.size());
+	}
+
+	FILE *f = fopen(argv[2], "wb");
+	if (!f) {
+		perror(argv[2]);
+		return 1;
+	}
+	if (fwrite(out.data(), 1, out.size(), f) != out.size() ||
+	    fclose(f) != 0) {
+		perror(argv[2]);
+		return 1;
+	}
+	printf("%u tracks, %u shared, %zu bytes of track data packed "
+	       "into %zu\n", (unsigned)tracks.size(), shared, unpacked,
+	       out.size() - DSK_HEADER_SIZE - tracks.size() * 8);
+	return 0;
+}
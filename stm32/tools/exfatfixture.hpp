@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+/* the files mkexfatimg puts into its images and exfattest expects to
+ * find there. contents are made up from the seed.
+ */
+
+enum ExFatFixtureLayout {
+	ExFatContiguous,//no fat chain, the stream flag says so
+	ExFatChained,//fat chain over consecutive clusters
+	ExFatFragmented,//fat chain over every other cluster
+};
+
+struct ExFatFixtureFile {
+	char const *dir;//NULL for the root directory
+	char const *name;//utf-8
+	uint32_t size;
+	unsigned seed;
+	ExFatFixtureLayout layout;
+};
+
+static ExFatFixtureFile const exfat_fixture[] = {
+	{ NULL, "contiguous.bin", 200 * 1024 + 100, 1, ExFatContiguous },
+	{ NULL, "fragmented.bin", 30 * 4096 - 7, 2, ExFatFragmented },
+	//fills the clusters fragmented.bin skips
+	{ NULL, "filler.bin", 30 * 4096, 3, ExFatFragmented },
+	//two name entries, and a character only the up-case table maps
+	{ NULL, "\xc3\xbc" "ber Disk Collection.dsk", 3 * 4096 + 1, 4,
+	  ExFatChained },
+	{ NULL, "empty.txt", 0, 5, ExFatContiguous },
+	{ "Games", "\xc3\x89" "lite.dsk", 2 * 4096, 6, ExFatContiguous },
+};
+
+#define EXFAT_FIXTURE_FILES \
+	(sizeof(exfat_fixture) / sizeof(exfat_fixture[0]))
+
+static inline std::vector<uint8_t> exfatFixtureData(uint32_t len,
+						    unsigned seed) {
+	std::vector<uint8_t> data(len);
+	uint32_t x = seed * 2654435761U + 1;
+	for(size_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+	return data;
+}
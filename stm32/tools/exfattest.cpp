@@ -0,0 +1,170 @@
+
+/* reads an image from mkexfatimg with the firmware exfat code: looks up
+ * every file, also with the case of the name changed, reads them back in
+ * small and large pieces and checks that nothing can be written. with
+ * the oversized up-case table the firmware falls back to ascii rules,
+ * names then only match up to the case of ascii characters.
+ *
+ * usage: exfattest image standard|oversized
+ */
+
+#include "host/host.hpp"
+#include "host/msd.hpp"
+#include "exfatfixture.hpp"
+
+#include <fs/fat.h>
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <set>
+#include <string>
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+static RefPtr<vfs::Inode> lookup(RefPtr<vfs::Inode> dir,
+				 std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->lookup(d) != 0)
+		return RefPtr<vfs::Inode>();
+	return d->inode;
+}
+
+static RefPtr<vfs::Inode> lookupFile(RefPtr<vfs::Inode> root,
+				     char const *dir, std::string const &name) {
+	if (dir) {
+		root = lookup(root, dir);
+		if (!root || !S_ISDIR(root->mode))
+			return RefPtr<vfs::Inode>();
+	}
+	return lookup(root, name);
+}
+
+static std::string asciiUpper(std::string s) {
+	for(auto &c : s) {
+		if (c >= 'a' && c <= 'z')
+			c = c - 'a' + 'A';
+	}
+	return s;
+}
+
+/* reads ino in pieces of chunk bytes, returns the simulated time taken
+ */
+static uint64_t readCheck(RefPtr<vfs::Inode> ino, ExFatFixtureFile const &f,
+			  size_t chunk) {
+	std::vector<uint8_t> data(f.size + 1);
+	uint64_t start = Timer_timeSincePowerOn();
+	size_t pos = 0;
+	while(pos < data.size()) {
+		_ssize_t r = ino->pread(data.data() + pos,
+					std::min(chunk, data.size() - pos), pos);
+		if (r <= 0)
+			break;
+		pos += r;
+	}
+	uint64_t usec = Timer_timeSincePowerOn() - start;
+	data.resize(pos);
+	if (data != exfatFixtureData(f.size, f.seed))
+		fail("%s: contents differ reading %zu at a time", f.name, chunk);
+	return usec;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3 || (strcmp(argv[2], "standard") != 0 &&
+			  strcmp(argv[2], "oversized") != 0)) {
+		fprintf(stderr, "usage: %s image standard|oversized\n", argv[0]);
+		return 2;
+	}
+	bool standard = strcmp(argv[2], "standard") == 0;
+	HostMSD msd(argv[1], 0x07);
+	if (!msd.ok()) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	FAT_Setup();
+	RefPtr<vfs::Inode> root = HostMSD_Mount(&msd);
+	if (!root) {
+		fprintf(stderr, "%s: no file system found\n", argv[1]);
+		return 1;
+	}
+
+	printf("%-28s %10s %10s\n", "file", "KB/s 512", "KB/s 16K");
+	for(auto const &f : exfat_fixture) {
+		RefPtr<vfs::Inode> ino = lookupFile(root, f.dir, f.name);
+		if (!ino) {
+			fail("%s: not found", f.name);
+			continue;
+		}
+		if (ino->size != f.size) {
+			fail("%s: size %u, expected %u", f.name,
+			     (unsigned)ino->size, (unsigned)f.size);
+			continue;
+		}
+		uint64_t small = readCheck(ino, f, 512);
+		uint64_t large = readCheck(ino, f, 16384);
+		printf("%-28s %10llu %10llu\n", f.name,
+		       (unsigned long long)(small ? f.size * 1000000ULL / 1024 /
+					    small : 0),
+		       (unsigned long long)(large ? f.size * 1000000ULL / 1024 /
+					    large : 0));
+		//ascii case never matters
+		if (!lookupFile(root, f.dir, asciiUpper(f.name)))
+			fail("%s: not found as %s", f.name,
+			     asciiUpper(f.name).c_str());
+	}
+
+	//a character only the up-case table maps: capital u umlaut
+	std::string upper = "\xc3\x9c" "BER DISK COLLECTION.DSK";
+	bool found = lookupFile(root, NULL, upper);
+	if (found != standard)
+		fail("%s: %s with the %s table", upper.c_str(),
+		     found ? "found" : "not found", argv[2]);
+	for(char const *n : { "missing.bin", "contiguous.bi",
+			      "\xc3\xbc" "ber Disk Collection.dsk2" }) {
+		if (lookupFile(root, NULL, n))
+			fail("%s: found", n);
+	}
+
+	std::set<std::string> expected;
+	for(auto const &f : exfat_fixture)
+		expected.insert(f.dir ? f.dir : f.name);
+	off_t d_off = -1;
+	std::string name;
+	size_t count = 0;
+	while(root->readdir(d_off, name)) {
+		if (expected.find(name) == expected.end())
+			fail("%s: unexpected entry", name.c_str());
+		count++;
+	}
+	if (count != expected.size())
+		fail("%zu entries, expected %zu", count, expected.size());
+
+	//read only
+	RefPtr<vfs::Dentry> d = new vfs::Dentry("new.txt",
+						RefPtr<vfs::Dentry>());
+	if (root->create(d, S_IFREG | S_IRWXU) == 0 || errno != EROFS)
+		fail("new.txt: created");
+	RefPtr<vfs::Inode> ino = lookup(root, exfat_fixture[0].name);
+	if (ino && (ino->pwrite("x", 1, 0) != -1 || errno != EROFS))
+		fail("%s: written", exfat_fixture[0].name);
+	ino = RefPtr<vfs::Inode>();
+	d = RefPtr<vfs::Dentry>();
+
+	root = RefPtr<vfs::Inode>();
+	HostMSD_Unmount(&msd);
+	if (failed)
+		return 1;
+	printf("%zu files check out with the %s up-case table\n",
+	       EXFAT_FIXTURE_FILES, argv[2]);
+	return 0;
+}
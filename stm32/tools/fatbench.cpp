@@ -0,0 +1,262 @@
+
+/* lookup and read benchmark for the firmware fat code. fills the root
+ * directory with files, writes two files interleaved so their chains
+ * are fragmented and one in a single run, then mounts the image again
+ * and times lookups and reads of them. everything read is checked.
+ *
+ * times are simulated sd card time, except for the lookup cpu time,
+ * which is host time spent in the fat code without waiting for the card.
+ *
+ * the block requests can be logged to trace, for sdreplay.
+ *
+ * usage: fatbench image fat12|fat16|fat32 [trace]
+ */
+
+#include "host/host.hpp"
+#include "host/msd.hpp"
+
+#include <fs/fat.h>
+#include <timer.hpp>
+#include <stdio.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define BENCH_FILES 150
+#define BENCH_RUN_SIZE (512 * 1024)
+#define BENCH_FRAG_SIZE (768 * 1024)
+#define BENCH_FRAG_CHUNK 4096
+
+static bool failed = false;
+
+static std::vector<uint8_t> pattern(size_t len, unsigned seed) {
+	std::vector<uint8_t> data(len);
+	uint32_t x = seed * 2654435761U + 1;
+	for(size_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+	return data;
+}
+
+static RefPtr<vfs::Inode> lookup(RefPtr<vfs::Inode> dir,
+				 std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->lookup(d) != 0)
+		return RefPtr<vfs::Inode>();
+	return d->inode;
+}
+
+static RefPtr<vfs::Inode> create(RefPtr<vfs::Inode> dir,
+				 std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->create(d, S_IFREG | S_IRWXU) != 0) {
+		fprintf(stderr, "%s: create failed, errno %d\n", name.c_str(),
+			errno);
+		failed = true;
+		return RefPtr<vfs::Inode>();
+	}
+	return d->inode;
+}
+
+static void write(RefPtr<vfs::Inode> ino, std::vector<uint8_t> const &data,
+		  size_t offset, size_t len) {
+	if (ino->pwrite(data.data() + offset, len, offset) != (_ssize_t)len) {
+		fprintf(stderr, "write of %zu at %zu failed, errno %d\n",
+			len, offset, errno);
+		failed = true;
+	}
+}
+
+static std::string fileName(unsigned i) {
+	char n[32];
+	snprintf(n, sizeof(n), "Disk image %03u.dsk", i);
+	return n;
+}
+
+static void fill(RefPtr<vfs::Inode> root) {
+	for(unsigned i = 0; i < BENCH_FILES; i++) {
+		RefPtr<vfs::Inode> ino = create(root, fileName(i));
+		if (ino)
+			write(ino, pattern(100, i), 0, 100);
+	}
+	//one cluster after the other for each, on fat12 the chains cross
+	//the fat entries split between blocks
+	RefPtr<vfs::Inode> a = create(root, "frag_a.bin");
+	RefPtr<vfs::Inode> b = create(root, "frag_b.bin");
+	std::vector<uint8_t> da = pattern(BENCH_FRAG_SIZE, 1000);
+	std::vector<uint8_t> db = pattern(BENCH_FRAG_SIZE, 1001);
+	for(size_t pos = 0; a && b && pos < BENCH_FRAG_SIZE;
+	    pos += BENCH_FRAG_CHUNK) {
+		write(a, da, pos, BENCH_FRAG_CHUNK);
+		write(b, db, pos, BENCH_FRAG_CHUNK);
+	}
+	RefPtr<vfs::Inode> r = create(root, "run.bin");
+	if (r)
+		write(r, pattern(BENCH_RUN_SIZE, 1002), 0, BENCH_RUN_SIZE);
+}
+
+struct LookupTime {
+	uint64_t usec;
+	uint64_t cpu_ns;
+	uint64_t block_reads;
+	unsigned scans;
+};
+
+static LookupTime lookupAll(HostMSD *msd, RefPtr<vfs::Inode> root) {
+	LookupTime t;
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t reads = msd->stats.reads;
+	unsigned scans = FAT_CacheInfo().dir_scans;
+	auto cpu = std::chrono::steady_clock::now();
+	for(unsigned i = 0; i < BENCH_FILES; i++) {
+		RefPtr<vfs::Inode> ino = lookup(root, fileName(i));
+		if (!ino || ino->size != 100) {
+			fprintf(stderr, "%s: lookup failed\n",
+				fileName(i).c_str());
+			failed = true;
+		}
+	}
+	//names that are not there
+	for(unsigned i = 0; i < BENCH_FILES; i++) {
+		if (lookup(root, fileName(i + BENCH_FILES))) {
+			fprintf(stderr, "%s: found\n",
+				fileName(i + BENCH_FILES).c_str());
+			failed = true;
+		}
+	}
+	t.cpu_ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+		(std::chrono::steady_clock::now() - cpu).count();
+	t.usec = Timer_timeSincePowerOn() - start;
+	t.block_reads = msd->stats.reads - reads;
+	t.scans = FAT_CacheInfo().dir_scans - scans;
+	return t;
+}
+
+struct ReadTime {
+	uint64_t usec;
+	uint64_t requests;
+};
+
+static ReadTime readAll(HostMSD *msd, RefPtr<vfs::Inode> root,
+			char const *name, unsigned seed, size_t size,
+			size_t chunk) {
+	ReadTime t = { 0, 0 };
+	RefPtr<vfs::Inode> ino = lookup(root, name);
+	if (!ino || (size_t)ino->size != size) {
+		fprintf(stderr, "%s: missing\n", name);
+		failed = true;
+		return t;
+	}
+	std::vector<uint8_t> data(size);
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t requests = msd->stats.reads;
+	for(size_t pos = 0; pos < size; pos += chunk) {
+		size_t l = std::min(chunk, size - pos);
+		if (ino->pread(data.data() + pos, l, pos) != (_ssize_t)l) {
+			fprintf(stderr, "%s: read at %zu failed\n", name, pos);
+			failed = true;
+			return t;
+		}
+	}
+	t.usec = Timer_timeSincePowerOn() - start;
+	t.requests = msd->stats.reads - requests;
+	if (data != pattern(size, seed)) {
+		fprintf(stderr, "%s: contents differ\n", name);
+		failed = true;
+	}
+	return t;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3 && argc != 4) {
+		fprintf(stderr, "usage: %s image fat12|fat16|fat32 [trace]\n",
+			argv[0]);
+		return 2;
+	}
+	uint8_t type;
+	if (strcmp(argv[2], "fat12") == 0)
+		type = 0x01;
+	else if (strcmp(argv[2], "fat16") == 0)
+		type = 0x06;
+	else if (strcmp(argv[2], "fat32") == 0)
+		type = 0x0c;
+	else {
+		fprintf(stderr, "%s: unknown variant\n", argv[2]);
+		return 2;
+	}
+	HostMSD msd(argv[1], type);
+	if (!msd.ok()) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	if (argc == 4) {
+		msd.trace = fopen(argv[3], "w");
+		if (!msd.trace) {
+			fprintf(stderr, "%s: cannot create\n", argv[3]);
+			return 1;
+		}
+	}
+	FAT_Setup();
+	RefPtr<vfs::Inode> root = HostMSD_Mount(&msd);
+	if (!root) {
+		fprintf(stderr, "%s: no file system found\n", argv[1]);
+		return 1;
+	}
+	fill(root);
+	root = RefPtr<vfs::Inode>();
+	HostMSD_Unmount(&msd);
+
+	//cold cache from here on
+	root = HostMSD_Mount(&msd);
+	if (!root) {
+		fprintf(stderr, "%s: no file system after remount\n", argv[1]);
+		return 1;
+	}
+	LookupTime cold = lookupAll(&msd, root);
+	LookupTime warm = lookupAll(&msd, root);
+	struct {
+		char const *name;
+		unsigned seed;
+		size_t size;
+	} const reads[] = {
+		{ "run.bin", 1002, BENCH_RUN_SIZE },
+		{ "frag_a.bin", 1000, BENCH_FRAG_SIZE },
+	};
+	std::vector<ReadTime> rt;
+	for(auto const &r : reads) {
+		for(size_t chunk : { 512, 4096, 16384 })
+			rt.push_back(readAll(&msd, root, r.name, r.seed, r.size,
+					     chunk));
+	}
+	root = RefPtr<vfs::Inode>();
+	HostMSD_Unmount(&msd);
+	if (msd.trace)
+		fclose(msd.trace);
+	if (failed)
+		return 1;
+
+	printf("%u lookups, half of them for missing names\n", 2 * BENCH_FILES);
+	printf("%-6s %10s %10s %8s %6s\n", "", "time us", "cpu ns", "reads",
+	       "scans");
+	printf("%-6s %10llu %10llu %8llu %6u\n", "cold",
+	       (unsigned long long)cold.usec, (unsigned long long)cold.cpu_ns,
+	       (unsigned long long)cold.block_reads, cold.scans);
+	printf("%-6s %10llu %10llu %8llu %6u\n", "warm",
+	       (unsigned long long)warm.usec, (unsigned long long)warm.cpu_ns,
+	       (unsigned long long)warm.block_reads, warm.scans);
+	printf("%-12s %6s %8s %8s\n", "file", "chunk", "KB/s", "reads");
+	unsigned n = 0;
+	for(auto const &r : reads) {
+		for(size_t chunk : { 512, 4096, 16384 }) {
+			ReadTime const &t = rt[n++];
+			printf("%-12s %6zu %8llu %8llu\n", r.name, chunk,
+			       (unsigned long long)(t.usec ? r.size * 1000000ULL /
+						    1024 / t.usec : 0),
+			       (unsigned long long)t.requests);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,393 @@
+
+/* checks a fat12/16/32 image without the firmware code, for what fattest
+ * left behind: the fat copies agree, every chain fits the size of its
+ * file and no cluster is used twice or lost, long names belong to their
+ * short entries, names are unique and the fsinfo free count is right.
+ * the files in the root directory have to match the manifest.
+ *
+ * usage: fatcheck image [manifest]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+static std::vector<uint8_t> img;
+static unsigned bits;
+static uint32_t bytes_per_cluster;
+static uint32_t fat_offset;//bytes
+static uint32_t fat_size;//bytes
+static unsigned fat_copies;
+static uint32_t root_offset;//fat12/16 only
+static uint32_t root_entries;
+static uint32_t data_offset;
+static uint32_t clusters;//highest cluster + 1
+static std::vector<uint8_t> used;
+static unsigned errors = 0;
+
+static void error(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	errors++;
+}
+
+static uint16_t get16(size_t off) {
+	return img[off] | (img[off + 1] << 8);
+}
+
+static uint32_t get32(size_t off) {
+	return get16(off) | ((uint32_t)get16(off + 2) << 16);
+}
+
+static uint32_t fatEntry(uint32_t cluster) {
+	if (bits == 12) {
+		uint16_t v = get16(fat_offset + cluster + cluster / 2);
+		return (cluster & 1) ? v >> 4 : v & 0xfff;
+	}
+	if (bits == 16)
+		return get16(fat_offset + cluster * 2);
+	return get32(fat_offset + cluster * 4) & 0x0fffffff;
+}
+
+static bool isEnd(uint32_t v) {
+	return v >= (bits == 12 ? 0xff8U : bits == 16 ? 0xfff8U : 0x0ffffff8U);
+}
+
+static bool isBad(uint32_t v) {
+	return v == (bits == 12 ? 0xff7U : bits == 16 ? 0xfff7U : 0x0ffffff7U);
+}
+
+/* follows the chain from first, marking its clusters used. returns the
+ * clusters in order, empty on errors.
+ */
+static std::vector<uint32_t> chain(uint32_t first, std::string const &name) {
+	std::vector<uint32_t> c;
+	uint32_t cl = first;
+	while(1) {
+		if (cl < 2 || cl >= clusters) {
+			error("%s: chain leaves the volume at %u", name.c_str(),
+			      (unsigned)cl);
+			return std::vector<uint32_t>();
+		}
+		if (used[cl]) {
+			error("%s: cluster %u used twice", name.c_str(),
+			      (unsigned)cl);
+			return std::vector<uint32_t>();
+		}
+		used[cl] = 1;
+		c.push_back(cl);
+		uint32_t next = fatEntry(cl);
+		if (isEnd(next))
+			return c;
+		if (next == 0 || isBad(next)) {
+			error("%s: chain broken at %u", name.c_str(), (unsigned)cl);
+			return std::vector<uint32_t>();
+		}
+		cl = next;
+	}
+}
+
+static std::vector<uint8_t> readChain(std::vector<uint32_t> const &c) {
+	std::vector<uint8_t> data;
+	for(uint32_t cl : c) {
+		size_t off = data_offset + (size_t)(cl - 2) * bytes_per_cluster;
+		data.insert(data.end(), img.begin() + off,
+			    img.begin() + off + bytes_per_cluster);
+	}
+	return data;
+}
+
+static uint32_t crc32(uint8_t const *p, size_t len) {
+	uint32_t crc = 0xffffffff;
+	for(size_t n = 0; n < len; n++) {
+		crc ^= p[n];
+		for(unsigned i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static std::string utf8(std::vector<uint16_t> const &s) {
+	std::string r;
+	for(uint16_t c : s) {
+		if (c < 0x80) {
+			r += c;
+		} else if (c < 0x800) {
+			r += 0xc0 | (c >> 6);
+			r += 0x80 | (c & 0x3f);
+		} else {
+			r += 0xe0 | (c >> 12);
+			r += 0x80 | ((c >> 6) & 0x3f);
+			r += 0x80 | (c & 0x3f);
+		}
+	}
+	return r;
+}
+
+static std::string upper(std::string s) {
+	for(auto &c : s) {
+		if (c >= 'a' && c <= 'z')
+			c = c - 'a' + 'A';
+	}
+	return s;
+}
+
+struct File {
+	uint32_t size;
+	uint32_t crc;
+};
+
+/* checks the entries in dir, the files of the root directory end up in
+ * files.
+ */
+static void checkDir(std::vector<uint8_t> const &dir, std::string const &path,
+		     std::map<std::string, File> *files, unsigned depth) {
+	std::set<std::string> names;
+	std::vector<uint16_t> lfn;
+	unsigned lfn_next = 0;
+	uint8_t lfn_sum = 0;
+	for(size_t off = 0; off + 32 <= dir.size(); off += 32) {
+		uint8_t const *e = &dir[off];
+		if (e[0] == 0)
+			break;
+		if (e[0] == 0xe5) {
+			if (lfn_next != 0)
+				error("%s: long name without entry", path.c_str());
+			lfn_next = 0;
+			continue;
+		}
+		if (e[11] == 0x0f) {
+			unsigned order = e[0] & 0x3f;
+			if (e[0] & 0x40) {
+				if (lfn_next != 0)
+					error("%s: long name cut short",
+					      path.c_str());
+				lfn.assign(order * 13, 0xffff);
+				lfn_next = order;
+				lfn_sum = e[13];
+			}
+			if (order == 0 || order != lfn_next || e[13] != lfn_sum) {
+				error("%s: long name entries out of order",
+				      path.c_str());
+				lfn_next = 0;
+				continue;
+			}
+			static unsigned const pos[13] = {
+				1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+			};
+			for(unsigned i = 0; i < 13; i++)
+				lfn[(order - 1) * 13 + i] = e[pos[i]] |
+					(e[pos[i] + 1] << 8);
+			lfn_next--;
+			continue;
+		}
+		if (e[11] & 0x08) {
+			lfn_next = 0;
+			lfn.clear();
+			continue;
+		}
+		std::string sname;
+		for(unsigned i = 0; i < 8 && e[i] != ' '; i++)
+			sname += i == 0 && e[i] == 0x05 ? (char)0xe5 : (char)e[i];
+		if (e[8] != ' ') {
+			sname += '.';
+			for(unsigned i = 8; i < 11 && e[i] != ' '; i++)
+				sname += e[i];
+		}
+		std::string name = sname;
+		if (!lfn.empty()) {
+			uint8_t sum = 0;
+			for(unsigned i = 0; i < 11; i++)
+				sum = ((sum & 1) << 7) + (sum >> 1) + e[i];
+			if (lfn_next != 0 || sum != lfn_sum) {
+				error("%s: long name does not belong to %s",
+				      path.c_str(), sname.c_str());
+			} else {
+				size_t l = 0;
+				while(l < lfn.size() && lfn[l] != 0 &&
+				      lfn[l] != 0xffff)
+					l++;
+				lfn.resize(l);
+				name = utf8(lfn);
+			}
+		}
+		lfn.clear();
+		lfn_next = 0;
+		if (sname == "." || sname == "..")
+			continue;
+		std::string full = path + "/" + name;
+		if (!names.insert(upper(sname)).second)
+			error("%s: short name %s taken twice", path.c_str(),
+			      sname.c_str());
+		if (upper(name) != upper(sname) &&
+		    !names.insert(upper(name)).second)
+			error("%s: name %s taken twice", path.c_str(),
+			      name.c_str());
+		uint32_t first = e[26] | (e[27] << 8);
+		if (bits == 32)
+			first |= (uint32_t)(e[20] | (e[21] << 8)) << 16;
+		uint32_t size = e[28] | (e[29] << 8) | (e[30] << 16) |
+			((uint32_t)e[31] << 24);
+		if (e[11] & 0x10) {
+			if (depth > 16) {
+				error("%s: nested too deep", full.c_str());
+				continue;
+			}
+			std::vector<uint32_t> c = chain(first, full);
+			if (!c.empty())
+				checkDir(readChain(c), full, NULL, depth + 1);
+			continue;
+		}
+		uint32_t need = ((uint64_t)size + bytes_per_cluster - 1) /
+			bytes_per_cluster;
+		std::vector<uint32_t> c;
+		if (first != 0)
+			c = chain(first, full);
+		if (first == 0 && size != 0)
+			error("%s: %u bytes without clusters", full.c_str(),
+			      (unsigned)size);
+		else if (first != 0 && c.size() != need)
+			error("%s: %zu clusters for %u bytes", full.c_str(),
+			      c.size(), (unsigned)size);
+		if (files && c.size() == need) {
+			std::vector<uint8_t> data = readChain(c);
+			File f = { size, crc32(data.data(), size) };
+			(*files)[name] = f;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "usage: %s image [manifest]\n", argv[0]);
+		return 2;
+	}
+	FILE *f = fopen(argv[1], "rb");
+	if (!f) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	img.resize(ftell(f));
+	fseek(f, 0, SEEK_SET);
+	if (img.size() < 512 || fread(img.data(), 1, img.size(), f) != img.size()) {
+		fprintf(stderr, "%s: cannot read\n", argv[1]);
+		return 1;
+	}
+	fclose(f);
+
+	if (get16(510) != 0xaa55 || get16(11) != 512) {
+		fprintf(stderr, "%s: no fat boot sector\n", argv[1]);
+		return 1;
+	}
+	uint32_t spc = img[13];
+	uint32_t reserved = get16(14);
+	fat_copies = img[16];
+	root_entries = get16(17);
+	uint32_t sectors = get16(19) ? get16(19) : get32(32);
+	uint32_t fat_sectors = get16(22) ? get16(22) : get32(36);
+	uint32_t root_sectors = (root_entries * 32 + 511) / 512;
+	uint32_t meta = reserved + fat_copies * fat_sectors + root_sectors;
+	if (spc == 0 || fat_copies == 0 || sectors <= meta ||
+	    (size_t)sectors * 512 > img.size()) {
+		fprintf(stderr, "%s: bad geometry\n", argv[1]);
+		return 1;
+	}
+	uint32_t count = (sectors - meta) / spc;
+	bits = count < 4085 ? 12 : count < 65525 ? 16 : 32;
+	bytes_per_cluster = spc * 512;
+	fat_offset = reserved * 512;
+	fat_size = fat_sectors * 512;
+	root_offset = fat_offset + fat_copies * fat_size;
+	data_offset = root_offset + root_sectors * 512;
+	clusters = count + 2;
+	used.assign(clusters, 0);
+
+	for(unsigned i = 1; i < fat_copies; i++) {
+		if (memcmp(&img[fat_offset], &img[fat_offset + i * fat_size],
+			   fat_size) != 0)
+			error("fat copy %u differs", i);
+	}
+	if ((fatEntry(0) & 0xff) != img[21])
+		error("fat entry 0 does not hold the media byte");
+
+	std::map<std::string, File> files;
+	if (bits == 32) {
+		std::vector<uint32_t> c = chain(get32(44), "/");
+		if (!c.empty())
+			checkDir(readChain(c), "", &files, 0);
+	} else {
+		std::vector<uint8_t> root(img.begin() + root_offset,
+					  img.begin() + data_offset);
+		checkDir(root, "", &files, 0);
+	}
+
+	uint32_t free_clusters = 0;
+	for(uint32_t cl = 2; cl < clusters; cl++) {
+		uint32_t v = fatEntry(cl);
+		if (v == 0)
+			free_clusters++;
+		else if (!used[cl] && !isBad(v))
+			error("cluster %u lost", (unsigned)cl);
+	}
+	if (bits == 32 && get16(48) != 0 && get16(48) != 0xffff) {
+		size_t fsinfo = get16(48) * 512;
+		uint32_t fc = get32(fsinfo + 488);
+		if (get32(fsinfo) != 0x41615252 ||
+		    get32(fsinfo + 484) != 0x61417272)
+			error("fsinfo signature broken");
+		else if (fc != 0xffffffff && fc != free_clusters)
+			error("fsinfo says %u free clusters, there are %u",
+			      (unsigned)fc, (unsigned)free_clusters);
+	}
+
+	if (argc == 3) {
+		FILE *m = fopen(argv[2], "r");
+		if (!m) {
+			fprintf(stderr, "%s: cannot open\n", argv[2]);
+			return 1;
+		}
+		char line[512];
+		size_t listed = 0;
+		while(fgets(line, sizeof(line), m)) {
+			unsigned size, crc;
+			int n;
+			if (sscanf(line, "%u %x %n", &size, &crc, &n) < 2)
+				continue;
+			std::string name(line + n);
+			while(!name.empty() && name.back() == '\n')
+				name.pop_back();
+			listed++;
+			auto it = files.find(name);
+			if (it == files.end())
+				error("%s: missing", name.c_str());
+			else if (it->second.size != size || it->second.crc != crc)
+				error("%s: %u bytes crc %08x, expected %u "
+				      "bytes crc %08x", name.c_str(),
+				      (unsigned)it->second.size,
+				      (unsigned)it->second.crc, size, crc);
+		}
+		fclose(m);
+		if (listed != files.size())
+			error("%zu files, the manifest lists %zu",
+			      files.size(), listed);
+	}
+
+	if (errors) {
+		fprintf(stderr, "%u errors\n", errors);
+		return 1;
+	}
+	printf("fat%u, %u clusters, %u free, %zu files ok\n", bits,
+	       (unsigned)count, (unsigned)free_clusters, files.size());
+	return 0;
+}
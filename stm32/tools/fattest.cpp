@@ -0,0 +1,340 @@
+
+/* runs the firmware fat code against a file system image: creates,
+ * grows, truncates and unlinks files, reads everything back after
+ * mounting the image again and writes a manifest of the files left for
+ * fatcheck. also reports how fast writes of different sizes go, in
+ * simulated sd card time.
+ *
+ * usage: fattest image fat12|fat16|fat32 manifest
+ */
+
+#include "host/host.hpp"
+#include "host/msd.hpp"
+
+#include <fs/fat.h>
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::vector<uint8_t> > Files;
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+static uint32_t crc32(std::vector<uint8_t> const &data) {
+	uint32_t crc = 0xffffffff;
+	for(uint8_t b : data) {
+		crc ^= b;
+		for(unsigned i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static std::vector<uint8_t> pattern(size_t len, unsigned seed) {
+	std::vector<uint8_t> data(len);
+	uint32_t x = seed * 2654435761U + 1;
+	for(size_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+	return data;
+}
+
+static RefPtr<vfs::Inode> lookup(RefPtr<vfs::Inode> dir,
+				 std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->lookup(d) != 0)
+		return RefPtr<vfs::Inode>();
+	return d->inode;
+}
+
+static RefPtr<vfs::Inode> create(RefPtr<vfs::Inode> dir,
+				 std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->create(d, S_IFREG | S_IRWXU) != 0) {
+		fail("%s: create failed, errno %d", name.c_str(), errno);
+		return RefPtr<vfs::Inode>();
+	}
+	return d->inode;
+}
+
+static void unlink(RefPtr<vfs::Inode> dir, std::string const &name) {
+	RefPtr<vfs::Dentry> d = new vfs::Dentry(name, RefPtr<vfs::Dentry>());
+	if (dir->lookup(d) != 0 || !d->inode) {
+		fail("%s: not found for unlink", name.c_str());
+		return;
+	}
+	if (dir->unlink(d) != 0)
+		fail("%s: unlink failed, errno %d", name.c_str(), errno);
+}
+
+/* writes data at offset in chunks of chunk bytes
+ */
+static void write(RefPtr<vfs::Inode> ino, std::string const &name,
+		  std::vector<uint8_t> const &data, off_t offset, size_t chunk) {
+	for(size_t pos = 0; pos < data.size(); pos += chunk) {
+		size_t l = std::min(chunk, data.size() - pos);
+		if (ino->pwrite(data.data() + pos, l, offset + pos) != (_ssize_t)l) {
+			fail("%s: write of %zu at %zu failed, errno %d",
+			     name.c_str(), l, (size_t)(offset + pos), errno);
+			return;
+		}
+	}
+}
+
+//applies a write to the expected contents
+static void model(std::vector<uint8_t> &file, std::vector<uint8_t> const &data,
+		  size_t offset) {
+	if (file.size() < offset + data.size())
+		file.resize(offset + data.size(), 0);
+	std::copy(data.begin(), data.end(), file.begin() + offset);
+}
+
+static void verify(RefPtr<vfs::Inode> root, Files const &files) {
+	for(auto const &f : files) {
+		RefPtr<vfs::Inode> ino = lookup(root, f.first);
+		if (!ino) {
+			fail("%s: not found", f.first.c_str());
+			continue;
+		}
+		if ((size_t)ino->size != f.second.size()) {
+			fail("%s: size %zu, expected %zu", f.first.c_str(),
+			     (size_t)ino->size, f.second.size());
+			continue;
+		}
+		//odd sizes, so both the cached and the direct paths get used
+		std::vector<uint8_t> data(f.second.size() + 1);
+		size_t pos = 0;
+		while(pos < data.size()) {
+			_ssize_t r = ino->pread(data.data() + pos, 3000, pos);
+			if (r <= 0)
+				break;
+			pos += r;
+		}
+		data.resize(pos);
+		if (data != f.second)
+			fail("%s: contents differ", f.first.c_str());
+	}
+	//nothing but the expected names
+	off_t d_off = -1;
+	std::string name;
+	size_t count = 0;
+	while(root->readdir(d_off, name)) {
+		if (files.find(name) == files.end())
+			fail("%s: unexpected entry", name.c_str());
+		count++;
+	}
+	if (count != files.size())
+		fail("%zu entries, expected %zu", count, files.size());
+}
+
+struct Throughput {
+	size_t chunk;
+	uint64_t append_us;
+	uint64_t append_requests;
+	uint64_t overwrite_us;
+	uint64_t overwrite_requests;
+};
+
+#define BENCH_SIZE (256 * 1024)
+
+static Throughput bench(HostMSD *msd, RefPtr<vfs::Inode> root, size_t chunk) {
+	Throughput t = { chunk, 0, 0, 0, 0 };
+	char name[32];
+	snprintf(name, sizeof(name), "bench%zu.bin", chunk);
+	RefPtr<vfs::Inode> ino = create(root, name);
+	if (!ino)
+		return t;
+	std::vector<uint8_t> data = pattern(BENCH_SIZE, chunk);
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t requests = msd->stats.writes;
+	write(ino, name, data, 0, chunk);
+	Host_RunIdle();
+	t.append_us = Timer_timeSincePowerOn() - start;
+	t.append_requests = msd->stats.writes - requests;
+	start = Timer_timeSincePowerOn();
+	requests = msd->stats.writes;
+	write(ino, name, data, 0, chunk);
+	Host_RunIdle();
+	t.overwrite_us = Timer_timeSincePowerOn() - start;
+	t.overwrite_requests = msd->stats.writes - requests;
+	ino = RefPtr<vfs::Inode>();
+	unlink(root, name);
+	return t;
+}
+
+static void exercise(RefPtr<vfs::Inode> root, Files &files) {
+	static char const * const names[] = {
+		"README.TXT",
+		"lower.txt",
+		"MixedCase.Dat",
+		"a name with spaces and a long tail.bin",
+		"\xc3\xbc" "ber.dsk",//u umlaut, no 8.3 name for it
+		"no_extension",
+	};
+	unsigned seed = 1;
+	for(char const *n : names) {
+		RefPtr<vfs::Inode> ino = create(root, n);
+		if (!ino)
+			continue;
+		std::vector<uint8_t> data = pattern(1000 * seed + 17 * seed, seed);
+		write(ino, n, data, 0, 4096);
+		model(files[n], data, 0);
+		seed++;
+	}
+	//names are taken regardless of case
+	{
+		RefPtr<vfs::Dentry> d = new vfs::Dentry("readme.txt",
+							RefPtr<vfs::Dentry>());
+		if (root->create(d, S_IFREG | S_IRWXU) == 0 || errno != EEXIST)
+			fail("readme.txt: created next to README.TXT");
+	}
+
+	//growing with a write past the end, the gap reads as zeros
+	{
+		std::string n = "lower.txt";
+		RefPtr<vfs::Inode> ino = lookup(root, n);
+		std::vector<uint8_t> data = pattern(5000, 100);
+		write(ino, n, data, 70000, 512);
+		model(files[n], data, 70000);
+		//and an unaligned overwrite across block boundaries
+		data = pattern(1500, 101);
+		write(ino, n, data, 300, 1500);
+		model(files[n], data, 300);
+	}
+	//shrinking, then growing again with truncate
+	{
+		std::string n = "MixedCase.Dat";
+		RefPtr<vfs::Inode> ino = lookup(root, n);
+		if (ino->truncate(700) != 0)
+			fail("%s: truncate to 700 failed", n.c_str());
+		files[n].resize(700);
+		if (ino->truncate(40000) != 0)
+			fail("%s: truncate to 40000 failed", n.c_str());
+		files[n].resize(40000, 0);
+		if (ino->truncate(0) != 0)
+			fail("%s: truncate to 0 failed", n.c_str());
+		files[n].clear();
+		std::vector<uint8_t> data = pattern(2048, 102);
+		write(ino, n, data, 0, 2048);
+		model(files[n], data, 0);
+	}
+	//enough files for directories to need more than one cluster
+	for(unsigned i = 0; i < 40; i++) {
+		char n[32];
+		snprintf(n, sizeof(n), "file%03u.dat", i);
+		RefPtr<vfs::Inode> ino = create(root, n);
+		if (!ino)
+			continue;
+		std::vector<uint8_t> data = pattern(i * 97, 200 + i);
+		write(ino, n, data, 0, 16384);
+		model(files[n], data, 0);
+	}
+	//unlinking every other one leaves holes the next creates reuse
+	for(unsigned i = 0; i < 40; i += 2) {
+		char n[32];
+		snprintf(n, sizeof(n), "file%03u.dat", i);
+		unlink(root, n);
+		files.erase(n);
+	}
+	unlink(root, "README.TXT");
+	files.erase("README.TXT");
+	for(unsigned i = 0; i < 5; i++) {
+		char n[32];
+		snprintf(n, sizeof(n), "refill%u.bin", i);
+		RefPtr<vfs::Inode> ino = create(root, n);
+		if (!ino)
+			continue;
+		std::vector<uint8_t> data = pattern(3000 + i, 300 + i);
+		write(ino, n, data, 0, 4096);
+		model(files[n], data, 0);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 4) {
+		fprintf(stderr, "usage: %s image fat12|fat16|fat32 manifest\n",
+			argv[0]);
+		return 2;
+	}
+	uint8_t type;
+	if (strcmp(argv[2], "fat12") == 0)
+		type = 0x01;
+	else if (strcmp(argv[2], "fat16") == 0)
+		type = 0x06;
+	else if (strcmp(argv[2], "fat32") == 0)
+		type = 0x0c;
+	else {
+		fprintf(stderr, "%s: unknown variant\n", argv[2]);
+		return 2;
+	}
+	HostMSD msd(argv[1], type);
+	if (!msd.ok()) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	FAT_Setup();
+	RefPtr<vfs::Inode> root = HostMSD_Mount(&msd);
+	if (!root) {
+		fprintf(stderr, "%s: no file system found\n", argv[1]);
+		return 1;
+	}
+
+	Files files;
+	exercise(root, files);
+	verify(root, files);
+	std::vector<Throughput> bt;
+	for(size_t chunk : { 512, 4096, 16384 })
+		bt.push_back(bench(&msd, root, chunk));
+
+	//everything has to come back from the image
+	root = RefPtr<vfs::Inode>();
+	HostMSD_Unmount(&msd);
+	root = HostMSD_Mount(&msd);
+	if (!root) {
+		fprintf(stderr, "%s: no file system after remount\n", argv[1]);
+		return 1;
+	}
+	verify(root, files);
+	root = RefPtr<vfs::Inode>();
+	HostMSD_Unmount(&msd);
+	if (failed)
+		return 1;
+
+	FILE *f = fopen(argv[3], "w");
+	if (!f) {
+		fprintf(stderr, "%s: cannot write\n", argv[3]);
+		return 1;
+	}
+	for(auto const &file : files)
+		fprintf(f, "%zu %08x %s\n", file.second.size(),
+			crc32(file.second), file.first.c_str());
+	fclose(f);
+
+	printf("%zu files check out\n", files.size());
+	printf("%6s %12s %8s %12s %8s\n", "chunk", "append KB/s", "writes",
+	       "rewrite KB/s", "writes");
+	for(auto const &t : bt)
+		printf("%6zu %12llu %8llu %12llu %8llu\n", t.chunk,
+		       (unsigned long long)(t.append_us ? BENCH_SIZE * 1000000ULL /
+					    1024 / t.append_us : 0),
+		       (unsigned long long)t.append_requests,
+		       (unsigned long long)(t.overwrite_us ? BENCH_SIZE * 1000000ULL /
+					    1024 / t.overwrite_us : 0),
+		       (unsigned long long)t.overwrite_requests);
+	return 0;
+}
@@ -0,0 +1,611 @@
+
+/* replays a trace of cpc disk accesses against fdc.cpp and dsk.cpp. the
+ * fdc frontend of the fpga is emulated on top of the fpga register stub,
+ * it follows the protocol described in fdc.cpp. times are simulated, image
+ * accesses take the time host/host.hpp assigns to sd card transfers.
+ *
+ * usage: fdcreplay trace
+ *
+ * trace lines, numbers in C notation, image paths relative to the trace:
+ *   insert <drive> <image>
+ *       prints the time until the drive is ready
+ *   create <drive> data|system|ibm|data80|system80
+ *       formats a new image in a temporary directory and inserts it
+ *   eject <drive>
+ *   seek <drive> <cylinder>
+ *   readid <drive> <head> <cylinder>
+ *   read <drive> <head> <cylinder> <C> <H> <R> <N> [<last R>]
+ *   write <drive> <head> <cylinder> <C> <H> <R> <N> [<last R>]
+ *   writedeleted <drive> <head> <cylinder> <C> <H> <R> <N> [<last R>]
+ *   format <drive> <head> <cylinder> <C> <H> <first R> <N> <sectors>
+ *          <gap> <filler>
+ *   wait <us>
+ *   check <crc32>
+ *       compares the crc of the data read since the last check
+ *
+ * sectors written get a pattern derived from their position, reads of
+ * them are checked against it. a multi sector command stops at the first
+ * sector returning an error, like the cpc does.
+ */
+
+#include "host/host.hpp"
+#include "host/fpga.hpp"
+
+#include <fdc/fdc.h>
+#include <fdc/dsk.hpp>
+#include <fpga/layout.h>
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+//byte time of a double density disk
+#define REPLAY_BYTE_US 32
+#define REPLAY_REVOLUTION_US 200000
+#define REPLAY_STEP_US 3000
+//cpc reading the result phase and setting up the next command
+#define REPLAY_CPC_RESULT_US 100
+//simulated time without progress after which the replay gives up
+#define REPLAY_STUCK_US 10000000
+
+enum {
+	CMD_READID = 1,
+	CMD_FORMAT = 2,
+	CMD_READ = 3,
+	CMD_WRITE = 5,
+	CMD_WRITEDELETED = 6,
+};
+
+enum {
+	RESP_CONTROLMARK = 0x02,
+	RESP_MISSINGADDRESSMARK = 0x10,
+	RESP_NODATA = 0x20,
+	RESP_DATAERROR = 0x40,
+	RESP_VALID = 0x80,
+};
+
+struct TraceLine {
+	unsigned lineno;
+	std::string op;
+	std::vector<std::string> args;
+};
+
+static std::vector<TraceLine> trace;
+static unsigned trace_pos;
+static std::string trace_dir;
+static std::string tmp_dir;
+static std::vector<std::string> tmp_images;
+
+static enum {
+	CPC_READY,//the next trace line can run
+	CPC_BUSY,//waiting for a timer or the fdc
+	CPC_DONE,
+} cpc_state = CPC_READY;
+
+static enum {
+	FE_IDLE,
+	FE_LOOKUP,
+	FE_EXECUTION,
+	FE_RESULT,
+} fe_state = FE_IDLE;
+
+//sector command in progress
+static struct {
+	unsigned command;
+	unsigned drive, phn, pcn;
+	unsigned C, H, R, N;
+	unsigned lastR;
+	unsigned spt, gap, filler;
+	uint64_t issue_time;
+	uint64_t lookup_time;
+	uint64_t execdone_time;
+	uint8_t status;
+} cur;
+
+static unsigned cylinder[4];
+static uint64_t last_progress;
+static uint64_t cpc_wait_us;
+static unsigned sector_commands;
+static unsigned error_statuses;
+static unsigned failures;
+
+static uint32_t crc;
+static std::map<std::vector<unsigned>, std::vector<uint8_t> > written;
+
+static uint32_t crc32Update(uint32_t c, uint8_t const *data, size_t len) {
+	c = ~c;
+	while(len--) {
+		c ^= *data++;
+		for(unsigned k = 0; k < 8; k++)
+			c = (c >> 1) ^ (0xedb88320U & -(c & 1));
+	}
+	return ~c;
+}
+
+static void fail(char const *fmt, unsigned a = 0, unsigned b = 0) {
+	fprintf(stderr, "line %u: ", trace[trace_pos-1].lineno);
+	fprintf(stderr, fmt, a, b);
+	fprintf(stderr, "\n");
+	failures++;
+}
+
+static unsigned sectorSize(unsigned N) {
+	unsigned size = 128 << (N & 7);
+	return size < 2048 ? size : 2048;
+}
+
+static std::vector<unsigned> sectorKey() {
+	return std::vector<unsigned>{cur.drive, cur.pcn, cur.phn,
+			cur.C, cur.H, cur.R, cur.N};
+}
+
+static void fillPattern(uint8_t *data, size_t len) {
+	uint32_t v = cur.drive * 0x1000193 + cur.pcn * 0x10001 +
+		cur.phn * 0x301 + cur.C * 0x3f1 + cur.H * 0x1f +
+		cur.R * 0x7f;
+	for(size_t i = 0; i < len; i++) {
+		v = v * 1103515245 + 12345;
+		data[i] = v >> 16;
+	}
+}
+
+static void cpcContinue() {
+	cpc_state = CPC_READY;
+}
+
+static void cpcContinueAfter(uint32_t usec) {
+	cpc_state = CPC_BUSY;
+	Timer_Oneshot(usec, sigc::ptr_fun(&cpcContinue));
+}
+
+static void issueSector() {
+	uint8_t *cmd = HostFPGA_Memory(FPGA_CPC_FDC_INFOBLK, 10);
+	cmd[0] = cur.drive | (cur.phn << 2) | (cur.command << 3) |
+		0x40 | 0x80;
+	cmd[1] = cur.pcn;
+	cmd[2] = cur.C;
+	cmd[3] = cur.H;
+	cmd[4] = cur.R;
+	cmd[5] = cur.N;
+	cmd[6] = cur.N;
+	cmd[7] = cur.spt;
+	cmd[8] = cur.gap;
+	cmd[9] = cur.filler;
+	cur.issue_time = Timer_timeSincePowerOn();
+	fe_state = FE_LOOKUP;
+	cpc_state = CPC_BUSY;
+	sector_commands++;
+	HostFPGA_RaiseIRQ(0x01);
+}
+
+static void executionDone() {
+	uint8_t *cmd = HostFPGA_Memory(FPGA_CPC_FDC_INFOBLK, 1);
+	cmd[0] &= ~(0x80 | 0x38);
+	cur.execdone_time = Timer_timeSincePowerOn();
+	fe_state = FE_RESULT;
+	HostFPGA_RaiseIRQ(0x01);
+}
+
+/* the cpc gets to see the data during the execution phase, the data of
+ * reads is in the data ram once the response arrives.
+ */
+static void startExecution() {
+	uint8_t *ram = HostFPGA_Memory(FPGA_CPC_FDC_DATA, 2048);
+	uint32_t usec = 0;
+	bool error = (cur.status & (RESP_MISSINGADDRESSMARK |
+				    RESP_NODATA)) != 0;
+	switch(cur.command) {
+	case CMD_READID:
+		if (!error)
+			crc = crc32Update(crc, ram, 4);
+		usec = 7 * REPLAY_BYTE_US;
+		break;
+	case CMD_READ: {
+		if (error)
+			break;
+		unsigned size = sectorSize(cur.N);
+		crc = crc32Update(crc, ram, size);
+		auto it = written.find(sectorKey());
+		if (it != written.end() &&
+		    memcmp(it->second.data(), ram, size) != 0)
+			fail("sector %02x on cylinder %u reads back wrong",
+			     cur.R, cur.pcn);
+		usec = size * REPLAY_BYTE_US;
+		break;
+	}
+	case CMD_WRITE:
+	case CMD_WRITEDELETED:
+		if (error)
+			break;
+		fillPattern(ram, sectorSize(cur.N));
+		usec = sectorSize(cur.N) * REPLAY_BYTE_US;
+		break;
+	case CMD_FORMAT:
+		if (error)
+			break;
+		for(unsigned i = 0; i < cur.spt; i++) {
+			ram[i*4+0] = cur.C;
+			ram[i*4+1] = cur.H;
+			ram[i*4+2] = cur.R + i;
+			ram[i*4+3] = cur.N;
+		}
+		usec = REPLAY_REVOLUTION_US;
+		break;
+	}
+	fe_state = FE_EXECUTION;
+	Timer_Oneshot(usec, sigc::ptr_fun(&executionDone));
+}
+
+static void commandDone(uint8_t status) {
+	uint64_t now = Timer_timeSincePowerOn();
+	cpc_wait_us += (cur.lookup_time - cur.issue_time) +
+		(now - cur.execdone_time);
+	fe_state = FE_IDLE;
+	status |= cur.status & ~RESP_VALID;
+	bool ok = (status & (RESP_MISSINGADDRESSMARK | RESP_NODATA |
+			     RESP_DATAERROR)) == 0;
+	if (!ok)
+		error_statuses++;
+	if (ok && (cur.command == CMD_WRITE ||
+		   cur.command == CMD_WRITEDELETED)) {
+		std::vector<uint8_t> data(sectorSize(cur.N));
+		fillPattern(data.data(), data.size());
+		written[sectorKey()] = data;
+	}
+	if (cur.command == CMD_FORMAT && ok) {
+		//everything on the track is gone
+		for(auto it = written.begin(); it != written.end();) {
+			if (it->first[0] == cur.drive &&
+			    it->first[1] == cur.pcn && it->first[2] == cur.phn)
+				it = written.erase(it);
+			else
+				it++;
+		}
+	}
+	last_progress = now;
+	if (ok && (cur.command == CMD_READ || cur.command == CMD_WRITE ||
+		   cur.command == CMD_WRITEDELETED) && cur.R < cur.lastR) {
+		cur.R++;
+		issueSector();
+		return;
+	}
+	cpcContinueAfter(REPLAY_CPC_RESULT_US);
+}
+
+static void fpgaWritten(uint32_t address, size_t len) {
+	if (address > FPGA_CPC_FDC_INSTS ||
+	    address + len <= FPGA_CPC_FDC_INSTS)
+		return;
+	uint8_t status = *HostFPGA_Memory(FPGA_CPC_FDC_INSTS, 1);
+	HostFPGA_ClearIRQ(0x01);
+	if (fe_state == FE_LOOKUP && (status & RESP_VALID)) {
+		cur.lookup_time = Timer_timeSincePowerOn();
+		cur.status = status;
+		startExecution();
+	} else if (fe_state == FE_RESULT && !(status & RESP_VALID)) {
+		commandDone(status);
+	} else {
+		fail("unexpected response %02x", status);
+	}
+}
+
+static bool parseNumbers(TraceLine const &l, unsigned min, unsigned max,
+			 unsigned *v) {
+	if (l.args.size() < min || l.args.size() > max)
+		return false;
+	for(unsigned i = 0; i < l.args.size(); i++) {
+		char *end;
+		v[i] = strtoul(l.args[i].c_str(), &end, 0);
+		if (*end)
+			return false;
+	}
+	return true;
+}
+
+static bool makeTmpDir() {
+	if (tmp_dir.empty()) {
+		char templ[] = "/tmp/fdcreplayXXXXXX";
+		if (!mkdtemp(templ))
+			return false;
+		tmp_dir = templ;
+	}
+	return true;
+}
+
+/* inserts the image at path and prints the time until the drive is
+ * ready, with the image reads it took.
+ */
+static void insertImage(unsigned drive, std::string const &path,
+			std::string const &name) {
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t reads = host_io_stats.reads;
+	uint64_t bytes = host_io_stats.read_bytes;
+	FDC_InsertDisk(drive, path.c_str());
+	printf("insert %s: %llu us to ready, %llu reads, %llu bytes\n",
+	       name.c_str(),
+	       (unsigned long long)(Timer_timeSincePowerOn() - start),
+	       (unsigned long long)(host_io_stats.reads - reads),
+	       (unsigned long long)(host_io_stats.read_bytes - bytes));
+}
+
+static void imageCreated(int result, bool *done, int *res) {
+	*res = result;
+	*done = true;
+}
+
+static bool createImage(unsigned drive, std::string const &format) {
+	static char const *names[dsk::BlankFormatCount] = {
+		"data", "system", "ibm", "data80", "system80"
+	};
+	unsigned f;
+	for(f = 0; f < dsk::BlankFormatCount; f++) {
+		if (format == names[f])
+			break;
+	}
+	if (f == dsk::BlankFormatCount)
+		return false;
+	if (!makeTmpDir())
+		return false;
+	std::string path = tmp_dir + "/" + std::to_string(tmp_images.size()) +
+		".dsk";
+	tmp_images.push_back(path);
+	bool done = false;
+	int res = -1;
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t writes = host_io_stats.writes;
+	uint64_t bytes = host_io_stats.write_bytes;
+	dsk::createImage(path.c_str(), (dsk::BlankFormat)f,
+			 sigc::slot<void(unsigned, unsigned)>(),
+			 sigc::bind(sigc::ptr_fun(&imageCreated), &done, &res));
+	while(!done)
+		Host_Step();
+	if (res != 0)
+		return false;
+	printf("create %s: %llu us, %llu writes, %llu bytes\n",
+	       format.c_str(),
+	       (unsigned long long)(Timer_timeSincePowerOn() - start),
+	       (unsigned long long)(host_io_stats.writes - writes),
+	       (unsigned long long)(host_io_stats.write_bytes - bytes));
+	insertImage(drive, path, format);
+	return true;
+}
+
+/* runs the next trace line. sector commands and delays continue from
+ * the timers and the fpga stub.
+ */
+static void runLine() {
+	if (trace_pos >= trace.size()) {
+		cpc_state = CPC_DONE;
+		return;
+	}
+	TraceLine const &l = trace[trace_pos++];
+	unsigned v[10];
+	last_progress = Timer_timeSincePowerOn();
+	if (l.op == "insert" && l.args.size() == 2) {
+		std::string path = l.args[1];
+		if (path[0] != '/')
+			path = trace_dir + path;
+		insertImage(strtoul(l.args[0].c_str(), NULL, 0) & 3, path,
+			    l.args[1]);
+	} else if (l.op == "create" && l.args.size() == 2) {
+		if (!createImage(strtoul(l.args[0].c_str(), NULL, 0) & 3,
+				 l.args[1]))
+			fail("cannot create the image");
+	} else if (l.op == "eject" && parseNumbers(l, 1, 1, v)) {
+		FDC_EjectDisk(v[0] & 3);
+	} else if (l.op == "seek" && parseNumbers(l, 2, 2, v)) {
+		unsigned drive = v[0] & 3;
+		unsigned steps = v[1] > cylinder[drive] ?
+			v[1] - cylinder[drive] : cylinder[drive] - v[1];
+		cylinder[drive] = v[1];
+		*HostFPGA_Memory(FPGA_CPC_FDC_FDD_NCN(drive), 1) = v[1];
+		cpcContinueAfter(steps * REPLAY_STEP_US);
+	} else if (l.op == "wait" && parseNumbers(l, 1, 1, v)) {
+		cpcContinueAfter(v[0]);
+	} else if (l.op == "check" && parseNumbers(l, 1, 1, v)) {
+		if (crc != v[0])
+			fail("crc is 0x%08x, expected 0x%08x", crc, v[0]);
+		crc = 0;
+	} else if (l.op == "readid" && parseNumbers(l, 3, 3, v)) {
+		memset(&cur, 0, sizeof(cur));
+		cur.command = CMD_READID;
+		cur.drive = v[0] & 3;
+		cur.phn = v[1] & 1;
+		cur.pcn = v[2];
+		issueSector();
+	} else if ((l.op == "read" || l.op == "write" ||
+		    l.op == "writedeleted") && parseNumbers(l, 7, 8, v)) {
+		memset(&cur, 0, sizeof(cur));
+		cur.command = l.op == "read" ? CMD_READ :
+			l.op == "write" ? CMD_WRITE : CMD_WRITEDELETED;
+		cur.drive = v[0] & 3;
+		cur.phn = v[1] & 1;
+		cur.pcn = v[2];
+		cur.C = v[3];
+		cur.H = v[4];
+		cur.R = v[5];
+		cur.N = v[6];
+		cur.lastR = l.args.size() > 7 ? v[7] : v[5];
+		issueSector();
+	} else if (l.op == "format" && parseNumbers(l, 10, 10, v)) {
+		memset(&cur, 0, sizeof(cur));
+		cur.command = CMD_FORMAT;
+		cur.drive = v[0] & 3;
+		cur.phn = v[1] & 1;
+		cur.pcn = v[2];
+		cur.C = v[3];
+		cur.H = v[4];
+		cur.R = v[5];
+		cur.N = v[6];
+		cur.spt = v[7];
+		cur.gap = v[8];
+		cur.filler = v[9];
+		issueSector();
+	} else {
+		fail("cannot parse the line");
+	}
+}
+
+static bool readTrace(char const *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f)
+		return false;
+	char buf[512];
+	unsigned lineno = 0;
+	while(fgets(buf, sizeof(buf), f)) {
+		lineno++;
+		char *hash = strchr(buf, '#');
+		if (hash)
+			*hash = 0;
+		TraceLine l;
+		l.lineno = lineno;
+		for(char *tok = strtok(buf, " \t\r\n"); tok;
+		    tok = strtok(NULL, " \t\r\n")) {
+			if (l.op.empty())
+				l.op = tok;
+			else
+				l.args.push_back(tok);
+		}
+		if (!l.op.empty())
+			trace.push_back(l);
+	}
+	fclose(f);
+	std::string name = filename;
+	size_t slash = name.rfind('/');
+	trace_dir = slash == std::string::npos ? "" : name.substr(0, slash+1);
+	return true;
+}
+
+void FDC_MotorOn() {
+}
+
+void FDC_MotorOff() {
+}
+
+void FDC_Activity(int /*drive*/, int /*activity*/) {
+}
+
+static void report(uint64_t total) {
+	static char const *names[8] = {
+		NULL, "read id", "format", "read data", NULL, "write data",
+		"write deleted", NULL
+	};
+	printf("%-14s %6s %10s %10s %10s %10s %8s\n", "command", "count",
+	       "lookup us", "worst", "final us", "worst", "reads");
+	for(unsigned c = 0; c < 8; c++) {
+		FDCCommandInfo ci = FDC_CommandInfo(c);
+		if (!names[c] || ci.count == 0)
+			continue;
+		printf("%-14s %6u %10llu %10u %10llu %10u %8u\n", names[c],
+		       ci.count,
+		       (unsigned long long)(ci.total_lookup / ci.count),
+		       ci.worst_lookup,
+		       (unsigned long long)(ci.total_final / ci.count),
+		       ci.worst_final, ci.image_reads);
+	}
+	dsk::DiskCacheInfo cache = dsk::cacheInfo();
+	printf("sector commands: %u, %u with error status\n",
+	       sector_commands, error_statuses);
+	printf("sd reads: %llu, %llu bytes; writes: %llu, %llu bytes\n",
+	       (unsigned long long)host_io_stats.reads,
+	       (unsigned long long)host_io_stats.read_bytes,
+	       (unsigned long long)host_io_stats.writes,
+	       (unsigned long long)host_io_stats.write_bytes);
+	printf("cylinder cache: %u hits, %u misses\n",
+	       cache.hits, cache.misses);
+	printf("emulated time: %llu us, cpc waiting for the box: %llu us\n",
+	       (unsigned long long)total, (unsigned long long)cpc_wait_us);
+}
+
+/* the trace saved by the fdc has to hold the commands it keeps, one per
+ * line with all of the fields.
+ */
+static void checkSavedTrace() {
+	std::vector<FDCTraceEntry> entries(FDC_TRACE_SIZE);
+	unsigned n = FDC_Trace(entries.data(), entries.size());
+	if (!makeTmpDir()) {
+		fprintf(stderr, "cannot create a temporary directory\n");
+		failures++;
+		return;
+	}
+	std::string path = tmp_dir + "/fdc.trace";
+	FILE *f = NULL;
+	if (FDC_SaveTrace(path.c_str()) == 0)
+		f = fopen(path.c_str(), "r");
+	if (!f) {
+		fprintf(stderr, "saving the fdc trace failed\n");
+		failures++;
+		return;
+	}
+	char line[256];
+	unsigned lines = 0;
+	bool ok = fgets(line, sizeof(line), f) && line[0] == '#';
+	while(ok && fgets(line, sizeof(line), f)) {
+		int v[13];
+		if (lines >= n) {
+			ok = false;
+			break;
+		}
+		FDCTraceEntry const &t = entries[n - 1 - lines];
+		//the ids and the status are in hex
+		ok = sscanf(line, "%i %i %i %i %i %i %i %i %i %i %i %i %i",
+			    &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6],
+			    &v[7], &v[8], &v[9], &v[10], &v[11], &v[12]) == 13 &&
+			v[2] == t.command && v[6] == t.R &&
+			(uint32_t)v[12] == t.final;
+		lines++;
+	}
+	fclose(f);
+	unlink(path.c_str());
+	if (!ok || lines != n) {
+		fprintf(stderr, "saved fdc trace does not match, %u of %u "
+			"commands\n", lines, n);
+		failures++;
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s trace\n", argv[0]);
+		return 2;
+	}
+	if (!readTrace(argv[1])) {
+		perror(argv[1]);
+		return 2;
+	}
+	HostFPGA_WriteSignal().connect(sigc::ptr_fun(&fpgaWritten));
+	FDC_Setup();
+	*HostFPGA_Memory(FPGA_CPC_FDC_MOTOR, 1) = 1;
+	uint64_t start = Timer_timeSincePowerOn();
+	last_progress = start;
+	while(cpc_state != CPC_DONE) {
+		if (cpc_state == CPC_READY) {
+			runLine();
+			continue;
+		}
+		Host_Step();
+		if (Timer_timeSincePowerOn() - last_progress >
+		    REPLAY_STUCK_US) {
+			fail("no progress, the fdc is stuck");
+			break;
+		}
+	}
+	uint64_t total = Timer_timeSincePowerOn() - start;
+	for(unsigned d = 0; d < 4; d++)
+		FDC_EjectDisk(d);
+	Host_RunIdle();
+	report(total);
+	checkSavedTrace();
+	for(auto &p : tmp_images) {
+		unlink(p.c_str());
+		unlink((p + ".jnl").c_str());
+	}
+	if (!tmp_dir.empty())
+		rmdir(tmp_dir.c_str());
+	return failures ? 1 : 0;
+}
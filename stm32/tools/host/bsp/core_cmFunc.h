@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/* the host tools run everything from one thread, interrupts are only
+ * emulated by calling the handlers from the main loop. BASEPRI is kept
+ * so nesting of ISR_Guard still works as on the target.
+ */
+extern uint32_t host_basepri;
+
+static inline uint32_t __get_BASEPRI(void) {
+	return host_basepri;
+}
+
+static inline void __set_BASEPRI(uint32_t value) {
+	host_basepri = value;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+/* stands in for the device header when building firmware sources for the
+ * host. only what the shared headers need is provided.
+ */
+
+#include <stdint.h>
+
+//the handler declarations in irq.h, no meaning on the host
+#define interrupt used
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+
+typedef enum {
+	EXTI9_5_IRQn = 23,
+	SDIO_IRQn = 49,
+	DMA2_Stream3_IRQn = 59,
+} IRQn_Type;
+
+/* the ports only hold the pin levels. inputs are set by the models of
+ * what is connected, see host/gpio.hpp.
+ */
+typedef struct GPIO_TypeDef {
+	uint32_t IDR;
+	uint32_t ODR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef host_gpio[4];
+
+#define GPIOA (&host_gpio[0])
+#define GPIOB (&host_gpio[1])
+#define GPIOC (&host_gpio[2])
+#define GPIOD (&host_gpio[3])
+
+//misc.h on the target
+typedef struct {
+	uint8_t NVIC_IRQChannel;
+	uint8_t NVIC_IRQChannelPreemptionPriority;
+	uint8_t NVIC_IRQChannelSubPriority;
+	FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct);
+
+#ifdef __cplusplus
+}
+#endif
+
+//core_cmInstr.h on the target, stops the host tool instead
+#define __BKPT(value) __builtin_trap()
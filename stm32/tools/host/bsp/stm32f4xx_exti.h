@@ -0,0 +1,47 @@
+#pragma once
+
+#include "stm32f4xx.h"
+
+typedef enum {
+	EXTI_Mode_Interrupt = 0x00,
+	EXTI_Mode_Event = 0x04,
+} EXTIMode_TypeDef;
+
+typedef enum {
+	EXTI_Trigger_Rising = 0x08,
+	EXTI_Trigger_Falling = 0x0C,
+	EXTI_Trigger_Rising_Falling = 0x10,
+} EXTITrigger_TypeDef;
+
+typedef struct {
+	uint32_t EXTI_Line;
+	EXTIMode_TypeDef EXTI_Mode;
+	EXTITrigger_TypeDef EXTI_Trigger;
+	FunctionalState EXTI_LineCmd;
+} EXTI_InitTypeDef;
+
+#define EXTI_Line0 ((uint32_t)0x00001)
+#define EXTI_Line1 ((uint32_t)0x00002)
+#define EXTI_Line2 ((uint32_t)0x00004)
+#define EXTI_Line3 ((uint32_t)0x00008)
+#define EXTI_Line4 ((uint32_t)0x00010)
+#define EXTI_Line5 ((uint32_t)0x00020)
+#define EXTI_Line6 ((uint32_t)0x00040)
+#define EXTI_Line7 ((uint32_t)0x00080)
+#define EXTI_Line8 ((uint32_t)0x00100)
+#define EXTI_Line9 ((uint32_t)0x00200)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void EXTI_Init(EXTI_InitTypeDef *EXTI_InitStruct);
+void EXTI_StructInit(EXTI_InitTypeDef *EXTI_InitStruct);
+void EXTI_GenerateSWInterrupt(uint32_t EXTI_Line);
+ITStatus EXTI_GetITStatus(uint32_t EXTI_Line);
+void EXTI_ClearFlag(uint32_t EXTI_Line);
+void EXTI_ClearITPendingBit(uint32_t EXTI_Line);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "stm32f4xx.h"
+
+#define RCC_AHB1Periph_GPIOA ((uint32_t)0x00000001)
+#define RCC_AHB1Periph_GPIOB ((uint32_t)0x00000002)
+#define RCC_AHB1Periph_GPIOC ((uint32_t)0x00000004)
+#define RCC_AHB1Periph_GPIOD ((uint32_t)0x00000008)
+#define RCC_APB2Periph_SYSCFG ((uint32_t)0x00004000)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void RCC_AHB1PeriphClockCmd(uint32_t RCC_AHB1Periph, FunctionalState NewState);
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,219 @@
+
+#include "fpga.hpp"
+
+#include <fpga/fpga_comm.hpp>
+#include <fpga/layout.h>
+#include <timer.hpp>
+#include <bits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+
+//spi at 20MBit/s, three address bytes per transfer and the dma setup
+#define HOST_FPGA_NS_PER_BYTE 400
+#define HOST_FPGA_SETUP_NS 2000
+
+static uint8_t fdc_memory[0x1000];
+static uint8_t irq_status;
+static uint8_t irq_mask;
+static bool irq_line = false;
+
+static FPGAComm_Command *fpga_current_command = NULL;
+static std::deque<FPGAComm_Command *> workqueue;
+static sigc::signal<void(uint32_t, size_t)> write_signal;
+
+uint8_t *HostFPGA_Memory(uint32_t address, size_t len) {
+	if (address >= FPGA_CPC_FDC_BASE &&
+	    address + len <= FPGA_CPC_FDC_BASE + sizeof(fdc_memory))
+		return fdc_memory + (address - FPGA_CPC_FDC_BASE);
+	if (address == FPGA_INT_IRQSTS && len == 1)
+		return &irq_status;
+	if (address == FPGA_INT_IRQMSK && len == 1)
+		return &irq_mask;
+	return NULL;
+}
+
+sigc::signal<void(uint32_t, size_t)> &HostFPGA_WriteSignal() {
+	return write_signal;
+}
+
+static void irqLineChanged();
+
+static void updateIRQLine() {
+	bool line = (irq_status & irq_mask) != 0;
+	if (line == irq_line)
+		return;
+	irq_line = line;
+	//the exti only reacts on the rising edge
+	if (line)
+		irqLineChanged();
+}
+
+void HostFPGA_RaiseIRQ(unsigned mask) {
+	irq_status |= mask;
+	updateIRQLine();
+}
+
+void HostFPGA_ClearIRQ(unsigned mask) {
+	irq_status &= ~mask;
+	updateIRQLine();
+}
+
+void FPGAComm_Setup() {
+}
+
+static void issueCommand(FPGAComm_Command *command);
+
+static void commandComplete() {
+	FPGAComm_Command *command = fpga_current_command;
+	uint8_t *mem = HostFPGA_Memory(command->address, command->length);
+	if (!mem) {
+		fprintf(stderr, "fpga access to %06x, %u bytes\n",
+			(unsigned)command->address, (unsigned)command->length);
+		abort();
+	}
+	//only the unmasked irqs are visible in the status
+	uint8_t status = irq_status & irq_mask;
+	if (command->address == FPGA_INT_IRQSTS)
+		mem = &status;
+	if (command->read_data)
+		memcpy(command->read_data, mem, command->length);
+	if (command->write_data)
+		memcpy(mem, command->write_data, command->length);
+	if (!workqueue.empty()) {
+		issueCommand(workqueue.front());
+		workqueue.pop_front();
+	} else {
+		fpga_current_command = NULL;
+	}
+	if (command->write_data) {
+		write_signal(command->address, command->length);
+		updateIRQLine();
+	}
+	if (command->slot)
+		command->slot(0);
+}
+
+static void issueCommand(FPGAComm_Command *command) {
+	fpga_current_command = command;
+	command->state = 0;
+	unsigned ns = HOST_FPGA_SETUP_NS +
+		(3 + command->length) * HOST_FPGA_NS_PER_BYTE;
+	Timer_Oneshot((ns + 999) / 1000, sigc::ptr_fun(&commandComplete));
+}
+
+void FPGAComm_ReadWriteCommand(FPGAComm_Command *command) {
+	if (!fpga_current_command)
+		issueCommand(command);
+	else
+		workqueue.push_back(command);
+}
+
+struct FPGAComm_FPGAComm_Command {
+	uint32_t completed;
+	FPGAComm_Command command;
+};
+
+static void FPGAComm_Completion(int /*result*/,
+				FPGAComm_FPGAComm_Command *c) {
+	c->completed = 1;
+}
+
+void FPGAComm_CopyFromToFPGA(void *dest, uint32_t fpga, void const *src,
+			     size_t n) {
+	FPGAComm_FPGAComm_Command comm;
+	comm.completed = 0;
+	comm.command.address = fpga;
+	comm.command.length = n;
+	comm.command.read_data = dest;
+	comm.command.write_data = src;
+	comm.command.slot = sigc::bind(sigc::ptr_fun(&FPGAComm_Completion),
+				       &comm);
+
+	FPGAComm_ReadWriteCommand(&comm.command);
+	while(!comm.completed)
+		sched_yield();
+}
+
+void FPGAComm_CopyToFPGA(uint32_t dest, void const *src, size_t n) {
+	FPGAComm_CopyFromToFPGA(NULL, dest, src, n);
+}
+
+void FPGAComm_CopyFromFPGA(void *dest, uint32_t src, size_t n) {
+	FPGAComm_CopyFromToFPGA(dest, src, NULL, n);
+}
+
+static sigc::signal<void> FPGAComm_IRQHandlers[8];
+
+sigc::signal<void> &FPGAComm_IRQHandler(unsigned int num) {
+	return FPGAComm_IRQHandlers[num];
+}
+
+static uint8_t FPGAComm_IRQ_mask = 0;
+
+void FPGAComm_EnableIRQs(unsigned int mask) {
+	FPGAComm_IRQ_mask |= mask;
+	FPGAComm_CopyToFPGA(FPGA_INT_IRQMSK, &FPGAComm_IRQ_mask, 1);
+}
+
+void FPGAComm_DisableIRQs(unsigned int mask) {
+	FPGAComm_IRQ_mask &= ~mask;
+	FPGAComm_CopyToFPGA(FPGA_INT_IRQMSK, &FPGAComm_IRQ_mask, 1);
+}
+
+void FPGAComm_EnableIRQs_nb(unsigned int mask, FPGAComm_Command *command) {
+	FPGAComm_IRQ_mask |= mask;
+	command->address = FPGA_INT_IRQMSK;
+	command->length = 1;
+	command->read_data = NULL;
+	command->write_data = &FPGAComm_IRQ_mask;
+	FPGAComm_ReadWriteCommand(command);
+}
+
+void FPGAComm_DisableIRQs_nb(unsigned int mask, FPGAComm_Command *command) {
+	FPGAComm_IRQ_mask &= ~mask;
+	command->address = FPGA_INT_IRQMSK;
+	command->length = 1;
+	command->read_data = NULL;
+	command->write_data = &FPGAComm_IRQ_mask;
+	FPGAComm_ReadWriteCommand(command);
+}
+
+//the irq fetch as done by fpga_comm
+static bool FPGAComm_IRQFetchInProgress = false;
+static bool FPGAComm_IRQSeenAgain = false;
+static uint8_t FPGAComm_IRQ_status;
+static void FPGAComm_IRQFetch_Completion(int result);
+static FPGAComm_Command FPGAComm_IRQFetch_Command = {
+	.address = FPGA_INT_IRQSTS,
+	.length = 1,
+	.read_data = &FPGAComm_IRQ_status,
+	.write_data = NULL,
+	.slot = sigc::ptr_fun(&FPGAComm_IRQFetch_Completion),
+	FPGAComm_Command_Private_Init,
+};
+
+static void FPGAComm_IRQFetch_Completion(int /*result*/) {
+	if (FPGAComm_IRQSeenAgain) {
+		FPGAComm_IRQSeenAgain = false;
+		FPGAComm_ReadWriteCommand(&FPGAComm_IRQFetch_Command);
+		return;
+	}
+	FPGAComm_IRQFetchInProgress = false;
+	uint8_t status = FPGAComm_IRQ_status;
+	for(unsigned i = 0; i < 7; i++) {
+		if (status & (1<<i))
+			FPGAComm_IRQHandlers[i]();
+	}
+}
+
+static void irqLineChanged() {
+	if (FPGAComm_IRQFetchInProgress) {
+		FPGAComm_IRQSeenAgain = true;
+	} else {
+		FPGAComm_IRQFetchInProgress = true;
+		FPGAComm_ReadWriteCommand(&FPGAComm_IRQFetch_Command);
+	}
+}
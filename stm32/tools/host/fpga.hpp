@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sigc++/sigc++.h>
+
+/* host stand-in for the fpga behind fpga_comm. transfers are queued and
+ * take the time they would take on the spi bus, the irq line works like
+ * the one of the fpga. only the fdc registers and the irq registers exist,
+ * the emulated frontend accesses them directly.
+ */
+
+/** \brief Address of emulated fpga memory
+ *
+ * \return Pointer to the memory at address, NULL if [address,
+ *         address+len) is not emulated
+ */
+uint8_t *HostFPGA_Memory(uint32_t address, size_t len);
+/** \brief Called after the firmware wrote to the fpga
+ *
+ * Gets the address and length of the write, after the data has been
+ * stored.
+ */
+sigc::signal<void(uint32_t, size_t)> &HostFPGA_WriteSignal();
+//sets or clears bits in the irq status register
+void HostFPGA_RaiseIRQ(unsigned mask);
+void HostFPGA_ClearIRQ(unsigned mask);
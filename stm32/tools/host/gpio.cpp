@@ -0,0 +1,116 @@
+#include "gpio.hpp"
+#include "host.hpp"
+
+#include <bsp/stm32f4xx_gpio.h>
+#include <bsp/stm32f4xx_rcc.h>
+#include <bsp/stm32f4xx_exti.h>
+#include <bsp/stm32f4xx_syscfg.h>
+#include <irq.h>
+#include <deferredwork.hpp>
+#include <sigc++/sigc++.h>
+
+GPIO_TypeDef host_gpio[4] = {
+	{ 0xffff, 0 }, { 0xffff, 0 }, { 0xffff, 0 }, { 0xffff, 0 },
+};
+
+//port of each EXTI line, and the edges it triggers on
+static uint8_t exti_port[16];
+static uint32_t exti_rising;
+static uint32_t exti_falling;
+static uint32_t exti_pending;
+
+static void Host_EXTI_Dispatch(uint32_t lines) {
+	if (lines & 0x03e0)
+		EXTI9_5_IRQHandler();
+}
+
+static void Host_EXTI_Raise(uint32_t line) {
+	exti_pending |= line;
+	addDeferredWork(sigc::bind(sigc::ptr_fun(&Host_EXTI_Dispatch), line));
+}
+
+void Host_GPIO_Set(GPIO_TypeDef *port, uint16_t pin, bool high) {
+	bool was = port->IDR & pin;
+	if (high)
+		port->IDR |= pin;
+	else
+		port->IDR &= ~pin;
+	for(unsigned i = 0; i < 16; i++) {
+		if (pin != (1 << i) || &host_gpio[exti_port[i]] != port ||
+		    was == high)
+			continue;
+		if ((high && (exti_rising & pin)) ||
+		    (!high && (exti_falling & pin)))
+			Host_EXTI_Raise(pin);
+	}
+}
+
+void GPIO_Init(GPIO_TypeDef * /*GPIOx*/, GPIO_InitTypeDef * /*init*/) {
+}
+
+void GPIO_StructInit(GPIO_InitTypeDef *init) {
+	init->GPIO_Pin = 0xffff;
+	init->GPIO_Mode = GPIO_Mode_IN;
+	init->GPIO_Speed = GPIO_Speed_2MHz;
+	init->GPIO_OType = GPIO_OType_PP;
+	init->GPIO_PuPd = GPIO_PuPd_NOPULL;
+}
+
+uint8_t GPIO_ReadInputDataBit(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+	return (GPIOx->IDR & GPIO_Pin) ? Bit_SET : Bit_RESET;
+}
+
+void GPIO_SetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+	GPIOx->ODR |= GPIO_Pin;
+}
+
+void GPIO_ResetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin) {
+	GPIOx->ODR &= ~GPIO_Pin;
+}
+
+void RCC_AHB1PeriphClockCmd(uint32_t /*periph*/, FunctionalState /*state*/) {
+}
+
+void RCC_APB2PeriphClockCmd(uint32_t /*periph*/, FunctionalState /*state*/) {
+}
+
+void SYSCFG_EXTILineConfig(uint8_t port, uint8_t pin) {
+	exti_port[pin] = port;
+}
+
+void EXTI_Init(EXTI_InitTypeDef *init) {
+	exti_rising &= ~init->EXTI_Line;
+	exti_falling &= ~init->EXTI_Line;
+	if (!init->EXTI_LineCmd)
+		return;
+	if (init->EXTI_Trigger != EXTI_Trigger_Falling)
+		exti_rising |= init->EXTI_Line;
+	if (init->EXTI_Trigger != EXTI_Trigger_Rising)
+		exti_falling |= init->EXTI_Line;
+}
+
+void EXTI_StructInit(EXTI_InitTypeDef *init) {
+	init->EXTI_Line = 0;
+	init->EXTI_Mode = EXTI_Mode_Interrupt;
+	init->EXTI_Trigger = EXTI_Trigger_Falling;
+	init->EXTI_LineCmd = DISABLE;
+}
+
+void EXTI_GenerateSWInterrupt(uint32_t EXTI_Line) {
+	Host_EXTI_Raise(EXTI_Line);
+}
+
+ITStatus EXTI_GetITStatus(uint32_t EXTI_Line) {
+	return (exti_pending & EXTI_Line) ? SET : RESET;
+}
+
+void EXTI_ClearFlag(uint32_t EXTI_Line) {
+	exti_pending &= ~EXTI_Line;
+}
+
+void EXTI_ClearITPendingBit(uint32_t EXTI_Line) {
+	exti_pending &= ~EXTI_Line;
+}
+
+void NVIC_Init(NVIC_InitTypeDef * /*init*/) {
+}
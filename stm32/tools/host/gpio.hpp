@@ -0,0 +1,11 @@
+#pragma once
+
+#include <bsp/stm32f4xx.h>
+
+/* pin levels and the external interrupts they trigger. all pins read
+ * high after start, as with the pull-ups the board has. an input changed
+ * with Host_GPIO_Set raises the EXTI line configured for it, and the
+ * handler runs from the main loop like any other interrupt.
+ */
+
+void Host_GPIO_Set(GPIO_TypeDef *port, uint16_t pin, bool high);
@@ -0,0 +1,203 @@
+
+#include "host.hpp"
+
+#include <timer.hpp>
+#include <deferredwork.hpp>
+#include <irq.h>
+#include <bits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <map>
+#include <list>
+
+uint32_t host_basepri;
+struct HostIOStats host_io_stats;
+long host_write_cut = -1;
+bool host_power_cut = false;
+
+struct Timer {
+	uint32_t interval;
+	sigc::slot<void> slot;
+	Timer(sigc::slot<void> slot)
+		: interval(0), slot(slot)
+	{
+		slot.set_parent(this, &Timer::notify);
+	}
+	Timer(uint32_t interval, sigc::slot<void> slot)
+		: interval(interval), slot(slot)
+	{
+		slot.set_parent(this, &Timer::notify);
+	}
+	static void *notify(void* data);
+};
+
+static uint64_t counter = 0;
+static std::multimap<uint64_t, Timer*> timers;
+static unsigned oneshots = 0;
+static std::list<sigc::slot<void> > deferred_work;
+
+void* Timer::notify(void* data) {
+	Timer *_this = static_cast<Timer*>(data);
+
+	for(auto it = timers.begin(); it != timers.end(); it++) {
+		if(it->second == _this) {
+			timers.erase(it);
+			if (_this->interval == 0)
+				oneshots--;
+			break;
+		}
+	}
+	delete _this;
+	return nullptr;
+}
+
+uint64_t Timer_timeSincePowerOn() {
+	return counter;
+}
+
+sigc::connection Timer_Oneshot(uint32_t usec, sigc::slot<void> const &slot) {
+	Timer *t = new Timer(slot);
+	timers.insert(std::make_pair(counter + usec, t));
+	oneshots++;
+	return sigc::connection(t->slot);
+}
+
+sigc::connection Timer_Repeating(uint32_t usec, sigc::slot<void> const &slot) {
+	Timer *t = new Timer(usec, slot);
+	timers.insert(std::make_pair(counter + usec, t));
+	return sigc::connection(t->slot);
+}
+
+void addDeferredWork(sigc::slot<void> const &work) {
+	deferred_work.push_back(work);
+}
+
+bool doDeferredWork() {
+	if(deferred_work.empty())
+		return false;
+	sigc::slot<void> work = deferred_work.front();
+	deferred_work.pop_front();
+	work();
+	return true;
+}
+
+static bool runTimer() {
+	auto it = timers.begin();
+	if (it == timers.end())
+		return false;
+	std::pair<uint64_t,Timer*> d = *it;
+	timers.erase(it);
+	if (d.first > counter)
+		counter = d.first;
+	if (d.second->interval != 0) {
+		d.first += d.second->interval;
+		timers.insert(d);
+	} else {
+		oneshots--;
+	}
+	d.second->slot();
+	if (d.second->interval == 0)
+		delete d.second;
+	return true;
+}
+
+bool Host_Step() {
+	if (doDeferredWork())
+		return true;
+	return runTimer();
+}
+
+void Host_RunUntil(uint64_t usec) {
+	while(true) {
+		if (doDeferredWork())
+			continue;
+		auto it = timers.begin();
+		if (it == timers.end() || it->first > usec)
+			break;
+		runTimer();
+	}
+	if (counter < usec)
+		counter = usec;
+}
+
+void Host_RunIdle() {
+	while(!deferred_work.empty() || oneshots != 0)
+		Host_Step();
+}
+
+//the firmware only waits in the main loop, so does the host.
+int sched_yield() {
+	if (!Host_Step()) {
+		fprintf(stderr, "waiting with nothing left to do\n");
+		abort();
+	}
+	return 0;
+}
+
+uint32_t Host_TransferTime(size_t len) {
+	return HOST_SD_LATENCY_US + (len * HOST_SD_US_PER_KB + 1023) / 1024;
+}
+
+static void preadComplete(int fd, aio::PReadCommand *command) {
+	host_io_stats.reads++;
+	ssize_t res = ::pread(fd, command->ptr, command->len,
+			      command->offset);
+	if (res < 0) {
+		command->slot(-1, errno);
+		return;
+	}
+	host_io_stats.read_bytes += res;
+	command->slot(res, 0);
+}
+
+static void pwriteComplete(int fd, aio::PWriteCommand *command) {
+	host_io_stats.writes++;
+	if (host_write_cut == 0 && !host_power_cut) {
+		//the last write is torn
+		host_power_cut = true;
+		ssize_t torn = ::pwrite(fd, command->ptr, command->len / 2,
+					command->offset);
+		(void)torn;
+	}
+	if (host_power_cut) {
+		command->slot(-1, EIO);
+		return;
+	}
+	if (host_write_cut > 0)
+		host_write_cut--;
+	ssize_t res = ::pwrite(fd, command->ptr, command->len,
+			       command->offset);
+	if (res < 0) {
+		command->slot(-1, errno);
+		return;
+	}
+	host_io_stats.write_bytes += res;
+	command->slot(res, 0);
+}
+
+namespace aio {
+	int pread(int fd, struct PReadCommand *command) {
+		if (fd < 0) {
+			errno = EBADF;
+			return -1;
+		}
+		Timer_Oneshot(Host_TransferTime(command->len),
+			      sigc::bind(sigc::ptr_fun(&preadComplete),
+					 fd, command));
+		return 0;
+	}
+
+	int pwrite(int fd, struct PWriteCommand *command) {
+		if (fd < 0) {
+			errno = EBADF;
+			return -1;
+		}
+		Timer_Oneshot(Host_TransferTime(command->len),
+			      sigc::bind(sigc::ptr_fun(&pwriteComplete),
+					 fd, command));
+		return 0;
+	}
+}
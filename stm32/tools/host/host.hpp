@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* runtime for firmware sources built for the host: simulated time, timers,
+ * deferred work and aio on top of the host file system. everything runs
+ * from one thread, time only advances when nothing else is left to do.
+ *
+ * image reads and writes complete from the main loop after a delay
+ * modelling the sd card, so the time a disk operation takes on the box
+ * can be estimated from the simulated time.
+ */
+
+//command overhead of one sd card transfer
+#define HOST_SD_LATENCY_US 800
+//transfer time per KiB, about 10MB/s
+#define HOST_SD_US_PER_KB 100
+
+struct HostIOStats {
+	uint64_t reads;
+	uint64_t read_bytes;
+	uint64_t writes;
+	uint64_t write_bytes;
+};
+
+extern struct HostIOStats host_io_stats;
+
+/* power cut for fault injection: once host_write_cut more image writes
+ * have completed, the next one only gets the first half of its data to
+ * the file and fails, and all writes after it fail without writing
+ * anything. -1 for no cut. host_power_cut tells whether it happened,
+ * both get set back by the caller.
+ */
+extern long host_write_cut;
+extern bool host_power_cut;
+
+//time an sd card transfer of len bytes takes
+uint32_t Host_TransferTime(size_t len);
+
+/* runs one deferred work item, or the next timer if there is no work,
+ * advancing the time to it. returns false if neither is left.
+ */
+bool Host_Step();
+//runs until the time reaches usec or nothing is left to do.
+void Host_RunUntil(uint64_t usec);
+//runs until nothing but repeating timers is left.
+void Host_RunIdle();
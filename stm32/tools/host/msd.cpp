@@ -0,0 +1,147 @@
+
+#include "msd.hpp"
+#include "host.hpp"
+
+#include <timer.hpp>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+
+HostMSD::HostMSD(char const *image, uint8_t type)
+	: MSD(512)
+	, trace(NULL)
+	, type(type)
+	, busy(false)
+{
+	memset(&stats, 0, sizeof(stats));
+	fd = ::open(image, O_RDWR);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0)
+		size = HOST_MSD_FIRST_BLOCK + st.st_size / 512;
+}
+
+HostMSD::~HostMSD() {
+	if (fd >= 0)
+		::close(fd);
+}
+
+void HostMSD::readBlocks(struct MSDReadCommand *command) {
+	if (trace)
+		fprintf(trace, "%llu R %u %u\n",
+			(unsigned long long)Timer_timeSincePowerOn(),
+			(unsigned)command->start_block,
+			(unsigned)command->num_blocks);
+	Request r = { command, NULL };
+	queue.push_back(r);
+	if (!busy)
+		start();
+}
+
+void HostMSD::writeBlocks(struct MSDWriteCommand *command) {
+	if (trace)
+		fprintf(trace, "%llu W %u %u\n",
+			(unsigned long long)Timer_timeSincePowerOn(),
+			(unsigned)command->start_block,
+			(unsigned)command->num_blocks);
+	Request r = { NULL, command };
+	queue.push_back(r);
+	if (!busy)
+		start();
+}
+
+void HostMSD::start() {
+	busy = true;
+	Request const &r = queue.front();
+	uint32_t blocks = r.read ? r.read->num_blocks : r.write->num_blocks;
+	Timer_Oneshot(Host_TransferTime(blocks * 512),
+		      sigc::mem_fun(this, &HostMSD::complete));
+}
+
+/* the mbr, everything else in front of the partition reads as zeros.
+ */
+int HostMSD::transfer(Request const &r) {
+	uint32_t start = r.read ? r.read->start_block : r.write->start_block;
+	uint32_t blocks = r.read ? r.read->num_blocks : r.write->num_blocks;
+	if (start + blocks > size || blocks == 0)
+		return -1;
+	for(uint32_t i = 0; i < blocks; i++) {
+		uint32_t block = start + i;
+		if (r.write) {
+			if (block < HOST_MSD_FIRST_BLOCK)
+				return -1;
+			if (pwrite(fd, (char const *)r.write->src + i * 512, 512,
+				   (off_t)(block - HOST_MSD_FIRST_BLOCK) * 512)
+			    != 512)
+				return -1;
+			continue;
+		}
+		uint8_t *dst = (uint8_t *)r.read->dst + i * 512;
+		if (block >= HOST_MSD_FIRST_BLOCK) {
+			if (pread(fd, dst, 512,
+				  (off_t)(block - HOST_MSD_FIRST_BLOCK) * 512)
+			    != 512)
+				return -1;
+			continue;
+		}
+		memset(dst, 0, 512);
+		if (block != 0)
+			continue;
+		uint8_t *part = dst + 446;
+		uint32_t first = HOST_MSD_FIRST_BLOCK;
+		uint32_t count = size - HOST_MSD_FIRST_BLOCK;
+		part[4] = type;
+		memcpy(part + 8, &first, 4);
+		memcpy(part + 12, &count, 4);
+		dst[510] = 0x55;
+		dst[511] = 0xaa;
+	}
+	return 0;
+}
+
+void HostMSD::complete() {
+	Request r = queue.front();
+	queue.pop_front();
+	int res = transfer(r);
+	if (r.read) {
+		stats.reads++;
+		stats.read_blocks += r.read->num_blocks;
+	} else {
+		stats.writes++;
+		stats.write_blocks += r.write->num_blocks;
+	}
+	if (!queue.empty())
+		start();
+	else
+		busy = false;
+	if (r.read)
+		r.read->slot(res);
+	else
+		r.write->slot(res);
+}
+
+static RefPtr<vfs::Inode> registered;
+
+namespace vfs {
+	void RegisterFilesystem(char const * /*type*/, RefPtr<Inode> ino) {
+		registered = ino;
+	}
+
+	void UnregisterFilesystem(RefPtr<Inode> ino) {
+		if (registered == ino)
+			registered = RefPtr<Inode>();
+	}
+}
+
+RefPtr<vfs::Inode> HostMSD_Mount(HostMSD *msd) {
+	registered = RefPtr<vfs::Inode>();
+	MSD_Register(msd);
+	while(!registered && Host_Step()) {
+	}
+	return registered;
+}
+
+void HostMSD_Unmount(HostMSD *msd) {
+	Host_RunIdle();
+	MSD_Unregister(msd);
+}
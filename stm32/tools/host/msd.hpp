@@ -0,0 +1,58 @@
+#pragma once
+
+#include <string.h>
+#include <block/msd.hpp>
+#include <fs/vfs.hpp>
+#include <stdio.h>
+
+#include <deque>
+
+/* block device backed by a file system image. block 0 is a made up mbr
+ * with a single partition holding the image, so the partition probing of
+ * the firmware runs as on the box. transfers are done one at a time, each
+ * taking the time of an sd card transfer.
+ */
+
+//first block of the partition
+#define HOST_MSD_FIRST_BLOCK 2048
+
+struct HostMSDStats {
+	uint64_t reads;
+	uint64_t read_blocks;
+	uint64_t writes;
+	uint64_t write_blocks;
+};
+
+class HostMSD : public MSD {
+public:
+	/* type is the partition type put into the mbr, 0x01 for fat12,
+	 * 0x06 for fat16, 0x0c for fat32 and 0x07 for exfat.
+	 */
+	HostMSD(char const *image, uint8_t type);
+	~HostMSD();
+	bool ok() const { return fd >= 0; }
+	virtual void readBlocks(struct MSDReadCommand *command);
+	virtual void writeBlocks(struct MSDWriteCommand *command);
+	struct HostMSDStats stats;
+	//every request gets logged here when it is issued, if set
+	FILE *trace;
+private:
+	struct Request {
+		MSDReadCommand *read;
+		MSDWriteCommand *write;
+	};
+	int fd;
+	uint8_t type;
+	std::deque<Request> queue;
+	bool busy;
+	void start();
+	void complete();
+	int transfer(Request const &r);
+};
+
+/* registers msd and runs until a file system shows up on it. returns its
+ * root, NULL if none was found.
+ */
+RefPtr<vfs::Inode> HostMSD_Mount(HostMSD *msd);
+//the file system drivers forget about msd
+void HostMSD_Unmount(HostMSD *msd);
@@ -0,0 +1,601 @@
+#include "sdio.hpp"
+#include "gpio.hpp"
+#include "host.hpp"
+
+#include <timer.hpp>
+#include <block/sdcard.h>
+#include <hw/sd.h>
+#include <bsp/stm32f4xx_gpio.h>
+#include <assert.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "../../src/block/sdcard_std.h"
+
+HostSDCard *host_sd_card = NULL;
+int host_sdio_khz = 400;
+int host_sdio_widebus = 0;
+
+//clocks of a command, its response and the gaps around them
+#define HOST_SDIO_COMMAND_CLOCKS (48 + 48 + 16)
+#define HOST_SDIO_LONG_CLOCKS (48 + 136 + 16)
+//clocks around each data block: start, crc, end and the gap to the next
+#define HOST_SDIO_BLOCK_CLOCKS (1 + 16 + 1 + 8)
+//crc status token and the busy the card shows after each block it takes
+#define HOST_SDIO_WRITE_CLOCKS (8 + 8)
+//interrupt and setup time of the controller per command
+#define HOST_SDIO_OVERHEAD_US 2
+
+static uint32_t HostSD_Clocks(uint32_t clocks) {
+	return (clocks * 1000 + host_sdio_khz - 1) / host_sdio_khz;
+}
+
+static bool HostSD_DataResult(int result) {
+	return result == SDIO_DataCRC || result == SDIO_DataTimeout ||
+		result == SDIO_DataRxOverrun || result == SDIO_DataStartBitError;
+}
+
+HostSDCard::HostSDCard(uint32_t blocks)
+	: data((size_t)blocks * 512)
+	, command_classes(0x5b5)
+	, highspeed(true)
+	, refuse_switch(false)
+	, ready_polls(2)
+	, max_khz(48000)
+	, garbage_khz(48000)
+	, read_access_usec(100)
+	, program_usec(800)
+	, program_block_usec(20)
+	, state(Removed)
+	, app(false)
+	, wide(false)
+	, range_error(false)
+	, data_command(0)
+	, data_block(0)
+	, rca(0)
+	, polls(0)
+	, switched(false)
+	, pending_blocks(0)
+{
+	memset(&stats, 0, sizeof(stats));
+	memset(switch_status, 0, sizeof(switch_status));
+	//SD 2.0, 1 and 4 bit bus, no commands beyond 2.0
+	static uint8_t const default_scr[8] = {
+		0x02, 0x35, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	memcpy(scr, default_scr, sizeof(scr));
+}
+
+void HostSDCard::insert() {
+	host_sd_card = this;
+	state = Idle;
+	app = false;
+	wide = false;
+	range_error = false;
+	rca = 0;
+	polls = 0;
+	switched = false;
+	pending_blocks = 0;
+	Host_GPIO_Set(SD_D0_GPIO, SD_D0_PIN, true);
+	Host_GPIO_Set(SD_CD_GPIO, SD_CD_PIN, false);
+}
+
+void HostSDCard::remove() {
+	state = Removed;
+	Host_GPIO_Set(SD_CD_GPIO, SD_CD_PIN, true);
+}
+
+void HostSDCard::fail(uint8_t command, int result, unsigned times,
+		      uint32_t status) {
+	Fault f = { command, result, status };
+	for(unsigned i = 0; i < times; i++)
+		faults.push_back(f);
+}
+
+bool HostSDCard::takeFault(uint8_t command, bool data, Fault &f) {
+	for(auto it = faults.begin(); it != faults.end(); it++) {
+		if (it->command != command ||
+		    HostSD_DataResult(it->result) != data)
+			continue;
+		f = *it;
+		faults.erase(it);
+		return true;
+	}
+	return false;
+}
+
+uint32_t HostSDCard::status(State s) const {
+	uint32_t r = (uint32_t)s << 9;
+	if (state != Program)
+		r |= 0x100;//ready for data
+	if (app)
+		r |= 0x20;
+	if (range_error)
+		r |= SD_CS_ADDR_OUT_OF_RANGE;
+	return r;
+}
+
+bool HostSDCard::inRange(uint32_t block, uint32_t count) const {
+	return block < data.size() / 512 && count <= data.size() / 512 - block;
+}
+
+void HostSDCard::program(uint32_t blocks) {
+	state = Program;
+	pending_blocks = 0;
+	uint32_t usec = program_usec + blocks * program_block_usec;
+	stats.busy_usec += usec;
+	Host_GPIO_Set(SD_D0_GPIO, SD_D0_PIN, false);
+	Timer_Oneshot(usec, sigc::mem_fun(this, &HostSDCard::programmed));
+}
+
+void HostSDCard::programmed() {
+	if (state == Program)
+		state = Transfer;
+	Host_GPIO_Set(SD_D0_GPIO, SD_D0_PIN, true);
+}
+
+/* a card ignores commands it does not take in its state, the error only
+ * shows in the next status. the driver sees a timeout.
+ */
+#define ILLEGAL() do { stats.protocol_errors++; return SDIO_CommandTimeout; } while(0)
+
+int HostSDCard::command(uint8_t index, uint32_t argument,
+			uint32_t response[4]) {
+	if (state == Removed)
+		return SDIO_CommandTimeout;
+	bool is_app = app;
+	app = false;
+	if (is_app)
+		stats.app_commands[index & 63]++;
+	else
+		stats.commands[index & 63]++;
+	Fault f;
+	if (takeFault(index, false, f)) {
+		if (f.result != SDIO_CSError)
+			return f.result;
+		response[0] = status(state) | f.status;
+		return SDIO_OK;
+	}
+	State s = state;
+	if (index == 0) {
+		state = Idle;
+		rca = 0;
+		wide = false;
+		switched = false;
+		return SDIO_OK;
+	}
+	if (index == 13) {
+		if (s == Idle || s == Ready || s == Ident)
+			ILLEGAL();
+		response[0] = status(s);
+		range_error = false;
+		return SDIO_OK;
+	}
+	if (index == 12) {
+		if (s == Data) {
+			state = Transfer;
+		} else if (s == Receive) {
+			if (pending_blocks)
+				program(pending_blocks);
+			else
+				state = Transfer;
+		} else {
+			ILLEGAL();
+		}
+		response[0] = status(s);
+		range_error = false;
+		return SDIO_OK;
+	}
+	//the rest only works with the bus idle
+	if (s == Data || s == Receive || s == Program)
+		ILLEGAL();
+	if (index == 55) {
+		if (s != Idle && (argument >> 16) != rca)
+			ILLEGAL();
+		app = true;
+		response[0] = status(s);
+		return SDIO_OK;
+	}
+	if (is_app) {
+		switch(index) {
+		case 41:
+			if (s != Idle)
+				ILLEGAL();
+			//high capacity cards stay busy for hosts without
+			if (polls < ready_polls || !(argument & SD_HIGH_CAPACITY)) {
+				polls++;
+				response[0] = 0x00ff8000;
+				return SDIO_OK;
+			}
+			state = Ready;
+			response[0] = 0x80ff8000 | SD_HIGH_CAPACITY;
+			return SDIO_OK;
+		case 6:
+			if (s != Transfer)
+				ILLEGAL();
+			wide = (argument & 3) == 2;
+			response[0] = status(s);
+			return SDIO_OK;
+		case 23:
+		case 51:
+			if (s != Transfer)
+				ILLEGAL();
+			data_command = index | SDIO_APPCMD;
+			response[0] = status(s);
+			return SDIO_OK;
+		default:
+			ILLEGAL();
+		}
+	}
+	switch(index) {
+	case 8:
+		if (s != Idle)
+			ILLEGAL();
+		response[0] = argument & 0xfff;
+		return SDIO_OK;
+	case 2:
+		if (s != Ready)
+			ILLEGAL();
+		state = Ident;
+		response[0] = 0x03534453;//'SD'
+		response[1] = 0x484f5354;//"HOST"
+		response[2] = 0x10000001;
+		response[3] = 0x00012301;
+		return SDIO_OK;
+	case 3:
+		if (s != Ident && s != Standby)
+			ILLEGAL();
+		state = Standby;
+		rca = 0xb368;
+		response[0] = (uint32_t)rca << 16 | (uint32_t)s << 9 | 0x100;
+		return SDIO_OK;
+	case 9: {
+		if (s != Standby || (argument >> 16) != rca)
+			ILLEGAL();
+		//CSD version 2.0, bit 0 in csd[0]
+		uint32_t csd[4] = { 0, 0, 0, 0 };
+		auto set = [&csd](unsigned lsb, unsigned bits, uint32_t v) {
+			for(unsigned i = 0; i < bits; i++) {
+				if (v & (1U << i))
+					csd[(lsb + i) / 32] |= 1U << ((lsb + i) % 32);
+			}
+		};
+		set(0, 1, 1);
+		set(22, 4, 9);//write block length
+		set(39, 7, 0x7f);//erase sector size
+		set(46, 1, 1);
+		set(48, 22, data.size() / 512 / 1024 - 1);
+		set(80, 4, 9);//read block length
+		set(84, 12, command_classes);
+		set(96, 8, 0x32);//25MHz
+		set(112, 8, 0x0e);
+		set(126, 2, 1);
+		response[0] = csd[3];
+		response[1] = csd[2];
+		response[2] = csd[1];
+		response[3] = csd[0];
+		return SDIO_OK;
+	}
+	case 7:
+		if ((argument >> 16) != rca) {
+			if (s == Transfer)
+				state = Standby;
+			return SDIO_CommandTimeout;//nothing answers
+		}
+		if (s != Standby)
+			ILLEGAL();
+		state = Transfer;
+		response[0] = status(s);
+		return SDIO_OK;
+	case 16:
+		if (s != Transfer)
+			ILLEGAL();
+		response[0] = status(s);
+		if (argument != 512)
+			response[0] |= SD_CS_BLOCK_LEN_ERR;
+		return SDIO_OK;
+	case 6: {
+		if (s != Transfer)
+			ILLEGAL();
+		//switch function status, msb first
+		memset(switch_status, 0, sizeof(switch_status));
+		switch_status[1] = 0x64;//max current, 100mA
+		switch_status[13] = highspeed ? 0x03 : 0x01;
+		unsigned fn = argument & 0xf;
+		bool ok = fn == 0 || fn == 0xf || (fn == 1 && highspeed);
+		switch_status[16] = ok ? (fn == 0xf ? 0 : fn) : 0xf;
+		if (ok && fn == 1 && (argument & 0x80000000U)) {
+			if (refuse_switch)
+				switch_status[16] = 0xf;
+			else
+				switched = true;
+		}
+		data_command = 6;
+		response[0] = status(s);
+		return SDIO_OK;
+	}
+	case 17:
+	case 18:
+	case 24:
+	case 25:
+		if (s != Transfer)
+			ILLEGAL();
+		response[0] = status(s);
+		if (!inRange(argument, 1)) {
+			response[0] |= SD_CS_ADDR_OUT_OF_RANGE;
+			return SDIO_OK;
+		}
+		data_command = index;
+		data_block = argument;
+		if (index == 18)
+			state = Data;
+		else if (index == 24 || index == 25)
+			state = Receive;
+		return SDIO_OK;
+	default:
+		ILLEGAL();
+	}
+}
+
+int HostSDCard::transfer(SDCommand *c) {
+	uint8_t index = data_command;
+	bool write = index == 24 || index == 25;
+	Fault f;
+	int result = SDIO_OK;
+	if (state == Removed)
+		result = SDIO_DataTimeout;
+	else if (takeFault(index & ~SDIO_APPCMD, true, f))
+		result = f.result;
+	//too fast for the card or the board, or not the bus width the card
+	//uses: garbage arrives
+	else if (host_sdio_khz > max_khz ||
+		 (host_sdio_khz > 25000 && !switched) ||
+		 (host_sdio_widebus != 0) != wide)
+		result = SDIO_DataCRC;
+	if (result != SDIO_OK) {
+		stats.data_errors++;
+		if (!write)
+			memset(c->data, 0xee, c->datalength);
+		//single block ones are over, the others wait for a stop
+		if (index == 24 || index == 17 || index & SDIO_APPCMD ||
+		    index == 6)
+			state = state == Removed ? Removed : Transfer;
+		return result;
+	}
+	uint32_t blocks = c->datalength / 512;
+	switch(index) {
+	case 51 | SDIO_APPCMD:
+		memcpy(c->data, scr, std::min<size_t>(c->datalength, 8));
+		break;
+	case 6:
+		memcpy(c->data, switch_status,
+		       std::min<size_t>(c->datalength, 64));
+		break;
+	case 17:
+	case 18:
+		if (!inRange(data_block, blocks)) {
+			//the card stops at the end, the stop tells why
+			range_error = true;
+			blocks = data.size() / 512 - data_block;
+			result = SDIO_DataTimeout;
+		}
+		memcpy(c->data, &data[(size_t)data_block * 512],
+		       (size_t)blocks * 512);
+		stats.read_blocks += blocks;
+		stats.largest_read = std::max(stats.largest_read, blocks);
+		if (index == 17)
+			state = Transfer;
+		break;
+	case 24:
+	case 25:
+		if (!inRange(data_block, blocks)) {
+			range_error = true;
+			blocks = data.size() / 512 - data_block;
+			result = SDIO_DataTimeout;
+		}
+		memcpy(&data[(size_t)data_block * 512], c->data,
+		       (size_t)blocks * 512);
+		stats.write_blocks += blocks;
+		if (index == 24)
+			program(blocks);
+		else
+			pending_blocks += blocks;
+		break;
+	}
+	if (!write && host_sdio_khz > garbage_khz) {
+		for(uint32_t i = 0; i < c->datalength; i += 3)
+			((uint8_t *)c->data)[i] ^= 0x10;
+	}
+	return result;
+}
+
+uint32_t HostSDCard::commandTime(SDCommand const *c) const {
+	uint32_t clocks = c->responseType == ResponseLong ?
+		HOST_SDIO_LONG_CLOCKS : HOST_SDIO_COMMAND_CLOCKS;
+	return HostSD_Clocks(clocks) + HOST_SDIO_OVERHEAD_US;
+}
+
+uint32_t HostSDCard::transferTime(SDCommand const *c) const {
+	uint32_t size = 1U << (c->datablocksize >> 4);
+	uint32_t blocks = (c->datalength + size - 1) / size;
+	uint32_t clocks = size * 8 / (host_sdio_widebus ? 4 : 1) +
+		HOST_SDIO_BLOCK_CLOCKS;
+	if (c->dataType == DataToCard)
+		return HostSD_Clocks(blocks * (clocks + HOST_SDIO_WRITE_CLOCKS));
+	return read_access_usec + HostSD_Clocks(blocks * clocks);
+}
+
+/* the controller: CMD55 in front of app commands, retries of failed
+ * commands and the checks of the responses as in src/block/sdio.cpp.
+ */
+static struct SDCommand *sdio_current_command = NULL;
+
+static void SDIO_CommandDone();
+static void SDIO_DataDone();
+
+void SDIO_Setup() {
+}
+
+void SDIO_PowerUp() {
+	SDIO_ConfigureBus(0, 400);
+}
+
+void SDIO_ClockEnable() {
+}
+
+void SDIO_ConfigureBus(int widebus, int maxkhz) {
+	host_sdio_widebus = widebus;
+	if (maxkhz >= 48000) {
+		host_sdio_khz = 48000;
+		return;
+	}
+	int div = (48000 + maxkhz - 1) / maxkhz;
+	if (div > 257)
+		div = 257;
+	if (div < 2)
+		div = 2;
+	host_sdio_khz = 48000 / div;
+}
+
+void SDIO_PowerDown() {
+}
+
+static uint32_t SDIO_CommandTime(struct SDCommand *c) {
+	if (!host_sd_card)
+		return HostSD_Clocks(HOST_SDIO_LONG_CLOCKS);
+	return host_sd_card->commandTime(c);
+}
+
+void SDIO_Command(struct SDCommand *command) {
+	assert(!sdio_current_command);
+	sdio_current_command = command;
+	command->state = (command->command & SDIO_APPCMD) ? 0 : 1;
+	Timer_Oneshot(SDIO_CommandTime(command),
+		      sigc::ptr_fun(&SDIO_CommandDone));
+}
+
+static void SDIO_Finish(struct SDCommand *c, int result) {
+	sdio_current_command = NULL;
+	c->slot(result);
+}
+
+static void SDIO_CommandDone() {
+	struct SDCommand *c = sdio_current_command;
+	int result = SDIO_CommandTimeout;
+	uint32_t response[4] = { 0, 0, 0, 0 };
+	if (c->state == 0) {
+		if (host_sd_card)
+			result = host_sd_card->command(55, (uint32_t)c->rca << 16,
+						       response);
+		if (result == SDIO_OK) {
+			c->response[0] = response[0];
+			if (response[0] & SD_CS_ERRORBITS)
+				result = SDIO_CSError;
+		}
+		if (result != SDIO_OK && c->retryCounter > 0) {
+			c->retryCounter--;
+			sdio_current_command = NULL;
+			SDIO_Command(c);
+			return;
+		}
+		if (result != SDIO_OK) {
+			SDIO_Finish(c, result);
+			return;
+		}
+		c->state = 1;
+		Timer_Oneshot(SDIO_CommandTime(c),
+			      sigc::ptr_fun(&SDIO_CommandDone));
+		return;
+	}
+	if (host_sd_card)
+		result = host_sd_card->command(c->command & ~SDIO_APPCMD,
+					       c->argument, response);
+	switch(c->responseType) {
+	case NoResponse:
+		result = SDIO_OK;
+		break;
+	case ResponseShort:
+		c->response[0] = response[0];
+		break;
+	case Response3:
+		if (result == SDIO_CommandCRC)
+			result = SDIO_OK;
+		c->response[0] = response[0];
+		break;
+	case Response1:
+		c->response[0] = response[0];
+		if (result == SDIO_OK && (response[0] & SD_CS_ERRORBITS))
+			result = SDIO_CSError;
+		break;
+	case ResponseLong:
+		memcpy(c->response, response, sizeof(response));
+		break;
+	}
+	if (result != SDIO_OK && c->retryCounter > 0) {
+		c->retryCounter--;
+		sdio_current_command = NULL;
+		SDIO_Command(c);
+		return;
+	}
+	if (result != SDIO_OK || c->dataType == NoData) {
+		SDIO_Finish(c, result);
+		return;
+	}
+	c->state = c->dataType == DataToSDIO ? 2 : 3;
+	Timer_Oneshot(host_sd_card->transferTime(c),
+		      sigc::ptr_fun(&SDIO_DataDone));
+}
+
+static void SDIO_DataDone() {
+	struct SDCommand *c = sdio_current_command;
+	SDIO_Finish(c, host_sd_card->transfer(c));
+}
+
+/* the driver registers the card once it is initialised. the partition
+ * the card gets probed for tells which msd it is.
+ */
+class HostSDProbe : public FilesystemDriver {
+public:
+	MSD *msd;
+	HostSDProbe() : msd(NULL) {}
+	virtual void probe_partition(uint32_t /*type*/, uint32_t /*first*/,
+				     uint32_t /*num*/, MSD *msd) {
+		this->msd = msd;
+	}
+	virtual void remove_msd(MSD *msd) {
+		if (this->msd == msd)
+			this->msd = NULL;
+	}
+};
+
+static HostSDProbe *host_sd_probe = NULL;
+
+void HostSD_Partition(HostSDCard *card, uint32_t first) {
+	uint8_t *mbr = card->data.data();
+	uint8_t *part = mbr + 446;
+	uint32_t count = card->data.size() / 512 - first;
+	memset(mbr, 0, 512);
+	part[4] = 0x0c;
+	memcpy(part + 8, &first, 4);
+	memcpy(part + 12, &count, 4);
+	mbr[510] = 0x55;
+	mbr[511] = 0xaa;
+}
+
+MSD *HostSD_Insert(HostSDCard *card) {
+	if (!host_sd_probe) {
+		host_sd_probe = new HostSDProbe;
+		FSDriver_Register(host_sd_probe);
+		SDcard_Setup();
+	}
+	card->insert();
+	while(!host_sd_probe->msd && Host_Step()) {
+	}
+	return host_sd_probe->msd;
+}
+
+bool HostSD_Remove(HostSDCard *card) {
+	card->remove();
+	Host_RunIdle();
+	return !host_sd_probe || !host_sd_probe->msd;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <block/sdio.hpp>
+#include <block/msd.hpp>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+/* sd card behind the SDIO interface of the firmware. it follows the card
+ * states far enough for the driver in src/block/sdcard.cpp: commands only
+ * work in the states the spec allows them in, a multi block transfer is
+ * only left with a stop, and after a write the card holds DAT0 low while
+ * it programs the data.
+ *
+ * transfers take the time they take on the bus at the clock and width
+ * the driver set up, plus the access and programming times below. faults
+ * can be injected per command, and clocks above what the card and the
+ * board manage give crc errors on data.
+ */
+
+struct HostSDStats {
+	uint64_t commands[64];//by index, app commands included
+	uint64_t app_commands[64];
+	uint64_t read_blocks;
+	uint64_t write_blocks;
+	uint32_t largest_read;//blocks
+	uint64_t data_errors;
+	//commands sent in a state the card does not take them in
+	uint64_t protocol_errors;
+	uint64_t busy_usec;//time DAT0 was held low
+};
+
+class HostSDCard {
+public:
+	HostSDCard(uint32_t blocks);
+
+	//card detect: the driver sees the card come and go
+	void insert();
+	void remove();
+
+	/* the next times commands with this index get to the card, they
+	 * fail with result. command errors are given to the driver as the
+	 * response of the command, data errors once the data is sent.
+	 * status is or-ed into the response for SDIO_CSError.
+	 */
+	void fail(uint8_t command, int result, unsigned times = 1,
+		  uint32_t status = 0);
+
+	std::vector<uint8_t> data;
+	struct HostSDStats stats;
+
+	//what the card can do, used when it is inserted
+	uint8_t scr[8];//as sent, msb first
+	uint16_t command_classes;
+	bool highspeed;//group 1 function 1
+	bool refuse_switch;//says it can, but does not switch
+	unsigned ready_polls;//ACMD41 answered busy that often
+	//data at a faster clock than this gets crc errors
+	int max_khz;
+	//data read at a faster clock than this has bits flipped, but a
+	//crc that matches
+	int garbage_khz;
+
+	//timing, in us
+	uint32_t read_access_usec;
+	uint32_t program_usec;//once per write
+	uint32_t program_block_usec;
+
+	/* the interface of the firmware runs the card, these are only
+	 * public for it.
+	 */
+	int command(uint8_t index, uint32_t argument, uint32_t response[4]);
+	int transfer(SDCommand *c);
+	uint32_t commandTime(SDCommand const *c) const;
+	uint32_t transferTime(SDCommand const *c) const;
+private:
+	enum State {
+		Idle = 0, Ready, Ident, Standby, Transfer, Data, Receive,
+		Program, Disconnect, Removed = 15,
+	};
+	struct Fault {
+		uint8_t command;
+		int result;
+		uint32_t status;
+	};
+	State state;
+	bool app;//the last command was CMD55
+	bool wide;//4 bit bus
+	bool range_error;//for the next status
+	uint8_t data_command;//of the transfer to come
+	uint32_t data_block;
+	uint16_t rca;
+	unsigned polls;
+	bool switched;
+	uint32_t pending_blocks;//written since the last programming
+	uint8_t switch_status[64];
+	std::deque<Fault> faults;
+	bool takeFault(uint8_t command, bool data, Fault &f);
+	uint32_t status(State s) const;
+	void program(uint32_t blocks);
+	void programmed();
+	bool inRange(uint32_t block, uint32_t count) const;
+};
+
+//the inserted card, NULL if none ever was
+extern HostSDCard *host_sd_card;
+//bus the driver set up
+extern int host_sdio_khz;
+extern int host_sdio_widebus;
+
+/* card block 0 made an mbr with one partition from first to the end. the
+ * driver registers the card with the block layer, which only tells about
+ * the partitions it finds.
+ */
+void HostSD_Partition(HostSDCard *card, uint32_t first);
+/* puts card in and runs until the driver has it registered. returns it,
+ * NULL if the init failed.
+ */
+MSD *HostSD_Insert(HostSDCard *card);
+/* takes card out and runs until the driver is done with it. returns
+ * false if it is still registered.
+ */
+bool HostSD_Remove(HostSDCard *card);
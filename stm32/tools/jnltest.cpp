@@ -0,0 +1,284 @@
+/* checks the journal of dsk.cpp against power cuts. a fresh image gets
+ * sectors written on a few cylinders, with idle times in between for the
+ * changes to reach the image. the same run is repeated with the power cut
+ * at every write of it, the write at the cut torn halfway. after every
+ * cut the image is opened again, which replays the journal, and it has
+ * to hold the changes of the first visits to cylinders and none of the
+ * others, including all that were there before the last idle time.
+ *
+ * done for an image created with its journal and one the journal only
+ * gets created for on the first write.
+ *
+ * usage: jnltest
+ */
+
+#include "host/host.hpp"
+
+#include <fdc/dsk.hpp>
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+//long enough for the flush and the merge into the image
+#define JNLTEST_IDLE_US 2000000
+
+struct Visit {
+	unsigned pcn;
+	unsigned first;//sector, from 0
+	unsigned count;
+	bool idle;//after it
+};
+
+static Visit const visits[] = {
+	{ 2, 0, 3, false },
+	{ 7, 2, 4, false },
+	{ 2, 4, 3, true },
+	{ 12, 0, 9, false },
+	{ 7, 0, 1, false },
+	{ 30, 5, 2, true },
+	{ 12, 3, 2, false },
+	{ 2, 1, 1, false },
+};
+#define JNLTEST_VISITS (sizeof(visits) / sizeof(visits[0]))
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+//disks left behind by a power cut, they must not go away with io pending
+static std::vector<RefPtr<dsk::Disk> > cut_disks;
+
+static std::vector<uint8_t> readFile(std::string const &name) {
+	std::vector<uint8_t> data;
+	FILE *f = fopen(name.c_str(), "rb");
+	if (!f)
+		return data;
+	uint8_t buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	return data;
+}
+
+static void writeFile(std::string const &name,
+		      std::vector<uint8_t> const &data) {
+	FILE *f = fopen(name.c_str(), "wb");
+	if (!f || fwrite(data.data(), 1, data.size(), f) != data.size()) {
+		fprintf(stderr, "%s: cannot write\n", name.c_str());
+		exit(1);
+	}
+	fclose(f);
+}
+
+static void sectorData(uint8_t *d, unsigned visit, unsigned pcn,
+		       unsigned r) {
+	for(unsigned i = 0; i < 512; i++)
+		d[i] = visit * 37 + pcn * 11 + r * 5 + i;
+}
+
+static void findComplete(RefPtr<dsk::DiskSector> sector,
+			 RefPtr<dsk::DiskSector> *result, bool *done) {
+	*result = sector;
+	*done = true;
+}
+
+static RefPtr<dsk::DiskSector> find(RefPtr<dsk::Disk> disk, unsigned pcn,
+				    unsigned r) {
+	RefPtr<dsk::DiskSector> sector;
+	bool done = false;
+	dsk::DiskFindSectorCommand c;
+	c.pcn = pcn;
+	c.phn = 0;
+	c.C = pcn;
+	c.H = 0;
+	c.R = r;
+	c.N = 2;
+	c.mfm = true;
+	c.deleted = false;
+	c.find_any = false;
+	c.ignore_deleted = true;
+	c.slot = sigc::bind(sigc::ptr_fun(&findComplete), &sector, &done);
+	disk->findSector(&c);
+	while(!done && Host_Step()) {
+	}
+	return sector;
+}
+
+/* writes the visits to image, the power cut after cut writes, -1 for
+ * none. returns the writes done after each visit and its idle time, the
+ * last one after closing the image.
+ */
+static std::vector<uint64_t> run(std::string const &image, long cut) {
+	std::vector<uint64_t> writes;
+	uint64_t start = host_io_stats.writes;
+	host_write_cut = cut;
+	host_power_cut = false;
+	RefPtr<dsk::Disk> disk = dsk::openImage(image.c_str());
+	if (!disk) {
+		fprintf(stderr, "%s: cannot open\n", image.c_str());
+		exit(1);
+	}
+	uint8_t data[512];
+	for(unsigned v = 0; v < JNLTEST_VISITS; v++) {
+		Visit const &vi = visits[v];
+		for(unsigned i = vi.first; i < vi.first + vi.count; i++) {
+			RefPtr<dsk::DiskSector> s = find(disk, vi.pcn,
+							 0xc1 + i);
+			sectorData(data, v, vi.pcn, 0xc1 + i);
+			if (!s || disk->writeSector(s, data, false) != 0) {
+				if (!host_power_cut)
+					fail("cylinder %u sector %02x: write "
+					     "failed", vi.pcn, 0xc1 + i);
+			}
+		}
+		if (vi.idle)
+			Host_RunUntil(Timer_timeSincePowerOn() +
+				      JNLTEST_IDLE_US);
+		writes.push_back(host_io_stats.writes - start);
+	}
+	if (cut < 0) {
+		disk->close();
+	} else {
+		Host_RunIdle();
+		cut_disks.push_back(disk);
+	}
+	writes.push_back(host_io_stats.writes - start);
+	host_write_cut = -1;
+	host_power_cut = false;
+	return writes;
+}
+
+/* the number of visits whose changes the image holds, -1 if it does not
+ * match any number of them.
+ */
+static int visitsKept(std::string const &image) {
+	RefPtr<dsk::Disk> disk = dsk::openImage(image.c_str());
+	if (!disk)
+		return -1;
+	std::vector<std::vector<uint8_t> > sectors;
+	for(auto const &vi : visits) {
+		for(unsigned i = 0; i < 9; i++) {
+			RefPtr<dsk::DiskSector> s = find(disk, vi.pcn, 0xc1 + i);
+			if (!s || s->size != 512) {
+				disk->close();
+				return -1;
+			}
+			uint8_t const *d = static_cast<uint8_t const *>(s->data);
+			sectors.push_back(std::vector<uint8_t>(d, d + 512));
+		}
+	}
+	disk->close();
+	for(int kept = JNLTEST_VISITS; kept >= 0; kept--) {
+		bool match = true;
+		unsigned n = 0;
+		for(auto const &vi : visits) {
+			for(unsigned i = 0; match && i < 9; i++) {
+				uint8_t expect[512];
+				memset(expect, 0xe5, sizeof(expect));
+				for(int v = 0; v < kept; v++) {
+					Visit const &w = visits[v];
+					if (w.pcn == vi.pcn && i >= w.first &&
+					    i < w.first + w.count)
+						sectorData(expect, v, vi.pcn,
+							   0xc1 + i);
+				}
+				if (memcmp(expect, sectors[n + i].data(),
+					   512) != 0)
+					match = false;
+			}
+			n += 9;
+		}
+		if (match)
+			return kept;
+	}
+	return -1;
+}
+
+static void test(char const *what, std::string const &image,
+		 std::vector<uint8_t> const &pristine,
+		 std::vector<uint8_t> const *journal) {
+	std::string jnl = image + ".jnl";
+	auto reset = [&]() {
+		writeFile(image, pristine);
+		if (journal)
+			writeFile(jnl, *journal);
+		else
+			unlink(jnl.c_str());
+	};
+	reset();
+	std::vector<uint64_t> ref = run(image, -1);
+	struct stat st;
+	if (stat(jnl.c_str(), &st) != 0 || st.st_size == 0)
+		fail("%s: no journal after the first write", what);
+	int kept = visitsKept(image);
+	if (kept != (int)JNLTEST_VISITS)
+		fail("%s: %d visits on the image without a cut", what, kept);
+	uint64_t total = ref.back();
+	printf("%s: %llu writes, visits kept after a cut at each:\n", what,
+	       (unsigned long long)total);
+	for(uint64_t cut = 0; cut < total; cut++) {
+		reset();
+		run(image, cut);
+		kept = visitsKept(image);
+		//the visits through their idle time before the cut
+		int durable = 0;
+		for(unsigned v = 0; v < JNLTEST_VISITS; v++) {
+			if (visits[v].idle && ref[v] <= cut)
+				durable = v + 1;
+		}
+		if (kept < durable)
+			fail("%s: cut at write %llu: %d visits kept, %d were "
+			     "safe", what, (unsigned long long)cut, kept,
+			     durable);
+		printf(" %d", kept);
+	}
+	printf("\n");
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+	char templ[] = "/tmp/jnltestXXXXXX";
+	if (!mkdtemp(templ)) {
+		fprintf(stderr, "cannot create a temporary directory\n");
+		return 1;
+	}
+	std::string dir = templ;
+	std::string image = dir + "/test.dsk";
+	bool done = false;
+	int res = -1;
+	dsk::createImage(image.c_str(), dsk::BlankData,
+			 sigc::slot<void(unsigned, unsigned)>(),
+			 [&](int r) { res = r; done = true; });
+	while(!done && Host_Step()) {
+	}
+	std::vector<uint8_t> pristine = readFile(image);
+	std::vector<uint8_t> journal = readFile(image + ".jnl");
+	if (res != 0 || pristine.empty()) {
+		fprintf(stderr, "cannot create an image\n");
+		return 1;
+	}
+	if (journal.empty())
+		fail("image created without a journal");
+
+	test("journal created with the image", image, pristine, &journal);
+	test("journal created on the first write", image, pristine, NULL);
+
+	unlink((image + ".jnl").c_str());
+	unlink(image.c_str());
+	rmdir(dir.c_str());
+	return failed ? 1 : 0;
+}
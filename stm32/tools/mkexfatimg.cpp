@@ -0,0 +1,361 @@
+
+/* makes an 8MiB exfat image holding the files of exfatfixture.hpp, for
+ * the exfat tests. the firmware only reads exfat, so the image has to
+ * come with its files, mkfs.exfat alone would not do.
+ *
+ * the up-case table is either close to the standard one, or one mapping
+ * more characters than the firmware keeps, so it falls back to ascii
+ * rules. names are hashed with the table of the image either way.
+ *
+ * usage: mkexfatimg standard|oversized image
+ */
+
+#include "exfatfixture.hpp"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#define IMAGE_SECTORS 16384
+#define SPC_SHIFT 3
+#define CLUSTER_SIZE (512 << SPC_SHIFT)
+#define FAT_OFFSET 128
+
+static std::vector<uint8_t> img(IMAGE_SECTORS * 512, 0);
+static uint32_t fat_length;
+static uint32_t heap_offset;
+static uint32_t cluster_count;
+static uint32_t next_cluster = 2;
+static bool oversized = false;
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static void put64(uint8_t *p, uint64_t v) {
+	put32(p, v);
+	put32(p + 4, v >> 32);
+}
+
+static uint16_t upcase(uint16_t c) {
+	if (c >= 'a' && c <= 'z')
+		return c - 0x20;
+	if (c >= 0xe0 && c <= 0xfe && c != 0xf7)
+		return c - 0x20;
+	if (c == 0xff)
+		return 0x178;
+	if (((c >= 0x100 && c <= 0x137) || (c >= 0x14a && c <= 0x177)) &&
+	    (c & 1))
+		return c - 1;
+	if (c >= 0x139 && c <= 0x148 && !(c & 1))
+		return c - 1;
+	if (c >= 0x3b1 && c <= 0x3c9 && c != 0x3c2)
+		return c - 0x20;
+	if (c >= 0x430 && c <= 0x44f)
+		return c - 0x20;
+	if (c >= 0x450 && c <= 0x45f)
+		return c - 0x50;
+	if (c >= 0xff41 && c <= 0xff5a)
+		return c - 0x20;
+	//more than the firmware keeps
+	if (oversized && c >= 0x4e00 && c < 0x5e00)
+		return c + 0x1000;
+	return c;
+}
+
+//compressed, runs of characters mapping to themselves as 0xffff, count
+static std::vector<uint8_t> upcaseTable() {
+	std::vector<uint8_t> t;
+	uint32_t c = 0;
+	while(c < 0x10000) {
+		uint32_t run = 0;
+		while(c + run < 0x10000 && run < 0xffff &&
+		      upcase(c + run) == c + run)
+			run++;
+		uint16_t v[2];
+		unsigned n;
+		if (run > 2) {
+			v[0] = 0xffff;
+			v[1] = run;
+			n = 2;
+			c += run;
+		} else {
+			v[0] = upcase(c);
+			n = 1;
+			c++;
+		}
+		for(unsigned i = 0; i < n; i++) {
+			t.push_back(v[i]);
+			t.push_back(v[i] >> 8);
+		}
+	}
+	return t;
+}
+
+static uint32_t checksum32(uint8_t const *p, size_t len, uint32_t sum,
+			   bool boot) {
+	for(size_t i = 0; i < len; i++) {
+		if (boot && (i == 106 || i == 107 || i == 112))
+			continue;
+		sum = ((sum & 1) ? 0x80000000U : 0) + (sum >> 1) + p[i];
+	}
+	return sum;
+}
+
+static std::basic_string<uint16_t> utf16(char const *s) {
+	std::basic_string<uint16_t> r;
+	for(uint8_t const *p = (uint8_t const *)s; *p;) {
+		if (*p < 0x80) {
+			r += *p++;
+		} else if ((*p & 0xe0) == 0xc0) {
+			r += ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+			p += 2;
+		} else {
+			r += ((p[0] & 0x0f) << 12) | ((p[1] & 0x3f) << 6) |
+				(p[2] & 0x3f);
+			p += 3;
+		}
+	}
+	return r;
+}
+
+static uint8_t *cluster(uint32_t c) {
+	return &img[((size_t)heap_offset + (c - 2) * (CLUSTER_SIZE / 512)) *
+		    512];
+}
+
+static void setFat(uint32_t c, uint32_t v) {
+	put32(&img[FAT_OFFSET * 512 + c * 4], v);
+}
+
+static uint32_t alloc(uint32_t count) {
+	uint32_t c = next_cluster;
+	next_cluster += count;
+	return c;
+}
+
+//chains count clusters starting at first, stride apart
+static void chain(uint32_t first, uint32_t count, uint32_t stride) {
+	for(uint32_t i = 0; i < count; i++)
+		setFat(first + i * stride, i + 1 < count ?
+		       first + (i + 1) * stride : 0xffffffff);
+}
+
+static void writeData(uint32_t first, uint32_t stride,
+		      std::vector<uint8_t> const &data) {
+	for(size_t off = 0; off < data.size(); off += CLUSTER_SIZE) {
+		size_t l = std::min((size_t)CLUSTER_SIZE, data.size() - off);
+		memcpy(cluster(first + off / CLUSTER_SIZE * stride),
+		       data.data() + off, l);
+	}
+}
+
+/* appends the entry set of a file or directory to dir
+ */
+static void addEntrySet(std::vector<uint8_t> &dir, char const *name,
+			uint16_t attributes, uint32_t first, uint64_t size,
+			bool contiguous) {
+	std::basic_string<uint16_t> n = utf16(name);
+	unsigned name_entries = (n.size() + 14) / 15;
+	std::vector<uint8_t> set((2 + name_entries) * 32, 0);
+	uint8_t *e = set.data();
+	e[0] = 0x85;
+	e[1] = 1 + name_entries;
+	put16(e + 4, attributes);
+	//2024-01-01 12:00
+	for(unsigned i = 8; i < 20; i += 4)
+		put32(e + i, (44 << 25) | (1 << 21) | (1 << 16) | (12 << 11));
+	e += 32;
+	e[0] = 0xc0;
+	e[1] = 0x01 | (contiguous ? 0x02 : 0);
+	e[3] = n.size();
+	uint16_t hash = 0;
+	for(uint16_t c : n) {
+		c = upcase(c);
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c & 0xff);
+		hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c >> 8);
+	}
+	put16(e + 4, hash);
+	put64(e + 8, size);
+	put32(e + 20, first);
+	put64(e + 24, size);
+	for(unsigned i = 0; i < name_entries; i++) {
+		e += 32;
+		e[0] = 0xc1;
+		for(unsigned j = 0; j < 15 && i * 15 + j < n.size(); j++)
+			put16(e + 2 + j * 2, n[i * 15 + j]);
+	}
+	uint16_t sum = 0;
+	for(size_t i = 0; i < set.size(); i++) {
+		if (i == 2 || i == 3)
+			continue;
+		sum = ((sum & 1) ? 0x8000 : 0) + (sum >> 1) + set[i];
+	}
+	put16(set.data() + 2, sum);
+	dir.insert(dir.end(), set.begin(), set.end());
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3 || (strcmp(argv[1], "standard") != 0 &&
+			  strcmp(argv[1], "oversized") != 0)) {
+		fprintf(stderr, "usage: %s standard|oversized image\n", argv[0]);
+		return 2;
+	}
+	oversized = strcmp(argv[1], "oversized") == 0;
+
+	fat_length = 1;
+	while(1) {
+		heap_offset = (FAT_OFFSET + fat_length + (1 << SPC_SHIFT) - 1) &
+			~((1U << SPC_SHIFT) - 1);
+		cluster_count = (IMAGE_SECTORS - heap_offset) >> SPC_SHIFT;
+		uint32_t need = ((cluster_count + 2) * 4 + 511) / 512;
+		if (need <= fat_length)
+			break;
+		fat_length = need;
+	}
+	setFat(0, 0xfffffff8);
+	setFat(1, 0xffffffff);
+
+	//allocation bitmap, up-case table, root directory
+	uint32_t bitmap_bytes = (cluster_count + 7) / 8;
+	uint32_t bitmap = alloc((bitmap_bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+	chain(bitmap, next_cluster - bitmap, 1);
+	std::vector<uint8_t> table = upcaseTable();
+	uint32_t upcase_first = alloc((table.size() + CLUSTER_SIZE - 1) /
+				      CLUSTER_SIZE);
+	chain(upcase_first, next_cluster - upcase_first, 1);
+	writeData(upcase_first, 1, table);
+	uint32_t root = alloc(1);
+	chain(root, 1, 1);
+
+	std::vector<uint8_t> rootdir;
+	uint8_t e[32];
+	memset(e, 0, sizeof(e));
+	e[0] = 0x81;
+	put32(e + 20, bitmap);
+	put64(e + 24, bitmap_bytes);
+	rootdir.insert(rootdir.end(), e, e + 32);
+	memset(e, 0, sizeof(e));
+	e[0] = 0x82;
+	put32(e + 4, checksum32(table.data(), table.size(), 0, false));
+	put32(e + 20, upcase_first);
+	put64(e + 24, table.size());
+	rootdir.insert(rootdir.end(), e, e + 32);
+
+	//directories first, one cluster each
+	std::vector<std::string> dirs;
+	std::vector<uint32_t> dir_clusters;
+	std::vector<std::vector<uint8_t> > dir_entries;
+	for(auto const &f : exfat_fixture) {
+		if (!f.dir)
+			continue;
+		bool known = false;
+		for(auto const &d : dirs)
+			known = known || d == f.dir;
+		if (known)
+			continue;
+		uint32_t c = alloc(1);
+		setFat(c, 0);
+		dirs.push_back(f.dir);
+		dir_clusters.push_back(c);
+		dir_entries.push_back(std::vector<uint8_t>());
+		addEntrySet(rootdir, f.dir, 0x10, c, CLUSTER_SIZE, true);
+	}
+
+	//fragmented files come in pairs, the second takes the clusters the
+	//first skipped
+	uint32_t frag_base = 0;
+	for(auto const &f : exfat_fixture) {
+		uint32_t count = (f.size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+		uint32_t first = 0;
+		uint32_t stride = 1;
+		if (count > 0 && f.layout == ExFatFragmented) {
+			stride = 2;
+			if (frag_base == 0) {
+				frag_base = alloc(2 * count);
+				first = frag_base;
+			} else {
+				first = frag_base + 1;
+				frag_base = 0;
+			}
+			chain(first, count, 2);
+		} else if (count > 0) {
+			first = alloc(count);
+			if (f.layout == ExFatChained)
+				chain(first, count, 1);
+		}
+		writeData(first, stride, exfatFixtureData(f.size, f.seed));
+		std::vector<uint8_t> *dir = &rootdir;
+		for(size_t i = 0; i < dirs.size(); i++) {
+			if (f.dir && dirs[i] == f.dir)
+				dir = &dir_entries[i];
+		}
+		addEntrySet(*dir, f.name, 0x20, first, f.size,
+			    f.layout == ExFatContiguous);
+	}
+	if (frag_base != 0) {
+		fprintf(stderr, "fragmented files have to come in pairs\n");
+		return 1;
+	}
+	if (next_cluster - 2 > cluster_count || rootdir.size() > CLUSTER_SIZE) {
+		fprintf(stderr, "the files do not fit\n");
+		return 1;
+	}
+	memcpy(cluster(root), rootdir.data(), rootdir.size());
+	for(size_t i = 0; i < dirs.size(); i++)
+		memcpy(cluster(dir_clusters[i]), dir_entries[i].data(),
+		       dir_entries[i].size());
+
+	uint8_t *bm = cluster(bitmap);
+	for(uint32_t c = 2; c < next_cluster; c++)
+		bm[(c - 2) / 8] |= 1 << ((c - 2) % 8);
+
+	//boot region and its backup
+	uint8_t *bs = &img[0];
+	bs[0] = 0xeb;
+	bs[1] = 0x76;
+	bs[2] = 0x90;
+	memcpy(bs + 3, "EXFAT   ", 8);
+	put64(bs + 72, IMAGE_SECTORS);
+	put32(bs + 80, FAT_OFFSET);
+	put32(bs + 84, fat_length);
+	put32(bs + 88, heap_offset);
+	put32(bs + 92, cluster_count);
+	put32(bs + 96, root);
+	put32(bs + 100, 0x12345678);
+	put16(bs + 104, 0x0100);
+	bs[108] = 9;
+	bs[109] = SPC_SHIFT;
+	bs[110] = 1;
+	bs[111] = 0x80;
+	bs[112] = (next_cluster - 2) * 100 / cluster_count;
+	bs[510] = 0x55;
+	bs[511] = 0xaa;
+	for(unsigned s = 1; s <= 8; s++)
+		put32(&img[s * 512 + 508], 0xaa550000);
+	uint32_t sum = checksum32(&img[0], 512, 0, true);
+	sum = checksum32(&img[512], 10 * 512, sum, false);
+	for(unsigned i = 0; i < 512; i += 4)
+		put32(&img[11 * 512 + i], sum);
+	memcpy(&img[12 * 512], &img[0], 12 * 512);
+
+	FILE *f = fopen(argv[2], "wb");
+	if (!f || fwrite(img.data(), 1, img.size(), f) != img.size() ||
+	    fclose(f) != 0) {
+		fprintf(stderr, "%s: cannot write\n", argv[2]);
+		return 1;
+	}
+	printf("exfat, %u clusters of %u bytes, %u used, up-case table %zu "
+	       "bytes\n", (unsigned)cluster_count, CLUSTER_SIZE,
+	       (unsigned)(next_cluster - 2), table.size());
+	return 0;
+}
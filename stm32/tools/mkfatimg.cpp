@@ -0,0 +1,169 @@
+
+/* makes an empty fat file system image, laid out the way mkfs.fat does
+ * with the same options. the host tests use it where mkfs.fat is not
+ * installed:
+ *   mkfs.fat -C -F <bits> -S 512 -s <sectors per cluster> image <KiB>
+ *
+ * usage: mkfatimg fat12|fat16|fat32 image KiB sectors_per_cluster
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+static void put16(std::vector<uint8_t> &img, size_t off, uint16_t v) {
+	img[off] = v;
+	img[off + 1] = v >> 8;
+}
+
+static void put32(std::vector<uint8_t> &img, size_t off, uint32_t v) {
+	put16(img, off, v);
+	put16(img, off + 2, v >> 16);
+}
+
+/* sets fat entry cluster in all copies
+ */
+static void setFat(std::vector<uint8_t> &img, unsigned bits,
+		   uint32_t fat_start, uint32_t fat_size, unsigned fats,
+		   uint32_t cluster, uint32_t value) {
+	for(unsigned f = 0; f < fats; f++) {
+		size_t base = (size_t)(fat_start + f * fat_size) * 512;
+		if (bits == 12) {
+			size_t off = base + cluster + cluster / 2;
+			if (cluster & 1) {
+				img[off] = (img[off] & 0x0f) | ((value << 4) & 0xf0);
+				img[off + 1] = value >> 4;
+			} else {
+				img[off] = value;
+				img[off + 1] = (img[off + 1] & 0xf0) |
+					((value >> 8) & 0x0f);
+			}
+		} else if (bits == 16) {
+			put16(img, base + cluster * 2, value);
+		} else {
+			put32(img, base + cluster * 4, value);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 5) {
+		fprintf(stderr, "usage: %s fat12|fat16|fat32 image KiB "
+			"sectors_per_cluster\n", argv[0]);
+		return 2;
+	}
+	unsigned bits;
+	if (strcmp(argv[1], "fat12") == 0)
+		bits = 12;
+	else if (strcmp(argv[1], "fat16") == 0)
+		bits = 16;
+	else if (strcmp(argv[1], "fat32") == 0)
+		bits = 32;
+	else {
+		fprintf(stderr, "%s: unknown variant\n", argv[1]);
+		return 2;
+	}
+	uint32_t sectors = strtoul(argv[3], NULL, 0) * 2;
+	unsigned spc = strtoul(argv[4], NULL, 0);
+	if (spc == 0 || spc > 128 || (spc & (spc - 1)) != 0 || sectors < 64) {
+		fprintf(stderr, "bad size or cluster size\n");
+		return 2;
+	}
+
+	unsigned fats = 2;
+	unsigned reserved = bits == 32 ? 32 : 1;
+	unsigned root_entries = bits == 32 ? 0 : 512;
+	unsigned root_sectors = root_entries * 32 / 512;
+	//the fat has to cover the clusters that are left next to it
+	uint32_t fat_size = 1;
+	uint32_t clusters;
+	while(1) {
+		clusters = (sectors - reserved - root_sectors -
+			    fats * fat_size) / spc;
+		uint32_t need = ((uint64_t)(clusters + 2) * bits + 8 * 512 - 1) /
+			(8 * 512);
+		if (need <= fat_size)
+			break;
+		fat_size = need;
+	}
+	if ((bits == 12 && clusters >= 4085) ||
+	    (bits == 16 && (clusters < 4085 || clusters >= 65525)) ||
+	    (bits == 32 && clusters < 65525)) {
+		fprintf(stderr, "%u clusters do not make fat%u\n",
+			(unsigned)clusters, bits);
+		return 1;
+	}
+
+	std::vector<uint8_t> img((size_t)sectors * 512, 0);
+	//boot sector
+	img[0] = 0xeb;
+	img[1] = bits == 32 ? 0x58 : 0x3c;
+	img[2] = 0x90;
+	memcpy(&img[3], "mkfs.fat", 8);
+	put16(img, 11, 512);
+	img[13] = spc;
+	put16(img, 14, reserved);
+	img[16] = fats;
+	put16(img, 17, root_entries);
+	put16(img, 19, sectors < 65536 && bits != 32 ? sectors : 0);
+	img[21] = 0xf8;
+	put16(img, 22, bits == 32 ? 0 : fat_size);
+	put16(img, 24, 32);//sectors per track
+	put16(img, 26, 64);//heads
+	put32(img, 28, 0);
+	put32(img, 32, sectors < 65536 && bits != 32 ? 0 : sectors);
+	size_t ext = 36;
+	if (bits == 32) {
+		put32(img, 36, fat_size);
+		put16(img, 40, 0);//flags, mirrored fats
+		put16(img, 42, 0);//version
+		put32(img, 44, 2);//root directory cluster
+		put16(img, 48, 1);//fsinfo
+		put16(img, 50, 6);//backup boot sector
+		ext = 64;
+	}
+	img[ext] = 0x80;//drive number
+	img[ext + 2] = 0x29;
+	put32(img, ext + 3, 0x12345678);
+	memcpy(&img[ext + 7], "NO NAME    ", 11);
+	memcpy(&img[ext + 18], bits == 12 ? "FAT12   " :
+	       bits == 16 ? "FAT16   " : "FAT32   ", 8);
+	img[510] = 0x55;
+	img[511] = 0xaa;
+
+	//media byte and end of chain in the first two entries
+	setFat(img, bits, reserved, fat_size, fats, 0,
+	       bits == 12 ? 0xff8 : bits == 16 ? 0xfff8 : 0x0ffffff8);
+	setFat(img, bits, reserved, fat_size, fats, 1,
+	       bits == 12 ? 0xfff : bits == 16 ? 0xffff : 0x0fffffff);
+	if (bits == 32) {
+		//the root directory takes the first cluster
+		setFat(img, bits, reserved, fat_size, fats, 2, 0x0fffffff);
+		//fsinfo
+		put32(img, 512 + 0, 0x41615252);
+		put32(img, 512 + 484, 0x61417272);
+		put32(img, 512 + 488, clusters - 1);
+		put32(img, 512 + 492, 2);
+		put32(img, 512 + 508, 0xaa550000);
+		//backup of boot sector and fsinfo
+		memcpy(&img[6 * 512], &img[0], 2 * 512);
+		//the third boot sector only has the signature
+		img[2 * 512 + 510] = 0x55;
+		img[2 * 512 + 511] = 0xaa;
+		img[8 * 512 + 510] = 0x55;
+		img[8 * 512 + 511] = 0xaa;
+	}
+
+	FILE *f = fopen(argv[2], "wb");
+	if (!f || fwrite(img.data(), 1, img.size(), f) != img.size() ||
+	    fclose(f) != 0) {
+		fprintf(stderr, "%s: cannot write\n", argv[2]);
+		return 1;
+	}
+	printf("fat%u, %u clusters of %u bytes, %u sectors per fat\n", bits,
+	       (unsigned)clusters, spc * 512, (unsigned)fat_size);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#makes an empty fat image for the tests, with mkfs.fat if there is one
+#and mkfatimg otherwise:
+#  cmake -DMKFS=... -DMKFATIMG=... -DBITS=12 -DIMAGE=... -DKB=... -DSPC=...
+#        -P mkimage.cmake
+
+file(REMOVE ${IMAGE})
+if(MKFS)
+  set(ARGS -C -F ${BITS} -S 512 -s ${SPC})
+  if(BITS EQUAL 32)
+    list(APPEND ARGS -R 32 -b 6)
+  endif()
+  execute_process(COMMAND ${MKFS} ${ARGS} ${IMAGE} ${KB}
+    RESULT_VARIABLE RES)
+else()
+  execute_process(COMMAND ${MKFATIMG} fat${BITS} ${IMAGE} ${KB} ${SPC}
+    RESULT_VARIABLE RES)
+endif()
+if(NOT RES EQUAL 0)
+  message(FATAL_ERROR "cannot make ${IMAGE}")
+endif()
@@ -0,0 +1,158 @@
+
+/* runs the init of the firmware sd card driver against cards of the card
+ * model of host/sdio that make it settle on different bus clocks: cards
+ * without CMD6, a card that does not switch when asked to, and boards
+ * that garble the data or get crc errors above some clock. each card has
+ * to end up at the clock given, take a write and read it back there.
+ *
+ * usage: sdinit
+ */
+
+#include "host/host.hpp"
+#include "host/sdio.hpp"
+
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <vector>
+
+#define SDINIT_BLOCKS (8 * 1024)
+#define SDINIT_PARTITION 2048
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+static int transfer(MSD *msd, bool write, uint32_t block, uint8_t *data) {
+	bool done = false;
+	int result = -1;
+	MSDReadCommand r;
+	MSDWriteCommand w;
+	if (write) {
+		w.start_block = block;
+		w.num_blocks = 8;
+		w.src = data;
+		w.slot = [&](int res) { result = res; done = true; };
+		msd->writeBlocks(&w);
+	} else {
+		r.start_block = block;
+		r.num_blocks = 8;
+		r.dst = data;
+		r.slot = [&](int res) { result = res; done = true; };
+		msd->readBlocks(&r);
+	}
+	while(!done && Host_Step()) {
+	}
+	return result;
+}
+
+struct Case {
+	char const *name;
+	void (*setup)(HostSDCard *card);
+	int khz;//the driver has to end up with
+	unsigned cmd6;//CMD6 sent
+	unsigned acmd51;//SCR reads, the verify ones included
+};
+
+static Case const cases[] = {
+	{ "high speed", [](HostSDCard *) {}, 48000, 2, 2 },
+	//CMD_SUPPORT set, the SCR bytes differ all the way through
+	{ "high speed, scr 02 35 80 03", [](HostSDCard *card) {
+		card->scr[2] = 0x80;
+		card->scr[3] = 0x03;
+	}, 48000, 2, 2 },
+	//no class 10, no CMD6
+	{ "cmd6 unsupported, no class 10", [](HostSDCard *card) {
+		card->command_classes &= ~(1 << 10);
+	}, 24000, 0, 2 },
+	//SD_spec 1.0
+	{ "cmd6 unsupported, spec 1.0", [](HostSDCard *card) {
+		card->scr[0] = 0x00;
+	}, 24000, 0, 2 },
+	{ "high speed not supported", [](HostSDCard *card) {
+		card->highspeed = false;
+	}, 24000, 1, 2 },
+	{ "switch refused", [](HostSDCard *card) {
+		card->refuse_switch = true;
+	}, 24000, 2, 2 },
+	//data comes with matching crcs, the check of the SCR sees it
+	{ "scr mismatch above 30MHz", [](HostSDCard *card) {
+		card->garbage_khz = 30000;
+	}, 24000, 2, 3 },
+	{ "scr mismatch above 20MHz", [](HostSDCard *card) {
+		card->garbage_khz = 20000;
+	}, 12000, 2, 4 },
+	{ "crc errors above 30MHz", [](HostSDCard *card) {
+		card->max_khz = 30000;
+	}, 24000, 2, 3 },
+	//the status of the CMD6 check already gets them
+	{ "crc errors above 20MHz", [](HostSDCard *card) {
+		card->max_khz = 20000;
+	}, 12000, 1, 3 },
+};
+
+static void run(Case const &c) {
+	HostSDCard *card = new HostSDCard(SDINIT_BLOCKS);
+	c.setup(card);
+	HostSD_Partition(card, SDINIT_PARTITION);
+	uint64_t start = Timer_timeSincePowerOn();
+	MSD *msd = HostSD_Insert(card);
+	uint64_t usec = Timer_timeSincePowerOn() - start;
+	if (!msd) {
+		fail("%s: card not registered", c.name);
+		HostSD_Remove(card);
+		host_sd_card = NULL;
+		delete card;
+		return;
+	}
+	unsigned cmd6 = card->stats.commands[6];
+	unsigned acmd51 = card->stats.app_commands[51];
+	int khz = host_sdio_khz;
+	if (khz != c.khz)
+		fail("%s: at %d kHz, expected %d kHz", c.name, khz, c.khz);
+	if (cmd6 != c.cmd6)
+		fail("%s: %u CMD6, expected %u", c.name, cmd6, c.cmd6);
+	if (acmd51 != c.acmd51)
+		fail("%s: %u ACMD51, expected %u", c.name, acmd51, c.acmd51);
+	if (!host_sdio_widebus)
+		fail("%s: 1 bit bus", c.name);
+
+	//the bus has to work where it ended up
+	std::vector<uint8_t> data(8 * 512), back(8 * 512);
+	for(size_t i = 0; i < data.size(); i++)
+		data[i] = i * 7 + 3;
+	uint64_t errors = card->stats.data_errors;
+	if (transfer(msd, true, SDINIT_PARTITION + 8, data.data()) != 0 ||
+	    transfer(msd, false, SDINIT_PARTITION + 8, back.data()) != 0 ||
+	    back != data)
+		fail("%s: write and read back failed", c.name);
+	if (card->stats.data_errors != errors || host_sdio_khz != khz)
+		fail("%s: data errors after the init", c.name);
+
+	if (!HostSD_Remove(card))
+		fail("%s: card still registered after removal", c.name);
+	if (card->stats.protocol_errors)
+		fail("%s: %llu commands the card did not take in its state",
+		     c.name, (unsigned long long)card->stats.protocol_errors);
+	printf("%-30s %5d %4u %6u %8llu\n", c.name, khz, cmd6, acmd51,
+	       (unsigned long long)usec);
+	host_sd_card = NULL;
+	delete card;
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+	printf("%-30s %5s %4s %6s %8s\n", "card", "kHz", "CMD6", "ACMD51",
+	       "init us");
+	for(auto const &c : cases)
+		run(c);
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+
+/* replays a block trace against the firmware sd card driver and the card
+ * model of host/sdio, and counts the commands the card gets. the trace is
+ * what HostMSD logs, "usec R|W block count" per request, as written by
+ * fatbench. up to depth requests of it are kept queued with the driver,
+ * in the order of the trace.
+ *
+ * every read is checked to return what the writes before it in the trace
+ * left, however the driver orders them.
+ *
+ * built twice: sdreplay with the scheduler of the driver, sdreplay_fifo
+ * with nothing merged or reordered.
+ *
+ * usage: sdreplay trace depth
+ */
+
+#include "host/host.hpp"
+#include "host/sdio.hpp"
+
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <list>
+#include <vector>
+
+//the partition of the images the traces are recorded with
+#define SDREPLAY_PARTITION 2048
+
+struct TraceEntry {
+	bool write;
+	uint32_t block;
+	uint32_t count;
+};
+
+struct Request {
+	MSDReadCommand read;
+	MSDWriteCommand write;
+	std::vector<uint8_t> data;
+	std::vector<uint8_t> expected;
+	uint32_t block;
+	bool is_write;
+	bool done;
+	int result;
+};
+
+static HostSDCard *card;
+static std::vector<uint8_t> image;//what the card should hold
+static std::list<Request> requests;
+static unsigned outstanding = 0;
+static unsigned errors = 0;
+
+static void fillBlock(uint8_t *dst, uint32_t block, uint32_t seq) {
+	uint32_t x = block * 2654435761U + seq * 40503U + 1;
+	for(size_t i = 0; i < 512; i++) {
+		x = x * 1103515245 + 12345;
+		dst[i] = x >> 16;
+	}
+}
+
+static void complete(int result, Request *r) {
+	r->done = true;
+	r->result = result;
+	outstanding--;
+}
+
+static void issue(TraceEntry const &e, uint32_t seq, MSD *msd) {
+	requests.emplace_back();
+	Request *r = &requests.back();
+	r->block = e.block;
+	r->is_write = e.write;
+	r->done = false;
+	r->data.resize((size_t)e.count * 512);
+	outstanding++;
+	uint8_t *img = &image[(size_t)e.block * 512];
+	if (e.write) {
+		for(uint32_t i = 0; i < e.count; i++)
+			fillBlock(&r->data[i * 512], e.block + i, seq);
+		memcpy(img, r->data.data(), r->data.size());
+		r->write.start_block = e.block;
+		r->write.num_blocks = e.count;
+		r->write.src = r->data.data();
+		r->write.slot = sigc::bind(sigc::ptr_fun(&complete), r);
+		msd->writeBlocks(&r->write);
+		return;
+	}
+	r->expected.assign(img, img + r->data.size());
+	r->read.start_block = e.block;
+	r->read.num_blocks = e.count;
+	r->read.dst = r->data.data();
+	r->read.slot = sigc::bind(sigc::ptr_fun(&complete), r);
+	msd->readBlocks(&r->read);
+}
+
+//checks and forgets the requests done
+static void reap() {
+	for(auto it = requests.begin(); it != requests.end();) {
+		if (!it->done) {
+			it++;
+			continue;
+		}
+		if (it->result != 0 || (!it->is_write &&
+					it->data != it->expected)) {
+			if (errors++ < 10)
+				fprintf(stderr, "%s of block %u: %s\n",
+					it->is_write ? "write" : "read",
+					(unsigned)it->block,
+					it->result ? "failed" : "wrong data");
+		}
+		it = requests.erase(it);
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s trace depth\n", argv[0]);
+		return 2;
+	}
+	FILE *f = fopen(argv[1], "r");
+	if (!f) {
+		fprintf(stderr, "%s: cannot open\n", argv[1]);
+		return 1;
+	}
+	unsigned depth = atoi(argv[2]);
+	if (depth == 0)
+		depth = 1;
+	std::vector<TraceEntry> trace;
+	uint32_t end = SDREPLAY_PARTITION;
+	unsigned long long usec;
+	char op;
+	unsigned block, count;
+	while(fscanf(f, "%llu %c %u %u", &usec, &op, &block, &count) == 4) {
+		TraceEntry e = { op == 'W', block, count };
+		//block 0 holds the mbr the driver is found with
+		if (count == 0 || (e.write && block == 0))
+			continue;
+		trace.push_back(e);
+		end = std::max(end, block + count);
+	}
+	fclose(f);
+	if (trace.empty()) {
+		fprintf(stderr, "%s: no requests\n", argv[1]);
+		return 1;
+	}
+
+	//the card size has to be a multiple of 512KiB
+	card = new HostSDCard((end + 1023) / 1024 * 1024);
+	for(uint32_t b = 1; b < card->data.size() / 512; b++)
+		fillBlock(&card->data[(size_t)b * 512], b, 0);
+	HostSD_Partition(card, SDREPLAY_PARTITION);
+	image = card->data;
+	MSD *msd = HostSD_Insert(card);
+	if (!msd) {
+		fprintf(stderr, "card not registered\n");
+		return 1;
+	}
+
+	uint64_t before[64];
+	memcpy(before, card->stats.commands, sizeof(before));
+	uint64_t read_blocks = card->stats.read_blocks;
+	uint64_t start = Timer_timeSincePowerOn();
+	size_t next = 0;
+	while(next < trace.size() || outstanding) {
+		while(outstanding < depth && next < trace.size()) {
+			issue(trace[next], next + 1, msd);
+			next++;
+		}
+		reap();
+		if (!Host_Step())
+			break;
+	}
+	reap();
+	uint64_t elapsed = Timer_timeSincePowerOn() - start;
+	if (outstanding)
+		fprintf(stderr, "%u requests never done\n", outstanding);
+	if (card->data != image)
+		fprintf(stderr, "card contents differ from the trace\n");
+
+	unsigned reads = 0, writes = 0;
+	for(auto const &e : trace)
+		(e.write ? writes : reads)++;
+	auto count_of = [&](unsigned i) {
+		return (unsigned long long)(card->stats.commands[i] - before[i]);
+	};
+	printf("%s, depth %u: %u reads, %u writes\n", argv[1], depth, reads,
+	       writes);
+	printf("CMD17 %llu CMD18 %llu CMD24 %llu CMD25 %llu, "
+	       "%llu blocks read, %llu us\n", count_of(17), count_of(18),
+	       count_of(24), count_of(25),
+	       (unsigned long long)(card->stats.read_blocks - read_blocks),
+	       (unsigned long long)elapsed);
+	HostSD_Remove(card);
+	if (card->stats.protocol_errors)
+		fprintf(stderr, "%llu commands the card did not take in its "
+			"state\n",
+			(unsigned long long)card->stats.protocol_errors);
+	if (errors || outstanding || card->data != image ||
+	    card->stats.protocol_errors)
+		return 1;
+	return 0;
+}
@@ -0,0 +1,233 @@
+
+/* checks the request scheduling of the firmware sd card driver with the
+ * card model of host/sdio: queued reads of neighbouring blocks get merged
+ * into reads of at most SDCARD_MERGE_MAX blocks, a request the elevator
+ * keeps passing goes after SDCARD_BYPASS_MAX others at most, and requests
+ * touching the same blocks as a write stay in order around it.
+ *
+ * usage: sdsched
+ */
+
+#include "host/host.hpp"
+#include "host/sdio.hpp"
+
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <list>
+#include <vector>
+
+//as in src/block/sdcard.cpp
+#define SDSCHED_MERGE_MAX 8
+#define SDSCHED_BYPASS_MAX 8
+
+#define SDSCHED_BLOCKS (128 * 1024)
+#define SDSCHED_PARTITION 2048
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+static HostSDCard card(SDSCHED_BLOCKS);
+static MSD *msd;
+
+/* a request in flight. done is the position it completed at, counting
+ * from 1.
+ */
+struct Request {
+	MSDReadCommand read;
+	MSDWriteCommand write;
+	std::vector<uint8_t> data;
+	int result;
+	unsigned done;
+};
+
+static std::list<Request> requests;
+static unsigned completed;
+
+static void complete(int result, Request *r) {
+	r->result = result;
+	r->done = ++completed;
+}
+
+static Request *read(uint32_t block, uint32_t count) {
+	requests.emplace_back();
+	Request *r = &requests.back();
+	r->data.resize(count * 512);
+	r->result = -1;
+	r->done = 0;
+	r->read.start_block = block;
+	r->read.num_blocks = count;
+	r->read.dst = r->data.data();
+	r->read.slot = sigc::bind(sigc::ptr_fun(&complete), r);
+	msd->readBlocks(&r->read);
+	return r;
+}
+
+static Request *write(uint32_t block, uint32_t count, uint8_t fill) {
+	requests.emplace_back();
+	Request *r = &requests.back();
+	r->data.assign(count * 512, fill);
+	r->result = -1;
+	r->done = 0;
+	r->write.start_block = block;
+	r->write.num_blocks = count;
+	r->write.src = r->data.data();
+	r->write.slot = sigc::bind(sigc::ptr_fun(&complete), r);
+	msd->writeBlocks(&r->write);
+	return r;
+}
+
+static void finish(char const *what) {
+	Host_RunIdle();
+	for(auto const &r : requests) {
+		if (!r.done || r.result != 0)
+			fail("%s: request not done, result %d", what, r.result);
+	}
+}
+
+static void clear() {
+	requests.clear();
+	completed = 0;
+}
+
+static bool filled(Request const *r, uint32_t offset, uint8_t fill) {
+	for(size_t i = 0; i < 512; i++) {
+		if (r->data[offset * 512 + i] != fill)
+			return false;
+	}
+	return true;
+}
+
+/* single block reads of 20 blocks in a row: the first goes alone, the
+ * others come in reads of up to SDSCHED_MERGE_MAX blocks.
+ */
+static void merge() {
+	uint32_t block = SDSCHED_PARTITION + 100;
+	for(uint32_t i = 0; i < 20; i++)
+		memset(&card.data[(size_t)(block + i) * 512], i + 1, 512);
+	uint64_t c17 = card.stats.commands[17];
+	uint64_t c18 = card.stats.commands[18];
+	card.stats.largest_read = 0;
+	std::vector<Request *> r;
+	for(uint32_t i = 0; i < 20; i++)
+		r.push_back(read(block + i, 1));
+	//a read that is long enough already is not merged with its neighbour
+	Request *big = read(block + 20, SDSCHED_MERGE_MAX);
+	Request *next = read(block + 20 + SDSCHED_MERGE_MAX, 1);
+	finish("merge");
+	for(uint32_t i = 0; i < 20; i++) {
+		if (!filled(r[i], 0, i + 1))
+			fail("merge: block %u read wrong", i);
+	}
+	c17 = card.stats.commands[17] - c17;
+	c18 = card.stats.commands[18] - c18;
+	//19 queued reads in 3, the long one, and the one behind it
+	if (c17 != 2 || c18 != 4)
+		fail("merge: %llu CMD17 and %llu CMD18, expected 2 and 4",
+		     (unsigned long long)c17, (unsigned long long)c18);
+	if (card.stats.largest_read > SDSCHED_MERGE_MAX)
+		fail("merge: read of %u blocks", card.stats.largest_read);
+	if (!big->done || !next->done)
+		fail("merge: long read not done");
+	printf("merge: 22 reads in %llu CMD17 and %llu CMD18, "
+	       "%u blocks at most\n", (unsigned long long)c17,
+	       (unsigned long long)c18, card.stats.largest_read);
+	clear();
+}
+
+/* one read below the head while reads above it keep coming: it is passed
+ * SDSCHED_BYPASS_MAX times at most.
+ */
+static void starvation() {
+	uint32_t high = SDSCHED_PARTITION + 50000;
+	read(high, 1);//moves the head up
+	Request *low = read(SDSCHED_PARTITION + 3000, 1);
+	unsigned issued = 0;
+	//far enough apart to not be merged, one more for every one done
+	for(; issued < 4; issued++)
+		read(high + 1000 + issued * 100, 1);
+	while(!low->done && Host_Step()) {
+		while(issued < completed + 4 && issued < 40) {
+			read(high + 1000 + issued * 100, 1);
+			issued++;
+		}
+	}
+	finish("starvation");
+	//the first read was on the card before
+	unsigned passed = low->done - 2;
+	if (passed > SDSCHED_BYPASS_MAX)
+		fail("starvation: passed %u times", passed);
+	if (passed == 0)
+		fail("starvation: never passed, no elevator");
+	printf("starvation: passed %u times, %u allowed\n", passed,
+	       SDSCHED_BYPASS_MAX);
+	clear();
+}
+
+/* reads and writes of the same blocks, queued behind a read far away.
+ * the elevator would take them by block, but each must see the writes
+ * queued before it and none after.
+ */
+static void ordering() {
+	uint32_t block = SDSCHED_PARTITION + 4000;
+	memset(&card.data[(size_t)block * 512], 0x11, 4 * 512);
+	read(SDSCHED_PARTITION + 60000, 1);
+	Request *w1 = write(block, 4, 0xaa);
+	Request *r1 = read(block + 2, 1);
+	Request *w2 = write(block + 1, 2, 0xbb);
+	Request *r2 = read(block, 4);
+	//lower, the elevator wants these first
+	Request *r0 = read(block - 10, 1);
+	Request *w0 = write(block - 1, 2, 0xcc);
+	Request *r3 = read(block + 3, 1);
+	finish("ordering");
+	if (!(w1->done < r1->done && r1->done < w2->done && w2->done < r2->done))
+		fail("ordering: done as %u %u %u %u", w1->done, r1->done,
+		     w2->done, r2->done);
+	if (!(w1->done < w0->done && w1->done < r3->done))
+		fail("ordering: later ones passed the first write");
+	if (!filled(r1, 0, 0xaa))
+		fail("ordering: first read did not see the first write");
+	//w0 overlaps the first block of r2 and was queued after it
+	if (!filled(r2, 0, 0xaa) || !filled(r2, 1, 0xbb) ||
+	    !filled(r2, 2, 0xbb) || !filled(r2, 3, 0xaa))
+		fail("ordering: second read saw the wrong writes");
+	if (!filled(r3, 0, 0xaa))
+		fail("ordering: last read saw the wrong write");
+	uint8_t const *d = &card.data[(size_t)(block - 1) * 512];
+	if (d[0] != 0xcc || d[512] != 0xcc || d[1024] != 0xbb)
+		fail("ordering: writes not on the card in order");
+	printf("ordering: done as w1 %u, r1 %u, w2 %u, r2 %u, r0 %u, w0 %u, "
+	       "r3 %u\n", w1->done, r1->done, w2->done, r2->done, r0->done,
+	       w0->done, r3->done);
+	clear();
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+	HostSD_Partition(&card, SDSCHED_PARTITION);
+	msd = HostSD_Insert(&card);
+	if (!msd) {
+		fprintf(stderr, "card not registered\n");
+		return 1;
+	}
+	merge();
+	starvation();
+	ordering();
+	if (!HostSD_Remove(&card))
+		fail("card still registered after removal");
+	if (card.stats.protocol_errors)
+		fail("%llu commands the card did not take in its state",
+		     (unsigned long long)card.stats.protocol_errors);
+	return failed ? 1 : 0;
+}
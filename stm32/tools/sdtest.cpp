@@ -0,0 +1,341 @@
+
+/* runs the firmware sd card driver against the card model of host/sdio:
+ * card detect and init, then reads and writes of different sizes at the
+ * clock the card ends up with, and the error paths of writes: the busy
+ * wait, crc errors retried slower, the stop a multi block write needs
+ * after an error and the card not finishing in time. the card model
+ * counts commands the card would not have taken in its state, there must
+ * not be any.
+ *
+ * times are simulated, from the bus clock and the card timing of the
+ * model.
+ *
+ * usage: sdtest
+ */
+
+#include "host/host.hpp"
+#include "host/sdio.hpp"
+
+#include <timer.hpp>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include <vector>
+
+//64MiB
+#define SDTEST_BLOCKS (128 * 1024)
+#define SDTEST_PARTITION 2048
+#define SDTEST_ROUNDS 64
+
+static bool failed = false;
+
+static void fail(char const *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	failed = true;
+}
+
+static HostSDCard card(SDTEST_BLOCKS);
+static MSD *msd;
+
+//returns the time the init took
+static uint64_t insert() {
+	uint64_t start = Timer_timeSincePowerOn();
+	msd = HostSD_Insert(&card);
+	if (!msd) {
+		fprintf(stderr, "card not registered\n");
+		exit(1);
+	}
+	return Timer_timeSincePowerOn() - start;
+}
+
+static void remove() {
+	if (!HostSD_Remove(&card))
+		fail("card still registered after removal");
+}
+
+static int readBlocks(uint32_t block, uint32_t count, void *dst) {
+	bool done = false;
+	int result = -1;
+	MSDReadCommand c;
+	c.start_block = block;
+	c.num_blocks = count;
+	c.dst = dst;
+	c.slot = [&](int r) { result = r; done = true; };
+	msd->readBlocks(&c);
+	while(!done && Host_Step()) {
+	}
+	return result;
+}
+
+static int writeBlocks(uint32_t block, uint32_t count, void const *src) {
+	bool done = false;
+	int result = -1;
+	MSDWriteCommand c;
+	c.start_block = block;
+	c.num_blocks = count;
+	c.src = src;
+	c.slot = [&](int r) { result = r; done = true; };
+	msd->writeBlocks(&c);
+	while(!done && Host_Step()) {
+	}
+	return result;
+}
+
+static std::vector<uint8_t> pattern(size_t len, unsigned seed) {
+	std::vector<uint8_t> data(len);
+	uint32_t x = seed * 2654435761U + 1;
+	for(size_t i = 0; i < len; i++) {
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+	return data;
+}
+
+static bool onCard(uint32_t block, std::vector<uint8_t> const &data) {
+	return memcmp(&card.data[(size_t)block * 512], data.data(),
+		      data.size()) == 0;
+}
+
+/* SDTEST_ROUNDS transfers of count blocks one after the other, reads of
+ * what was written. prints the time per request and the throughput.
+ */
+static void throughput(uint32_t count) {
+	uint32_t block = SDTEST_PARTITION;
+	std::vector<uint8_t> data = pattern(SDTEST_ROUNDS * count * 512, count);
+	uint64_t start = Timer_timeSincePowerOn();
+	uint64_t worst_write = 0;
+	for(unsigned i = 0; i < SDTEST_ROUNDS; i++) {
+		uint64_t t = Timer_timeSincePowerOn();
+		int r = writeBlocks(block + i * count, count,
+				    &data[(size_t)i * count * 512]);
+		if (r != 0)
+			fail("write of %u blocks: %d", count, r);
+		worst_write = std::max(worst_write, Timer_timeSincePowerOn() - t);
+	}
+	uint64_t write_usec = Timer_timeSincePowerOn() - start;
+	if (!onCard(block, data))
+		fail("%u block writes: not on the card", count);
+	std::vector<uint8_t> back(data.size());
+	start = Timer_timeSincePowerOn();
+	uint64_t worst_read = 0;
+	for(unsigned i = 0; i < SDTEST_ROUNDS; i++) {
+		uint64_t t = Timer_timeSincePowerOn();
+		int r = readBlocks(block + i * count, count,
+				   &back[(size_t)i * count * 512]);
+		if (r != 0)
+			fail("read of %u blocks: %d", count, r);
+		worst_read = std::max(worst_read, Timer_timeSincePowerOn() - t);
+	}
+	uint64_t read_usec = Timer_timeSincePowerOn() - start;
+	if (back != data)
+		fail("%u block reads: contents differ", count);
+	uint64_t kb = data.size() / 1024;
+	printf("%6u %5d %8llu %8llu %8llu %8llu %8llu %8llu\n", count,
+	       host_sdio_khz,
+	       (unsigned long long)(read_usec / SDTEST_ROUNDS),
+	       (unsigned long long)worst_read,
+	       (unsigned long long)(kb * 1000000 / read_usec),
+	       (unsigned long long)(write_usec / SDTEST_ROUNDS),
+	       (unsigned long long)worst_write,
+	       (unsigned long long)(kb * 1000000 / write_usec));
+}
+
+static void table(char const *what, uint64_t init_usec) {
+	printf("%s: %s bus at %d kHz, init took %llu us\n", what,
+	       host_sdio_widebus ? "4 bit" : "1 bit", host_sdio_khz,
+	       (unsigned long long)init_usec);
+	printf("%6s %5s %8s %8s %8s %8s %8s %8s\n", "blocks", "kHz",
+	       "read us", "worst", "KB/s", "write us", "worst", "KB/s");
+	for(uint32_t count : { 1, 8, 32, 128 })
+		throughput(count);
+}
+
+struct Counts {
+	uint64_t c12, c13, c18, c24, c25, data_errors;
+	Counts() {
+		c12 = card.stats.commands[12];
+		c13 = card.stats.commands[13];
+		c18 = card.stats.commands[18];
+		c24 = card.stats.commands[24];
+		c25 = card.stats.commands[25];
+		data_errors = card.stats.data_errors;
+	}
+};
+
+static void expect(char const *what, char const *counter, uint64_t before,
+		   uint64_t now, uint64_t expected) {
+	if (now - before != expected)
+		fail("%s: %llu %s, expected %llu", what,
+		     (unsigned long long)(now - before), counter,
+		     (unsigned long long)expected);
+}
+
+//the card takes long to program, the driver waits on DAT0
+static void busy() {
+	uint32_t block = SDTEST_PARTITION + 1000;
+	std::vector<uint8_t> data = pattern(8 * 512, 10);
+	card.program_usec = 20000;
+	Counts before;
+	uint64_t start = Timer_timeSincePowerOn();
+	int r = writeBlocks(block, 8, data.data());
+	uint64_t usec = Timer_timeSincePowerOn() - start;
+	Counts after;
+	card.program_usec = 800;
+	if (r != 0 || !onCard(block, data))
+		fail("busy: write failed, %d", r);
+	if (usec < 20000)
+		fail("busy: done after %llu us, before the card",
+		     (unsigned long long)usec);
+	//polled on DAT0, the status only once it is released
+	expect("busy", "CMD13", before.c13, after.c13, 1);
+	expect("busy", "CMD12", before.c12, after.c12, 1);
+	printf("busy: 20ms programming, write done after %llu us\n",
+	       (unsigned long long)usec);
+}
+
+//a crc error in the data of a multi block read: stop, slower, again
+static void readCRC() {
+	uint32_t block = SDTEST_PARTITION + 2000;
+	std::vector<uint8_t> back(8 * 512);
+	card.fail(18, SDIO_DataCRC);
+	int khz = host_sdio_khz;
+	Counts before;
+	int r = readBlocks(block, 8, back.data());
+	Counts after;
+	if (r != 0 || !onCard(block, back))
+		fail("read crc: read failed, %d", r);
+	expect("read crc", "CMD18", before.c18, after.c18, 2);
+	expect("read crc", "CMD12", before.c12, after.c12, 2);
+	if (host_sdio_khz >= khz)
+		fail("read crc: still at %d kHz", host_sdio_khz);
+	printf("read crc: retried at %d kHz, was %d kHz\n", host_sdio_khz, khz);
+}
+
+static void writeCRC(char const *what, uint32_t count, unsigned errors,
+		     int expected) {
+	uint32_t block = SDTEST_PARTITION + 3000 + count * 10 + errors;
+	std::vector<uint8_t> data = pattern(count * 512, 20 + count + errors);
+	uint8_t command = count > 1 ? 25 : 24;
+	card.fail(command, SDIO_DataCRC, errors);
+	int khz = host_sdio_khz;
+	Counts before;
+	int r = writeBlocks(block, count, data.data());
+	Counts after;
+	if (r != expected)
+		fail("%s: result %d, expected %d", what, r, expected);
+	if (expected == 0 && !onCard(block, data))
+		fail("%s: not on the card", what);
+	unsigned tries = std::min(errors + 1, 3U);
+	if (count > 1) {
+		expect(what, "CMD25", before.c25, after.c25, tries);
+		//each try needs its stop, the failed ones too
+		expect(what, "CMD12", before.c12, after.c12, tries);
+	} else {
+		expect(what, "CMD24", before.c24, after.c24, tries);
+		expect(what, "CMD12", before.c12, after.c12, 0);
+	}
+	printf("%s: %u tries, result %d, %d kHz, was %d kHz\n", what, tries,
+	       r, host_sdio_khz, khz);
+}
+
+//the stop after a failed multi block write does not get through at first
+static void stopLost() {
+	uint32_t block = SDTEST_PARTITION + 4000;
+	std::vector<uint8_t> data = pattern(8 * 512, 30);
+	card.fail(25, SDIO_DataCRC);
+	//the controller tries three times
+	card.fail(12, SDIO_CommandTimeout, 3);
+	Counts before;
+	int r = writeBlocks(block, 8, data.data());
+	Counts after;
+	if (r != 0 || !onCard(block, data))
+		fail("stop lost: write failed, %d", r);
+	printf("stop lost: %llu stops sent, result %d\n",
+	       (unsigned long long)(after.c12 - before.c12), r);
+}
+
+//a write past the end of the card is refused with the command
+static void outOfRange() {
+	std::vector<uint8_t> data = pattern(8 * 512, 40);
+	Counts before;
+	int r = writeBlocks(SDTEST_BLOCKS + 8, 8, data.data());
+	Counts after;
+	if (r != ENOSPC)
+		fail("out of range: result %d, expected ENOSPC", r);
+	//the card never got into the receive state
+	expect("out of range", "CMD12", before.c12, after.c12, 0);
+	r = readBlocks(SDTEST_BLOCKS + 8, 1, data.data());
+	if (r != ENODATA)
+		fail("out of range: read result %d, expected ENODATA", r);
+	printf("out of range: write %s, read %s\n",
+	       strerror(ENOSPC), strerror(ENODATA));
+}
+
+//the card does not finish programming in time
+static void busyTimeout() {
+	uint32_t block = SDTEST_PARTITION + 5000;
+	std::vector<uint8_t> data = pattern(512, 50);
+	card.program_usec = 700000;
+	uint64_t start = Timer_timeSincePowerOn();
+	int r = writeBlocks(block, 1, data.data());
+	uint64_t usec = Timer_timeSincePowerOn() - start;
+	card.program_usec = 800;
+	if (r != ETIMEDOUT)
+		fail("busy timeout: result %d, expected ETIMEDOUT", r);
+	//the card gets done eventually, and takes the next write
+	Host_RunIdle();
+	r = writeBlocks(block, 1, data.data());
+	if (r != 0)
+		fail("busy timeout: next write failed, %d", r);
+	printf("busy timeout: gave up after %llu us\n",
+	       (unsigned long long)usec);
+}
+
+int main(int /*argc*/, char ** /*argv*/) {
+	HostSD_Partition(&card, SDTEST_PARTITION);
+
+	table("high speed card", insert());
+	remove();
+
+	card.highspeed = false;
+	table("default speed card", insert());
+	remove();
+	card.highspeed = true;
+
+	insert();
+	busy();
+	readCRC();
+	remove();
+
+	insert();
+	writeCRC("write crc", 8, 1, 0);
+	writeCRC("single write crc", 1, 1, 0);
+	writeCRC("write crc, no luck", 8, 3, EIO);
+	remove();
+
+	insert();
+	stopLost();
+	outOfRange();
+	busyTimeout();
+	remove();
+
+	if (card.stats.protocol_errors)
+		fail("%llu commands the card did not take in its state",
+		     (unsigned long long)card.stats.protocol_errors);
+	if (failed)
+		return 1;
+	printf("%llu blocks read, %llu written, %llu data errors, "
+	       "%llu us busy\n",
+	       (unsigned long long)card.stats.read_blocks,
+	       (unsigned long long)card.stats.write_blocks,
+	       (unsigned long long)card.stats.data_errors,
+	       (unsigned long long)card.stats.busy_usec);
+	return 0;
+}